@@ -0,0 +1,51 @@
+	alloc a 20
+	alloc b 20
+	alloc c 20
+main:
+	// a[i] = i
+	push 0
+	store i
+init:
+	fetch i
+	push 20
+	lt
+	jeqz fill:
+	fetch i
+	push a
+	fetch i
+	add
+	storei
+	fetch i
+	push 1
+	add
+	store i
+	jmp init:
+fill:
+	push b
+	push 20
+	push 4
+	fill
+	// c = a + b
+	push c
+	push a
+	push b
+	push 20
+	vadd
+	push c
+	push 20
+	sum
+	store total
+	printv total
+	// a[0..10] = c[10..20]
+	push a
+	push c
+	push 10
+	add
+	push 10
+	copy
+	push a
+	push 9
+	add
+	fetchi
+	store last
+	printv last
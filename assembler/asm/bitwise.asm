@@ -0,0 +1,19 @@
+push 17
+push 5
+div // 17 / 5
+push 17
+push 5
+mod // 17 % 5
+add
+push 12
+push 10
+and
+push 1
+or
+xor
+push 1
+push 4
+shl
+push 2
+shr
+mul
@@ -0,0 +1,18 @@
+main:
+	push 3
+	store n
+	call countdown:
+	printc 100
+	jmp end:
+countdown:
+	fetch n
+	jeqz done:
+	printv n
+	fetch n
+	push 1
+	sub
+	store n
+	call countdown:
+done:
+	ret
+end:
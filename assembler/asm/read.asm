@@ -0,0 +1,13 @@
+main:
+	push 0
+	store total
+loop:
+	read
+	jeqz end:
+	fetch total
+	add
+	store total
+	jmp loop:
+end:
+	drop
+	printv total
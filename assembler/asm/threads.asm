@@ -0,0 +1,52 @@
+	alloc counter 1
+main:
+	// Four threads each add 1000 to counter
+	push 1
+	spawn worker:
+	store t1
+	push 2
+	spawn worker:
+	store t2
+	push 3
+	spawn worker:
+	store t3
+	push 4
+	spawn worker:
+	store t4
+	// Every thread returns its argument doubled
+	fetch t1
+	join
+	fetch t2
+	join
+	add
+	fetch t3
+	join
+	add
+	fetch t4
+	join
+	add
+	store results
+	printv results
+	push counter
+	fetchi
+	store total
+	printv total
+	jmp end:
+worker:
+	push 1000
+loop:
+	dup
+	jeqz done:
+	push counter
+	push 1
+	fadd
+	drop
+	push 1
+	sub
+	jmp loop:
+done:
+	drop
+	push 2
+	mul
+	ret
+end:
@@ -0,0 +1,73 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "am4asm.h"
+#include "arena.h"
+#include "code_generation.h"
+#include "error.h"
+#include "format.h"
+#include "lexer.h"
+#include "parser.h"
+
+/**
+ * The arena lives in the caller, so nothing this function changes before a
+ * longjmp is lost
+ *
+ * @returns 0 on success, 1 if asm_error was called
+ */
+int assemble_trapped(const char *source, size_t len, struct Arena *arena,
+                     struct Am4Buffer *out) {
+    jmp_buf *outer_trap = asm_error_trap;
+    jmp_buf trap;
+    asm_error_trap = &trap;
+    if (setjmp(trap) != 0) {
+        asm_error_trap = outer_trap;
+        return 1;
+    }
+
+    struct ParseResult result = parse(lex_buffer(source, len, arena));
+    struct Binary binary = generate_binary(result);
+    out->data = binary_encode_to_memory(&binary, &result, &out->len);
+
+    asm_error_trap = outer_trap;
+    return 0;
+}
+
+int am4_assemble(const char *source, size_t len, struct Am4Buffer *out) {
+    *out = (struct Am4Buffer){
+        .data = NULL, .len = 0, .messages = NULL, .messages_len = 0};
+    FILE *messages = open_memstream(&out->messages, &out->messages_len);
+    if (messages == NULL) {
+        return 1;
+    }
+
+    bool outer_quiet = asm_error_quiet;
+    FILE *outer_stream = asm_error_stream;
+    asm_error_quiet = false;
+    asm_error_stream = messages;
+
+    struct Arena arena = arena_new();
+    int status = assemble_trapped(source, len, &arena, out);
+    arena_destroy(&arena);
+
+    asm_error_quiet = outer_quiet;
+    asm_error_stream = outer_stream;
+    fclose(messages);
+    if (status != 0) {
+        free(out->data);
+        out->data = NULL;
+        out->len = 0;
+    }
+    return status;
+}
+
+void am4_buffer_free(struct Am4Buffer *buffer) {
+    free(buffer->data);
+    free(buffer->messages);
+    buffer->data = NULL;
+    buffer->len = 0;
+    buffer->messages = NULL;
+    buffer->messages_len = 0;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * The public interface of libam4asm, for assembling in memory without
+ * touching the file system or ending the process
+ */
+
+/**
+ * What an assembly made
+ */
+struct Am4Buffer {
+    // The binary, as am4asm writes it to a file. NULL if the assembly failed.
+    uint8_t *data;
+    size_t len;
+    // Every error and warning, NUL terminated and empty if there were none.
+    // NULL if there was no memory for them.
+    char *messages;
+    size_t messages_len;
+};
+
+/**
+ * Assemble source code into an am4 binary
+ *
+ * @note Never exits and prints nothing, errors and warnings end up in the
+ * messages of out. Can be called from several threads at once.
+ *
+ * @param source Does not have to be NUL terminated
+ * @param len
+ * @param out Set to the binary and the messages, has to be freed with
+ * am4_buffer_free whether the assembly failed or not
+ *
+ * @returns 0 on success, 1 if the source has an error
+ */
+int am4_assemble(const char *source, size_t len, struct Am4Buffer *out);
+
+/**
+ * Free the binary and the messages of a buffer
+ *
+ * @param buffer
+ */
+void am4_buffer_free(struct Am4Buffer *buffer);
@@ -0,0 +1,186 @@
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "arena.h"
+#include "error.h"
+
+// Size of the blocks small allocations share
+#define ARENA_BLOCK_SIZE (1 << 20)
+
+// Allocations from this size on get a block of their own
+#define ARENA_LARGE_SIZE (ARENA_BLOCK_SIZE / 4)
+
+#define ARENA_ALIGNMENT alignof(max_align_t)
+
+struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    alignas(max_align_t) unsigned char data[];
+};
+
+struct Arena arena_new() {
+    return (struct Arena){.blocks = NULL, .large = NULL};
+}
+
+/**
+ * calloc keeps the memory zeroed, big blocks come straight from the kernel
+ * and are not touched until they are used
+ */
+struct ArenaBlock *arena_block_new(size_t size) {
+    if (size > SIZE_MAX - sizeof(struct ArenaBlock)) {
+        asm_error("Failed to do a heap allocation\n");
+    }
+    struct ArenaBlock *block = calloc(1, sizeof(struct ArenaBlock) + size);
+    if (block == NULL) {
+        asm_error("Failed to do a heap allocation\n");
+    }
+    block->size = size;
+    block->used = 0;
+    return block;
+}
+
+void *arena_bump(struct Arena *arena, size_t size, size_t alignment) {
+    if (size >= ARENA_LARGE_SIZE) {
+        struct ArenaBlock *block = arena_block_new(size);
+        block->used = size;
+        block->next = arena->large;
+        arena->large = block;
+        return block->data;
+    }
+
+    struct ArenaBlock *block = arena->blocks;
+    if (block != NULL) {
+        size_t start = (block->used + alignment - 1) & ~(alignment - 1);
+        if (start + size <= block->size) {
+            block->used = start + size;
+            return block->data + start;
+        }
+    }
+    // What is left of the old block is given up
+    block = arena_block_new(ARENA_BLOCK_SIZE);
+    block->used = size;
+    block->next = arena->blocks;
+    arena->blocks = block;
+    return block->data;
+}
+
+void *arena_alloc(struct Arena *arena, size_t size) {
+    return arena_bump(arena, size, ARENA_ALIGNMENT);
+}
+
+/**
+ * Let a large allocation grow with realloc, which can move the pages of a big
+ * block instead of copying them
+ *
+ * @returns NULL if ptr is not a large allocation
+ */
+void *arena_grow_large(struct Arena *arena, void *ptr, size_t new_size) {
+    for (struct ArenaBlock **link = &arena->large; *link != NULL;
+         link = &(*link)->next) {
+        if ((*link)->data != ptr) {
+            continue;
+        }
+        if (new_size > SIZE_MAX - sizeof(struct ArenaBlock)) {
+            asm_error("Failed to do a heap allocation\n");
+        }
+        struct ArenaBlock *block =
+            realloc(*link, sizeof(struct ArenaBlock) + new_size);
+        if (block == NULL) {
+            asm_error("Failed to reallocate memory\n");
+        }
+        block->size = new_size;
+        block->used = new_size;
+        *link = block;
+        return block->data;
+    }
+    return NULL;
+}
+
+void *arena_grow(struct Arena *arena, void *ptr, size_t old_size,
+                 size_t new_size) {
+    if (ptr == NULL) {
+        return arena_alloc(arena, new_size);
+    }
+    if (old_size >= ARENA_LARGE_SIZE) {
+        void *grown = arena_grow_large(arena, ptr, new_size);
+        if (grown != NULL) {
+            return grown;
+        }
+    }
+
+    struct ArenaBlock *block = arena->blocks;
+    if (block != NULL && new_size < ARENA_LARGE_SIZE &&
+        (unsigned char *)ptr + old_size == block->data + block->used &&
+        block->used - old_size + new_size <= block->size) {
+        block->used += new_size - old_size;
+        return ptr;
+    }
+
+    void *grown = arena_alloc(arena, new_size);
+    memcpy(grown, ptr, old_size);
+    return grown;
+}
+
+char *arena_strndup(struct Arena *arena, const char *str, size_t len) {
+    char *copy = arena_bump(arena, len + 1, 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+void arena_free_blocks(struct ArenaBlock *block) {
+    while (block != NULL) {
+        struct ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+}
+
+void arena_reset(struct Arena *arena) {
+    arena_free_blocks(arena->large);
+    arena->large = NULL;
+    struct ArenaBlock *block = arena->blocks;
+    if (block == NULL) {
+        return;
+    }
+    arena_free_blocks(block->next);
+    block->next = NULL;
+    // arena_alloc hands out zeroed memory
+    memset(block->data, 0, block->used);
+    block->used = 0;
+}
+
+struct ArenaBlock *arena_last_block(struct ArenaBlock *block) {
+    while (block->next != NULL) {
+        block = block->next;
+    }
+    return block;
+}
+
+void arena_adopt(struct Arena *arena, struct Arena *other) {
+    if (other->blocks != NULL) {
+        if (arena->blocks == NULL) {
+            arena->blocks = other->blocks;
+        } else {
+            // The block arena allocates from stays in front
+            arena_last_block(other->blocks)->next = arena->blocks->next;
+            arena->blocks->next = other->blocks;
+        }
+    }
+    if (other->large != NULL) {
+        arena_last_block(other->large)->next = arena->large;
+        arena->large = other->large;
+    }
+    other->blocks = NULL;
+    other->large = NULL;
+}
+
+void arena_destroy(struct Arena *arena) {
+    arena_free_blocks(arena->blocks);
+    arena_free_blocks(arena->large);
+    arena->blocks = NULL;
+    arena->large = NULL;
+}
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+
+struct ArenaBlock;
+
+/**
+ * Bump pointer allocator for everything one assembly run creates. Nothing is
+ * freed on its own, the whole arena goes at once with arena_destroy.
+ */
+struct Arena {
+    // The block small allocations come from, and the full ones before it
+    struct ArenaBlock *blocks;
+    // Allocations too big to share a block, each one has its own
+    struct ArenaBlock *large;
+};
+
+/**
+ * Create an empty Arena, the first block is allocated on first use
+ *
+ * @returns struct Arena, has to be freed with arena_destroy
+ */
+struct Arena arena_new();
+
+/**
+ * Allocate size bytes aligned for any type
+ *
+ * @note The memory is zeroed
+ *
+ * @param arena
+ * @param size
+ *
+ * @returns The memory, it lives as long as the arena
+ */
+void *arena_alloc(struct Arena *arena, size_t size);
+
+/**
+ * Resize an allocation, keeping its contents
+ *
+ * @note The last allocation of a block grows in place when there is room, a
+ * large allocation is reallocated on its own, anything else is copied
+ *
+ * @param arena
+ * @param ptr NULL allocates new memory
+ * @param old_size Size of the allocation ptr points to
+ * @param new_size Bigger than old_size, the added bytes are not initialized
+ *
+ * @returns The allocation, ptr is no longer valid
+ */
+void *arena_grow(struct Arena *arena, void *ptr, size_t old_size,
+                 size_t new_size);
+
+/**
+ * Copy len characters into a new NUL terminated string
+ *
+ * @param arena
+ * @param str Does not have to be NUL terminated
+ * @param len
+ *
+ * @returns The string, it lives as long as the arena
+ */
+char *arena_strndup(struct Arena *arena, const char *str, size_t len);
+
+/**
+ * Free every allocation of an Arena, but keep its newest block to allocate
+ * from again
+ *
+ * @note Meant for scratch arenas that are emptied over and over
+ *
+ * @param arena
+ */
+void arena_reset(struct Arena *arena);
+
+/**
+ * Move every allocation of other into arena, they live as long as arena now
+ *
+ * @param arena
+ * @param other Left empty
+ */
+void arena_adopt(struct Arena *arena, struct Arena *other);
+
+/**
+ * Free every allocation of an Arena at once
+ *
+ * @param arena
+ */
+void arena_destroy(struct Arena *arena);
@@ -1,9 +1,11 @@
+#include <limits.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "arguments.h"
+#include "optimize.h"
 
 void print_help();
 
@@ -17,13 +19,73 @@ bool str_starts_with(char *str, char *pattern) {
 }
 
 struct Arguments arguments_parse(int argc, char **argv) {
-    struct Arguments args = {.input = NULL, .output = NULL};
+    struct Arguments args = {.inputs = malloc(argc * sizeof(char *)),
+                             .inputs_len = 0,
+                             .output = NULL,
+                             .optimization_level = 0,
+                             .stream = false,
+                             .threads = 0,
+                             .compile = false,
+                             .cache = NULL,
+                             .profile = NULL};
+    if (args.inputs == NULL) {
+        fprintf(stderr, "Failed to do a heap allocation\n");
+        exit(1);
+    }
 
     // i == 1 becasue argv[0] is just the ./am4asm
     for (int i = 1; i < argc; i++) {
-        if (str_starts_with(argv[i], "--")) {
+        if (str_starts_with(argv[i], "-O")) {
+            char *end;
+            long level = strtol(argv[i] + 2, &end, 10);
+            if (argv[i][2] == '\0' || *end != '\0' || level < 0 ||
+                level > OPTIMIZATION_LEVEL_MAX) {
+                fprintf(stderr,
+                        "`%s` is not a valid optimization level, see `--help` "
+                        "for more info\n",
+                        argv[i]);
+                exit(1);
+            }
+            args.optimization_level = level;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            args.compile = true;
+        } else if (str_starts_with(argv[i], "--")) {
             if (strcmp(argv[i], "--help") == 0) {
                 print_help();
+            } else if (strcmp(argv[i], "--stream") == 0) {
+                args.stream = true;
+            } else if (strcmp(argv[i], "--threads") == 0) {
+                i++;
+                char *end;
+                long threads = i < argc ? strtol(argv[i], &end, 10) : -1;
+                if (i >= argc || argv[i][0] == '\0' || *end != '\0' ||
+                    threads < 0 || threads > INT_MAX) {
+                    fprintf(stderr,
+                            "`--threads` needs a number of threads, see "
+                            "`--help` for more info\n");
+                    exit(1);
+                }
+                args.threads = threads;
+            } else if (strcmp(argv[i], "--cache") == 0) {
+                i++;
+                if (i < argc) {
+                    args.cache = argv[i];
+                } else {
+                    fprintf(stderr,
+                            "`--cache` needs a directory, see `--help` for "
+                            "more info\n");
+                    exit(1);
+                }
+            } else if (strcmp(argv[i], "--profile") == 0) {
+                i++;
+                if (i < argc) {
+                    args.profile = argv[i];
+                } else {
+                    fprintf(stderr,
+                            "`--profile` needs a file, see `--help` for more "
+                            "info\n");
+                    exit(1);
+                }
             } else if (strcmp(argv[i], "--out") == 0) {
                 i++;
                 if (i < argc) {
@@ -42,18 +104,35 @@ struct Arguments arguments_parse(int argc, char **argv) {
                 exit(1);
             }
         } else {
-            if (args.input != NULL) {
-                fprintf(stderr, "You can only assemble one file at a time");
-                exit(1);
-            } else {
-                args.input = argv[i];
-            }
+            args.inputs[args.inputs_len++] = argv[i];
         }
     }
-    if (args.input == NULL) {
+    if (args.inputs_len == 0) {
         fprintf(stderr, "No input files, see `--help` for more info\n");
         exit(1);
-    } else if (args.output == NULL) {
+    }
+    if (args.stream && (args.compile || args.inputs_len > 1)) {
+        fprintf(stderr, "`--stream` assembles a single file into a binary, "
+                        "see `--help` for more info\n");
+        exit(1);
+    }
+    if (args.compile && args.output != NULL && args.inputs_len > 1) {
+        fprintf(stderr, "`--out` can only name the object of a single input, "
+                        "see `--help` for more info\n");
+        exit(1);
+    }
+    if (args.cache != NULL && !args.compile) {
+        fprintf(stderr,
+                "`--cache` only caches objects, it needs `-c`, see `--help` "
+                "for more info\n");
+        exit(1);
+    }
+    if (args.profile != NULL && (args.compile || args.stream)) {
+        fprintf(stderr, "`--profile` needs the whole program, it does not go "
+                        "with `-c` or `--stream`\n");
+        exit(1);
+    }
+    if (!args.compile && args.output == NULL) {
         args.output = "out.bin";
     }
     return args;
@@ -61,17 +140,50 @@ struct Arguments arguments_parse(int argc, char **argv) {
 
 void arguments_print(struct Arguments args) {
     printf("struct Arguments {\n");
-    printf("  .input = \"%s\",\n", args.input);
-    printf("  .output = \"%s\",\n", args.output);
+    printf("  .inputs = {");
+    for (int i = 0; i < args.inputs_len; i++) {
+        printf("%s\"%s\"", i == 0 ? "" : ", ", args.inputs[i]);
+    }
+    printf("},\n");
+    printf("  .output = \"%s\",\n", args.output != NULL ? args.output : "");
+    printf("  .optimization_level = %d,\n", args.optimization_level);
+    printf("  .stream = %s,\n", args.stream ? "true" : "false");
+    printf("  .threads = %d,\n", args.threads);
+    printf("  .compile = %s,\n", args.compile ? "true" : "false");
+    printf("  .cache = \"%s\",\n", args.cache != NULL ? args.cache : "");
+    printf("  .profile = \"%s\",\n", args.profile != NULL ? args.profile : "");
     printf("}\n");
 }
 
 void print_help() {
-    printf("Assemble an am4 assembly file\n");
+    printf("Assemble am4 assembly files into a binary, or into objects that "
+           "am4ld links\n");
+    printf("\n");
+    printf("Usage: am4asm [OPTIONS] <FILENAME>...\n");
     printf("\n");
-    printf("Usage: am4asm [OPTIONS] <FILENAME>\n");
+    printf("Several files are assembled as if they were one, in order.\n");
     printf("\n");
     printf("Arguments\n");
-    printf("    --help  -- Print this message\n");
+    printf("    --help           -- Print this message\n");
+    printf("    --out <FILE>     -- Name of the output, out.bin (default) or "
+           "the input\n");
+    printf("                        with `.o` with `-c`\n");
+    printf("    -c               -- Make an object of every file instead of a "
+           "binary\n");
+    printf("    --cache <DIR>    -- Reuse the objects of files that did not "
+           "change, needs\n");
+    printf("                        `-c`\n");
+    printf("    --stream         -- Assemble one line at a time, memory does "
+           "not grow with\n");
+    printf("                        the size of the program\n");
+    printf("    --threads <N>    -- Threads for assembling big files, 0 "
+           "(default) uses\n");
+    printf("                        every processor\n");
+    printf("    -O<N>            -- Optimize the program, N is 0 (default), 1 "
+           "or 2\n");
+    printf("    --profile <FILE> -- Lay the program out along a profile from "
+           "`am4vm\n");
+    printf("                        --profile`, made with the binary the same "
+           "options give\n");
     exit(0);
 }
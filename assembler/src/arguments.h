@@ -1,8 +1,23 @@
 #include <stdbool.h>
 
 struct Arguments {
-    char *input;
+    // Every argument that is not an option, in order
+    char **inputs;
+    int inputs_len;
+    // NULL with `-c`, where every object is named after its input
     char *output;
+    // Set with -O<level>, 0 turns the optimizer off
+    int optimization_level;
+    // Assemble one line at a time instead of the whole file at once
+    bool stream;
+    // Threads for assembling big files, 0 uses every processor
+    int threads;
+    // Make an object file of every input instead of linking them
+    bool compile;
+    // Directory objects are cached in, NULL if there is none
+    char *cache;
+    // Profile written by `am4vm --profile`, NULL if there is none
+    char *profile;
 };
 
 /**
@@ -0,0 +1,109 @@
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "error.h"
+#include "object.h"
+
+// Bytes copied at a time
+#define CACHE_COPY_SIZE (1 << 16)
+
+/**
+ * 64 bit FNV-1a, continuing from hash
+ */
+uint64_t cache_hash(uint64_t hash, const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+uint64_t cache_key(const char *source, size_t len) {
+    uint32_t version = OBJECT_VERSION;
+    uint64_t hash = cache_hash(14695981039346656037u, &version,
+                               sizeof(version));
+    return cache_hash(hash, source, len);
+}
+
+/**
+ * @returns `<dir>/<key>.o<suffix>`, with the key in hex
+ */
+char *cache_path(char *dir, uint64_t key, char *suffix, struct Arena *arena) {
+    size_t size =
+        strlen(dir) + sizeof("/0123456789abcdef.o") + strlen(suffix);
+    char *path = arena_alloc(arena, size);
+    snprintf(path, size, "%s/%016" PRIx64 ".o%s", dir, key, suffix);
+    return path;
+}
+
+/**
+ * @returns false if a read or a write fails
+ */
+bool cache_copy(FILE *from, FILE *to) {
+    char buffer[CACHE_COPY_SIZE];
+    size_t len;
+    while ((len = fread(buffer, 1, sizeof(buffer), from)) > 0) {
+        if (fwrite(buffer, 1, len, to) != len) {
+            return false;
+        }
+    }
+    return !ferror(from);
+}
+
+bool cache_fetch(char *dir, uint64_t key, char *output_file,
+                 struct Arena *arena) {
+    FILE *cached = fopen(cache_path(dir, key, "", arena), "rb");
+    if (cached == NULL) {
+        return false;
+    }
+    FILE *output = fopen(output_file, "wb");
+    if (output == NULL) {
+        asm_error("Failed to open file: %s\n", output_file);
+    }
+    bool copied = cache_copy(cached, output);
+    fclose(cached);
+    if (fclose(output) != 0 || !copied) {
+        asm_error("Failed to write the object\n");
+    }
+    return true;
+}
+
+void cache_store(char *dir, uint64_t key, char *object_file,
+                 struct Arena *arena) {
+    if (mkdir(dir, 0777) != 0 && errno != EEXIST) {
+        asm_warning("warning: failed to create the cache %s\n", dir);
+        return;
+    }
+
+    // Written next to its place and renamed into it once it is complete
+    char *path = cache_path(dir, key, "", arena);
+    char *template = cache_path(dir, key, ".XXXXXX", arena);
+    int fd = mkstemp(template);
+    FILE *cached = fd < 0 ? NULL : fdopen(fd, "wb");
+    FILE *object = fopen(object_file, "rb");
+    bool stored =
+        cached != NULL && object != NULL && cache_copy(object, cached);
+    if (object != NULL) {
+        fclose(object);
+    }
+    if (cached != NULL) {
+        stored = fclose(cached) == 0 && stored;
+    } else if (fd >= 0) {
+        close(fd);
+    }
+    stored = stored && rename(template, path) == 0;
+    if (!stored) {
+        if (fd >= 0) {
+            unlink(template);
+        }
+        asm_warning("warning: failed to store %s in the cache %s\n",
+                    object_file, dir);
+    }
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+/**
+ * Hash everything an object is made from, the objects of two sources with
+ * the same key are the same
+ *
+ * @note Covers OBJECT_VERSION, which has to be bumped whenever the object the
+ * assembler makes of a source changes
+ *
+ * @param source
+ * @param len
+ *
+ * @returns The key of the object in the cache
+ */
+uint64_t cache_key(const char *source, size_t len);
+
+/**
+ * Copy the object with a key out of the cache
+ *
+ * @param dir Directory of the cache
+ * @param key
+ * @param output_file File name the object is copied to
+ * @param arena Where the path of the object is built
+ *
+ * @returns false if the cache does not have the object
+ */
+bool cache_fetch(char *dir, uint64_t key, char *output_file,
+                 struct Arena *arena);
+
+/**
+ * Copy an object into the cache under a key
+ *
+ * @note The object shows up in the cache all at once, so a cache can be
+ * shared by assemblers running at the same time. Failing to store an object
+ * is only a warning.
+ *
+ * @param dir Directory of the cache, created if it does not exist
+ * @param key
+ * @param object_file File name of the object
+ * @param arena Where the path of the object is built
+ */
+void cache_store(char *dir, uint64_t key, char *object_file,
+                 struct Arena *arena);
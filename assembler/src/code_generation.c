@@ -1,56 +1,110 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "code_generation.h"
+#include "error.h"
+#include "format.h"
 #include "parser.h"
 
-// Only header
-#define MINIMUM_BINARY_SIZE 2
-
-struct Binary {
-    uint32_t *bin;
-    size_t capacity;
-    size_t len;
-};
-
+/**
+ * @note The binary is allocated with its final size, see binary_new
+ */
 void write_to_binary(struct Binary *binary, uint32_t value) {
-    if (binary->len >= binary->capacity) {
-        size_t new_capacity = binary->capacity * 2;
-        binary->bin = realloc(binary->bin, new_capacity * sizeof(uint32_t));
-        if (binary->bin == NULL) {
-            fprintf(stderr, "Failed to reallocate the binary buffer\n");
-            exit(1);
+    binary->bin[binary->len++] = value;
+}
+
+int32_t constant_pool_get(struct ConstantPool *pool, uint32_t value) {
+    for (size_t i = 0; i < pool->len; i++) {
+        if (pool->values[i] == value) {
+            return i;
         }
-        binary->capacity *= 2;
     }
-    binary->bin[binary->len++] = value;
+    if (pool->len >= pool->capacity) {
+        pool->capacity = pool->capacity == 0 ? 8 : pool->capacity * 2;
+        pool->values =
+            realloc(pool->values, pool->capacity * sizeof(uint32_t));
+        if (pool->values == NULL) {
+            asm_error("Failed to reallocate the constant pool\n");
+        }
+    }
+    pool->values[pool->len] = value;
+    return pool->len++;
+}
+
+bool fits_in_argument(int32_t value) {
+    return value >= -(1 << 23) && value < (1 << 23);
+}
+
+enum InstructionKind wide_instruction_kind(enum InstructionKind kind) {
+    switch (kind) {
+    case InstructionJmp:
+        return InstructionJmpW;
+    case InstructionJEQZ:
+        return InstructionJEQZW;
+    case InstructionJNEZ:
+        return InstructionJNEZW;
+    case InstructionCall:
+        return InstructionCallW;
+    case InstructionSpawn:
+        return InstructionSpawnW;
+    case InstructionPush:
+        return InstructionPushK;
+    case InstructionFetch:
+        return InstructionFetchW;
+    case InstructionStore:
+        return InstructionStoreW;
+    case InstructionPrintV:
+        return InstructionPrintVW;
+    default:
+        return kind;
+    }
 }
 
 void create_header(struct Binary *binary, struct InstructionVec *instructions,
-                   struct IdentMap *idents) {
+                   struct IdentMap *idents, struct ConstantPool *pool) {
     // Start of the text section
-    write_to_binary(binary, idents->len);
+    write_to_binary(binary, pool->len + idents->size);
     // Total size of the binary
-    write_to_binary(binary, instructions->len + idents->len);
+    write_to_binary(binary, pool->len + idents->size + instructions->len);
+}
+
+/**
+ * @note The constant pool lives **BEFORE** the data section, so its entries
+ * always have small addresses
+ */
+void setup_constant_pool(struct Binary *binary, struct ConstantPool *pool) {
+    for (size_t i = 0; i < pool->len; i++) {
+        write_to_binary(binary, pool->values[i]);
+    }
 }
 
 /**
- * Allocates a single integer to every variable
+ * Allocates a single integer to every variable, or as many as `alloc` asked
+ * for
  * @note The data section lives **BEFORE** the text section
  */
 void setup_data_section(struct Binary *binary, struct IdentMap *idents) {
-    for (size_t i = 0; i < idents->len; i++) {
+    for (size_t i = 0; i < idents->size; i++) {
         write_to_binary(binary, 0);
     }
 }
 
+bool takes_identifier(enum InstructionKind kind) {
+    return kind == InstructionFetch || kind == InstructionStore ||
+           kind == InstructionPrintV || kind == InstructionPush;
+}
+
 /**
  * Labels and identifiers must be converted to addresses
+ *
+ * @param pool_len Number of words in front of the data section
  */
 int32_t get_value_as_int(struct Instruction *instruction,
-                         struct LabelMap *labels, struct IdentMap *idents) {
+                         struct LabelMap *labels, struct IdentMap *idents,
+                         size_t pool_len) {
     switch (instruction->value.kind) {
     case None:
         return 0;
@@ -60,31 +114,27 @@ int32_t get_value_as_int(struct Instruction *instruction,
         // We say that false = 0, true = 1
         return instruction->value.value.boolean;
     case StringValue:
-        if (instruction->kind == InstructionFetch ||
-            instruction->kind == InstructionStore ||
-            instruction->kind == InstructionPrintV) {
+        if (takes_identifier(instruction->kind)) {
             int32_t value =
                 ident_map_get(idents, instruction->value.value.string);
             if (value == -1) {
-                fprintf(stderr, "%s is not a valid identifier!\n",
-                        instruction->value.value.string);
-                exit(1);
+                asm_error("%s is not a valid identifier!\n",
+                          instruction->value.value.string);
             }
-            // The data section lives first, so no need to offset by anything
-            return value;
+            // The data section lives after the constant pool
+            return value + pool_len;
 
         } else {
             // The only strings are labels && identifiers
             int32_t value =
                 label_map_get(labels, instruction->value.value.string);
             if (value == -1) {
-                fprintf(stderr, "%s is not a valid label!\n",
-                        instruction->value.value.string);
-                exit(1);
+                asm_error("%s is not a valid label!\n",
+                          instruction->value.value.string);
             }
-            // The data section lives first, so the text section is offset
-            // by the number of unique identifiers (variables)
-            return value + idents->len;
+            // The constant pool and the data section live first, so the text
+            // section is offset by their size
+            return value + pool_len + idents->size;
         }
         break;
     default:
@@ -92,16 +142,59 @@ int32_t get_value_as_int(struct Instruction *instruction,
     }
 }
 
+void collect_constant_pool(struct ConstantPool *pool,
+                           struct InstructionVec *instructions,
+                           struct LabelMap *labels, struct IdentMap *idents,
+                           size_t pool_len) {
+    for (size_t i = 0; i < instructions->len; i++) {
+        struct Instruction *instruction = &instructions->elements[i];
+        if (wide_instruction_kind(instruction->kind) == instruction->kind) {
+            continue;
+        }
+        int32_t value = get_value_as_int(instruction, labels, idents, pool_len);
+        if (!fits_in_argument(value)) {
+            constant_pool_get(pool, value);
+        }
+    }
+}
+
+/**
+ * Collect every argument that needs a wide instruction form
+ *
+ * @note Growing the pool moves every address after it, which can push more
+ * addresses past 24 bits, so this runs until the size settles
+ */
+struct ConstantPool build_constant_pool(struct InstructionVec *instructions,
+                                        struct LabelMap *labels,
+                                        struct IdentMap *idents) {
+    struct ConstantPool pool = {.values = NULL, .len = 0, .capacity = 0};
+    size_t pool_len;
+    do {
+        pool_len = pool.len;
+        pool.len = 0;
+        collect_constant_pool(&pool, instructions, labels, idents, pool_len);
+    } while (pool.len != pool_len);
+    return pool;
+}
+
 void generate_text_section(struct Binary *binary,
                            struct InstructionVec *instructions,
-                           struct LabelMap *labels, struct IdentMap *idents) {
+                           struct LabelMap *labels, struct IdentMap *idents,
+                           struct ConstantPool *pool) {
     for (size_t i = 0; i < instructions->len; i++) {
         struct Instruction instruction = instructions->elements[i];
+        enum InstructionKind kind = instruction.kind;
+
+        int32_t value =
+            get_value_as_int(&instruction, labels, idents, pool->len);
+        if (!fits_in_argument(value) && wide_instruction_kind(kind) != kind) {
+            kind = wide_instruction_kind(kind);
+            value = constant_pool_get(pool, value);
+        }
 
         // The opcode occupies the 8 most significant bits
-        int32_t opcode = instruction.kind << 24;
+        int32_t opcode = kind << 24;
 
-        int32_t value = get_value_as_int(&instruction, labels, idents);
         // Only the least significant 24 bits are reserved for data
         value = value & 0xFFFFFF;
 
@@ -109,16 +202,27 @@ void generate_text_section(struct Binary *binary,
     }
 }
 
-struct Binary binary_new() {
-    struct Binary binary = {
-        .bin = calloc(MINIMUM_BINARY_SIZE, sizeof(uint32_t)),
-        .capacity = MINIMUM_BINARY_SIZE,
+/**
+ * Every section is known once the constant pool is built, so the binary never
+ * has to grow
+ */
+struct Binary binary_new(struct Arena *arena,
+                         struct InstructionVec *instructions,
+                         struct IdentMap *idents, struct ConstantPool *pool) {
+    size_t size = HEADER_SIZE + pool->len + idents->size + instructions->len;
+    return (struct Binary){
+        .bin = arena_alloc(arena, size * sizeof(uint32_t)),
         .len = 0,
     };
-    if (binary.bin == NULL) {
-        fprintf(stderr, "Failed to do a heap allocation\n");
-        exit(1);
-    }
+}
+
+struct Binary generate_sections(struct ParseResult result,
+                                struct ConstantPool *pool) {
+    struct Binary binary =
+        binary_new(result.arena, result.instructions, result.idents, pool);
+    create_header(&binary, result.instructions, result.idents, pool);
+    setup_constant_pool(&binary, pool);
+    setup_data_section(&binary, result.idents);
     return binary;
 }
 
@@ -126,20 +230,29 @@ struct Binary generate_binary(struct ParseResult result) {
     struct InstructionVec *instructions = result.instructions;
     struct LabelMap *labels = result.labels;
     struct IdentMap *idents = result.idents;
-    struct Binary binary = binary_new();
-
-    create_header(&binary, instructions, idents);
-    setup_data_section(&binary, idents);
+    struct ConstantPool pool =
+        build_constant_pool(instructions, labels, idents);
+    struct Binary binary = generate_sections(result, &pool);
 
-    generate_text_section(&binary, instructions, labels, idents);
+    generate_text_section(&binary, instructions, labels, idents, &pool);
+    free(pool.values);
     return binary;
 }
 
+void write_binary_to_file(struct Binary *binary, struct ParseResult *result,
+                          char *output_file) {
+    FILE *output = fopen(output_file, "wb");
+    if (output == NULL) {
+        asm_error("Failed to open file: %s\n", output_file);
+    }
+    binary_encode(output, binary, result);
+    if (fclose(output) != 0) {
+        asm_error("Failed to write the binary\n");
+    }
+}
+
 void generate_binary_and_write_to_file(struct ParseResult result,
                                        char *output_file) {
     struct Binary binary = generate_binary(result);
-    FILE *output = fopen(output_file, "wb");
-    fwrite(binary.bin, sizeof(uint32_t), binary.len, output);
-    fclose(output);
-    free(binary.bin);
+    write_binary_to_file(&binary, &result, output_file);
 }
@@ -1,6 +1,146 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #include "parser.h"
 
+// Start of the text section and total size
+#define HEADER_SIZE 2
+
+struct Binary {
+    uint32_t *bin;
+    size_t len;
+};
+
+/**
+ * Values that do not fit in the 24 bit argument of an instruction. They are
+ * stored before the data section, and the wide instruction forms take the
+ * address of an entry as their argument.
+ */
+struct ConstantPool {
+    uint32_t *values;
+    size_t len;
+    size_t capacity;
+};
+
+/**
+ * Get the address of a value in the pool, adding it if it is not there
+ *
+ * @param pool
+ * @param value
+ *
+ * @returns The address of the entry
+ */
+int32_t constant_pool_get(struct ConstantPool *pool, uint32_t value);
+
+/**
+ * The argument is sign extended, so addresses only get 23 bits
+ *
+ * @param value
+ *
+ * @returns true if value fits in the argument of an instruction
+ */
+bool fits_in_argument(int32_t value);
+
+/**
+ * @param kind
+ *
+ * @returns The wide form of an instruction, or the instruction itself if it
+ * has none
+ */
+enum InstructionKind wide_instruction_kind(enum InstructionKind kind);
+
+/**
+ * @param kind
+ *
+ * @returns true if a string argument of kind names an identifier, and not a
+ * label
+ */
+bool takes_identifier(enum InstructionKind kind);
+
+/**
+ * Convert the label or identifier argument of an instruction to an address
+ *
+ * @note Stops the assembly if the label or identifier does not exist
+ *
+ * @param instruction
+ * @param labels
+ * @param idents
+ * @param pool_len Number of words in front of the data section
+ *
+ * @returns The argument of the instruction
+ */
+int32_t get_value_as_int(struct Instruction *instruction,
+                         struct LabelMap *labels, struct IdentMap *idents,
+                         size_t pool_len);
+
+/**
+ * Add the arguments of instructions that need a wide instruction form to a
+ * pool, in the order they first appear
+ *
+ * @note One pass of building the constant pool, it is only complete once a
+ * pass leaves the pool at pool_len entries
+ *
+ * @param pool
+ * @param instructions
+ * @param labels
+ * @param idents
+ * @param pool_len Size of the pool the addresses are computed with
+ */
+void collect_constant_pool(struct ConstantPool *pool,
+                           struct InstructionVec *instructions,
+                           struct LabelMap *labels, struct IdentMap *idents,
+                           size_t pool_len);
+
+/**
+ * Allocate the binary and write everything in front of the text section
+ *
+ * @param result The result of parsing the tokens
+ * @param pool The complete constant pool
+ *
+ * @returns struct Binary, its len is the start of the text section
+ */
+struct Binary generate_sections(struct ParseResult result,
+                                struct ConstantPool *pool);
+
+/**
+ * Encode instructions at the end of a binary
+ *
+ * @note Reads the pool without adding to it if it is complete, so several
+ * threads can encode with the same pool
+ *
+ * @param binary Has room for the instructions
+ * @param instructions
+ * @param labels
+ * @param idents
+ * @param pool The complete constant pool
+ */
+void generate_text_section(struct Binary *binary,
+                           struct InstructionVec *instructions,
+                           struct LabelMap *labels, struct IdentMap *idents,
+                           struct ConstantPool *pool);
+
+/**
+ * Generate am4 binary / machine code in memory
+ *
+ * @param result The result of parsing the tokens
+ *
+ * @returns struct Binary, bin lives in the arena of the result
+ */
+struct Binary generate_binary(struct ParseResult result);
+
+/**
+ * Write a binary to a file, in the format described in format.h
+ *
+ * @param binary
+ * @param result Where the symbols and lines come from, NULL to leave them
+ * out
+ * @param output_file File name of the output target
+ */
+void write_binary_to_file(struct Binary *binary, struct ParseResult *result,
+                          char *output_file);
+
 /**
  * Generate am4 binary / machine code and write it to a file
  *
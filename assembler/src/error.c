@@ -0,0 +1,34 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "error.h"
+
+_Thread_local jmp_buf *asm_error_trap = NULL;
+_Thread_local bool asm_error_quiet = false;
+_Thread_local FILE *asm_error_stream = NULL;
+
+void asm_error(const char *format, ...) {
+    if (!asm_error_quiet) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(asm_error_stream != NULL ? asm_error_stream : stderr, format,
+                 args);
+        va_end(args);
+    }
+
+    if (asm_error_trap != NULL) {
+        longjmp(*asm_error_trap, 1);
+    }
+    exit(1);
+}
+
+void asm_warning(const char *format, ...) {
+    if (!asm_error_quiet) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(asm_error_stream != NULL ? asm_error_stream : stderr, format,
+                 args);
+        va_end(args);
+    }
+}
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+/**
+ * When set, asm_error longjmps here instead of exiting, so the assembler
+ * can be used as a library
+ *
+ * @note Every thread has its own
+ */
+extern _Thread_local jmp_buf *asm_error_trap;
+
+/**
+ * Do not print errors or warnings, used when errors are expected (fuzzing)
+ *
+ * @note Every thread has its own
+ */
+extern _Thread_local bool asm_error_quiet;
+
+/**
+ * Where errors and warnings are printed, stderr when NULL. Lets a thread hold
+ * its messages back so they can be printed in source order.
+ *
+ * @note Every thread has its own
+ */
+extern _Thread_local FILE *asm_error_stream;
+
+/**
+ * Report an error and abort the assembly
+ *
+ * @note Exits unless asm_error_trap is set
+ *
+ * @param format printf style format string
+ */
+__attribute__((noreturn, format(printf, 1, 2))) void
+asm_error(const char *format, ...);
+
+/**
+ * Report a warning, the assembly continues
+ *
+ * @param format printf style format string
+ */
+__attribute__((format(printf, 1, 2))) void asm_warning(const char *format,
+                                                       ...);
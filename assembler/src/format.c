@@ -0,0 +1,267 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "error.h"
+#include "format.h"
+#include "symbol_index.h"
+
+// CRC-32 of every nibble, for the reversed polynomial 0xedb88320
+const uint32_t crc32_nibbles[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+    0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len) {
+    const uint8_t *bytes = data;
+    crc = ~crc;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 4) ^ crc32_nibbles[(crc ^ bytes[i]) & 0xf];
+        crc = (crc >> 4) ^ crc32_nibbles[(crc ^ (bytes[i] >> 4)) & 0xf];
+    }
+    return ~crc;
+}
+
+bool binary_has_argument(enum InstructionKind kind) {
+    switch (kind) {
+    case InstructionJmp:
+    case InstructionJEQZ:
+    case InstructionJNEZ:
+    case InstructionCall:
+    case InstructionSpawn:
+    case InstructionJmpW:
+    case InstructionJEQZW:
+    case InstructionJNEZW:
+    case InstructionCallW:
+    case InstructionSpawnW:
+    case InstructionPush:
+    case InstructionPushK:
+    case InstructionFetch:
+    case InstructionStore:
+    case InstructionFetchW:
+    case InstructionStoreW:
+    case InstructionPrintC:
+    case InstructionPrintV:
+    case InstructionPrintVW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void binary_writer_start(struct BinaryWriter *writer, FILE *file) {
+    *writer = (struct BinaryWriter){
+        .file = file,
+        .crc = 0,
+        .offset = sizeof(struct BinaryHeader),
+        .sections_len = 0,
+        .line = 0,
+        .source_line = 0,
+    };
+    struct BinaryHeader header = {0};
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        asm_error("Failed to write the binary\n");
+    }
+}
+
+void binary_writer_section(struct BinaryWriter *writer,
+                           enum BinarySectionType type) {
+    writer->sections[writer->sections_len++] = (struct BinarySection){
+        .type = type,
+        .offset = writer->offset,
+        .size = 0,
+    };
+}
+
+void binary_write(struct BinaryWriter *writer, const void *data, size_t len) {
+    if (len > UINT32_MAX - writer->offset) {
+        asm_error("error: the program does not fit in a binary file\n");
+    }
+    if (len > 0 && fwrite(data, 1, len, writer->file) != len) {
+        asm_error("Failed to write the binary\n");
+    }
+    writer->crc = crc32_update(writer->crc, data, len);
+    writer->offset += len;
+    if (writer->sections_len > 0) {
+        writer->sections[writer->sections_len - 1].size += len;
+    }
+}
+
+/**
+ * @returns The number of bytes written to bytes, at most 10
+ */
+size_t encode_varint(uint8_t *bytes, uint64_t value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        bytes[len++] = (value & 0x7f) | 0x80;
+        value >>= 7;
+    }
+    bytes[len++] = value;
+    return len;
+}
+
+void binary_write_varint(struct BinaryWriter *writer, uint64_t value) {
+    uint8_t bytes[10];
+    binary_write(writer, bytes, encode_varint(bytes, value));
+}
+
+void binary_write_instruction(struct BinaryWriter *writer,
+                              enum InstructionKind kind, int32_t arg) {
+    uint8_t bytes[11];
+    bytes[0] = kind;
+    size_t len = 1;
+    if (binary_has_argument(kind)) {
+        // Only the 24 bits an instruction word has room for, sign extended
+        arg = (int32_t)((uint32_t)arg << 8) >> 8;
+        // Zigzag, so small negative numbers stay short
+        uint32_t zigzag = ((uint32_t)arg << 1) ^ (uint32_t)(arg >> 31);
+        len += encode_varint(bytes + 1, zigzag);
+    }
+    binary_write(writer, bytes, len);
+}
+
+void binary_write_symbol(struct BinaryWriter *writer,
+                         enum BinarySymbolKind kind, uint32_t addr,
+                         char *name) {
+    uint8_t byte = kind;
+    binary_write(writer, &byte, 1);
+    binary_write_varint(writer, addr);
+    binary_write(writer, name, strlen(name) + 1);
+}
+
+void binary_write_symbols(struct BinaryWriter *writer, struct LabelMap *labels,
+                          struct IdentMap *idents, size_t pool_len) {
+    binary_writer_section(writer, SectionSymbols);
+    for (size_t i = 0; i < labels->len; i++) {
+        struct Label *label = &labels->elements[i];
+        // A label that is defined again keeps its first address
+        size_t position;
+        symbol_index_get(&labels->index, label->ident, strlen(label->ident),
+                         &position);
+        if (position == i && label->addr >= 0) {
+            binary_write_symbol(writer, SymbolLabel, label->addr,
+                                label->ident);
+        }
+    }
+    for (size_t i = 0; i < idents->len; i++) {
+        struct Ident *ident = &idents->elements[i];
+        binary_write_symbol(writer, SymbolIdent, pool_len + ident->addr,
+                            ident->ident);
+    }
+}
+
+/**
+ * @returns The difference of value to previous as a zigzag varint
+ */
+uint64_t zigzag_difference(uint32_t value, uint32_t previous) {
+    int64_t difference = (int64_t)value - previous;
+    return ((uint64_t)difference << 1) ^ (uint64_t)(difference >> 63);
+}
+
+void binary_write_line(struct BinaryWriter *writer, uint32_t line,
+                       uint32_t source_line) {
+    uint8_t bytes[20];
+    size_t len = encode_varint(bytes, zigzag_difference(line, writer->line));
+    len += encode_varint(bytes + len,
+                         zigzag_difference(source_line, writer->source_line));
+    binary_write(writer, bytes, len);
+    writer->line = line;
+    writer->source_line = source_line;
+}
+
+struct BinaryHeader binary_writer_table(struct BinaryWriter *writer) {
+    struct BinaryHeader header = {
+        .magic = BINARY_MAGIC,
+        .version = BINARY_VERSION,
+        .crc = 0,
+        .sections_len = writer->sections_len,
+        .table = writer->offset,
+    };
+    // The table is not a section of its own
+    writer->sections_len = 0;
+    binary_write(writer, writer->sections,
+                 header.sections_len * sizeof(struct BinarySection));
+    header.crc = writer->crc;
+    return header;
+}
+
+void binary_writer_finish(struct BinaryWriter *writer) {
+    struct BinaryHeader header = binary_writer_table(writer);
+    if (fseek(writer->file, 0, SEEK_SET) != 0 ||
+        fwrite(&header, sizeof(header), 1, writer->file) != 1 ||
+        fseek(writer->file, 0, SEEK_END) != 0) {
+        asm_error("Failed to write the binary\n");
+    }
+}
+
+/**
+ * Write every section of a generated binary, but not the section table
+ *
+ * @note Without a result, there are no symbols and no line table
+ */
+void binary_encode_sections(struct BinaryWriter *writer,
+                            struct Binary *binary,
+                            struct ParseResult *result) {
+    uint32_t start_addr = binary->bin[0];
+    uint32_t total_size = binary->bin[1];
+    uint32_t *memory = binary->bin + HEADER_SIZE;
+
+    // The data section is zero until the program stores to it
+    uint32_t initialized = start_addr;
+    while (initialized > 0 && memory[initialized - 1] == 0) {
+        initialized--;
+    }
+    binary_writer_section(writer, SectionData);
+    binary_write(writer, &start_addr, sizeof(uint32_t));
+    binary_write(writer, memory, initialized * sizeof(uint32_t));
+
+    binary_writer_section(writer, SectionText);
+    binary_write_varint(writer, total_size - start_addr);
+    for (uint32_t pc = start_addr; pc < total_size; pc++) {
+        binary_write_instruction(writer, memory[pc] >> 24, memory[pc]);
+    }
+
+    if (result == NULL) {
+        return;
+    }
+    binary_write_symbols(writer, result->labels, result->idents,
+                         start_addr - result->idents->size);
+
+    // Every instruction is a word of the text section
+    struct InstructionVec *instructions = result->instructions;
+    binary_writer_section(writer, SectionDebug);
+    binary_write_varint(writer, instructions->len);
+    for (size_t i = 0; i < instructions->len; i++) {
+        binary_write_line(writer, instructions->elements[i].line,
+                          instructions->elements[i].source_line);
+    }
+}
+
+void binary_encode(FILE *file, struct Binary *binary,
+                   struct ParseResult *result) {
+    struct BinaryWriter writer;
+    binary_writer_start(&writer, file);
+    binary_encode_sections(&writer, binary, result);
+    binary_writer_finish(&writer);
+}
+
+uint8_t *binary_encode_to_memory(struct Binary *binary,
+                                 struct ParseResult *result, size_t *size) {
+    char *data = NULL;
+    FILE *file = open_memstream(&data, size);
+    if (file == NULL) {
+        asm_error("Failed to do a heap allocation\n");
+    }
+    struct BinaryWriter writer;
+    binary_writer_start(&writer, file);
+    binary_encode_sections(&writer, binary, result);
+    // A memory stream loses what comes after a seek back, so the header is
+    // filled in once it is closed
+    struct BinaryHeader header = binary_writer_table(&writer);
+    if (fclose(file) != 0) {
+        free(data);
+        asm_error("Failed to do a heap allocation\n");
+    }
+    memcpy(data, &header, sizeof(header));
+    return (uint8_t *)data;
+}
@@ -0,0 +1,188 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "code_generation.h"
+#include "parser.h"
+
+// "AM4B" in a little endian word
+#define BINARY_MAGIC 0x42344d41
+
+// Version 1 had no header but the start of the text and the memory size
+#define BINARY_VERSION 2
+
+/**
+ * A binary file is a header, its sections and a table of the sections:
+ *
+ * header | data | text | symbols | section table
+ *
+ * The crc is the CRC-32 of every byte after the header. Every entry of the
+ * section table gives the type, offset and size in bytes of a section, a
+ * reader skips the types it does not know.
+ *
+ * data: the number of memory words in front of the text section as a u32,
+ * followed by the words that are not zero at the start, the constant pool.
+ *
+ * text: the number of instructions as a varint, followed by every
+ * instruction as its opcode byte and, if it has one, its argument as a
+ * zigzag varint. Varints are LEB128, 7 bits at a time with the high bit set
+ * on every byte but the last.
+ *
+ * symbols: a kind byte, an address varint and a NUL terminated name for
+ * every label and identifier. Labels count instructions from the start of
+ * the text section, identifiers are memory addresses.
+ *
+ * debug: the line table, the number of instructions as a varint, followed by
+ * the line of the assembly and the line of the source of every instruction.
+ * Both are zigzag varints of the difference to the instruction before, the
+ * lines before the first instruction are 0. A source line of 0 means the
+ * instruction has none.
+ */
+struct BinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t crc;
+    uint32_t sections_len;
+    // Offset of the section table
+    uint32_t table;
+};
+
+enum BinarySectionType {
+    SectionData = 1,
+    SectionText = 2,
+    SectionSymbols = 3,
+    SectionDebug = 4,
+};
+
+struct BinarySection {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t size;
+};
+
+enum BinarySymbolKind {
+    SymbolLabel = 0,
+    SymbolIdent = 1,
+};
+
+// Every type at most once
+#define BINARY_SECTIONS_MAX 4
+
+/**
+ * Writes a binary file one section at a time, the header is written last
+ */
+struct BinaryWriter {
+    FILE *file;
+    // Of everything written after the header so far
+    uint32_t crc;
+    uint32_t offset;
+    struct BinarySection sections[BINARY_SECTIONS_MAX];
+    uint32_t sections_len;
+    // Of the last instruction written to the line table
+    uint32_t line;
+    uint32_t source_line;
+};
+
+/**
+ * @param crc The CRC-32 of the bytes in front of data, 0 for none
+ * @param data
+ * @param len
+ *
+ * @returns The CRC-32 of the bytes in front of data and data
+ */
+uint32_t crc32_update(uint32_t crc, const void *data, size_t len);
+
+/**
+ * @param kind
+ *
+ * @returns true if the argument of kind is written to the text section
+ */
+bool binary_has_argument(enum InstructionKind kind);
+
+/**
+ * Start a binary file, leaving room for the header
+ *
+ * @note Stops the assembly if the file can not be written
+ *
+ * @param writer
+ * @param file Has to be seekable
+ */
+void binary_writer_start(struct BinaryWriter *writer, FILE *file);
+
+/**
+ * Start the next section, everything written until the next one belongs to
+ * it
+ *
+ * @param writer
+ * @param type
+ */
+void binary_writer_section(struct BinaryWriter *writer,
+                           enum BinarySectionType type);
+
+void binary_write(struct BinaryWriter *writer, const void *data, size_t len);
+
+void binary_write_varint(struct BinaryWriter *writer, uint64_t value);
+
+void binary_write_instruction(struct BinaryWriter *writer,
+                              enum InstructionKind kind, int32_t arg);
+
+/**
+ * Write the symbols section
+ *
+ * @param writer
+ * @param labels
+ * @param idents
+ * @param pool_len Number of words in front of the data section
+ */
+void binary_write_symbols(struct BinaryWriter *writer, struct LabelMap *labels,
+                          struct IdentMap *idents, size_t pool_len);
+
+/**
+ * Write the lines of the next instruction to the line table
+ *
+ * @param writer
+ * @param line Line of the assembly
+ * @param source_line Line of the source, 0 for none
+ */
+void binary_write_line(struct BinaryWriter *writer, uint32_t line,
+                       uint32_t source_line);
+
+/**
+ * Write the section table
+ *
+ * @param writer
+ *
+ * @returns The header of the file
+ */
+struct BinaryHeader binary_writer_table(struct BinaryWriter *writer);
+
+/**
+ * Write the section table and go back to fill in the header
+ *
+ * @param writer
+ */
+void binary_writer_finish(struct BinaryWriter *writer);
+
+/**
+ * Write a generated binary as a binary file
+ *
+ * @param file Has to be seekable
+ * @param binary
+ * @param result Where the symbols and lines come from, NULL to leave them out
+ */
+void binary_encode(FILE *file, struct Binary *binary,
+                   struct ParseResult *result);
+
+/**
+ * Encode a generated binary into the bytes of a binary file
+ *
+ * @param binary
+ * @param result Where the symbols and lines come from, NULL to leave them out
+ * @param size Set to the size of the file
+ *
+ * @returns The file, has to be freed
+ */
+uint8_t *binary_encode_to_memory(struct Binary *binary,
+                                 struct ParseResult *result, size_t *size);
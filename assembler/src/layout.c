@@ -0,0 +1,556 @@
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "code_generation.h"
+#include "error.h"
+#include "format.h"
+#include "layout.h"
+
+#define NO_BLOCK SIZE_MAX
+
+// A jump back to the start of a loop weighs this many times as often as it
+// is taken
+#define BACK_EDGE_FACTOR 2
+
+// Longest synthetic label name, ".layout" and a size_t
+#define MAX_LAYOUT_LABEL_SIZE 32
+
+struct Block {
+    size_t start;
+    // One past the last instruction
+    size_t end;
+    // Where the jump that ends the block goes, or NO_BLOCK
+    size_t target;
+    // Where control goes if the block does not jump, NO_BLOCK after a `jmp`
+    // or a `ret`
+    size_t fall_through;
+    // A label that points to the block, NULL until one is needed
+    char *label;
+    // Neighbours in the chain of the block
+    size_t prev;
+    size_t next;
+    // Union-find over the chains, the root tells which chain it is
+    size_t parent;
+};
+
+struct Edge {
+    size_t from;
+    size_t to;
+    uint64_t weight;
+    // Edges to the next block come first among equals
+    bool fall_through;
+};
+
+struct Layout {
+    struct ParseResult *result;
+    struct Block *blocks;
+    // The empty block at the end of the program, jumping to it halts
+    size_t end_block;
+    // Block that starts at every address, NO_BLOCK inside of blocks
+    size_t *block_of;
+};
+
+uint64_t profile_hash(const void *data, size_t len) {
+    const unsigned char *bytes = data;
+    uint64_t hash = 14695981039346656037u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211u;
+    }
+    return hash;
+}
+
+struct Profile profile_read(char *filename, struct Arena *arena) {
+    FILE *input = fopen(filename, "r");
+    if (input == NULL) {
+        asm_error("Failed to open file: %s\n", filename);
+    }
+    struct Profile profile = {.hash = 0, .len = 0};
+    if (fscanf(input, "am4 profile binary %" SCNx64 " %zu", &profile.hash,
+               &profile.len) != 2) {
+        asm_error("error: %s is not a valid profile\n", filename);
+    }
+    profile.counts = arena_alloc(arena, profile.len * sizeof(uint64_t));
+    profile.taken = arena_alloc(arena, profile.len * sizeof(uint64_t));
+    memset(profile.counts, 0, profile.len * sizeof(uint64_t));
+    memset(profile.taken, 0, profile.len * sizeof(uint64_t));
+
+    size_t pc;
+    uint64_t count;
+    uint64_t taken;
+    int matched;
+    while ((matched = fscanf(input, "%zu %" SCNu64 " %" SCNu64, &pc, &count,
+                             &taken)) == 3) {
+        if (pc >= profile.len) {
+            asm_error("error: %s is not a valid profile\n", filename);
+        }
+        profile.counts[pc] = count;
+        profile.taken[pc] = taken;
+    }
+    if (matched != EOF) {
+        asm_error("error: %s is not a valid profile\n", filename);
+    }
+    fclose(input);
+    return profile;
+}
+
+bool profile_matches(struct Profile *profile, struct ParseResult *result) {
+    if (profile->len != result->instructions->len) {
+        return false;
+    }
+    struct Binary binary = generate_binary(*result);
+    size_t size;
+    uint8_t *file = binary_encode_to_memory(&binary, result, &size);
+    bool matches = profile->hash == profile_hash(file, size);
+    free(file);
+    return matches;
+}
+
+bool layout_ends_with_jump(enum InstructionKind kind) {
+    return kind == InstructionJmp || kind == InstructionJEQZ ||
+           kind == InstructionJNEZ;
+}
+
+/**
+ * @returns false if control can go anywhere a label does not tell
+ */
+bool layout_supported(struct ParseResult *result) {
+    struct InstructionVec *instructions = result->instructions;
+    for (size_t i = 0; i < instructions->len; i++) {
+        struct Instruction *instruction = &instructions->elements[i];
+        switch (instruction->kind) {
+        case InstructionJmp:
+        case InstructionJEQZ:
+        case InstructionJNEZ:
+        case InstructionCall:
+        case InstructionSpawn:
+            if (instruction->value.kind != StringValue ||
+                label_map_get(result->labels,
+                              instruction->value.value.string) == -1) {
+                return false;
+            }
+            break;
+        case InstructionJmpW:
+        case InstructionJEQZW:
+        case InstructionJNEZW:
+        case InstructionCallW:
+        case InstructionSpawnW:
+            return false;
+        default:
+            break;
+        }
+    }
+    return true;
+}
+
+void *layout_calloc(size_t len, size_t size) {
+    void *ptr = calloc(len, size);
+    if (ptr == NULL) {
+        asm_error("Failed to do a heap allocation\n");
+    }
+    return ptr;
+}
+
+/**
+ * Split the program into blocks, which start at a label or after a jump
+ *
+ * @returns Number of blocks, the empty block at the end included
+ */
+size_t layout_find_blocks(struct Layout *layout) {
+    struct InstructionVec *instructions = layout->result->instructions;
+    struct LabelMap *labels = layout->result->labels;
+    size_t len = instructions->len;
+    size_t *block_of = layout->block_of;
+
+    // Mark where every block starts first
+    block_of[0] = 0;
+    block_of[len] = 0;
+    for (size_t i = 0; i < labels->len; i++) {
+        block_of[labels->elements[i].addr] = 0;
+    }
+    for (size_t i = 0; i < len; i++) {
+        enum InstructionKind kind = instructions->elements[i].kind;
+        if (layout_ends_with_jump(kind) || kind == InstructionRet) {
+            block_of[i + 1] = 0;
+        }
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i <= len; i++) {
+        if (block_of[i] == NO_BLOCK) {
+            continue;
+        }
+        if (count > 0) {
+            layout->blocks[count - 1].end = i;
+        }
+        block_of[i] = count;
+        layout->blocks[count++] = (struct Block){.start = i,
+                                                 .end = len,
+                                                 .target = NO_BLOCK,
+                                                 .fall_through = NO_BLOCK,
+                                                 .label = NULL,
+                                                 .prev = NO_BLOCK,
+                                                 .next = NO_BLOCK};
+    }
+    layout->end_block = count - 1;
+
+    for (size_t b = 0; b < layout->end_block; b++) {
+        struct Block *block = &layout->blocks[b];
+        block->parent = b;
+        struct Instruction *last = &instructions->elements[block->end - 1];
+        if (layout_ends_with_jump(last->kind)) {
+            block->target = block_of[label_map_get(
+                labels, last->value.value.string)];
+        }
+        if (last->kind != InstructionJmp && last->kind != InstructionRet) {
+            block->fall_through = b + 1;
+        }
+    }
+
+    // Jumps keep using the labels they already have
+    for (size_t i = 0; i < labels->len; i++) {
+        struct Label *label = &labels->elements[i];
+        struct Block *block = &layout->blocks[block_of[label->addr]];
+        // A label that is defined again does not point here
+        if (block->label == NULL &&
+            label_map_get(labels, label->ident) == label->addr) {
+            block->label = label->ident;
+        }
+    }
+    return count;
+}
+
+/**
+ * @returns How often control goes from the end of the block along the edge
+ */
+uint64_t layout_edge_count(struct Layout *layout, struct Profile *profile,
+                           size_t from, bool fall_through) {
+    struct Block *block = &layout->blocks[from];
+    if (profile == NULL) {
+        // Without a profile only jumps forward are assumed not to be taken
+        return fall_through || block->target <= from;
+    }
+    size_t last = block->end - 1;
+    if (!fall_through) {
+        return profile->taken[last];
+    }
+    enum InstructionKind kind =
+        layout->result->instructions->elements[last].kind;
+    if (kind == InstructionJEQZ || kind == InstructionJNEZ) {
+        return profile->taken[last] < profile->counts[last]
+                   ? profile->counts[last] - profile->taken[last]
+                   : 0;
+    }
+    return profile->counts[last];
+}
+
+/**
+ * @returns How many instructions putting the blocks of the edge after each
+ * other saves, or an estimate of it without a profile
+ */
+uint64_t layout_edge_weight(struct Layout *layout, struct Profile *profile,
+                            size_t from, bool fall_through) {
+    if (profile == NULL) {
+        uint64_t count = layout_edge_count(layout, profile, from, fall_through);
+        // Every edge of a loop is taken about as often, the jump that closes
+        // it goes first so the loop ends with its condition
+        bool back_edge = !fall_through && layout->blocks[from].target <= from;
+        return back_edge ? BACK_EDGE_FACTOR * count : count;
+    }
+    // A conditional jump runs either way. Either of its edges saves the `jmp`
+    // to the fall through, which runs as often as the jump is not taken.
+    struct Block *block = &layout->blocks[from];
+    enum InstructionKind kind =
+        layout->result->instructions->elements[block->end - 1].kind;
+    bool conditional = kind == InstructionJEQZ || kind == InstructionJNEZ;
+    return layout_edge_count(layout, profile, from,
+                             fall_through || conditional);
+}
+
+int layout_edge_compare(const void *a, const void *b) {
+    const struct Edge *edge_a = a;
+    const struct Edge *edge_b = b;
+    if (edge_a->weight != edge_b->weight) {
+        return edge_a->weight > edge_b->weight ? -1 : 1;
+    }
+    if (edge_a->from != edge_b->from) {
+        return edge_a->from < edge_b->from ? -1 : 1;
+    }
+    return (int)edge_b->fall_through - (int)edge_a->fall_through;
+}
+
+size_t layout_chain(struct Layout *layout, size_t b) {
+    while (layout->blocks[b].parent != b) {
+        struct Block *block = &layout->blocks[b];
+        block->parent = layout->blocks[block->parent].parent;
+        b = block->parent;
+    }
+    return b;
+}
+
+/**
+ * Put blocks after each other along the heaviest edges first, as long as the
+ * edge goes from the end of one chain to the start of another
+ */
+void layout_build_chains(struct Layout *layout, struct Profile *profile) {
+    struct Edge *edges =
+        layout_calloc(2 * layout->end_block + 1, sizeof(struct Edge));
+    size_t edges_len = 0;
+    for (size_t b = 0; b < layout->end_block; b++) {
+        struct Block *block = &layout->blocks[b];
+        size_t to[2] = {block->fall_through, block->target};
+        for (int i = 0; i < 2; i++) {
+            // The first block stays first and the end stays last
+            if (to[i] == NO_BLOCK || to[i] == 0 || to[i] == layout->end_block) {
+                continue;
+            }
+            edges[edges_len++] = (struct Edge){
+                .from = b,
+                .to = to[i],
+                .weight = layout_edge_weight(layout, profile, b, i == 0),
+                .fall_through = i == 0};
+        }
+    }
+    qsort(edges, edges_len, sizeof(struct Edge), layout_edge_compare);
+
+    for (size_t i = 0; i < edges_len; i++) {
+        struct Block *from = &layout->blocks[edges[i].from];
+        struct Block *to = &layout->blocks[edges[i].to];
+        size_t from_chain = layout_chain(layout, edges[i].from);
+        size_t to_chain = layout_chain(layout, edges[i].to);
+        if (from->next != NO_BLOCK || to->prev != NO_BLOCK ||
+            from_chain == to_chain) {
+            continue;
+        }
+        from->next = edges[i].to;
+        to->prev = edges[i].from;
+        layout->blocks[to_chain].parent = from_chain;
+    }
+    free(edges);
+}
+
+/**
+ * @returns true if a block of the chain that starts at head ever ran
+ */
+bool layout_chain_ran(struct Layout *layout, struct Profile *profile,
+                      size_t head) {
+    for (size_t b = head; b != NO_BLOCK; b = layout->blocks[b].next) {
+        if (profile->counts[layout->blocks[b].start] > 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Order the chains, the one of the first block goes first. With a profile the
+ * chains that never ran go after the ones that did.
+ *
+ * @returns The order of every block, the end block last
+ */
+size_t *layout_order(struct Layout *layout, struct Profile *profile) {
+    size_t *order = layout_calloc(layout->end_block + 1, sizeof(size_t));
+    size_t len = 0;
+    bool *ran = layout_calloc(layout->end_block + 1, sizeof(bool));
+    for (size_t b = 0; b < layout->end_block; b++) {
+        ran[b] = layout->blocks[b].prev == NO_BLOCK &&
+                 (profile == NULL || b == 0 ||
+                  layout_chain_ran(layout, profile, b));
+    }
+    for (int cold = 0; cold < 2; cold++) {
+        for (size_t head = 0; head < layout->end_block; head++) {
+            if (layout->blocks[head].prev != NO_BLOCK || ran[head] == cold) {
+                continue;
+            }
+            for (size_t b = head; b != NO_BLOCK; b = layout->blocks[b].next) {
+                order[len++] = b;
+            }
+        }
+    }
+    order[len] = layout->end_block;
+    free(ran);
+    return order;
+}
+
+/**
+ * @returns How many jumps the order runs on the profiled run that are not
+ * there because of a jump of the program, see layout_emit_block
+ */
+uint64_t layout_cost(struct Layout *layout, struct Profile *profile,
+                     size_t *order) {
+    uint64_t cost = 0;
+    for (size_t i = 0; order[i] != layout->end_block; i++) {
+        size_t b = order[i];
+        size_t next = order[i + 1];
+        struct Block *block = &layout->blocks[b];
+        enum InstructionKind kind =
+            layout->result->instructions->elements[block->end - 1].kind;
+        if (kind == InstructionJmp) {
+            if (block->target != next) {
+                cost += layout_edge_count(layout, profile, b, false);
+            }
+        } else if (block->fall_through != NO_BLOCK &&
+                   block->fall_through != next && block->target != next) {
+            cost += layout_edge_count(layout, profile, b, true);
+        }
+    }
+    return cost;
+}
+
+/**
+ * Chain the blocks and order the chains
+ *
+ * @note The chains are greedy, so with a profile the blocks keep the order
+ * they have if it runs fewer jumps on the profiled run. A profile never makes
+ * the layout worse than none, `-O2` already laid the program out without one.
+ *
+ * @returns The order of every block, the end block last
+ */
+size_t *layout_build_order(struct Layout *layout, struct Profile *profile) {
+    layout_build_chains(layout, profile);
+    size_t *order = layout_order(layout, profile);
+    if (profile == NULL) {
+        return order;
+    }
+    size_t *kept = layout_calloc(layout->end_block + 1, sizeof(size_t));
+    for (size_t b = 0; b <= layout->end_block; b++) {
+        kept[b] = b;
+    }
+    if (layout_cost(layout, profile, kept) <
+        layout_cost(layout, profile, order)) {
+        free(order);
+        return kept;
+    }
+    free(kept);
+    return order;
+}
+
+/**
+ * @returns The name of a label that points to the block, adding one if there
+ * is none
+ */
+char *layout_label(struct Layout *layout, size_t b) {
+    struct Block *block = &layout->blocks[b];
+    if (block->label == NULL) {
+        // Labels of a source end with a `:`, so the name is never taken
+        struct LabelMap *labels = layout->result->labels;
+        block->label =
+            arena_alloc(layout->result->arena, MAX_LAYOUT_LABEL_SIZE);
+        snprintf(block->label, MAX_LAYOUT_LABEL_SIZE, ".layout%zu",
+                 labels->len);
+        label_map_insert(labels, (struct Label){.ident = block->label,
+                                                .addr = block->start});
+    }
+    return block->label;
+}
+
+/**
+ * @param at The instruction the jump takes the place of, or comes after
+ */
+void layout_push_jump(struct Layout *layout, struct InstructionVec *output,
+                      enum InstructionKind kind, size_t b,
+                      struct Instruction *at) {
+    struct Instruction jump = {
+        .kind = kind,
+        .value = {.kind = StringValue, .value.string = layout_label(layout, b)},
+        .line = at->line,
+        .source_line = at->source_line};
+    output->elements[output->len++] = jump;
+}
+
+/**
+ * Copy the block to the output, fixing up its end for the block that comes
+ * after it now
+ */
+void layout_emit_block(struct Layout *layout, struct InstructionVec *output,
+                       size_t b, size_t next) {
+    struct Block *block = &layout->blocks[b];
+    struct Instruction *elements = layout->result->instructions->elements;
+    struct Instruction *last = &elements[block->end - 1];
+    bool jumps = layout_ends_with_jump(last->kind);
+    size_t len = block->end - block->start - jumps;
+    memcpy(output->elements + output->len, elements + block->start,
+           len * sizeof(struct Instruction));
+    output->len += len;
+
+    if (last->kind == InstructionJmp) {
+        if (block->target != next) {
+            output->elements[output->len++] = *last;
+        }
+        return;
+    }
+    if (jumps && block->fall_through != next && block->target == next) {
+        // Jump the other way, so control falls into the target
+        enum InstructionKind inverse = last->kind == InstructionJEQZ
+                                           ? InstructionJNEZ
+                                           : InstructionJEQZ;
+        layout_push_jump(layout, output, inverse, block->fall_through, last);
+        return;
+    }
+    if (jumps) {
+        output->elements[output->len++] = *last;
+    }
+    if (block->fall_through != NO_BLOCK && block->fall_through != next) {
+        layout_push_jump(layout, output, InstructionJmp, block->fall_through,
+                         last);
+    }
+}
+
+void layout(struct ParseResult *result, struct Profile *profile) {
+    if (!layout_supported(result)) {
+        return;
+    }
+    struct InstructionVec *instructions = result->instructions;
+    size_t len = instructions->len;
+    struct Layout layout = {
+        .result = result,
+        .blocks = layout_calloc(len + 1, sizeof(struct Block)),
+        .block_of = layout_calloc(len + 1, sizeof(size_t))};
+    for (size_t i = 0; i <= len; i++) {
+        layout.block_of[i] = NO_BLOCK;
+    }
+    size_t count = layout_find_blocks(&layout);
+    size_t *order = layout_build_order(&layout, profile);
+
+    // Every block gets at most one jump more
+    struct InstructionVec output = {
+        .len = 0,
+        .capacity = len + count,
+        .elements = arena_alloc(result->arena,
+                                (len + count) * sizeof(struct Instruction)),
+        .arena = result->arena};
+    size_t *new_start = layout_calloc(count, sizeof(size_t));
+    for (size_t i = 0; i + 1 < count; i++) {
+        new_start[order[i]] = output.len;
+        layout_emit_block(&layout, &output, order[i], order[i + 1]);
+    }
+    new_start[layout.end_block] = output.len;
+
+    // Every label points to the start of a block, the new ones included
+    for (size_t i = 0; i < result->labels->len; i++) {
+        struct Label *label = &result->labels->elements[i];
+        label->addr = new_start[layout.block_of[label->addr]];
+    }
+    *instructions = output;
+
+    free(new_start);
+    free(order);
+    free(layout.block_of);
+    free(layout.blocks);
+}
+
+void layout_with_profile(struct ParseResult *result, char *filename,
+                         struct Arena *arena) {
+    struct Profile profile = profile_read(filename, arena);
+    if (!profile_matches(&profile, result)) {
+        asm_warning("warning: %s is not a profile of this program, it is "
+                    "ignored\n",
+                    filename);
+        return;
+    }
+    layout(result, &profile);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "parser.h"
+
+/**
+ * How often every instruction ran, as `am4vm --profile` writes it
+ */
+struct Profile {
+    // FNV-1a hash of the binary that was profiled
+    uint64_t hash;
+    size_t len;
+    // Times every instruction ran
+    uint64_t *counts;
+    // Times the jump at every instruction was taken
+    uint64_t *taken;
+};
+
+/**
+ * Read a profile written by `am4vm --profile`
+ *
+ * @note Stops the assembly if the file is not a valid profile
+ *
+ * @param filename
+ * @param arena Where the counts are allocated
+ *
+ * @returns struct Profile
+ */
+struct Profile profile_read(char *filename, struct Arena *arena);
+
+/**
+ * @returns true if the profile was made by running the binary the program
+ * assembles into
+ */
+bool profile_matches(struct Profile *profile, struct ParseResult *result);
+
+/**
+ * Reorder the basic blocks of a program so that the hot path falls through
+ *
+ * A block starts at a label and ends with a jump or a return. Blocks are
+ * chained along their heaviest edges, so a jump to the next block in a chain
+ * disappears, and a `jeqz` whose target comes next turns into a `jnez` to the
+ * block it used to fall into. A loop with its condition at the top ends up
+ * with the condition at the bottom, entered with a single `jmp`, so every
+ * iteration runs one jump instead of two.
+ *
+ * Without a profile, every edge but a jump forward is assumed to be taken
+ * once, and jumps back to the start of a loop weigh twice as much, so loops
+ * are rotated. With one, every edge weighs as many instructions as it saves
+ * on the profiled run: a `jmp` or a fall through as often as it was taken,
+ * both edges of a conditional jump as often as it was not taken, because
+ * the jump runs either way. The blocks keep their order if that runs fewer
+ * instructions.
+ *
+ * @note The program starts at its first block, which stays first. Programs
+ * with a jump that does not name a label are left alone.
+ *
+ * @param result The result of parsing the tokens, changed in place
+ * @param profile A profile that matches the program, or NULL
+ */
+void layout(struct ParseResult *result, struct Profile *profile);
+
+/**
+ * Read a profile and lay the program out along it
+ *
+ * @note Warns and leaves the program alone if the profile is of another
+ * binary than the one the program assembles into
+ *
+ * @param result The result of parsing the tokens, changed in place
+ * @param filename File written by `am4vm --profile`
+ * @param arena Where the profile is allocated
+ */
+void layout_with_profile(struct ParseResult *result, char *filename,
+                         struct Arena *arena);
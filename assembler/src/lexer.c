@@ -1,176 +1,188 @@
 #include <ctype.h>
+#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "arguments.h"
+#include "error.h"
 #include "lexer.h"
 #include "value.h"
 
-bool char_is_white_space(const char c) {
-    return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+// Streams that can not be mapped are read this much at a time
+#define STREAM_BLOCK_SIZE (1 << 16)
+
+// Tokens a TokenVec has room for before it first grows
+#define MINIMUM_TOKEN_CAPACITY 64
+
+// Size of the buffer token_to_string writes to
+#define MAX_TOKEN_SIZE 256
+
+// A power of two
+#define MNEMONIC_TABLE_SIZE 128
+
+struct Mnemonic {
+    const char *name;
+    enum TokenKind kind;
+};
+
+/**
+ * Every mnemonic and bool literal in the slot mnemonic_hash puts it in. The
+ * multipliers of the hash are picked so that no two names share a slot, two
+ * initializers for the same slot trigger -Woverride-init.
+ */
+static const struct Mnemonic mnemonics[MNEMONIC_TABLE_SIZE] = {
+    [2] = {"join", TokenJoin},
+    [7] = {"fence", TokenFence},
+    [10] = {"printc", TokenPrintC},
+    [12] = {"call", TokenCall},
+    [15] = {"false", TokenBool},
+    [18] = {"ge", TokenGe},
+    [21] = {"ret", TokenRet},
+    [22] = {"read", TokenRead},
+    [24] = {"drop", TokenDrop},
+    [28] = {"gt", TokenGt},
+    [29] = {"shl", TokenShl},
+    [32] = {"swap", TokenSwap},
+    [36] = {"send", TokenSend},
+    [37] = {"xor", TokenXor},
+    [38] = {"fill", TokenFill},
+    [40] = {"copy", TokenCopy},
+    [45] = {"shr", TokenShr},
+    [51] = {"cas", TokenCas},
+    [53] = {"jmp", TokenJmp},
+    [54] = {"jeqz", TokenJEQZ},
+    [56] = {"lneg", TokenLNeg},
+    [58] = {"push", TokenPush},
+    [59] = {"mod", TokenMod},
+    [63] = {"spawn", TokenSpawn},
+    [64] = {"storei", TokenStoreI},
+    [67] = {"alloc", TokenAlloc},
+    [70] = {"recv", TokenRecv},
+    [74] = {"land", TokenLAnd},
+    [79] = {"fetch", TokenFetch},
+    [81] = {"dup", TokenDup},
+    [82] = {"printv", TokenPrintV},
+    [83] = {"sub", TokenSub},
+    [85] = {"and", TokenAnd},
+    [86] = {"vadd", TokenVAdd},
+    [88] = {"le", TokenLe},
+    [90] = {"over", TokenOver},
+    [91] = {"sum", TokenSum},
+    [95] = {"store", TokenStore},
+    [96] = {"or", TokenOr},
+    [98] = {"lt", TokenLt},
+    [100] = {"jnez", TokenJNEZ},
+    [104] = {"fetchi", TokenFetchI},
+    [105] = {"add", TokenAdd},
+    [106] = {"noop", TokenNoop},
+    [111] = {"mul", TokenMul},
+    [112] = {"true", TokenBool},
+    [118] = {"fadd", TokenFAdd},
+    [120] = {".loc", TokenLoc},
+    [121] = {"div", TokenDiv},
+    [125] = {"lor", TokenLOr},
+    [126] = {"eq", TokenEq},
+};
+
+/**
+ * @note len has to be at least 2, the shortest mnemonics are `or` and `eq`
+ */
+size_t mnemonic_hash(const char *str, size_t len) {
+    const unsigned char *c = (const unsigned char *)str;
+    return (c[0] * 14 + c[1] * 62 + c[len - 1] * 24 + len) &
+           (MNEMONIC_TABLE_SIZE - 1);
 }
 
-bool is_int(const char *str) {
-    if (*str == '-') {
-        str++;
-    }
-    while (*str) {
-        if (!isdigit(*str++)) {
+bool is_int(const char *str, size_t len) {
+    size_t i = str[0] == '-';
+    for (; i < len; i++) {
+        if (!isdigit((unsigned char)str[i])) {
             return false;
         }
     }
     return true;
 }
 
-bool is_ident(const char *str) {
-    while (*str) {
-        if (!(isalnum(*str) || *str == '_')) {
+bool is_ident(const char *str, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (!(isalnum((unsigned char)str[i]) || str[i] == '_')) {
             return false;
         }
-        str++;
     }
     return true;
 }
 
-void lex_line(char *str, size_t line, struct TokenVec *vec);
-
-struct Token token_get(const char *str, size_t line, size_t col) {
-    struct Token token = {.line = line, .col = col, .value = {.kind = None}};
-    if (strcmp(str, "noop") == 0) {
-        token.kind = TokenNoop;
-        return token;
-    }
-
-    if (strcmp(str, "jmp") == 0) {
-        token.kind = TokenJmp;
-        return token;
-    }
-    if (strcmp(str, "jeqz") == 0) {
-        token.kind = TokenJEQZ;
-        return token;
-    }
-
-    if (strcmp(str, "push") == 0) {
-        token.kind = TokenPush;
-        return token;
-    }
-
-    if (strcmp(str, "add") == 0) {
-        token.kind = TokenAdd;
-        return token;
-    }
-    if (strcmp(str, "sub") == 0) {
-        token.kind = TokenSub;
-        return token;
-    }
-    if (strcmp(str, "mul") == 0) {
-        token.kind = TokenMul;
-        return token;
-    }
-
-    if (strcmp(str, "eq") == 0) {
-        token.kind = TokenEq;
-        return token;
-    }
-    if (strcmp(str, "lt") == 0) {
-        token.kind = TokenLt;
-        return token;
-    }
-    if (strcmp(str, "le") == 0) {
-        token.kind = TokenLe;
-        return token;
-    }
-    if (strcmp(str, "gt") == 0) {
-        token.kind = TokenGt;
-        return token;
-    }
-    if (strcmp(str, "ge") == 0) {
-        token.kind = TokenGe;
-        return token;
-    }
-
-    if (strcmp(str, "land") == 0) {
-        token.kind = TokenLAnd;
-        return token;
-    }
-    if (strcmp(str, "lor") == 0) {
-        token.kind = TokenLOr;
-        return token;
-    }
-    if (strcmp(str, "lneg") == 0) {
-        token.kind = TokenLNeg;
-        return token;
-    }
-
-    if (strcmp(str, "fetch") == 0) {
-        token.kind = TokenFetch;
-        return token;
-    }
-    if (strcmp(str, "store") == 0) {
-        token.kind = TokenStore;
-        return token;
-    }
-    if (strcmp(str, "printc") == 0) {
-        token.kind = TokenPrintC;
-        return token;
-    }
-    if (strcmp(str, "printv") == 0) {
-        token.kind = TokenPrintV;
-        return token;
+struct Token token_get(const char *str, uint32_t len, uint32_t line,
+                       uint32_t col) {
+    struct Token token = {
+        .line = line, .col = col, .len = len, .text = str, .value = 0};
+    if (len >= 2) {
+        const struct Mnemonic *mnemonic = &mnemonics[mnemonic_hash(str, len)];
+        if (mnemonic->name != NULL && strncmp(mnemonic->name, str, len) == 0 &&
+            mnemonic->name[len] == '\0') {
+            token.kind = mnemonic->kind;
+            if (token.kind == TokenBool) {
+                token.value = str[0] == 't';
+            }
+            return token;
+        }
     }
 
-    if (str[strlen(str) - 1] == ':') {
+    if (str[len - 1] == ':') {
         token.kind = TokenLabel;
-        token.value.kind = StringValue;
-        token.value.value.string = calloc(strlen(str) + 1, sizeof(char));
-        strcpy(token.value.value.string, str);
         return token;
     }
 
-    if (is_int(str)) {
-        int32_t int_value = strtol(str, NULL, 10);
-        token.kind = TokenInt;
-        token.value.kind = IntValue;
-        token.value.value.integer = int_value;
-        if (int_value > (1 << 23) - 1 || int_value < -(1 << 23)) {
-            fprintf(stderr,
-                    "warning(%zu:%zd): `%d` cannot fit within 24 bits and will "
-                    "be truncated\n",
-                    line, col, int_value);
+    if (is_int(str, len)) {
+        bool negative = str[0] == '-';
+        int64_t int_value = 0;
+        for (size_t i = negative; i < len; i++) {
+            int_value = int_value * 10 + (str[i] - '0');
+            if (int_value > (int64_t)INT32_MAX + 1) {
+                break;
+            }
+        }
+        int_value = negative ? -int_value : int_value;
+        if (int_value > INT32_MAX || int_value < INT32_MIN) {
+            asm_error("error(%u:%u): `%.*s` cannot fit within 32 bits\n",
+                      line, col, (int)len, str);
         }
+        token.kind = TokenInt;
+        token.value = int_value;
         return token;
     }
 
-    if (strcmp(str, "false") == 0) {
-        token.kind = TokenBool;
-        token.value.kind = BoolValue;
-        token.value.value.boolean = false;
-        return token;
-    }
-    if (strcmp(str, "true") == 0) {
-        token.kind = TokenBool;
-        token.value.kind = BoolValue;
-        token.value.value.boolean = true;
+    if (is_ident(str, len)) {
+        token.kind = TokenIdent;
         return token;
     }
+    asm_error("error(%u:%u): Could not parse token `%.*s`\n", line, col,
+              (int)len, str);
+}
 
-    if (strcmp(str, "\n") == 0) {
-        token.kind = TokenNewLine;
-        return token;
-    }
+char *token_text(struct Token *token, struct Arena *arena) {
+    return arena_strndup(arena, token->text, token->len);
+}
 
-    if (is_ident(str)) {
-        token.kind = TokenIdent;
-        token.value.kind = StringValue;
-        token.value.value.string = calloc(strlen(str) + 1, sizeof(char));
-        strcpy(token.value.value.string, str);
-        return token;
+struct Value token_value(struct Token *token) {
+    switch (token->kind) {
+    case TokenInt:
+        return (struct Value){.kind = IntValue,
+                              .value.integer = token->value};
+    case TokenBool:
+        return (struct Value){.kind = BoolValue,
+                              .value.boolean = token->value};
+    default:
+        return (struct Value){.kind = None};
     }
-    fprintf(stderr, "error(%zu:%zu): Could not parse token `%s`\n", line, col,
-            str);
-    exit(1);
 }
 
 void token_kind_to_string(struct Token *token,
@@ -186,6 +198,23 @@ void token_kind_to_string(struct Token *token,
     case TokenJEQZ:
         *str = "jeqz";
         return;
+    case TokenJNEZ:
+        *str = "jnez";
+        return;
+
+    case TokenCall:
+        *str = "call";
+        return;
+    case TokenRet:
+        *str = "ret";
+        return;
+
+    case TokenSpawn:
+        *str = "spawn";
+        return;
+    case TokenJoin:
+        *str = "join";
+        return;
 
     case TokenPush:
         *str = "push";
@@ -200,6 +229,42 @@ void token_kind_to_string(struct Token *token,
     case TokenMul:
         *str = "mul";
         return;
+    case TokenDiv:
+        *str = "div";
+        return;
+    case TokenMod:
+        *str = "mod";
+        return;
+
+    case TokenAnd:
+        *str = "and";
+        return;
+    case TokenOr:
+        *str = "or";
+        return;
+    case TokenXor:
+        *str = "xor";
+        return;
+
+    case TokenShl:
+        *str = "shl";
+        return;
+    case TokenShr:
+        *str = "shr";
+        return;
+
+    case TokenDup:
+        *str = "dup";
+        return;
+    case TokenSwap:
+        *str = "swap";
+        return;
+    case TokenOver:
+        *str = "over";
+        return;
+    case TokenDrop:
+        *str = "drop";
+        return;
 
     case TokenEq:
         *str = "eq";
@@ -233,6 +298,42 @@ void token_kind_to_string(struct Token *token,
     case TokenStore:
         *str = "store";
         return;
+    case TokenFetchI:
+        *str = "fetchi";
+        return;
+    case TokenStoreI:
+        *str = "storei";
+        return;
+
+    case TokenFAdd:
+        *str = "fadd";
+        return;
+    case TokenCas:
+        *str = "cas";
+        return;
+    case TokenFence:
+        *str = "fence";
+        return;
+
+    case TokenFill:
+        *str = "fill";
+        return;
+    case TokenCopy:
+        *str = "copy";
+        return;
+    case TokenVAdd:
+        *str = "vadd";
+        return;
+    case TokenSum:
+        *str = "sum";
+        return;
+
+    case TokenAlloc:
+        *str = "alloc";
+        return;
+    case TokenLoc:
+        *str = ".loc";
+        return;
 
     case TokenPrintC:
         *str = "printc";
@@ -241,6 +342,16 @@ void token_kind_to_string(struct Token *token,
         *str = "printv";
         return;
 
+    case TokenRead:
+        *str = "read";
+        return;
+    case TokenSend:
+        *str = "send";
+        return;
+    case TokenRecv:
+        *str = "recv";
+        return;
+
     case TokenLabel:
         *str = "label";
         return;
@@ -258,116 +369,213 @@ void token_kind_to_string(struct Token *token,
         *str = "\\n";
         return;
     };
-    fprintf(stderr, "Unreachable statement reached in token_kind_to_string\n");
-    exit(1);
+    asm_error("Unreachable statement reached in token_kind_to_string\n");
 }
 
 void token_to_string(struct Token *token, char *str) {
     char *token_kind;
     token_kind_to_string(token, &token_kind);
-    char *value;
-    value_to_string(&token->value, &value);
+    if (token->kind == TokenLabel || token->kind == TokenIdent) {
+        // Leaves room for the rest in a MAX_TOKEN_SIZE buffer
+        size_t token_len = token->len < 128 ? token->len : 128;
+        sprintf(str,
+                "struct Token { .kind = %s, .text = %.*s, .line = %u, "
+                ".col = %u }",
+                token_kind, (int)token_len, token->text, token->line,
+                token->col);
+        return;
+    }
+    struct Value value = token_value(token);
+    char *value_str;
+    value_to_string(&value, &value_str);
     sprintf(str,
-            "struct Token { .kind = %s, .value = %s, .line = %zu, .col = %zu }",
-            token_kind, value, token->line, token->col);
+            "struct Token { .kind = %s, .value = %s, .line = %u, .col = %u }",
+            token_kind, value_str, token->line, token->col);
 }
 
-struct TokenVec *lex(char *filename) {
-    struct TokenVec *vec = token_vec_new();
+/**
+ * Read a stream until EOF into the arena
+ */
+struct Source source_read(FILE *fptr, struct Arena *arena) {
+    size_t capacity = STREAM_BLOCK_SIZE;
+    size_t len = 0;
+    char *text = arena_alloc(arena, capacity);
 
-    FILE *fptr;
-    fptr = fopen(filename, "r");
-    if (fptr == NULL) {
-        fprintf(stderr, "Failed to open file: %s\n", filename);
-        exit(1);
+    size_t chars_read;
+    while ((chars_read = fread(text + len, 1, capacity - len, fptr)) > 0) {
+        len += chars_read;
+        if (len == capacity) {
+            text = arena_grow(arena, text, capacity, capacity * 2);
+            capacity *= 2;
+        }
     }
 
-    char *line = NULL;
-    size_t len = 0;
-    size_t chars_read;
+    return (struct Source){.text = text, .len = len, .mapping = NULL};
+}
 
-    // One-indexed
-    size_t line_num = 1;
-    while ((chars_read = getline(&line, &len, fptr)) != -1) {
-        lex_line(line, line_num, vec);
-        line_num++;
+struct Source source_open(char *filename, struct Arena *arena) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        asm_error("Failed to open file: %s\n", filename);
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void *mapping =
+            mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            close(fd);
+            return (struct Source){
+                .text = mapping, .len = st.st_size, .mapping = mapping};
+        }
     }
 
+    // Pipes and empty files can not be mapped
+    FILE *fptr = fdopen(fd, "r");
+    if (fptr == NULL) {
+        asm_error("Failed to open file: %s\n", filename);
+    }
+    struct Source source = source_read(fptr, arena);
     fclose(fptr);
-    free(line);
 
-    return vec;
+    return source;
 }
 
-#define MAX_TOKEN_SIZE 256
+void source_close(struct Source *source) {
+    if (source->mapping != NULL) {
+        munmap(source->mapping, source->len);
+        source->mapping = NULL;
+    }
+}
 
-void lex_line(char *str, size_t line, struct TokenVec *vec) {
-    char current_token[MAX_TOKEN_SIZE] = {0};
+struct TokenVec *lex(char *filename, struct Arena *arena) {
+    struct Source source = source_open(filename, arena);
+    struct TokenVec *vec = lex_buffer(source.text, source.len, arena);
+    vec->mapping = source.mapping;
+    vec->mapping_size = source.len;
+    return vec;
+}
 
-    // One-indexed
-    size_t col = 1;
-
-    while (*str) {
-        size_t pos = 0;
-        while (*str && !char_is_white_space(*str)) {
-            if (pos > 0 && *str == '/' && current_token[pos - 1] == '/') {
-                // Push the newline
-                token_vec_push(vec, token_get("\n", line, strlen(str) + col));
-                return;
-            }
+struct TokenVec *lex_stream(FILE *fptr, struct Arena *arena) {
+    struct Source source = source_read(fptr, arena);
+    return lex_buffer(source.text, source.len, arena);
+}
 
-            current_token[pos++] = *str++;
+/**
+ * Whitespace ends a token, and so do a NUL byte and a `//` comment, both of
+ * which hide the rest of the line
+ */
+bool ends_token(const char *source, size_t pos, size_t len) {
+    char c = source[pos];
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n' || c == '\0' ||
+           (c == '/' && pos + 1 < len && source[pos + 1] == '/');
+}
 
-            if (pos > MAX_TOKEN_SIZE - 1) {
-                fprintf(stderr,
-                        "error(%zu:%zu): Found a token more than 255 "
-                        "characters long\n",
-                        line, col);
-                exit(1);
+/**
+ * @returns The position of the first character at or after pos that ends the
+ * token, or len
+ */
+size_t find_token_end(const char *source, size_t pos, size_t len) {
+#ifdef __SSE2__
+    // Every delimiter but `/` is a control character or a space, so one
+    // unsigned compare finds the candidates of 16 characters at once
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i slash = _mm_set1_epi8('/');
+    while (pos + 16 <= len) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(source + pos));
+        __m128i low = _mm_cmpeq_epi8(_mm_min_epu8(chunk, space), chunk);
+        __m128i slashes = _mm_cmpeq_epi8(chunk, slash);
+        unsigned mask = _mm_movemask_epi8(_mm_or_si128(low, slashes));
+        while (mask != 0) {
+            size_t candidate = pos + __builtin_ctz(mask);
+            if (ends_token(source, candidate, len)) {
+                return candidate;
             }
+            mask &= mask - 1;
         }
+        pos += 16;
+    }
+#endif
+    while (pos < len && !ends_token(source, pos, len)) {
+        pos++;
+    }
+    return pos;
+}
 
-        if (pos > 0) {
-            token_vec_push(vec, token_get(current_token, line, col));
+void lex_line(struct TokenVec *vec, const char *source, size_t len,
+              uint32_t line, bool newline) {
+    size_t pos = 0;
+    while (pos < len) {
+        char c = source[pos];
+        if (c == ' ' || c == '\t' || c == '\r') {
+            pos++;
+            continue;
         }
-
-        col += pos + 1;
-
-        if (*str == '\n') {
-            // Col - 1 because IDK, works i guess
-            token_vec_push(vec, token_get("\n", line, col - 1));
-            return;
+        if (ends_token(source, pos, len)) {
+            // A comment or a NUL byte hides the rest of the line
+            break;
         }
 
-        memset(current_token, 0, MAX_TOKEN_SIZE);
-        str++;
+        size_t end = find_token_end(source, pos, len);
+        token_vec_push(vec, token_get(source + pos, end - pos, line, pos + 1));
+        pos = end;
+    }
+
+    // The last line of the file does not end with a newline, it only gets a
+    // newline token if there is anything on it
+    if (newline || len > 0) {
+        token_vec_push(vec, (struct Token){.kind = TokenNewLine,
+                                           .line = line,
+                                           .col = len + 1,
+                                           .text = source + len,
+                                           .len = newline});
     }
 }
 
-struct TokenVec *token_vec_new() {
-    struct TokenVec *vec = calloc(1, sizeof(struct TokenVec));
-    if (vec == NULL) {
-        fprintf(stderr, "Failed to allocate memory");
-        exit(1);
+void lex_lines(struct TokenVec *vec, const char *source, size_t len,
+               uint32_t first_line) {
+    uint32_t line = first_line;
+    size_t line_start = 0;
+    while (line_start < len) {
+        const char *newline =
+            memchr(source + line_start, '\n', len - line_start);
+        size_t line_end = newline == NULL ? len : (size_t)(newline - source);
+        lex_line(vec, source + line_start, line_end - line_start, line,
+                 newline != NULL);
+        line++;
+        line_start = line_end + 1;
     }
-    vec->elements = calloc(1, sizeof(struct Token));
-    if (vec->elements == NULL) {
-        fprintf(stderr, "Failed to allocate memory");
-        exit(1);
+}
+
+struct TokenVec *lex_buffer(const char *source, size_t len,
+                            struct Arena *arena) {
+    // Keeps every line, column and token length within 32 bits
+    if (len > UINT32_MAX) {
+        asm_error("error: source files over 4 GiB are not supported\n");
     }
+    struct TokenVec *vec = token_vec_new(arena);
+    // One-indexed
+    lex_lines(vec, source, len, 1);
+    return vec;
+}
+
+struct TokenVec *token_vec_new(struct Arena *arena) {
+    struct TokenVec *vec = arena_alloc(arena, sizeof(struct TokenVec));
+    vec->capacity = MINIMUM_TOKEN_CAPACITY;
+    vec->elements = arena_alloc(arena, vec->capacity * sizeof(struct Token));
     vec->len = 0;
-    vec->capacity = 1;
+    vec->arena = arena;
+    vec->mapping = NULL;
+    vec->mapping_size = 0;
     return vec;
 }
 
 void token_vec_push(struct TokenVec *vec, struct Token token) {
     if (vec->len == vec->capacity) {
-        vec->elements =
-            realloc(vec->elements, vec->capacity * 2 * sizeof(struct Token));
-        if (vec->elements == NULL) {
-            fprintf(stderr, "Failed to reallocate memory");
-            exit(1);
-        }
+        vec->elements = arena_grow(vec->arena, vec->elements,
+                                   vec->capacity * sizeof(struct Token),
+                                   vec->capacity * 2 * sizeof(struct Token));
         vec->capacity *= 2;
     }
 
@@ -375,8 +583,10 @@ void token_vec_push(struct TokenVec *vec, struct Token token) {
 }
 
 void token_vec_destroy(struct TokenVec *vec) {
-    free(vec->elements);
-    free(vec);
+    if (vec->mapping != NULL) {
+        munmap(vec->mapping, vec->mapping_size);
+        vec->mapping = NULL;
+    }
 }
 
 void token_vec_print(struct TokenVec *vec) {
@@ -1,21 +1,45 @@
 #pragma once
 
+#include "arena.h"
 #include "value.h"
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 enum TokenKind {
     TokenNoop,
 
     TokenJmp,
     TokenJEQZ,
+    TokenJNEZ,
+
+    TokenCall,
+    TokenRet,
+
+    TokenSpawn,
+    TokenJoin,
 
     TokenPush,
 
     TokenAdd,
     TokenSub,
     TokenMul,
+    TokenDiv,
+    TokenMod,
+
+    TokenAnd,
+    TokenOr,
+    TokenXor,
+
+    TokenShl,
+    TokenShr,
+
+    TokenDup,
+    TokenSwap,
+    TokenOver,
+    TokenDrop,
 
     TokenEq,
     TokenLt,
@@ -29,10 +53,28 @@ enum TokenKind {
 
     TokenFetch,
     TokenStore,
+    TokenFetchI,
+    TokenStoreI,
+
+    TokenFAdd,
+    TokenCas,
+    TokenFence,
+
+    TokenFill,
+    TokenCopy,
+    TokenVAdd,
+    TokenSum,
+
+    TokenAlloc,
+    TokenLoc,
 
     TokenPrintC,
     TokenPrintV,
 
+    TokenRead,
+    TokenSend,
+    TokenRecv,
+
     TokenLabel,
     TokenIdent,
 
@@ -42,27 +84,143 @@ enum TokenKind {
     TokenNewLine,
 };
 
+/**
+ * Tokens are kept small, a big program has millions of them
+ */
 struct Token {
     enum TokenKind kind;
-    size_t line;
-    size_t col;
-    struct Value value;
+    // One-indexed
+    uint32_t line;
+    uint32_t col;
+    uint32_t len;
+    // Points into the source, which is not NUL terminated
+    const char *text;
+    // Only set for ints and bools, labels and identifiers only have their text
+    int32_t value;
 };
 
 struct TokenVec {
     size_t len;
     size_t capacity;
     struct Token *elements;
+    // Where the tokens, and the source if it had to be read, are allocated
+    struct Arena *arena;
+    // The mapping of the file the tokens point into, if there is one
+    void *mapping;
+    size_t mapping_size;
+};
+
+/**
+ * The text of a source file
+ */
+struct Source {
+    // Not NUL terminated
+    const char *text;
+    size_t len;
+    // Set if text is a mapping of the file, source_close unmaps it
+    void *mapping;
 };
 
+/**
+ * Read a source file
+ *
+ * @note Regular files are mapped instead of read
+ *
+ * @param filename
+ * @param arena Where the text is read to if the file can not be mapped
+ *
+ * @returns The Source, has to be closed with source_close
+ */
+struct Source source_open(char *filename, struct Arena *arena);
+
+/**
+ * Unmap the text of a Source, if it is mapped
+ *
+ * @param source
+ */
+void source_close(struct Source *source);
+
 /**
  * Generate a vector (TokenVec) of tokens
  *
+ * @note Regular files are mapped instead of read, the tokens point into the
+ * mapping until the TokenVec is destroyed
+ *
  * @param filename Name of the file to turn into tokens
+ * @param arena Where the tokens are allocated
  *
  * @returns All the tokens in a TokenVec
  */
-struct TokenVec *lex(char *filename);
+struct TokenVec *lex(char *filename, struct Arena *arena);
+
+/**
+ * Generate a vector (TokenVec) of tokens from an open stream
+ *
+ * @param fptr Stream to read until EOF
+ * @param arena Where the source and the tokens are allocated
+ *
+ * @returns All the tokens in a TokenVec
+ */
+struct TokenVec *lex_stream(FILE *fptr, struct Arena *arena);
+
+/**
+ * Generate a vector (TokenVec) of tokens from source code in memory
+ *
+ * @note The tokens point into source, it has to outlive them
+ *
+ * @param source Does not have to be NUL terminated
+ * @param len
+ * @param arena Where the tokens are allocated
+ *
+ * @returns All the tokens in a TokenVec
+ */
+struct TokenVec *lex_buffer(const char *source, size_t len,
+                            struct Arena *arena);
+
+/**
+ * Lex every line of source, as lex_buffer does
+ *
+ * @note Lexing a source in pieces that end with a `\n` gives the same tokens
+ * as lexing it at once
+ *
+ * @param vec The tokens are pushed onto it, they point into source
+ * @param source Does not have to be NUL terminated
+ * @param len
+ * @param first_line Line number of the first line, one-indexed
+ */
+void lex_lines(struct TokenVec *vec, const char *source, size_t len,
+               uint32_t first_line);
+
+/**
+ * Lex one line and the newline token that ends it
+ *
+ * @param vec The tokens are pushed onto it, they point into source
+ * @param source The line, without its `\n`
+ * @param len
+ * @param line Line number of the line, one-indexed
+ * @param newline false if the line ends the file without a `\n`
+ */
+void lex_line(struct TokenVec *vec, const char *source, size_t len,
+              uint32_t line, bool newline);
+
+/**
+ * Copy the text of a label or an identifier into a NUL terminated string
+ *
+ * @param token
+ * @param arena Where the string is allocated
+ *
+ * @returns The text
+ */
+char *token_text(struct Token *token, struct Arena *arena);
+
+/**
+ * Get the value of an int or a bool token
+ *
+ * @param token
+ *
+ * @returns The value, or a Value of kind None for any other token
+ */
+struct Value token_value(struct Token *token);
 
 /**
  * Get the string representation of a TokenKind
@@ -83,9 +241,11 @@ void token_to_string(struct Token *token, char *str);
 /**
  * Create a new TokenVec
  *
+ * @param arena Where the tokens are allocated
+ *
  * @returns empty TokenVec
  */
-struct TokenVec *token_vec_new();
+struct TokenVec *token_vec_new(struct Arena *arena);
 
 /**
  * Push a token onto a TokenVec
@@ -96,7 +256,9 @@ struct TokenVec *token_vec_new();
 void token_vec_push(struct TokenVec *vec, struct Token token);
 
 /**
- * Free a TokenVec
+ * Unmap the source of a TokenVec, the tokens go with their arena
+ *
+ * @note The text of the tokens is no longer valid afterwards
  *
  * @param vec
  */
@@ -1,26 +1,114 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
+#include "arena.h"
 #include "arguments.h"
+#include "cache.h"
 #include "code_generation.h"
+#include "error.h"
+#include "layout.h"
 #include "lexer.h"
+#include "object.h"
+#include "optimize.h"
+#include "parallel.h"
 #include "parser.h"
+#include "stream.h"
+
+/**
+ * The object of `dir/name.asm` is `name.o`, in the working directory
+ */
+char *object_file_name(char *input, struct Arena *arena) {
+    char *name = strrchr(input, '/');
+    name = name != NULL ? name + 1 : input;
+    char *extension = strrchr(name, '.');
+    size_t len = extension != NULL && extension != name
+                     ? (size_t)(extension - name)
+                     : strlen(name);
+    char *object = arena_alloc(arena, len + sizeof(".o"));
+    memcpy(object, name, len);
+    memcpy(object + len, ".o", sizeof(".o"));
+    return object;
+}
+
+struct ParseResult parse_file(char *input, struct Arguments *args,
+                              struct Arena *arena) {
+    struct Source source = source_open(input, arena);
+    struct ParseResult result =
+        parse_parallel(source.text, source.len, arena, args->threads);
+    // Nothing points into the source once it is parsed
+    source_close(&source);
+    return result;
+}
+
+/**
+ * Make an object of a single input, or copy it out of the cache
+ */
+void assemble_object(char *input, char *output, struct Arguments *args,
+                     struct Arena *arena) {
+    struct Source source = source_open(input, arena);
+    uint64_t key = 0;
+    if (args->cache != NULL) {
+        key = cache_key(source.text, source.len);
+        if (cache_fetch(args->cache, key, output, arena)) {
+            source_close(&source);
+            return;
+        }
+    }
+    struct ParseResult result =
+        parse_parallel(source.text, source.len, arena, args->threads);
+    source_close(&source);
+
+    object_write(&result, arena, output);
+    if (args->cache != NULL) {
+        cache_store(args->cache, key, output, arena);
+    }
+}
 
 int main(int argc, char **argv) {
     struct Arguments args = arguments_parse(argc, argv);
-    if (args.input == NULL) {
-        fprintf(stderr, "am4asm needs a filename. See `--help` for more info");
-        exit(1);
+
+    if (args.compile) {
+        if (args.optimization_level > 0) {
+            asm_warning("warning: `-O` needs the whole program, pass it to "
+                        "am4ld when linking the objects\n");
+        }
+        for (int i = 0; i < args.inputs_len; i++) {
+            // Objects are independent, each one has an arena of its own
+            struct Arena arena = arena_new();
+            char *output = args.output != NULL
+                               ? args.output
+                               : object_file_name(args.inputs[i], &arena);
+            assemble_object(args.inputs[i], output, &args, &arena);
+            arena_destroy(&arena);
+        }
+        return 0;
     }
 
-    struct TokenVec *tokens = lex(args.input);
-    struct ParseResult parse_result = parse(tokens);
-    generate_binary_and_write_to_file(parse_result, args.output);
+    // Everything the assembly allocates goes at once at the end
+    struct Arena arena = arena_new();
+    if (args.stream) {
+        if (args.optimization_level > 0) {
+            asm_warning("warning: `-O` needs the whole program, it is ignored "
+                        "with `--stream`\n");
+        }
+        assemble_stream(args.inputs[0], args.output, &arena);
+        arena_destroy(&arena);
+        return 0;
+    }
 
-    token_vec_destroy(tokens);
-    instruction_vec_destroy(parse_result.instructions);
-    label_map_destroy(parse_result.labels);
-    ident_map_destroy(parse_result.idents);
+    struct ParseResult parse_result = parse_file(args.inputs[0], &args, &arena);
+    for (int i = 1; i < args.inputs_len; i++) {
+        struct ParseResult part = parse_file(args.inputs[i], &args, &arena);
+        parse_result_append(&parse_result, &part);
+    }
+    optimize(&parse_result, args.optimization_level);
+    if (args.profile != NULL) {
+        layout_with_profile(&parse_result, args.profile, &arena);
+    }
+    struct Binary binary = generate_binary_parallel(parse_result, args.threads);
+    write_binary_to_file(&binary, &parse_result, args.output);
+    arena_destroy(&arena);
 
     return 0;
 }
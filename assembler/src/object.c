@@ -0,0 +1,323 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "code_generation.h"
+#include "error.h"
+#include "lexer.h"
+#include "object.h"
+#include "symbol_index.h"
+
+/**
+ * Every name is stored once, however often it is used
+ */
+struct StringTable {
+    char *data;
+    size_t len;
+    size_t capacity;
+    // Offset of every string in data
+    struct SymbolIndex index;
+    struct Arena *arena;
+};
+
+/**
+ * @param str Has to live as long as the table
+ *
+ * @returns The offset of str in the table, adding it if it is not there
+ */
+uint32_t string_table_get(struct StringTable *table, char *str) {
+    size_t len = strlen(str);
+    size_t position;
+    if (symbol_index_get(&table->index, str, len, &position)) {
+        return position;
+    }
+    if (table->len + len + 1 > UINT32_MAX) {
+        asm_error("error: the names do not fit in an object file\n");
+    }
+    if (table->len + len + 1 > table->capacity) {
+        size_t capacity = table->capacity == 0 ? 64 : table->capacity * 2;
+        while (capacity < table->len + len + 1) {
+            capacity *= 2;
+        }
+        table->data =
+            arena_grow(table->arena, table->data, table->capacity, capacity);
+        table->capacity = capacity;
+    }
+    position = table->len;
+    memcpy(table->data + position, str, len + 1);
+    table->len += len + 1;
+    symbol_index_insert(&table->index, str, position);
+    return position;
+}
+
+void object_write_section(FILE *output, const void *section, size_t len,
+                          size_t size) {
+    // An empty section has no array
+    if (len > 0 && fwrite(section, size, len, output) != len) {
+        asm_error("Failed to write the object\n");
+    }
+}
+
+void object_write(struct ParseResult *result, struct Arena *arena,
+                  char *output_file) {
+    struct InstructionVec *instructions = result->instructions;
+    struct LabelMap *labels = result->labels;
+    struct IdentMap *idents = result->idents;
+    if (instructions->len > INT32_MAX || labels->len > UINT32_MAX ||
+        idents->len > UINT32_MAX) {
+        asm_error("error: the program does not fit in an object file\n");
+    }
+
+    struct StringTable strings = {.data = NULL,
+                                  .len = 0,
+                                  .capacity = 0,
+                                  .index = symbol_index_new(arena),
+                                  .arena = arena};
+
+    size_t relocations_len = 0;
+    for (size_t i = 0; i < instructions->len; i++) {
+        relocations_len += instructions->elements[i].value.kind == StringValue;
+    }
+    struct ObjectInstruction *text =
+        arena_alloc(arena, instructions->len * sizeof(*text));
+    struct ObjectRelocation *relocations =
+        arena_alloc(arena, relocations_len * sizeof(*relocations));
+    size_t relocation = 0;
+    for (size_t i = 0; i < instructions->len; i++) {
+        struct Instruction *instruction = &instructions->elements[i];
+        text[i] = (struct ObjectInstruction){
+            .kind = instruction->kind,
+            .value_kind = instruction->value.kind,
+            .value = 0,
+            .line = instruction->line,
+            .source_line = instruction->source_line};
+        switch (instruction->value.kind) {
+        case None:
+            break;
+        case IntValue:
+            text[i].value = instruction->value.value.integer;
+            break;
+        case BoolValue:
+            text[i].value = instruction->value.value.boolean;
+            break;
+        case StringValue:
+            relocations[relocation++] = (struct ObjectRelocation){
+                .addr = i,
+                .kind = takes_identifier(instruction->kind) ? RelocationIdent
+                                                            : RelocationLabel,
+                .name = string_table_get(&strings,
+                                         instruction->value.value.string)};
+            break;
+        }
+    }
+
+    struct ObjectLabel *object_labels =
+        arena_alloc(arena, labels->len * sizeof(*object_labels));
+    for (size_t i = 0; i < labels->len; i++) {
+        object_labels[i] = (struct ObjectLabel){
+            .name = string_table_get(&strings, labels->elements[i].ident),
+            .addr = labels->elements[i].addr};
+    }
+    struct ObjectIdent *object_idents =
+        arena_alloc(arena, idents->len * sizeof(*object_idents));
+    for (size_t i = 0; i < idents->len; i++) {
+        object_idents[i] = (struct ObjectIdent){
+            .name = string_table_get(&strings, idents->elements[i].ident),
+            .size = idents->elements[i].size,
+            .allocated = idents->elements[i].allocated};
+    }
+
+    // Keeps the sections after the strings aligned, if any are ever added
+    uint32_t padding = 0;
+    size_t padding_len = (4 - strings.len % 4) % 4;
+
+    struct ObjectHeader header = {
+        .magic = OBJECT_MAGIC,
+        .version = OBJECT_VERSION,
+        .text_len = instructions->len,
+        .labels_len = labels->len,
+        .idents_len = idents->len,
+        .relocations_len = relocations_len,
+        .strings_size = strings.len + padding_len,
+    };
+
+    FILE *output = fopen(output_file, "wb");
+    if (output == NULL) {
+        asm_error("Failed to open file: %s\n", output_file);
+    }
+    object_write_section(output, &header, 1, sizeof(header));
+    object_write_section(output, text, header.text_len, sizeof(*text));
+    object_write_section(output, object_labels, header.labels_len,
+                         sizeof(*object_labels));
+    object_write_section(output, object_idents, header.idents_len,
+                         sizeof(*object_idents));
+    object_write_section(output, relocations, header.relocations_len,
+                         sizeof(*relocations));
+    object_write_section(output, strings.data, strings.len, 1);
+    object_write_section(output, &padding, padding_len, 1);
+    if (fclose(output) != 0) {
+        asm_error("Failed to write the object\n");
+    }
+}
+
+/**
+ * @returns The name at offset in the string table, which ends with a NUL
+ */
+char *object_name(char *filename, char *strings, size_t strings_size,
+                  uint32_t offset) {
+    if (offset >= strings_size) {
+        asm_error("error: %s is not a valid object file\n", filename);
+    }
+    return strings + offset;
+}
+
+void object_read_text(char *filename, const struct ObjectInstruction *text,
+                      struct ObjectHeader *header,
+                      struct InstructionVec *instructions) {
+    for (size_t i = 0; i < header->text_len; i++) {
+        struct Instruction instruction = {.kind = text[i].kind,
+                                          .value = {.kind = None},
+                                          .line = text[i].line,
+                                          .source_line = text[i].source_line};
+        switch (text[i].value_kind) {
+        case None:
+            break;
+        case IntValue:
+            instruction.value.kind = IntValue;
+            instruction.value.value.integer = text[i].value;
+            break;
+        case BoolValue:
+            instruction.value.kind = BoolValue;
+            instruction.value.value.boolean = text[i].value;
+            break;
+        case StringValue:
+            // Its relocation gives it the string
+            instruction.value.kind = StringValue;
+            instruction.value.value.string = NULL;
+            break;
+        default:
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+        if (text[i].kind >= InstructionLabel) {
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+        instruction_vec_push(instructions, instruction);
+    }
+}
+
+void object_read_relocations(char *filename,
+                             const struct ObjectRelocation *relocations,
+                             struct ObjectHeader *header, char *strings,
+                             struct InstructionVec *instructions) {
+    for (size_t i = 0; i < header->relocations_len; i++) {
+        const struct ObjectRelocation *relocation = &relocations[i];
+        if (relocation->addr >= instructions->len) {
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+        struct Instruction *instruction =
+            &instructions->elements[relocation->addr];
+        enum RelocationKind kind = takes_identifier(instruction->kind)
+                                       ? RelocationIdent
+                                       : RelocationLabel;
+        if (instruction->value.kind != StringValue ||
+            instruction->value.value.string != NULL ||
+            relocation->kind != kind) {
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+        instruction->value.value.string = object_name(
+            filename, strings, header->strings_size, relocation->name);
+    }
+    for (size_t i = 0; i < instructions->len; i++) {
+        struct Instruction *instruction = &instructions->elements[i];
+        if (instruction->value.kind == StringValue &&
+            instruction->value.value.string == NULL) {
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+    }
+}
+
+struct ParseResult object_read(char *filename, struct Arena *arena) {
+    struct Source source = source_open(filename, arena);
+    struct ObjectHeader header;
+    if (source.len < sizeof(header)) {
+        asm_error("error: %s is not a valid object file\n", filename);
+    }
+    memcpy(&header, source.text, sizeof(header));
+    if (header.magic != OBJECT_MAGIC) {
+        asm_error("error: %s is not a valid object file\n", filename);
+    }
+    if (header.version != OBJECT_VERSION) {
+        asm_error("error: %s is an object of version %u, this is version %u\n",
+                  filename, header.version, OBJECT_VERSION);
+    }
+
+    // The counts are 32 bits, so none of this overflows
+    size_t text_offset = sizeof(header);
+    size_t labels_offset = text_offset + (size_t)header.text_len *
+                                             sizeof(struct ObjectInstruction);
+    size_t idents_offset =
+        labels_offset + (size_t)header.labels_len * sizeof(struct ObjectLabel);
+    size_t relocations_offset =
+        idents_offset + (size_t)header.idents_len * sizeof(struct ObjectIdent);
+    size_t strings_offset =
+        relocations_offset +
+        (size_t)header.relocations_len * sizeof(struct ObjectRelocation);
+    if (source.len != strings_offset + header.strings_size ||
+        (header.strings_size > 0 && source.text[source.len - 1] != '\0')) {
+        asm_error("error: %s is not a valid object file\n", filename);
+    }
+
+    // The names outlive the file
+    char *strings = arena_alloc(arena, header.strings_size);
+    memcpy(strings, source.text + strings_offset, header.strings_size);
+
+    struct ParseResult result = {.instructions = instruction_vec_new(arena),
+                                 .labels = label_map_new(arena),
+                                 .idents = ident_map_new(arena),
+                                 .arena = arena};
+    // Every section is a multiple of 4 bytes, so they are all aligned
+    object_read_text(filename,
+                     (const struct ObjectInstruction *)(source.text +
+                                                        text_offset),
+                     &header, result.instructions);
+
+    const struct ObjectLabel *labels =
+        (const struct ObjectLabel *)(source.text + labels_offset);
+    for (size_t i = 0; i < header.labels_len; i++) {
+        if (labels[i].addr < 0 || (uint32_t)labels[i].addr > header.text_len) {
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+        struct Label label = {.ident = object_name(filename, strings,
+                                                   header.strings_size,
+                                                   labels[i].name),
+                              .addr = labels[i].addr};
+        label_map_insert(result.labels, label);
+    }
+
+    const struct ObjectIdent *idents =
+        (const struct ObjectIdent *)(source.text + idents_offset);
+    for (size_t i = 0; i < header.idents_len; i++) {
+        char *name = object_name(filename, strings, header.strings_size,
+                                 idents[i].name);
+        // An identifier that is only used takes a single word
+        if (idents[i].size <= 0 ||
+            (!idents[i].allocated && idents[i].size != 1) ||
+            ident_map_get(result.idents, name) != -1) {
+            asm_error("error: %s is not a valid object file\n", filename);
+        }
+        if (idents[i].allocated) {
+            ident_map_alloc(result.idents, name, idents[i].size);
+        } else {
+            ident_map_insert(result.idents, name, strlen(name));
+        }
+    }
+
+    object_read_relocations(
+        filename,
+        (const struct ObjectRelocation *)(source.text + relocations_offset),
+        &header, strings, result.instructions);
+
+    source_close(&source);
+    return result;
+}
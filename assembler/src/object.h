@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "arena.h"
+#include "parser.h"
+
+// "AM4O" in a little endian word
+#define OBJECT_MAGIC 0x4f344d41
+
+// Bumped on every change to the layout below
+#define OBJECT_VERSION 2
+
+/**
+ * An object file is the program of one source before any address is known:
+ *
+ * header | text | labels | identifiers | relocations | strings
+ *
+ * Every section is an array of the structs below. Names are offsets into the
+ * string table, which holds NUL terminated strings. The addresses of labels
+ * and relocations count instructions from the start of the object's text.
+ */
+struct ObjectHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t text_len;
+    uint32_t labels_len;
+    uint32_t idents_len;
+    uint32_t relocations_len;
+    // In bytes, a multiple of 4
+    uint32_t strings_size;
+};
+
+struct ObjectInstruction {
+    uint16_t kind;
+    // The kind of Value of the argument, a StringValue has a relocation
+    uint16_t value_kind;
+    int32_t value;
+    // Lines of the assembly and of its source, see struct Instruction
+    uint32_t line;
+    uint32_t source_line;
+};
+
+/**
+ * A label defined in the object
+ */
+struct ObjectLabel {
+    uint32_t name;
+    int32_t addr;
+};
+
+/**
+ * An identifier the object allocates or stores to, in the order the source
+ * first has them
+ */
+struct ObjectIdent {
+    uint32_t name;
+    int32_t size;
+    // Reserved by an `alloc`, not by its first use
+    uint32_t allocated;
+};
+
+enum RelocationKind {
+    RelocationLabel,
+    RelocationIdent,
+};
+
+/**
+ * An instruction whose argument is the address of a label or an identifier,
+ * which the linker fills in
+ */
+struct ObjectRelocation {
+    uint32_t addr;
+    uint32_t kind;
+    uint32_t name;
+};
+
+/**
+ * Write a parsed program to an object file
+ *
+ * @param result The result of parsing the tokens
+ * @param arena Where the string table is built
+ * @param output_file File name of the object
+ */
+void object_write(struct ParseResult *result, struct Arena *arena,
+                  char *output_file);
+
+/**
+ * Read an object file back into the program it was written from
+ *
+ * @note Stops the assembly if the file is not a valid object
+ *
+ * @param filename
+ * @param arena Where the result is allocated
+ *
+ * @returns The result of parsing the source of the object
+ */
+struct ParseResult object_read(char *filename, struct Arena *arena);
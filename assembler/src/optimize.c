@@ -0,0 +1,363 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "code_generation.h"
+#include "error.h"
+#include "layout.h"
+#include "optimize.h"
+
+/**
+ * Instructions a label points to. Control can reach them from somewhere else,
+ * so a rewrite may only span several instructions if it starts at one.
+ *
+ * @returns One entry per instruction, plus one for the end of the program
+ */
+bool *find_jump_targets(struct ParseResult *result) {
+    bool *targets = calloc(result->instructions->len + 1, sizeof(bool));
+    if (targets == NULL) {
+        asm_error("Failed to do a heap allocation\n");
+    }
+    for (size_t i = 0; i < result->labels->len; i++) {
+        targets[result->labels->elements[i].addr] = true;
+    }
+    return targets;
+}
+
+/**
+ * Turn an instruction into a noop, which remove_noops drops
+ */
+void remove_instruction(struct Instruction *instruction) {
+    instruction->kind = InstructionNoop;
+    instruction->value.kind = None;
+}
+
+/**
+ * Drop every noop and move the labels after them back
+ *
+ * @returns true if anything was dropped
+ */
+bool remove_noops(struct ParseResult *result) {
+    struct InstructionVec *instructions = result->instructions;
+    size_t *new_addr = malloc((instructions->len + 1) * sizeof(size_t));
+    if (new_addr == NULL) {
+        asm_error("Failed to do a heap allocation\n");
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < instructions->len; i++) {
+        new_addr[i] = kept;
+        if (instructions->elements[i].kind != InstructionNoop) {
+            instructions->elements[kept++] = instructions->elements[i];
+        }
+    }
+    new_addr[instructions->len] = kept;
+
+    for (size_t i = 0; i < result->labels->len; i++) {
+        struct Label *label = &result->labels->elements[i];
+        label->addr = new_addr[label->addr];
+    }
+
+    bool removed = kept != instructions->len;
+    instructions->len = kept;
+    free(new_addr);
+    return removed;
+}
+
+/**
+ * @param value Set to the pushed value
+ *
+ * @returns true if the instruction pushes an int or a bool
+ */
+bool is_constant(struct Instruction *instruction, int32_t *value) {
+    if (instruction->kind != InstructionPush) {
+        return false;
+    }
+    switch (instruction->value.kind) {
+    case IntValue:
+        *value = instruction->value.value.integer;
+        return true;
+    case BoolValue:
+        *value = instruction->value.value.boolean;
+        return true;
+    default:
+        return false;
+    }
+}
+
+void set_constant(struct Instruction *instruction, int32_t value) {
+    instruction->kind = InstructionPush;
+    instruction->value.kind = IntValue;
+    instruction->value.value.integer = value;
+}
+
+/**
+ * Compute `v1 v2 <kind>` the same way the vm does
+ *
+ * @returns false if kind is not a binary operation, or if it stops the vm
+ */
+bool fold_binary(enum InstructionKind kind, int32_t v1, int32_t v2,
+                 int32_t *result) {
+    // Arithmetic wraps around, which signed overflow does not
+    uint32_t u1 = v1;
+    uint32_t u2 = v2;
+    switch (kind) {
+    case InstructionAdd:
+        *result = u1 + u2;
+        return true;
+    case InstructionSub:
+        *result = u1 - u2;
+        return true;
+    case InstructionMul:
+        *result = u1 * u2;
+        return true;
+    case InstructionDiv:
+        if (v2 == 0) {
+            return false;
+        }
+        *result = v2 == -1 ? (int32_t)(0u - u1) : v1 / v2;
+        return true;
+    case InstructionMod:
+        if (v2 == 0) {
+            return false;
+        }
+        *result = v2 == -1 ? 0 : v1 % v2;
+        return true;
+    case InstructionAnd:
+        *result = v1 & v2;
+        return true;
+    case InstructionOr:
+        *result = v1 | v2;
+        return true;
+    case InstructionXor:
+        *result = v1 ^ v2;
+        return true;
+    case InstructionShl:
+        *result = u1 << (v2 & 31);
+        return true;
+    case InstructionShr:
+        *result = v1 >> (v2 & 31);
+        return true;
+    case InstructionEq:
+        *result = v1 == v2;
+        return true;
+    case InstructionLt:
+        *result = v1 < v2;
+        return true;
+    case InstructionLe:
+        *result = v1 <= v2;
+        return true;
+    case InstructionGt:
+        *result = v1 > v2;
+        return true;
+    case InstructionGe:
+        *result = v1 >= v2;
+        return true;
+    case InstructionLAnd:
+        *result = v1 && v2;
+        return true;
+    case InstructionLOr:
+        *result = v1 || v2;
+        return true;
+    default:
+        return false;
+    }
+}
+
+bool same_variable(struct Instruction *a, struct Instruction *b) {
+    return a->value.kind == StringValue && b->value.kind == StringValue &&
+           strcmp(a->value.value.string, b->value.value.string) == 0;
+}
+
+/**
+ * Rewrite the instructions starting at i, the ones after it are only looked
+ * at if no label points to them
+ *
+ * @returns true if anything changed
+ */
+bool peephole(struct InstructionVec *instructions, bool *targets, size_t i) {
+    struct Instruction *a = &instructions->elements[i];
+    if (i + 1 >= instructions->len || targets[i + 1]) {
+        return false;
+    }
+    struct Instruction *b = &instructions->elements[i + 1];
+
+    int32_t v1;
+    int32_t v2;
+    int32_t result;
+    if (is_constant(a, &v1)) {
+        if (b->kind == InstructionLNeg) {
+            set_constant(a, !v1);
+            remove_instruction(b);
+            return true;
+        }
+        if (b->kind == InstructionJEQZ || b->kind == InstructionJNEZ) {
+            // Either the jump is always taken or it never is
+            if ((v1 == 0) == (b->kind == InstructionJEQZ)) {
+                b->kind = InstructionJmp;
+            } else {
+                remove_instruction(b);
+            }
+            remove_instruction(a);
+            return true;
+        }
+        if (i + 2 < instructions->len && !targets[i + 2] &&
+            is_constant(b, &v2) &&
+            fold_binary(instructions->elements[i + 2].kind, v1, v2,
+                        &result)) {
+            set_constant(a, result);
+            remove_instruction(b);
+            remove_instruction(&instructions->elements[i + 2]);
+            return true;
+        }
+    }
+
+    if (a->kind == InstructionStore && b->kind == InstructionFetch &&
+        same_variable(a, b)) {
+        // The stored value is still on the stack if it is duplicated first
+        remove_instruction(b);
+        *b = *a;
+        a->kind = InstructionDup;
+        a->value.kind = None;
+        return true;
+    }
+    if (a->kind == InstructionFetch && b->kind == InstructionStore &&
+        same_variable(a, b)) {
+        // Storing a variable back into itself
+        remove_instruction(a);
+        remove_instruction(b);
+        return true;
+    }
+    return false;
+}
+
+bool is_jump(enum InstructionKind kind) {
+    return kind == InstructionJmp || kind == InstructionJEQZ ||
+           kind == InstructionJNEZ || kind == InstructionCall ||
+           kind == InstructionSpawn;
+}
+
+/**
+ * Point a jump whose target is a `jmp` at the end of the chain, then drop or
+ * simplify jumps to the next instruction
+ *
+ * @returns true if anything changed
+ */
+bool thread_jump(struct InstructionVec *instructions, struct LabelMap *labels,
+                 size_t i) {
+    struct Instruction *jump = &instructions->elements[i];
+    char *label = jump->value.value.string;
+    int32_t target = label_map_get(labels, label);
+    if (target == -1) {
+        // Reported by the code generation
+        return false;
+    }
+
+    // A chain longer than the program is a loop of jumps, which is left alone
+    size_t steps = 0;
+    while ((size_t)target < instructions->len &&
+           instructions->elements[target].kind == InstructionJmp &&
+           steps++ < instructions->len) {
+        label = instructions->elements[target].value.value.string;
+        target = label_map_get(labels, label);
+        if (target == -1) {
+            return false;
+        }
+    }
+    if ((size_t)target < instructions->len &&
+        instructions->elements[target].kind == InstructionJmp) {
+        return false;
+    }
+
+    if ((size_t)target == i + 1 && jump->kind == InstructionJmp) {
+        remove_instruction(jump);
+        return true;
+    }
+    if ((size_t)target == i + 1 &&
+        (jump->kind == InstructionJEQZ || jump->kind == InstructionJNEZ)) {
+        // Both ways lead to the same place, only the condition has to go
+        remove_instruction(jump);
+        jump->kind = InstructionDrop;
+        return true;
+    }
+    if (strcmp(label, jump->value.value.string) == 0) {
+        return false;
+    }
+
+    // The strings live in the arena, so the jump can share the one of the
+    // last jump in the chain
+    jump->value.value.string = label;
+    return true;
+}
+
+/**
+ * Remove everything after an unconditional jump up to the next label
+ *
+ * @returns true if anything changed
+ */
+bool remove_unreachable(struct InstructionVec *instructions, bool *targets,
+                        size_t i) {
+    bool removed = false;
+    for (size_t j = i + 1; j < instructions->len && !targets[j]; j++) {
+        if (instructions->elements[j].kind != InstructionNoop) {
+            remove_instruction(&instructions->elements[j]);
+            removed = true;
+        }
+    }
+    return removed;
+}
+
+/**
+ * Run every rewrite over the program once
+ *
+ * @returns true if anything changed
+ */
+bool optimize_pass(struct ParseResult *result, int level) {
+    struct InstructionVec *instructions = result->instructions;
+    bool *targets = find_jump_targets(result);
+    bool changed = false;
+    for (size_t i = 0; i < instructions->len; i++) {
+        struct Instruction *instruction = &instructions->elements[i];
+        if (instruction->kind == InstructionNoop) {
+            continue;
+        }
+        changed |= peephole(instructions, targets, i);
+
+        if (level < 2) {
+            continue;
+        }
+        if (is_jump(instruction->kind) &&
+            instruction->value.kind == StringValue) {
+            changed |= thread_jump(instructions, result->labels, i);
+        }
+        if (instruction->kind == InstructionJmp ||
+            instruction->kind == InstructionRet) {
+            changed |= remove_unreachable(instructions, targets, i);
+        }
+    }
+    free(targets);
+    return changed;
+}
+
+void optimize(struct ParseResult *result, int level) {
+    if (level <= 0) {
+        return;
+    }
+    // Unreachable code is removed, its unknown labels and identifiers have to
+    // be reported first
+    for (size_t i = 0; i < result->instructions->len; i++) {
+        get_value_as_int(&result->instructions->elements[i], result->labels,
+                         result->idents, 0);
+    }
+
+    // A rewrite can make room for another one, so run until nothing changes
+    bool changed = true;
+    while (changed) {
+        changed = optimize_pass(result, level);
+        changed |= remove_noops(result);
+    }
+    if (level >= 2) {
+        layout(result, NULL);
+    }
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "parser.h"
+
+// Highest level `-O` accepts
+#define OPTIMIZATION_LEVEL_MAX 2
+
+/**
+ * Rewrite a parsed program into one that runs fewer instructions
+ *
+ * Level 1 removes noops, folds constant arithmetic, resolves `jeqz` and `jnez`
+ * over a constant and keeps a stored value on the stack instead of fetching it
+ * again.
+ * Level 2 also threads jumps through other jumps, removes unreachable code and
+ * lays out the blocks so that loops run one jump per iteration, see layout.h.
+ *
+ * @note Labels move along with the instructions they point to, a label whose
+ * instruction is removed points to the next one
+ *
+ * @param result The result of parsing the tokens, changed in place
+ * @param level 0 leaves the program as it is
+ */
+void optimize(struct ParseResult *result, int level);
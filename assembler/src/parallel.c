@@ -0,0 +1,395 @@
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "error.h"
+#include "lexer.h"
+#include "parallel.h"
+
+#define PARALLEL_MAX_THREADS 64
+
+// A chunk is never smaller, so small sources stay on one thread
+#define PARALLEL_MIN_CHUNK_SIZE (1 << 18)
+
+// Instructions a thread generates at least
+#define PARALLEL_MIN_RANGE_LEN (1 << 14)
+
+struct Chunk {
+    const char *source;
+    size_t len;
+    // One-indexed
+    uint32_t first_line;
+    uint32_t lines;
+
+    // Everything the chunk allocates, moved to the result once it is merged
+    struct Arena arena;
+    struct ParseResult result;
+    // Errors and warnings, in the order the chunk had them
+    char *messages;
+    size_t messages_len;
+    bool failed;
+};
+
+struct Range {
+    struct InstructionVec instructions;
+    struct LabelMap *labels;
+    struct IdentMap *idents;
+
+    // Constant pool entries of the range, in the order they first appear
+    struct ConstantPool local_pool;
+    size_t pool_len;
+    bool failed;
+
+    // Where the range is encoded, with the complete pool
+    struct Binary binary;
+    struct ConstantPool *pool;
+};
+
+int parallel_threads(int threads) {
+    if (threads <= 0) {
+        long online = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = online > 0 ? online : 1;
+    }
+    return threads < PARALLEL_MAX_THREADS ? threads : PARALLEL_MAX_THREADS;
+}
+
+/**
+ * Run task on every element of tasks, each on a thread of its own
+ *
+ * @note A task that does not get a thread runs on the calling thread
+ */
+void parallel_run(void *(*task)(void *), void *tasks, size_t size,
+                  size_t len) {
+    pthread_t threads[PARALLEL_MAX_THREADS];
+    bool started[PARALLEL_MAX_THREADS];
+    for (size_t i = 0; i < len; i++) {
+        void *arg = (char *)tasks + i * size;
+        started[i] = pthread_create(&threads[i], NULL, task, arg) == 0;
+        if (!started[i]) {
+            task(arg);
+        }
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+}
+
+void *chunk_count_lines(void *arg) {
+    struct Chunk *chunk = arg;
+    const char *end = chunk->source + chunk->len;
+    for (const char *c = chunk->source;
+         (c = memchr(c, '\n', end - c)) != NULL; c++) {
+        chunk->lines++;
+    }
+    return NULL;
+}
+
+void *chunk_parse(void *arg) {
+    struct Chunk *chunk = arg;
+    FILE *messages = open_memstream(&chunk->messages, &chunk->messages_len);
+    if (messages == NULL) {
+        chunk->failed = true;
+        return NULL;
+    }
+
+    // The task can run on the calling thread, which keeps its own
+    jmp_buf *outer_trap = asm_error_trap;
+    FILE *outer_stream = asm_error_stream;
+    jmp_buf trap;
+    asm_error_trap = &trap;
+    asm_error_stream = messages;
+    if (setjmp(trap) == 0) {
+        struct TokenVec *tokens = token_vec_new(&chunk->arena);
+        lex_lines(tokens, chunk->source, chunk->len, chunk->first_line);
+        chunk->result = parse(tokens);
+    } else {
+        chunk->failed = true;
+    }
+    asm_error_trap = outer_trap;
+    asm_error_stream = outer_stream;
+
+    fclose(messages);
+    return NULL;
+}
+
+/**
+ * Split the source into chunks that end with a `\n`, or with the source
+ *
+ * @returns Number of chunks
+ */
+size_t chunks_split(struct Chunk *chunks, size_t count, const char *source,
+                    size_t len) {
+    size_t start = 0;
+    for (size_t i = 0; i < count; i++) {
+        size_t end = len;
+        if (i + 1 < count && start + len / count < len) {
+            const char *newline =
+                memchr(source + start + len / count, '\n',
+                       len - start - len / count);
+            end = newline == NULL ? len : (size_t)(newline - source) + 1;
+        }
+        chunks[i] = (struct Chunk){.source = source + start,
+                                   .len = end - start,
+                                   .arena = arena_new()};
+        start = end;
+        if (start == len) {
+            return i + 1;
+        }
+    }
+    return count;
+}
+
+/**
+ * Merge the maps of every chunk into the result, in source order
+ *
+ * @returns false if an identifier is allocated after it is used in an earlier
+ * chunk
+ */
+bool chunks_merge(struct Chunk *chunks, size_t count,
+                  struct ParseResult *result) {
+    bool outer_quiet = asm_error_quiet;
+    jmp_buf *outer_trap = asm_error_trap;
+    jmp_buf trap;
+    asm_error_quiet = true;
+    asm_error_trap = &trap;
+    if (setjmp(trap) != 0) {
+        asm_error_quiet = outer_quiet;
+        asm_error_trap = outer_trap;
+        return false;
+    }
+
+    size_t base = 0;
+    for (size_t i = 0; i < count; i++) {
+        label_map_merge(result->labels, chunks[i].result.labels, base);
+        ident_map_merge(result->idents, chunks[i].result.idents);
+        base += chunks[i].result.instructions->len;
+    }
+    asm_error_quiet = outer_quiet;
+    asm_error_trap = outer_trap;
+    return true;
+}
+
+/**
+ * Copies the instructions of the chunk to its place in the result
+ */
+struct ChunkCopy {
+    struct Instruction *destination;
+    struct InstructionVec *source;
+};
+
+void *chunk_copy(void *arg) {
+    struct ChunkCopy *copy = arg;
+    if (copy->source->len > 0) {
+        memcpy(copy->destination, copy->source->elements,
+               copy->source->len * sizeof(struct Instruction));
+    }
+    return NULL;
+}
+
+void chunks_copy_instructions(struct Chunk *chunks, size_t count,
+                              struct ParseResult *result) {
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        len += chunks[i].result.instructions->len;
+    }
+    struct InstructionVec *instructions = result->instructions;
+    if (len > instructions->capacity) {
+        instructions->elements =
+            arena_alloc(result->arena, len * sizeof(struct Instruction));
+        instructions->capacity = len;
+    }
+
+    struct ChunkCopy copies[PARALLEL_MAX_THREADS];
+    for (size_t i = 0; i < count; i++) {
+        copies[i] = (struct ChunkCopy){
+            .destination = instructions->elements + instructions->len,
+            .source = chunks[i].result.instructions};
+        instructions->len += chunks[i].result.instructions->len;
+    }
+    parallel_run(chunk_copy, copies, sizeof(struct ChunkCopy), count);
+
+    // A chunk does not see the `.loc` in front of it, the instructions before
+    // its first one take the line of the chunks before
+    uint32_t source_line = 0;
+    for (size_t i = 0; i < count; i++) {
+        struct InstructionVec *source = chunks[i].result.instructions;
+        for (size_t j = 0;
+             j < source->len && copies[i].destination[j].source_line == 0;
+             j++) {
+            copies[i].destination[j].source_line = source_line;
+        }
+        if (chunks[i].result.source_line != 0) {
+            source_line = chunks[i].result.source_line;
+        }
+    }
+}
+
+struct ParseResult parse_parallel(const char *source, size_t len,
+                                  struct Arena *arena, int threads) {
+    size_t count = parallel_threads(threads);
+    if (count > len / PARALLEL_MIN_CHUNK_SIZE) {
+        count = len / PARALLEL_MIN_CHUNK_SIZE;
+    }
+    // Line numbers of bigger sources do not fit, lex_buffer reports it
+    if (count <= 1 || len > UINT32_MAX) {
+        return parse(lex_buffer(source, len, arena));
+    }
+
+    struct Chunk chunks[PARALLEL_MAX_THREADS];
+    count = chunks_split(chunks, count, source, len);
+    parallel_run(chunk_count_lines, chunks, sizeof(struct Chunk), count);
+    uint32_t line = 1;
+    for (size_t i = 0; i < count; i++) {
+        chunks[i].first_line = line;
+        line += chunks[i].lines;
+    }
+    parallel_run(chunk_parse, chunks, sizeof(struct Chunk), count);
+
+    bool failed = false;
+    for (size_t i = 0; i < count; i++) {
+        failed |= chunks[i].failed;
+    }
+
+    struct ParseResult result = {.instructions = instruction_vec_new(arena),
+                                 .labels = label_map_new(arena),
+                                 .idents = ident_map_new(arena),
+                                 .arena = arena};
+    if (!failed && chunks_merge(chunks, count, &result)) {
+        chunks_copy_instructions(chunks, count, &result);
+        FILE *stream = asm_error_stream != NULL ? asm_error_stream : stderr;
+        for (size_t i = 0; i < count && !asm_error_quiet; i++) {
+            fwrite(chunks[i].messages, 1, chunks[i].messages_len, stream);
+        }
+    } else {
+        failed = true;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        free(chunks[i].messages);
+        // The strings of the instructions and the maps live in the chunks
+        if (failed) {
+            arena_destroy(&chunks[i].arena);
+        } else {
+            arena_adopt(arena, &chunks[i].arena);
+        }
+    }
+
+    if (failed) {
+        return parse(lex_buffer(source, len, arena));
+    }
+    return result;
+}
+
+void *range_collect_pool(void *arg) {
+    struct Range *range = arg;
+    bool outer_quiet = asm_error_quiet;
+    jmp_buf *outer_trap = asm_error_trap;
+    jmp_buf trap;
+    asm_error_quiet = true;
+    asm_error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        range->local_pool.len = 0;
+        collect_constant_pool(&range->local_pool, &range->instructions,
+                              range->labels, range->idents, range->pool_len);
+    } else {
+        range->failed = true;
+    }
+    asm_error_quiet = outer_quiet;
+    asm_error_trap = outer_trap;
+    return NULL;
+}
+
+void *range_encode(void *arg) {
+    struct Range *range = arg;
+    generate_text_section(&range->binary, &range->instructions, range->labels,
+                          range->idents, range->pool);
+    return NULL;
+}
+
+/**
+ * The same fixpoint as build_constant_pool, every pass runs on all ranges
+ * at once and their entries are added to the pool in order
+ *
+ * @returns false if an instruction names a label or identifier that does
+ * not exist
+ */
+bool ranges_build_constant_pool(struct Range *ranges, size_t count,
+                                struct ConstantPool *pool) {
+    size_t pool_len;
+    do {
+        pool_len = pool->len;
+        pool->len = 0;
+        for (size_t i = 0; i < count; i++) {
+            ranges[i].pool_len = pool_len;
+        }
+        parallel_run(range_collect_pool, ranges, sizeof(struct Range), count);
+        for (size_t i = 0; i < count; i++) {
+            if (ranges[i].failed) {
+                return false;
+            }
+            for (size_t j = 0; j < ranges[i].local_pool.len; j++) {
+                constant_pool_get(pool, ranges[i].local_pool.values[j]);
+            }
+        }
+    } while (pool->len != pool_len);
+    return true;
+}
+
+struct Binary generate_binary_parallel(struct ParseResult result,
+                                       int threads) {
+    size_t len = result.instructions->len;
+    size_t count = parallel_threads(threads);
+    if (count > len / PARALLEL_MIN_RANGE_LEN) {
+        count = len / PARALLEL_MIN_RANGE_LEN;
+    }
+    if (count <= 1) {
+        return generate_binary(result);
+    }
+
+    struct Range ranges[PARALLEL_MAX_THREADS];
+    for (size_t i = 0; i < count; i++) {
+        size_t start = len * i / count;
+        size_t end = len * (i + 1) / count;
+        ranges[i] = (struct Range){
+            .instructions = {.len = end - start,
+                             .capacity = end - start,
+                             .elements = result.instructions->elements + start,
+                             .arena = result.arena},
+            .labels = result.labels,
+            .idents = result.idents,
+            .local_pool = {.values = NULL, .len = 0, .capacity = 0},
+        };
+    }
+
+    struct ConstantPool pool = {.values = NULL, .len = 0, .capacity = 0};
+    bool built = ranges_build_constant_pool(ranges, count, &pool);
+    for (size_t i = 0; i < count; i++) {
+        free(ranges[i].local_pool.values);
+    }
+    if (!built) {
+        free(pool.values);
+        // Reports the first instruction that fails, like it always has
+        return generate_binary(result);
+    }
+
+    struct Binary binary = generate_sections(result, &pool);
+    for (size_t i = 0; i < count; i++) {
+        size_t start = ranges[i].instructions.elements -
+                       result.instructions->elements;
+        ranges[i].binary =
+            (struct Binary){.bin = binary.bin + binary.len + start, .len = 0};
+        ranges[i].pool = &pool;
+    }
+    parallel_run(range_encode, ranges, sizeof(struct Range), count);
+    binary.len += len;
+
+    free(pool.values);
+    return binary;
+}
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "arena.h"
+#include "code_generation.h"
+#include "parser.h"
+
+/**
+ * Lex and parse a source in chunks on several threads
+ *
+ * The source is split into chunks at line boundaries. Every thread lexes and
+ * parses a chunk into instructions, labels and identifiers of its own. The
+ * chunks are then merged in source order: labels are moved by the number of
+ * instructions before their chunk, and identifiers get their slots in the
+ * order they are first seen, the same as in a sequential parse.
+ *
+ * @note The result is the same as parse gives. Small sources are parsed on
+ * one thread. If any chunk fails, the source is parsed again with parse, so
+ * errors are reported the same way as ever.
+ *
+ * @param source Does not have to be NUL terminated, nothing in the result
+ * points into it
+ * @param len
+ * @param arena Where the result is allocated
+ * @param threads Number of threads, 0 uses every processor
+ *
+ * @returns The result of parsing the source
+ */
+struct ParseResult parse_parallel(const char *source, size_t len,
+                                  struct Arena *arena, int threads);
+
+/**
+ * Generate am4 binary / machine code in memory on several threads
+ *
+ * Every thread collects the constant pool entries of a range of the
+ * instructions, the ranges are merged in order, and then every thread
+ * encodes its range straight into the binary.
+ *
+ * @note The binary is the same as generate_binary makes. Small programs are
+ * generated on one thread, and so is any program with an error.
+ *
+ * @param result The result of parsing the tokens
+ * @param threads Number of threads, 0 uses every processor
+ *
+ * @returns struct Binary, bin lives in the arena of the result
+ */
+struct Binary generate_binary_parallel(struct ParseResult result,
+                                       int threads);
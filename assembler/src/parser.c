@@ -2,9 +2,13 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "error.h"
 #include "lexer.h"
 #include "parser.h"
 
+// Elements a vector or a map has room for before it first grows
+#define MINIMUM_VEC_CAPACITY 16
+
 bool expect(enum TokenKind token_kind, struct Token *token) {
     return token->kind == token_kind;
 }
@@ -12,12 +16,25 @@ bool expect(enum TokenKind token_kind, struct Token *token) {
 void parse_error_newline(struct Token *token) {
     char *str;
     token_kind_to_string(token, &str);
-    fprintf(stderr, "error(%zu:%zu): expected `\\n`, found `%s`\n", token->line,
-            token->col, str);
-    exit(1);
+    asm_error("error(%u:%u): expected `\\n`, found `%s`\n", token->line,
+              token->col, str);
+}
+
+/**
+ * Labels and identifiers become strings in the arena of the tokens
+ */
+struct Value token_string_value(struct TokenVec *tokens, struct Token *token) {
+    struct Value value = {.kind = StringValue};
+    value.value.string = token_text(token, tokens->arena);
+    return value;
 }
 
 struct Token next_token(struct TokenVec *tokens, size_t *i) {
+    if (*i >= tokens->len) {
+        struct Token last = tokens->elements[tokens->len - 1];
+        asm_error("error(%u:%u): unexpected end of file\n", last.line,
+                  last.col);
+    }
     return tokens->elements[(*i)++];
 }
 
@@ -25,7 +42,7 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
                        struct IdentMap *idents, struct Instruction *instruction,
                        size_t instruction_addr, size_t *i) {
     struct Token token = next_token(tokens, i);
-    instruction->value = token.value;
+    instruction->value = token_value(&token);
 
     if (token.kind == TokenNoop) {
         struct Token newline = next_token(tokens, i);
@@ -42,19 +59,16 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
                 instruction->kind = InstructionJmp;
-                instruction->value = label.value;
+                instruction->value = token_string_value(tokens, &label);
                 return;
             } else {
-                fprintf(stderr,
-                        "error(%zu:%zu): `jmp %s` not followed by a newline\n",
-                        newline.line, newline.col,
-                        instruction->value.value.string);
-                exit(1);
+                asm_error(
+                    "error(%u:%u): `jmp %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)label.len, label.text);
             }
         } else {
-            fprintf(stderr, "error(%zu:%zu): `jmp` not followed by a label\n",
-                    label.line, label.col);
-            exit(1);
+            asm_error("error(%u:%u): `jmp` not followed by a label\n",
+                      label.line, label.col);
         }
     }
     if (token.kind == TokenJEQZ) {
@@ -63,21 +77,88 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
                 instruction->kind = InstructionJEQZ;
-                instruction->value = label.value;
+                instruction->value = token_string_value(tokens, &label);
                 return;
             } else {
-                fprintf(
-                    stderr,
-                    "error(%zu:%zu): `jmpeqz %s` not followed by a newline\n",
-                    newline.line, newline.col, instruction->value.value.string);
-                exit(1);
+                asm_error(
+                    "error(%u:%u): `jmpeqz %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)label.len, label.text);
             }
         } else {
-            fprintf(stderr,
-                    "error(%zu:%zu): `jmpeqz` not followed by a label\n",
-                    label.line, label.col);
-            exit(1);
+            asm_error("error(%u:%u): `jmpeqz` not followed by a label\n",
+                      label.line, label.col);
+        }
+    }
+    if (token.kind == TokenJNEZ) {
+        struct Token label = next_token(tokens, i);
+        if (expect(TokenLabel, &label)) {
+            struct Token newline = next_token(tokens, i);
+            if (expect(TokenNewLine, &newline)) {
+                instruction->kind = InstructionJNEZ;
+                instruction->value = token_string_value(tokens, &label);
+                return;
+            } else {
+                asm_error(
+                    "error(%u:%u): `jnez %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)label.len, label.text);
+            }
+        } else {
+            asm_error("error(%u:%u): `jnez` not followed by a label\n",
+                      label.line, label.col);
+        }
+    }
+
+    if (token.kind == TokenCall) {
+        struct Token label = next_token(tokens, i);
+        if (expect(TokenLabel, &label)) {
+            struct Token newline = next_token(tokens, i);
+            if (expect(TokenNewLine, &newline)) {
+                instruction->kind = InstructionCall;
+                instruction->value = token_string_value(tokens, &label);
+                return;
+            } else {
+                asm_error(
+                    "error(%u:%u): `call %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)label.len, label.text);
+            }
+        } else {
+            asm_error("error(%u:%u): `call` not followed by a label\n",
+                      label.line, label.col);
+        }
+    }
+    if (token.kind == TokenSpawn) {
+        struct Token label = next_token(tokens, i);
+        if (expect(TokenLabel, &label)) {
+            struct Token newline = next_token(tokens, i);
+            if (expect(TokenNewLine, &newline)) {
+                instruction->kind = InstructionSpawn;
+                instruction->value = token_string_value(tokens, &label);
+                return;
+            } else {
+                asm_error(
+                    "error(%u:%u): `spawn %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)label.len, label.text);
+            }
+        } else {
+            asm_error("error(%u:%u): `spawn` not followed by a label\n",
+                      label.line, label.col);
+        }
+    }
+    if (token.kind == TokenJoin) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionJoin;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenRet) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionRet;
+            return;
         }
+        parse_error_newline(&token);
     }
 
     if (token.kind == TokenPush) {
@@ -86,21 +167,31 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
                 instruction->kind = InstructionPush;
-                instruction->value = value.value;
+                instruction->value = token_value(&value);
                 return;
             } else {
-                fprintf(stderr,
-                        "error(%zu:%zu): `push <int/bool>` not followed by a "
-                        "newline\n",
-                        newline.line, newline.col);
-                exit(1);
+                asm_error("error(%u:%u): `push <int/bool>` not followed by a "
+                          "newline\n",
+                          newline.line, newline.col);
+            }
+        } else if (expect(TokenIdent, &value)) {
+            // Pushes the address of the identifier
+            struct Token newline = next_token(tokens, i);
+            if (expect(TokenNewLine, &newline)) {
+                char *name = ident_map_insert(idents, value.text, value.len);
+                instruction->kind = InstructionPush;
+                instruction->value.kind = StringValue;
+                instruction->value.value.string = name;
+                return;
+            } else {
+                asm_error(
+                    "error(%u:%u): `push %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)value.len, value.text);
             }
         } else {
-            fprintf(stderr,
-                    "error(%zu:%zu): `push` not followed by a "
-                    "int or a bool\n",
-                    value.line, value.col);
-            exit(1);
+            asm_error("error(%u:%u): `push` not followed by a "
+                      "int, a bool or an identifier\n",
+                      value.line, value.col);
         }
     }
 
@@ -128,6 +219,97 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
         }
         parse_error_newline(&token);
     }
+    if (token.kind == TokenDiv) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionDiv;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+    if (token.kind == TokenMod) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionMod;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+
+    if (token.kind == TokenAnd) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionAnd;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+    if (token.kind == TokenOr) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionOr;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+    if (token.kind == TokenXor) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionXor;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+
+    if (token.kind == TokenShl) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionShl;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+    if (token.kind == TokenShr) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionShr;
+            return;
+        }
+        parse_error_newline(&token);
+    }
+
+    if (token.kind == TokenDup) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionDup;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenSwap) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionSwap;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenOver) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionOver;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenDrop) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionDrop;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
 
     if (token.kind == TokenEq) {
         struct Token newline = next_token(tokens, i);
@@ -201,20 +383,16 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
                 instruction->kind = InstructionFetch;
-                instruction->value = ident.value;
+                instruction->value = token_string_value(tokens, &ident);
                 return;
             } else {
-                fprintf(
-                    stderr,
-                    "error(%zu:%zu): `fetch %s` not followed by a newline\n",
-                    newline.line, newline.col, instruction->value.value.string);
-                exit(1);
+                asm_error(
+                    "error(%u:%u): `fetch %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)ident.len, ident.text);
             }
         } else {
-            fprintf(stderr,
-                    "error(%zu:%zu): `fetch` not followed by an identifier\n",
-                    ident.line, ident.col);
-            exit(1);
+            asm_error("error(%u:%u): `fetch` not followed by an identifier\n",
+                      ident.line, ident.col);
         }
     }
     if (token.kind == TokenStore) {
@@ -222,29 +400,62 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
         if (expect(TokenIdent, &ident)) {
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
-                // Ownership if ident.value.value.string is transfered from the
-                // Token to the Ident here
-                ident_map_insert(idents, ident.value.value.string);
+                char *name = ident_map_insert(idents, ident.text, ident.len);
                 instruction->kind = InstructionStore;
-                char *string_value =
-                    calloc(strlen(ident.value.value.string) + 1, sizeof(char));
-                strcpy(string_value, ident.value.value.string);
                 instruction->value.kind = StringValue;
-                instruction->value.value.string = string_value;
+                instruction->value.value.string = name;
                 return;
             } else {
-                fprintf(
-                    stderr,
-                    "error(%zu:%zu): `store %s` not followed by a newline\n",
-                    newline.line, newline.col, instruction->value.value.string);
-                exit(1);
+                asm_error(
+                    "error(%u:%u): `store %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)ident.len, ident.text);
             }
         } else {
-            fprintf(stderr,
-                    "error(%zu:%zu): `store` not followed by an identifier\n",
-                    ident.line, ident.col);
-            exit(1);
+            asm_error("error(%u:%u): `store` not followed by an identifier\n",
+                      ident.line, ident.col);
+        }
+    }
+
+    if (token.kind == TokenFetchI) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionFetchI;
+            return;
         }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenStoreI) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionStoreI;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+
+    if (token.kind == TokenFAdd) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionFAdd;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenCas) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionCas;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenFence) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionFence;
+            return;
+        }
+        parse_error_newline(&newline);
     }
 
     if (token.kind == TokenPrintC) {
@@ -252,22 +463,27 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
         if (expect(TokenInt, &value) || expect(TokenBool, &value)) {
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
+                // Only push has a constant pool form
+                int32_t int_value = value.value;
+                if (expect(TokenInt, &value) &&
+                    (int_value > (1 << 23) - 1 || int_value < -(1 << 23))) {
+                    asm_warning("warning(%u:%u): `%d` cannot fit within 24 "
+                                "bits and will be truncated\n",
+                                value.line, value.col, int_value);
+                }
                 instruction->kind = InstructionPrintC;
-                instruction->value = value.value;
+                instruction->value = token_value(&value);
                 return;
             } else {
-                fprintf(stderr,
-                        "error(%zu:%zu): `printc <int/bool>` not followed by a "
-                        "newline\n",
-                        newline.line, newline.col);
-                exit(1);
+                asm_error(
+                    "error(%u:%u): `printc <int/bool>` not followed by a "
+                    "newline\n",
+                    newline.line, newline.col);
             }
         } else {
-            fprintf(stderr,
-                    "error(%zu:%zu): `printc` not followed by a "
-                    "int or a bool\n",
-                    value.line, value.col);
-            exit(1);
+            asm_error("error(%u:%u): `printc` not followed by a "
+                      "int or a bool\n",
+                      value.line, value.col);
         }
     }
     if (token.kind == TokenPrintV) {
@@ -276,27 +492,120 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
             struct Token newline = next_token(tokens, i);
             if (expect(TokenNewLine, &newline)) {
                 instruction->kind = InstructionPrintV;
-                instruction->value = ident.value;
+                instruction->value = token_string_value(tokens, &ident);
                 return;
             } else {
-                fprintf(
-                    stderr,
-                    "error(%zu:%zu): `printv %s` not followed by a newline\n",
-                    newline.line, newline.col, instruction->value.value.string);
-                exit(1);
+                asm_error(
+                    "error(%u:%u): `printv %.*s` not followed by a newline\n",
+                    newline.line, newline.col, (int)ident.len, ident.text);
             }
         } else {
-            fprintf(stderr,
-                    "error(%zu:%zu): `printv` not followed by an identifier\n",
-                    ident.line, ident.col);
-            exit(1);
+            asm_error(
+                "error(%u:%u): `printv` not followed by an identifier\n",
+                ident.line, ident.col);
         }
     }
 
+    if (token.kind == TokenRead) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionRead;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenSend) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionSend;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenRecv) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionRecv;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+
+    if (token.kind == TokenFill) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionFill;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenCopy) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionCopy;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenVAdd) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionVAdd;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+    if (token.kind == TokenSum) {
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionSum;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+
+    if (token.kind == TokenAlloc) {
+        struct Token ident = next_token(tokens, i);
+        struct Token size = next_token(tokens, i);
+        if (!expect(TokenIdent, &ident) || !expect(TokenInt, &size)) {
+            asm_error("error(%u:%u): `alloc` has to be followed by an "
+                      "identifier and a size\n",
+                      token.line, token.col);
+        }
+        if (size.value <= 0) {
+            asm_error("error(%u:%u): `alloc %.*s` needs a positive size\n",
+                      size.line, size.col, (int)ident.len, ident.text);
+        }
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            ident_map_alloc(idents, token_text(&ident, idents->arena),
+                            size.value);
+            instruction->kind = InstructionAlloc;
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+
+    if (token.kind == TokenLoc) {
+        struct Token line = next_token(tokens, i);
+        if (!expect(TokenInt, &line) || line.value <= 0) {
+            asm_error("error(%u:%u): `.loc` has to be followed by a line "
+                      "number above 0\n",
+                      token.line, token.col);
+        }
+        struct Token newline = next_token(tokens, i);
+        if (expect(TokenNewLine, &newline)) {
+            instruction->kind = InstructionLoc;
+            instruction->value = token_value(&line);
+            return;
+        }
+        parse_error_newline(&newline);
+    }
+
     if (token.kind == TokenLabel) {
         struct Token newline = next_token(tokens, i);
         if (expect(TokenNewLine, &newline)) {
-            struct Label label = {.ident = token.value.value.string,
+            struct Label label = {.ident = token_text(&token, labels->arena),
                                   .addr = instruction_addr};
             label_map_insert(labels, label);
             instruction->kind = InstructionLabel;
@@ -307,51 +616,81 @@ void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
     if (token.kind == TokenIdent) {
         char *token_string;
         token_kind_to_string(&token, &token_string);
-        fprintf(stderr, "error(%zu:%zu): unexpected token `%s`\n", token.line,
-                token.col, token_string);
-        fprintf(stderr,
-                "An identifier has to be preceded by `store` or `load`");
-        exit(1);
+        asm_error("error(%u:%u): unexpected token `%s`\n"
+                  "An identifier has to be preceded by `store` or `load`",
+                  token.line, token.col, token_string);
     }
     char *token_string;
     token_kind_to_string(&token, &token_string);
-    fprintf(stderr, "error(%zu:%zu): unexpected token `%s`\n", token.line,
-            token.col, token_string);
-    exit(1);
+    asm_error("error(%u:%u): unexpected token `%s`\n", token.line, token.col,
+              token_string);
 }
 
 struct ParseResult parse(struct TokenVec *token_vec) {
-    struct InstructionVec *instructions = instruction_vec_new();
-    struct LabelMap *labels = label_map_new();
-    struct IdentMap *idents = ident_map_new();
-    struct ParseResult result = {
-        .instructions = instructions, .labels = labels, .idents = idents};
+    struct Arena *arena = token_vec->arena;
+    struct InstructionVec *instructions = instruction_vec_new(arena);
+    struct LabelMap *labels = label_map_new(arena);
+    struct IdentMap *idents = ident_map_new(arena);
+    struct ParseResult result = {.instructions = instructions,
+                                 .labels = labels,
+                                 .idents = idents,
+                                 .arena = arena};
 
     // Relative addr to the current instruction
     size_t instruction_addr = 0;
+    uint32_t source_line = 0;
 
     // Position in token vector
     size_t i = 0;
     while (i < token_vec->len) {
         if (token_vec->elements[i].kind == TokenNewLine) {
             i++;
+            continue;
         }
         struct Instruction instruction;
+        uint32_t line = token_vec->elements[i].line;
         parse_instruction(token_vec, labels, idents, &instruction,
                           instruction_addr, &i);
+        if (instruction.kind == InstructionLoc) {
+            source_line = instruction.value.value.integer;
+            continue;
+        }
 
-        if (instruction.kind != InstructionLabel) {
+        // Labels and allocations do not take up any space in the text section
+        if (instruction.kind != InstructionLabel &&
+            instruction.kind != InstructionAlloc) {
+            instruction.line = line;
+            instruction.source_line = source_line;
             instruction_vec_push(instructions, instruction);
             instruction_addr++;
         }
     }
 
+    result.source_line = source_line;
     return result;
 }
 
-struct InstructionVec *instruction_vec_new();
+void parse_result_append(struct ParseResult *result, struct ParseResult *part) {
+    struct InstructionVec *instructions = result->instructions;
+    label_map_merge(result->labels, part->labels, instructions->len);
+    ident_map_merge(result->idents, part->idents);
+
+    size_t len = instructions->len + part->instructions->len;
+    if (len > instructions->capacity) {
+        instructions->elements =
+            arena_grow(instructions->arena, instructions->elements,
+                       instructions->capacity * sizeof(struct Instruction),
+                       len * sizeof(struct Instruction));
+        instructions->capacity = len;
+    }
+    for (size_t i = 0; i < part->instructions->len; i++) {
+        instructions->elements[instructions->len++] =
+            part->instructions->elements[i];
+    }
+}
+
+struct InstructionVec *instruction_vec_new(struct Arena *arena);
 void instruction_vec_push(struct InstructionVec *vec, struct Instruction);
-void instruction_vec_destroy(struct InstructionVec *vec);
 
 void instruction_vec_print(struct InstructionVec *vec);
 
@@ -368,10 +707,46 @@ void instruction_kind_to_string(struct Instruction *instruction,
     case InstructionJEQZ:
         *str = "jeqz";
         return;
+    case InstructionJNEZ:
+        *str = "jnez";
+        return;
+
+    case InstructionCall:
+        *str = "call";
+        return;
+    case InstructionRet:
+        *str = "ret";
+        return;
+
+    case InstructionJmpW:
+        *str = "jmpw";
+        return;
+    case InstructionJEQZW:
+        *str = "jeqzw";
+        return;
+    case InstructionJNEZW:
+        *str = "jnezw";
+        return;
+    case InstructionCallW:
+        *str = "callw";
+        return;
+
+    case InstructionSpawn:
+        *str = "spawn";
+        return;
+    case InstructionSpawnW:
+        *str = "spawnw";
+        return;
+    case InstructionJoin:
+        *str = "join";
+        return;
 
     case InstructionPush:
         *str = "push";
         return;
+    case InstructionPushK:
+        *str = "pushk";
+        return;
     case InstructionAdd:
         *str = "add";
         return;
@@ -381,6 +756,42 @@ void instruction_kind_to_string(struct Instruction *instruction,
     case InstructionMul:
         *str = "mul";
         return;
+    case InstructionDiv:
+        *str = "div";
+        return;
+    case InstructionMod:
+        *str = "mod";
+        return;
+
+    case InstructionAnd:
+        *str = "and";
+        return;
+    case InstructionOr:
+        *str = "or";
+        return;
+    case InstructionXor:
+        *str = "xor";
+        return;
+
+    case InstructionShl:
+        *str = "shl";
+        return;
+    case InstructionShr:
+        *str = "shr";
+        return;
+
+    case InstructionDup:
+        *str = "dup";
+        return;
+    case InstructionSwap:
+        *str = "swap";
+        return;
+    case InstructionOver:
+        *str = "over";
+        return;
+    case InstructionDrop:
+        *str = "drop";
+        return;
 
     case InstructionEq:
         *str = "eq";
@@ -414,6 +825,28 @@ void instruction_kind_to_string(struct Instruction *instruction,
     case InstructionStore:
         *str = "store";
         return;
+    case InstructionFetchI:
+        *str = "fetchi";
+        return;
+    case InstructionStoreI:
+        *str = "storei";
+        return;
+    case InstructionFetchW:
+        *str = "fetchw";
+        return;
+    case InstructionStoreW:
+        *str = "storew";
+        return;
+
+    case InstructionFAdd:
+        *str = "fadd";
+        return;
+    case InstructionCas:
+        *str = "cas";
+        return;
+    case InstructionFence:
+        *str = "fence";
+        return;
 
     case InstructionPrintC:
         *str = "printc";
@@ -421,16 +854,47 @@ void instruction_kind_to_string(struct Instruction *instruction,
     case InstructionPrintV:
         *str = "printv";
         return;
+    case InstructionPrintVW:
+        *str = "printvw";
+        return;
+
+    case InstructionRead:
+        *str = "read";
+        return;
+    case InstructionSend:
+        *str = "send";
+        return;
+    case InstructionRecv:
+        *str = "recv";
+        return;
+
+    case InstructionFill:
+        *str = "fill";
+        return;
+    case InstructionCopy:
+        *str = "copy";
+        return;
+    case InstructionVAdd:
+        *str = "vadd";
+        return;
+    case InstructionSum:
+        *str = "sum";
+        return;
 
     case InstructionLabel:
         *str = instruction->value.value.string;
         return;
+    case InstructionAlloc:
+        *str = "alloc";
+        return;
     case InstructionIdent:
         *str = instruction->value.value.string;
         return;
+    case InstructionLoc:
+        *str = ".loc";
+        return;
     }
-    fprintf(stderr, "Unreachable statement reached in token_kind_to_string\n");
-    exit(1);
+    asm_error("Unreachable statement reached in token_kind_to_string\n");
 }
 
 void instruction_to_string(struct Instruction *instruction, char (*str)[256]) {
@@ -442,35 +906,30 @@ void instruction_to_string(struct Instruction *instruction, char (*str)[256]) {
             value);
 }
 
-struct InstructionVec *instruction_vec_new() {
-    struct InstructionVec *vec = calloc(1, sizeof(struct InstructionVec));
-    vec->elements = calloc(1, sizeof(struct Instruction));
+struct InstructionVec *instruction_vec_new(struct Arena *arena) {
+    struct InstructionVec *vec =
+        arena_alloc(arena, sizeof(struct InstructionVec));
+    vec->capacity = MINIMUM_VEC_CAPACITY;
+    vec->elements =
+        arena_alloc(arena, vec->capacity * sizeof(struct Instruction));
     vec->len = 0;
-    vec->capacity = 1;
+    vec->arena = arena;
     return vec;
 }
 
 void instruction_vec_push(struct InstructionVec *vec,
                           struct Instruction instruction) {
     if (vec->len == vec->capacity) {
-        vec->elements = realloc(vec->elements,
-                                vec->capacity * 2 * sizeof(struct Instruction));
+        vec->elements =
+            arena_grow(vec->arena, vec->elements,
+                       vec->capacity * sizeof(struct Instruction),
+                       vec->capacity * 2 * sizeof(struct Instruction));
         vec->capacity *= 2;
     }
 
     vec->elements[vec->len++] = instruction;
 }
 
-void instruction_vec_destroy(struct InstructionVec *vec) {
-    for (size_t i = 0; i < vec->len; i++) {
-        if (vec->elements[i].value.kind == StringValue) {
-            free(vec->elements[i].value.value.string);
-        }
-    }
-    free(vec->elements);
-    free(vec);
-}
-
 void instruction_vec_print(struct InstructionVec *vec) {
     printf("struct InstructionVec {\n");
     for (size_t i = 0; i < vec->len; i++) {
@@ -481,39 +940,48 @@ void instruction_vec_print(struct InstructionVec *vec) {
     printf("}\n");
 }
 
-struct LabelMap *label_map_new() {
-    struct LabelMap *map = calloc(1, sizeof(struct LabelMap));
-    map->elements = calloc(1, sizeof(struct LabelMap));
+struct LabelMap *label_map_new(struct Arena *arena) {
+    struct LabelMap *map = arena_alloc(arena, sizeof(struct LabelMap));
+    map->capacity = MINIMUM_VEC_CAPACITY;
+    map->elements = arena_alloc(arena, map->capacity * sizeof(struct Label));
     map->len = 0;
-    map->capacity = 1;
+    map->index = symbol_index_new(arena);
+    map->arena = arena;
     return map;
 }
 
 void label_map_insert(struct LabelMap *map, struct Label label) {
     if (map->len == map->capacity) {
-        map->elements =
-            realloc(map->elements, map->capacity * 2 * sizeof(struct Label));
+        map->elements = arena_grow(map->arena, map->elements,
+                                   map->capacity * sizeof(struct Label),
+                                   map->capacity * 2 * sizeof(struct Label));
         map->capacity *= 2;
     }
 
+    // A label that is defined again keeps its first address
+    size_t position;
+    if (!symbol_index_get(&map->index, label.ident, strlen(label.ident),
+                          &position)) {
+        symbol_index_insert(&map->index, label.ident, map->len);
+    }
     map->elements[map->len++] = label;
 }
 
 int32_t label_map_get(struct LabelMap *map, char *ident) {
-    for (size_t i = 0; i < map->len; i++) {
-        if (strcmp(map->elements[i].ident, ident) == 0) {
-            return map->elements[i].addr;
-        }
+    size_t position;
+    if (symbol_index_get(&map->index, ident, strlen(ident), &position)) {
+        return map->elements[position].addr;
     }
     return -1;
 }
 
-void label_map_destroy(struct LabelMap *map) {
-    for (size_t i = 0; i < map->len; i++) {
-        free(map->elements[i].ident);
+void label_map_merge(struct LabelMap *map, struct LabelMap *other,
+                     int32_t offset) {
+    for (size_t i = 0; i < other->len; i++) {
+        struct Label label = other->elements[i];
+        label.addr += offset;
+        label_map_insert(map, label);
     }
-    free(map->elements);
-    free(map);
 }
 
 void label_map_print(struct LabelMap *map) {
@@ -525,50 +993,85 @@ void label_map_print(struct LabelMap *map) {
     printf("}\n");
 }
 
-struct IdentMap *ident_map_new() {
-    struct IdentMap *map = calloc(1, sizeof(struct IdentMap));
-    map->elements = calloc(1, sizeof(struct Ident));
+struct IdentMap *ident_map_new(struct Arena *arena) {
+    struct IdentMap *map = arena_alloc(arena, sizeof(struct IdentMap));
+    map->capacity = MINIMUM_VEC_CAPACITY;
+    map->elements = arena_alloc(arena, map->capacity * sizeof(struct Ident));
     map->len = 0;
-    map->capacity = 1;
+    map->size = 0;
+    map->index = symbol_index_new(arena);
+    map->arena = arena;
     return map;
 }
 
-void ident_map_insert(struct IdentMap *map, char *ident_string) {
-    // Ident already in map
-    if (ident_map_get(map, ident_string) != -1)
-        return;
+void ident_map_push(struct IdentMap *map, char *ident_string, int32_t size,
+                    bool allocated);
+
+char *ident_map_insert(struct IdentMap *map, const char *ident, size_t len) {
+    size_t position;
+    if (symbol_index_get(&map->index, ident, len, &position)) {
+        // Ident already in map
+        return map->elements[position].ident;
+    }
+    char *ident_string = arena_strndup(map->arena, ident, len);
+    ident_map_push(map, ident_string, 1, false);
+    return ident_string;
+}
+
+void ident_map_alloc(struct IdentMap *map, char *ident_string, int32_t size) {
+    if (ident_map_get(map, ident_string) != -1) {
+        asm_error("error: `%s` is already allocated, `alloc` has to come "
+                  "before any use\n",
+                  ident_string);
+    }
+    ident_map_push(map, ident_string, size, true);
+}
+
+/**
+ * Add an ident that is not in the map yet
+ */
+void ident_map_push(struct IdentMap *map, char *ident_string, int32_t size,
+                    bool allocated) {
     if (map->len == map->capacity) {
-        map->elements =
-            realloc(map->elements, map->capacity * 2 * sizeof(struct Ident));
+        map->elements = arena_grow(map->arena, map->elements,
+                                   map->capacity * sizeof(struct Ident),
+                                   map->capacity * 2 * sizeof(struct Ident));
         map->capacity *= 2;
     }
 
-    struct Ident ident = {.ident = ident_string, .addr = map->len};
+    struct Ident ident = {.ident = ident_string,
+                          .addr = map->size,
+                          .size = size,
+                          .allocated = allocated};
+    symbol_index_insert(&map->index, ident_string, map->len);
     map->elements[map->len++] = ident;
+    map->size += size;
 }
 
 int32_t ident_map_get(struct IdentMap *map, char *ident) {
-    for (size_t i = 0; i < map->len; i++) {
-        if (strcmp(map->elements[i].ident, ident) == 0) {
-            return map->elements[i].addr;
-        }
+    size_t position;
+    if (symbol_index_get(&map->index, ident, strlen(ident), &position)) {
+        return map->elements[position].addr;
     }
     return -1;
 }
 
-void ident_map_destroy(struct IdentMap *map) {
-    for (size_t i = 0; i < map->len; i++) {
-        free(map->elements[i].ident);
+void ident_map_merge(struct IdentMap *map, struct IdentMap *other) {
+    for (size_t i = 0; i < other->len; i++) {
+        struct Ident *ident = &other->elements[i];
+        if (ident->allocated) {
+            ident_map_alloc(map, ident->ident, ident->size);
+        } else {
+            ident_map_insert(map, ident->ident, strlen(ident->ident));
+        }
     }
-    free(map->elements);
-    free(map);
 }
 
 void ident_map_print(struct IdentMap *map) {
     printf("struct IdentMap {\n");
     for (size_t i = 0; i < map->len; i++) {
         struct Ident ident = map->elements[i];
-        printf("  %s: %d\n", ident.ident, ident.addr);
+        printf("  %s: %d [%d]\n", ident.ident, ident.addr, ident.size);
     }
     printf("}\n");
 }
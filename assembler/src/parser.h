@@ -1,8 +1,11 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 
+#include "arena.h"
 #include "lexer.h"
+#include "symbol_index.h"
 #include "value.h"
 
 enum InstructionKind {
@@ -11,11 +14,42 @@ enum InstructionKind {
     InstructionJmp = 0x01,
     InstructionJEQZ = 0x02,
 
+    InstructionCall = 0x03,
+    InstructionRet = 0x04,
+
+    // Wide forms, the argument is the address of a constant pool entry
+    // holding the full 32 bit argument
+    InstructionJmpW = 0x05,
+    InstructionJEQZW = 0x06,
+    InstructionCallW = 0x07,
+
+    InstructionSpawn = 0x08,
+    InstructionSpawnW = 0x09,
+    InstructionJoin = 0x0a,
+
+    InstructionJNEZ = 0x0b,
+    InstructionJNEZW = 0x0c,
+
     InstructionPush = 0x10,
+    InstructionPushK = 0x11,
 
     InstructionAdd = 0x20,
     InstructionSub = 0x30,
     InstructionMul = 0x40,
+    InstructionDiv = 0x50,
+    InstructionMod = 0x60,
+
+    InstructionAnd = 0x70,
+    InstructionOr = 0x71,
+    InstructionXor = 0x72,
+
+    InstructionShl = 0x80,
+    InstructionShr = 0x81,
+
+    InstructionDup = 0x90,
+    InstructionSwap = 0x91,
+    InstructionOver = 0x92,
+    InstructionDrop = 0x93,
 
     InstructionEq = 0xa0,
     InstructionLt = 0xa1,
@@ -29,27 +63,53 @@ enum InstructionKind {
 
     InstructionFetch = 0xc0,
     InstructionStore = 0xc1,
+    InstructionFetchI = 0xc2,
+    InstructionStoreI = 0xc3,
+    InstructionFetchW = 0xc4,
+    InstructionStoreW = 0xc5,
+
+    InstructionFAdd = 0xc6,
+    InstructionCas = 0xc7,
+    InstructionFence = 0xc8,
 
     InstructionPrintC = 0xd0,
     InstructionPrintV = 0xd1,
+    InstructionPrintVW = 0xd2,
+
+    InstructionRead = 0xd4,
+    InstructionSend = 0xd5,
+    InstructionRecv = 0xd6,
+
+    InstructionFill = 0xe0,
+    InstructionCopy = 0xe1,
+    InstructionVAdd = 0xe2,
+    InstructionSum = 0xe3,
 
     InstructionLabel,
+    InstructionAlloc,
     InstructionIdent,
+    InstructionLoc,
 };
 
 struct Instruction {
     enum InstructionKind kind;
     struct Value value;
+    // Line of the assembly the instruction is on, one-indexed
+    uint32_t line;
+    // Line of the program the assembly was compiled from, as the last `.loc`
+    // gave it, 0 if there was none
+    uint32_t source_line;
 };
 
 struct InstructionVec {
     size_t len;
     size_t capacity;
     struct Instruction *elements;
+    struct Arena *arena;
 };
 
 /**
- * The Label owns the ident
+ * The ident lives in the arena of the map
  */
 struct Label {
     char *ident;
@@ -60,43 +120,95 @@ struct LabelMap {
     size_t len;
     size_t capacity;
     struct Label *elements;
+    // Finds the first label with a name
+    struct SymbolIndex index;
+    struct Arena *arena;
 };
 
 /**
- * The Ident owns the ident
+ * The ident lives in the arena of the map
  */
 struct Ident {
     char *ident;
     int32_t addr;
+    // Number of words reserved in the data section
+    int32_t size;
+    // Reserved by an `alloc`, not by its first use
+    bool allocated;
 };
 
 struct IdentMap {
     size_t len;
     size_t capacity;
     struct Ident *elements;
+    // Total size of the data section in words
+    size_t size;
+    struct SymbolIndex index;
+    struct Arena *arena;
 };
 
+/**
+ * Everything in it, the strings of the instructions included, lives in arena
+ */
 struct ParseResult {
     struct InstructionVec *instructions;
     struct LabelMap *labels;
     struct IdentMap *idents;
+    struct Arena *arena;
+    // Line the last `.loc` gave, 0 if there was none
+    uint32_t source_line;
 };
 
 /**
  * Generate a vector (InstructionVec) of Instructions
  *
+ * @note The result is allocated in the arena of the tokens, it does not point
+ * into the source, so the tokens can be unmapped once it is parsed
+ *
  * @param token_vec
  *
  * @returns InstructionVec* All the instructions
  */
 struct ParseResult parse(struct TokenVec *token_vec);
 
+/**
+ * Parse the instruction, label or allocation the tokens at i start with
+ *
+ * @note Labels and allocations go into their maps, instruction is only set
+ * to InstructionLabel or InstructionAlloc for them
+ *
+ * @param tokens
+ * @param labels
+ * @param idents
+ * @param instruction Set to the parsed instruction, its strings live in the
+ * arena of the tokens
+ * @param instruction_addr Address a label here points to
+ * @param i Moved past the newline that ends the instruction
+ */
+void parse_instruction(struct TokenVec *tokens, struct LabelMap *labels,
+                       struct IdentMap *idents, struct Instruction *instruction,
+                       size_t instruction_addr, size_t *i);
+
+/**
+ * Append the program of part to result, as if its source came after the
+ * source of result
+ *
+ * @note Fails like ident_map_alloc if part allocates an identifier that
+ * result already has
+ *
+ * @param result
+ * @param part Its strings have to live as long as result
+ */
+void parse_result_append(struct ParseResult *result, struct ParseResult *part);
+
 /**
  * Create a new InstructionVec*
  *
+ * @param arena Where the instructions are allocated
+ *
  * @returns InstructionVec* empty InstructionVec
  */
-struct InstructionVec *instruction_vec_new();
+struct InstructionVec *instruction_vec_new(struct Arena *arena);
 
 /**
  * Push an Instruction onto an InstructionVec
@@ -109,13 +221,6 @@ struct InstructionVec *instruction_vec_new();
 void instruction_vec_push(struct InstructionVec *vec,
                           struct Instruction instruction);
 
-/**
- * Free an InstructionVec
- *
- * @param vec
- */
-void instruction_vec_destroy(struct InstructionVec *vec);
-
 /**
  * Print all instructions in a TokenVec
  *
@@ -126,9 +231,11 @@ void instruction_vec_print(struct InstructionVec *vec);
 /**
  * Create a new LabelMap*
  *
+ * @param arena Where the labels are allocated
+ *
  * @returns LabelMap* empty LabelMap
  */
-struct LabelMap *label_map_new();
+struct LabelMap *label_map_new(struct Arena *arena);
 
 /**
  * Insert a Label into a LabelMap
@@ -155,11 +262,14 @@ void label_map_insert(struct LabelMap *map, struct Label label);
 int32_t label_map_get(struct LabelMap *map, char *ident);
 
 /**
- * Free a LabelMap
+ * Insert every label of other into a LabelMap, in order
  *
  * @param map
+ * @param other Its idents have to live as long as map
+ * @param offset Added to the address of every label of other
  */
-void label_map_destroy(struct LabelMap *map);
+void label_map_merge(struct LabelMap *map, struct LabelMap *other,
+                     int32_t offset);
 
 /**
  * Print all instructions in a TokenVec
@@ -171,19 +281,36 @@ void label_map_print(struct LabelMap *map);
 /**
  * Create a new IdentMap*
  *
+ * @param arena Where the identifiers are allocated
+ *
  * @returns IdentMap* empty IdentMap
  */
-struct IdentMap *ident_map_new();
+struct IdentMap *ident_map_new(struct Arena *arena);
 
 /**
- * Insert a ident into a IdentMap
+ * Insert a ident into a IdentMap, unless it is already there
  *
  * @note If there is not enough space, space is allocated
  *
  * @param map
- * @param ident
+ * @param ident Does not have to be NUL terminated, it is only copied if the
+ * map does not have it yet
+ * @param len
+ *
+ * @returns The string the map keeps for the ident
  */
-void ident_map_insert(struct IdentMap *map, char *ident);
+char *ident_map_insert(struct IdentMap *map, const char *ident, size_t len);
+
+/**
+ * Insert a ident that reserves `size` words into a IdentMap
+ *
+ * @note Fails if the ident is already in the map
+ *
+ * @param map
+ * @param ident Has to live as long as the map
+ * @param size
+ */
+void ident_map_alloc(struct IdentMap *map, char *ident, int32_t size);
 
 /**
  * Get the address of a ident
@@ -200,11 +327,15 @@ void ident_map_insert(struct IdentMap *map, char *ident);
 int32_t ident_map_get(struct IdentMap *map, char *ident);
 
 /**
- * Free a IdentMap
+ * Insert every ident of other into an IdentMap, in the order other has them
+ *
+ * @note The idents other allocated are allocated again, and fail the same
+ * way if map already has them
  *
  * @param map
+ * @param other
  */
-void ident_map_destroy(struct IdentMap *map);
+void ident_map_merge(struct IdentMap *map, struct IdentMap *other);
 
 /**
  * Print all identifiers in an IdentMap
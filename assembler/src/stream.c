@@ -0,0 +1,414 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "code_generation.h"
+#include "error.h"
+#include "format.h"
+#include "lexer.h"
+#include "parser.h"
+#include "stream.h"
+
+// Bytes read from the source at a time, a longer line makes the buffer grow
+#define STREAM_READ_SIZE (1 << 16)
+
+// Instructions read from the spill file at a time
+#define SPILL_BLOCK_LEN 4096
+
+/**
+ * What the value of a spilled instruction is relative to. Addresses are only
+ * final once the size of the constant pool and the data section are known.
+ */
+enum SpilledArgument {
+    ArgumentConstant,
+    // Address in the data section
+    ArgumentIdent,
+    // Address in the text section
+    ArgumentLabel,
+};
+
+/**
+ * An instruction as it is written to the spill file
+ */
+struct SpilledInstruction {
+    uint16_t kind;
+    uint16_t argument;
+    int32_t value;
+    // Fixups only patch the fields above
+    uint32_t line;
+    uint32_t source_line;
+};
+
+/**
+ * A label or identifier used before its definition
+ */
+struct Fixup {
+    // Position of the instruction in the spill file
+    size_t addr;
+    enum InstructionKind kind;
+    char *name;
+};
+
+struct StreamAssembler {
+    struct Arena *arena;
+    // Strings the parser copies out of a line, emptied after every line
+    struct Arena line_arena;
+    struct TokenVec *tokens;
+    struct LabelMap *labels;
+    struct IdentMap *idents;
+
+    struct Fixup *fixups;
+    size_t fixups_len;
+    size_t fixups_capacity;
+
+    FILE *spill;
+    // Instructions written to the spill file
+    size_t len;
+    // As the last `.loc` gave it
+    uint32_t source_line;
+};
+
+/**
+ * The spill file is created next to the output, where there is room for the
+ * output, and unlinked right away so it goes away with the assembler
+ */
+FILE *spill_file_open(struct Arena *arena, char *output) {
+    size_t len = strlen(output);
+    char *template = arena_alloc(arena, len + sizeof(".XXXXXX"));
+    memcpy(template, output, len);
+    memcpy(template + len, ".XXXXXX", sizeof(".XXXXXX"));
+
+    int fd = mkstemp(template);
+    if (fd < 0) {
+        asm_error("Failed to create a spill file next to %s\n", output);
+    }
+    unlink(template);
+    FILE *spill = fdopen(fd, "w+b");
+    if (spill == NULL) {
+        close(fd);
+        asm_error("Failed to create a spill file next to %s\n", output);
+    }
+    return spill;
+}
+
+void fixup_push(struct StreamAssembler *assembler, struct Fixup fixup) {
+    if (assembler->fixups_len == assembler->fixups_capacity) {
+        size_t capacity = assembler->fixups_capacity == 0
+                              ? 16
+                              : assembler->fixups_capacity * 2;
+        assembler->fixups = arena_grow(
+            assembler->arena, assembler->fixups,
+            assembler->fixups_capacity * sizeof(struct Fixup),
+            capacity * sizeof(struct Fixup));
+        assembler->fixups_capacity = capacity;
+    }
+    assembler->fixups[assembler->fixups_len++] = fixup;
+}
+
+/**
+ * @returns The address of the label or identifier instruction names, or -1 if
+ * it is not defined (yet)
+ */
+int32_t stream_lookup(struct StreamAssembler *assembler,
+                      enum InstructionKind kind, char *name) {
+    if (takes_identifier(kind)) {
+        return ident_map_get(assembler->idents, name);
+    }
+    return label_map_get(assembler->labels, name);
+}
+
+enum SpilledArgument spilled_argument(enum InstructionKind kind) {
+    return takes_identifier(kind) ? ArgumentIdent : ArgumentLabel;
+}
+
+void spill_instruction(struct StreamAssembler *assembler,
+                       struct Instruction *instruction) {
+    struct SpilledInstruction spilled = {
+        .kind = instruction->kind,
+        .argument = ArgumentConstant,
+        .value = 0,
+        .line = instruction->line,
+        .source_line = instruction->source_line};
+    switch (instruction->value.kind) {
+    case None:
+        break;
+    case IntValue:
+        spilled.value = instruction->value.value.integer;
+        break;
+    case BoolValue:
+        spilled.value = instruction->value.value.boolean;
+        break;
+    case StringValue: {
+        char *name = instruction->value.value.string;
+        spilled.argument = spilled_argument(instruction->kind);
+        spilled.value = stream_lookup(assembler, instruction->kind, name);
+        if (spilled.value == -1) {
+            // Patched in once the whole source is read
+            fixup_push(assembler,
+                       (struct Fixup){
+                           .addr = assembler->len,
+                           .kind = instruction->kind,
+                           .name = arena_strndup(assembler->arena, name,
+                                                 strlen(name))});
+        }
+        break;
+    }
+    }
+
+    if (fwrite(&spilled, sizeof(spilled), 1, assembler->spill) != 1) {
+        asm_error("Failed to write to the spill file\n");
+    }
+    assembler->len++;
+}
+
+void stream_line(struct StreamAssembler *assembler, const char *source,
+                 size_t len, uint32_t line, bool newline) {
+    arena_reset(&assembler->line_arena);
+    assembler->tokens->len = 0;
+    lex_line(assembler->tokens, source, len, line, newline);
+
+    // Only the strings the parser copies go into the line arena, the tokens
+    // are reused for the next line
+    struct TokenVec tokens = *assembler->tokens;
+    tokens.arena = &assembler->line_arena;
+
+    size_t i = 0;
+    while (i < tokens.len) {
+        if (tokens.elements[i].kind == TokenNewLine) {
+            i++;
+            continue;
+        }
+        struct Instruction instruction;
+        uint32_t line = tokens.elements[i].line;
+        parse_instruction(&tokens, assembler->labels, assembler->idents,
+                          &instruction, assembler->len, &i);
+        if (instruction.kind == InstructionLoc) {
+            assembler->source_line = instruction.value.value.integer;
+            continue;
+        }
+
+        // Labels and allocations do not take up any space in the text section
+        if (instruction.kind != InstructionLabel &&
+            instruction.kind != InstructionAlloc) {
+            instruction.line = line;
+            instruction.source_line = assembler->source_line;
+            spill_instruction(assembler, &instruction);
+        }
+    }
+}
+
+void stream_source(struct StreamAssembler *assembler, char *input) {
+    FILE *fptr = fopen(input, "rb");
+    if (fptr == NULL) {
+        asm_error("Failed to open file: %s\n", input);
+    }
+
+    size_t capacity = STREAM_READ_SIZE;
+    size_t len = 0;
+    char *buffer = arena_alloc(assembler->arena, capacity);
+
+    // One-indexed
+    uint32_t line = 1;
+    for (;;) {
+        size_t chars_read = fread(buffer + len, 1, capacity - len, fptr);
+        len += chars_read;
+
+        size_t line_start = 0;
+        const char *newline;
+        while ((newline = memchr(buffer + line_start, '\n',
+                                 len - line_start)) != NULL) {
+            size_t line_end = newline - buffer;
+            stream_line(assembler, buffer + line_start,
+                        line_end - line_start, line++, true);
+            line_start = line_end + 1;
+        }
+
+        if (chars_read == 0) {
+            stream_line(assembler, buffer + line_start, len - line_start,
+                        line, false);
+            break;
+        }
+
+        // Keep the start of the line that is not complete yet
+        len -= line_start;
+        memmove(buffer, buffer + line_start, len);
+        if (len == capacity) {
+            buffer =
+                arena_grow(assembler->arena, buffer, capacity, capacity * 2);
+            capacity *= 2;
+        }
+    }
+    fclose(fptr);
+}
+
+void stream_resolve_fixups(struct StreamAssembler *assembler) {
+    if (fflush(assembler->spill) != 0) {
+        asm_error("Failed to write to the spill file\n");
+    }
+    int fd = fileno(assembler->spill);
+    for (size_t i = 0; i < assembler->fixups_len; i++) {
+        struct Fixup *fixup = &assembler->fixups[i];
+        int32_t value = stream_lookup(assembler, fixup->kind, fixup->name);
+        if (value == -1) {
+            asm_error("%s is not a valid %s!\n", fixup->name,
+                      takes_identifier(fixup->kind) ? "identifier" : "label");
+        }
+
+        struct SpilledInstruction spilled = {
+            .kind = fixup->kind,
+            .argument = spilled_argument(fixup->kind),
+            .value = value};
+        off_t offset = (off_t)fixup->addr * sizeof(spilled);
+        size_t size = offsetof(struct SpilledInstruction, line);
+        if (pwrite(fd, &spilled, size, offset) != (ssize_t)size) {
+            asm_error("Failed to write to the spill file\n");
+        }
+    }
+}
+
+/**
+ * Read the instructions from addr on, at most SPILL_BLOCK_LEN of them
+ *
+ * @returns Number of instructions read
+ */
+size_t spill_read(struct StreamAssembler *assembler, size_t addr,
+                  struct SpilledInstruction *block) {
+    size_t len = assembler->len - addr;
+    if (len > SPILL_BLOCK_LEN) {
+        len = SPILL_BLOCK_LEN;
+    }
+    size_t size = len * sizeof(struct SpilledInstruction);
+    off_t offset = (off_t)addr * sizeof(struct SpilledInstruction);
+    if (pread(fileno(assembler->spill), block, size, offset) != (ssize_t)size) {
+        asm_error("Failed to read the spill file\n");
+    }
+    return len;
+}
+
+/**
+ * The same value get_value_as_int gives the instruction
+ */
+int32_t spilled_value(struct SpilledInstruction *spilled, size_t pool_len,
+                      size_t data_size) {
+    switch (spilled->argument) {
+    case ArgumentIdent:
+        return spilled->value + pool_len;
+    case ArgumentLabel:
+        return spilled->value + pool_len + data_size;
+    default:
+        return spilled->value;
+    }
+}
+
+/**
+ * build_constant_pool for the spilled instructions
+ */
+struct ConstantPool stream_constant_pool(struct StreamAssembler *assembler,
+                                         struct SpilledInstruction *block) {
+    struct ConstantPool pool = {.values = NULL, .len = 0, .capacity = 0};
+    size_t pool_len;
+    do {
+        pool_len = pool.len;
+        pool.len = 0;
+        for (size_t addr = 0; addr < assembler->len;) {
+            size_t len = spill_read(assembler, addr, block);
+            for (size_t i = 0; i < len; i++) {
+                enum InstructionKind kind = block[i].kind;
+                if (wide_instruction_kind(kind) == kind) {
+                    continue;
+                }
+                int32_t value = spilled_value(&block[i], pool_len,
+                                              assembler->idents->size);
+                if (!fits_in_argument(value)) {
+                    constant_pool_get(&pool, value);
+                }
+            }
+            addr += len;
+        }
+    } while (pool.len != pool_len);
+    return pool;
+}
+
+void stream_write_binary(struct StreamAssembler *assembler,
+                         struct ConstantPool *pool,
+                         struct SpilledInstruction *block, char *output_file) {
+    FILE *output = fopen(output_file, "wb");
+    if (output == NULL) {
+        asm_error("Failed to open file: %s\n", output_file);
+    }
+
+    struct BinaryWriter writer;
+    binary_writer_start(&writer, output);
+
+    // The data section is zero, only the pool is written
+    size_t data_size = assembler->idents->size;
+    uint32_t start_addr = pool->len + data_size;
+    binary_writer_section(&writer, SectionData);
+    binary_write(&writer, &start_addr, sizeof(uint32_t));
+    binary_write(&writer, pool->values, pool->len * sizeof(uint32_t));
+
+    binary_writer_section(&writer, SectionText);
+    binary_write_varint(&writer, assembler->len);
+    for (size_t addr = 0; addr < assembler->len;) {
+        size_t len = spill_read(assembler, addr, block);
+        for (size_t i = 0; i < len; i++) {
+            enum InstructionKind kind = block[i].kind;
+            int32_t value = spilled_value(&block[i], pool->len, data_size);
+            if (!fits_in_argument(value) &&
+                wide_instruction_kind(kind) != kind) {
+                kind = wide_instruction_kind(kind);
+                value = constant_pool_get(pool, value);
+            }
+            binary_write_instruction(&writer, kind, value);
+        }
+        addr += len;
+    }
+
+    binary_write_symbols(&writer, assembler->labels, assembler->idents,
+                         pool->len);
+
+    binary_writer_section(&writer, SectionDebug);
+    binary_write_varint(&writer, assembler->len);
+    for (size_t addr = 0; addr < assembler->len;) {
+        size_t len = spill_read(assembler, addr, block);
+        for (size_t i = 0; i < len; i++) {
+            binary_write_line(&writer, block[i].line, block[i].source_line);
+        }
+        addr += len;
+    }
+    binary_writer_finish(&writer);
+    if (fclose(output) != 0) {
+        asm_error("Failed to write the binary\n");
+    }
+}
+
+void assemble_stream(char *input, char *output, struct Arena *arena) {
+    struct StreamAssembler assembler = {
+        .arena = arena,
+        .line_arena = arena_new(),
+        .tokens = token_vec_new(arena),
+        .labels = label_map_new(arena),
+        .idents = ident_map_new(arena),
+        .fixups = NULL,
+        .fixups_len = 0,
+        .fixups_capacity = 0,
+        .spill = spill_file_open(arena, output),
+        .len = 0,
+        .source_line = 0,
+    };
+
+    stream_source(&assembler, input);
+    stream_resolve_fixups(&assembler);
+
+    struct SpilledInstruction *block =
+        arena_alloc(arena, SPILL_BLOCK_LEN * sizeof(struct SpilledInstruction));
+    struct ConstantPool pool = stream_constant_pool(&assembler, block);
+    stream_write_binary(&assembler, &pool, block, output);
+
+    free(pool.values);
+    fclose(assembler.spill);
+    arena_destroy(&assembler.line_arena);
+}
@@ -0,0 +1,24 @@
+#pragma once
+
+#include "arena.h"
+
+/**
+ * Assemble a file one line at a time, without ever holding its tokens,
+ * instructions or binary in memory
+ *
+ * Every line is encoded as soon as it is parsed and written to a spill file
+ * next to the output. Labels and identifiers used before they are defined
+ * are kept in a fixup list and patched into the spill file at the end. Then
+ * the constant pool is written, followed by the text section encoded out of
+ * the spill file, the symbols and the line table, and the header is filled
+ * in last.
+ *
+ * @note The binary is the same as the one generate_binary makes. Memory grows
+ * with the number of labels, identifiers and forward references, not with the
+ * size of the program.
+ *
+ * @param input File name of the source
+ * @param output File name of the output target
+ * @param arena Where the labels, identifiers and fixups are allocated
+ */
+void assemble_stream(char *input, char *output, struct Arena *arena);
@@ -0,0 +1,92 @@
+#include <string.h>
+
+#include "symbol_index.h"
+
+#define MINIMUM_CAPACITY 16
+
+/**
+ * 32 bit FNV-1a
+ */
+uint32_t symbol_hash(const char *key, size_t len) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+struct SymbolIndex symbol_index_new(struct Arena *arena) {
+    return (struct SymbolIndex){
+        .slots = arena_alloc(arena, MINIMUM_CAPACITY * sizeof(struct Symbol)),
+        .capacity = MINIMUM_CAPACITY,
+        .len = 0,
+        .arena = arena,
+    };
+}
+
+/**
+ * Linear probing, the slot of key or the empty slot where it would go
+ */
+struct Symbol *symbol_index_slot(struct SymbolIndex *index, const char *key,
+                                 size_t len, uint32_t hash) {
+    size_t mask = index->capacity - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        struct Symbol *slot = &index->slots[i];
+        if (slot->key == NULL ||
+            (slot->hash == hash && strncmp(slot->key, key, len) == 0 &&
+             slot->key[len] == '\0')) {
+            return slot;
+        }
+    }
+}
+
+bool symbol_index_get(struct SymbolIndex *index, const char *key, size_t len,
+                      size_t *position) {
+    struct Symbol *slot =
+        symbol_index_slot(index, key, len, symbol_hash(key, len));
+    if (slot->key == NULL) {
+        return false;
+    }
+    *position = slot->position;
+    return true;
+}
+
+/**
+ * Double the capacity, keeping the index at most half full
+ */
+void symbol_index_grow(struct SymbolIndex *index) {
+    struct SymbolIndex grown = {
+        .slots = arena_alloc(index->arena,
+                             index->capacity * 2 * sizeof(struct Symbol)),
+        .capacity = index->capacity * 2,
+        .len = index->len,
+        .arena = index->arena,
+    };
+    // The keys are all different, each one goes to the first empty slot
+    size_t mask = grown.capacity - 1;
+    for (size_t i = 0; i < index->capacity; i++) {
+        struct Symbol *symbol = &index->slots[i];
+        if (symbol->key == NULL) {
+            continue;
+        }
+        size_t j = symbol->hash & mask;
+        while (grown.slots[j].key != NULL) {
+            j = (j + 1) & mask;
+        }
+        grown.slots[j] = *symbol;
+    }
+    *index = grown;
+}
+
+void symbol_index_insert(struct SymbolIndex *index, char *key,
+                         size_t position) {
+    if ((index->len + 1) * 2 > index->capacity) {
+        symbol_index_grow(index);
+    }
+    size_t len = strlen(key);
+    uint32_t hash = symbol_hash(key, len);
+    struct Symbol *slot = symbol_index_slot(index, key, len, hash);
+    *slot = (struct Symbol){.key = key, .hash = hash, .position = position};
+    index->len++;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+
+struct Symbol {
+    // NULL for an empty slot, NUL terminated
+    char *key;
+    uint32_t hash;
+    // Position of the symbol in the map's elements
+    size_t position;
+};
+
+/**
+ * Open addressing hash table from a name to its position in a LabelMap or an
+ * IdentMap. The maps keep their elements in first-seen order, the index only
+ * makes finding them constant time.
+ */
+struct SymbolIndex {
+    struct Symbol *slots;
+    // Always a power of two
+    size_t capacity;
+    size_t len;
+    struct Arena *arena;
+};
+
+/**
+ * Create an empty SymbolIndex
+ *
+ * @param arena Where the slots are allocated
+ *
+ * @returns struct SymbolIndex
+ */
+struct SymbolIndex symbol_index_new(struct Arena *arena);
+
+/**
+ * Find the position of a name
+ *
+ * @param index
+ * @param key Does not have to be NUL terminated
+ * @param len
+ * @param position Set to the position of the name, if it was found
+ *
+ * @returns false if the name is not in the index
+ */
+bool symbol_index_get(struct SymbolIndex *index, const char *key, size_t len,
+                      size_t *position);
+
+/**
+ * Insert a name that is not in the index yet
+ *
+ * @note If there is not enough space, space is allocated
+ *
+ * @param index
+ * @param key NUL terminated, has to live as long as the index
+ * @param position
+ */
+void symbol_index_insert(struct SymbolIndex *index, char *key,
+                         size_t position);
@@ -0,0 +1,49 @@
+#include <setjmp.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../../assembler/src/arena.h"
+#include "../../assembler/src/code_generation.h"
+#include "../../assembler/src/error.h"
+#include "../../assembler/src/format.h"
+#include "../../assembler/src/lexer.h"
+#include "../../assembler/src/optimize.h"
+#include "../../assembler/src/parser.h"
+#include "harness.h"
+
+// The assembler lives in its own translation unit, its headers can not be
+// included together with the vm's
+
+int harness_run_assembly(const uint8_t *data, size_t size) {
+    if (size == 0) {
+        return 1;
+    }
+
+    jmp_buf trap;
+    // Not a local, the trap longjmps back after it may have grown
+    static struct Arena arena;
+    arena = arena_new();
+    uint8_t *volatile file = NULL;
+    volatile size_t file_size = 0;
+    volatile int rejected = 1;
+    asm_error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        struct TokenVec *tokens =
+            lex_buffer((const char *)data, size, &arena);
+        struct ParseResult result = parse(tokens);
+        optimize(&result, OPTIMIZATION_LEVEL_MAX);
+        struct Binary binary = generate_binary(result);
+        size_t encoded_size;
+        file = binary_encode_to_memory(&binary, &result, &encoded_size);
+        file_size = encoded_size;
+        rejected = 0;
+    }
+    asm_error_trap = NULL;
+
+    if (!rejected) {
+        rejected = harness_run_binary(file, file_size);
+    }
+    free(file);
+    arena_destroy(&arena);
+    return rejected;
+}
@@ -0,0 +1,58 @@
+#include "coverage.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/shm.h>
+
+uint8_t *coverage_map = NULL;
+
+// Shifted hash of the previous host basic block, the AFL edge scheme
+uintptr_t previous_location = 0;
+
+int coverage_init() {
+    char *shm_id = getenv("__AFL_SHM_ID");
+    if (shm_id != NULL) {
+        void *map = shmat(atoi(shm_id), NULL, 0);
+        if (map == (void *)-1) {
+            perror("Error attaching the coverage map");
+            exit(1);
+        }
+        coverage_map = map;
+        return 1;
+    }
+    coverage_map = calloc(COVERAGE_MAP_SIZE, 1);
+    return 0;
+}
+
+void coverage_reset() {
+    memset(coverage_map, 0, COVERAGE_MAP_SIZE);
+    previous_location = 0;
+}
+
+void coverage_guest_edge(uint32_t from, uint32_t to) {
+    // Knuth's multiplicative hash spreads the small pcs over the map
+    uint32_t edge = (from * 2654435761u) ^ to;
+    coverage_map[edge & (COVERAGE_MAP_SIZE - 1)]++;
+}
+
+uint32_t coverage_count() {
+    uint32_t count = 0;
+    for (size_t i = 0; i < COVERAGE_MAP_SIZE; i++) {
+        count += coverage_map[i] != 0;
+    }
+    return count;
+}
+
+/**
+ * Called by code built with -fsanitize-coverage=trace-pc on every basic
+ * block
+ */
+void __sanitizer_cov_trace_pc() {
+    if (coverage_map == NULL) {
+        return;
+    }
+    uintptr_t location = (uintptr_t)__builtin_return_address(0);
+    location = (location >> 4) ^ (location << 8);
+    coverage_map[(location ^ previous_location) & (COVERAGE_MAP_SIZE - 1)]++;
+    previous_location = location >> 1;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+
+// Same size as the afl-fuzz shared map
+#define COVERAGE_MAP_SIZE (1 << 16)
+
+/**
+ * Edge hit counts of both the guest program and the host vm / assembler
+ */
+extern uint8_t *coverage_map;
+
+/**
+ * Attach to the afl-fuzz shared map when __AFL_SHM_ID is set, otherwise
+ * allocate a private map
+ *
+ * @returns 1 if the shared map is used, 0 otherwise
+ */
+int coverage_init();
+
+/**
+ * Clear the map and the previous location before running the next input
+ */
+void coverage_reset();
+
+/**
+ * Record a taken guest jump
+ *
+ * @param from pc of the jump
+ * @param to pc of the target
+ */
+void coverage_guest_edge(uint32_t from, uint32_t to);
+
+/**
+ * Count the number of map entries that have been hit
+ *
+ * @returns uint32_t
+ */
+uint32_t coverage_count();
@@ -0,0 +1,112 @@
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../assembler/src/error.h"
+#include "../../vm/src/binary.h"
+#include "../../vm/src/decode.h"
+#include "../../vm/src/error.h"
+#include "../../vm/src/input.h"
+#include "../../vm/src/pool.h"
+#include "../../vm/src/vm.h"
+#include "coverage.h"
+#include "harness.h"
+
+// Bounds the run time of inputs that loop forever
+#define MAX_JUMPS (1 << 16)
+
+uint32_t jumps_left;
+
+bool count_jump(uint32_t from, uint32_t to) {
+    coverage_guest_edge(from, to);
+    return --jumps_left > 0;
+}
+
+void harness_init() {
+    vm_error_quiet = true;
+    asm_error_quiet = true;
+    vm_jump_hook = count_jump;
+    // stdin may carry the test case
+    vm_input_fd = -1;
+    // Guest threads only run on this thread, errors longjmp out of them
+    pool_threads = 1;
+    if (freopen("/dev/null", "w", stdout) == NULL) {
+        perror("Error discarding output");
+        exit(1);
+    }
+}
+
+int harness_run_binary(const uint8_t *data, size_t size) {
+    struct BinaryFile *bin = binary_from_bytes(data, size, "input");
+    if (bin == NULL) {
+        return 1;
+    }
+
+    jmp_buf trap;
+    struct Program *volatile program = NULL;
+    volatile int rejected = 1;
+    vm_error_trap = &trap;
+    if (setjmp(trap) == 0) {
+        jumps_left = MAX_JUMPS;
+        program = decode_program(bin);
+        run_vm(bin, program);
+        rejected = 0;
+    }
+    vm_error_trap = NULL;
+    if (rejected) {
+        // Threads the failed run spawned but never joined
+        pool_reset();
+    }
+
+    if (program != NULL) {
+        free_program(program);
+    }
+    free_binary_file(bin);
+    return rejected;
+}
+
+int harness_run_cache(const uint8_t *data, size_t size) {
+    // The binary has no data, only as many zeroed words of text as the
+    // entry has instructions
+    struct BinaryFile *bin = calloc(1, sizeof(struct BinaryFile));
+    struct Program *program = calloc(1, sizeof(struct Program));
+    program->len = size / sizeof(struct DecodedInstruction);
+    bin->total_size = program->len;
+    bin->memory = calloc(program->len + 1, sizeof(uint32_t));
+    program->code = calloc(program->len + 1, sizeof(struct DecodedInstruction));
+    memcpy(program->code, data,
+           program->len * sizeof(struct DecodedInstruction));
+
+    jmp_buf trap;
+    volatile int rejected = 1;
+    if (check_program(bin, program)) {
+        vm_error_trap = &trap;
+        if (setjmp(trap) == 0) {
+            jumps_left = MAX_JUMPS;
+            run_vm(bin, program);
+            rejected = 0;
+        }
+        vm_error_trap = NULL;
+        if (rejected) {
+            pool_reset();
+        }
+    }
+
+    free_program(program);
+    free_binary_file(bin);
+    return rejected;
+}
+
+int harness_run(enum FuzzTarget target, const uint8_t *data, size_t size) {
+    switch (target) {
+    case FuzzTargetVm:
+        return harness_run_binary(data, size);
+    case FuzzTargetAsm:
+        return harness_run_assembly(data, size);
+    case FuzzTargetCache:
+        return harness_run_cache(data, size);
+    }
+    return 1;
+}
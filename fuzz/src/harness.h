@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+enum FuzzTarget {
+    // The input is an am4 binary
+    FuzzTargetVm,
+    // The input is am4 assembly, it is assembled and then run
+    FuzzTargetAsm,
+    // The input is the decoded program of a code cache entry, it is checked
+    // like one and then run
+    FuzzTargetCache,
+};
+
+/**
+ * Prepare the vm and the assembler for running many inputs in one process
+ *
+ * @note Errors are trapped instead of exiting, and output is discarded
+ */
+void harness_init();
+
+/**
+ * Run a single input in process
+ *
+ * @param target
+ * @param data
+ * @param size
+ *
+ * @returns 0 if the input was accepted, 1 if it was rejected with an error
+ */
+int harness_run(enum FuzzTarget target, const uint8_t *data, size_t size);
+
+/**
+ * Run an am4 binary, see harness_run
+ */
+int harness_run_binary(const uint8_t *data, size_t size);
+
+/**
+ * Assemble and run am4 assembly, see harness_run
+ */
+int harness_run_assembly(const uint8_t *data, size_t size);
+
+/**
+ * Check and run a decoded program as if it was loaded from the code cache,
+ * see harness_run
+ */
+int harness_run_cache(const uint8_t *data, size_t size);
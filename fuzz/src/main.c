@@ -0,0 +1,188 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "coverage.h"
+#include "harness.h"
+
+// File descriptors of the afl-fuzz fork server protocol
+#define FORKSRV_FD 198
+// Inputs a child runs before afl-fuzz forks a fresh one
+#define PERSISTENT_ITERATIONS 10000
+
+#define MAX_INPUT_SIZE (1 << 20)
+
+// afl-fuzz looks for this string to enable persistent mode
+__attribute__((used)) const char *afl_persistent_signature =
+    "##SIG_AFL_PERSISTENT##";
+
+uint8_t input[MAX_INPUT_SIZE];
+
+void print_help() {
+    printf("In-process fuzzing harness for am4vm and am4asm\n");
+    printf("\n");
+    printf("Usage: am4fuzz <vm|asm|cache> [OPTIONS] [FILENAME]...\n");
+    printf("\n");
+    printf("Under afl-fuzz, runs inputs from FILENAME (@@) or stdin in\n");
+    printf("persistent mode. Otherwise every FILENAME is replayed and the\n");
+    printf("coverage is reported.\n");
+    printf("\n");
+    printf("Arguments\n");
+    printf("    --help            -- Print this message\n");
+    printf("    --repeat <N>      -- Replay every file N times\n");
+    exit(0);
+}
+
+size_t read_input(const char *filename) {
+    FILE *fptr = filename != NULL ? fopen(filename, "rb") : stdin;
+    if (fptr == NULL) {
+        perror("Error opening input");
+        exit(1);
+    }
+    if (filename == NULL) {
+        // afl-fuzz rewrites the same file between iterations
+        rewind(fptr);
+    }
+    size_t size = fread(input, 1, MAX_INPUT_SIZE, fptr);
+    if (filename != NULL) {
+        fclose(fptr);
+    }
+    return size;
+}
+
+/**
+ * Hand inputs to afl-fuzz's fork server protocol. The fork server forks a
+ * child, which runs PERSISTENT_ITERATIONS inputs in process and stops itself
+ * with SIGSTOP after each of them.
+ */
+void run_persistent(enum FuzzTarget target, const char *filename) {
+    uint32_t message = 0;
+    if (write(FORKSRV_FD + 1, &message, 4) != 4) {
+        // Not started by afl-fuzz, run the input once
+        harness_run(target, input, read_input(filename));
+        return;
+    }
+
+    pid_t child = -1;
+    int child_stopped = 0;
+    while (1) {
+        uint32_t was_killed;
+        if (read(FORKSRV_FD, &was_killed, 4) != 4) {
+            if (child_stopped) {
+                kill(child, SIGKILL);
+            }
+            exit(0);
+        }
+        if (child_stopped && was_killed) {
+            child_stopped = 0;
+            waitpid(child, NULL, 0);
+        }
+
+        if (!child_stopped) {
+            child = fork();
+            if (child < 0) {
+                exit(1);
+            }
+            if (child == 0) {
+                close(FORKSRV_FD);
+                close(FORKSRV_FD + 1);
+                for (int i = 0; i < PERSISTENT_ITERATIONS; i++) {
+                    if (i > 0) {
+                        raise(SIGSTOP);
+                    }
+                    coverage_reset();
+                    harness_run(target, input, read_input(filename));
+                }
+                exit(0);
+            }
+        } else {
+            kill(child, SIGCONT);
+            child_stopped = 0;
+        }
+
+        int status;
+        if (write(FORKSRV_FD + 1, &child, 4) != 4 ||
+            waitpid(child, &status, WUNTRACED) < 0) {
+            exit(1);
+        }
+        if (WIFSTOPPED(status)) {
+            child_stopped = 1;
+        }
+        if (write(FORKSRV_FD + 1, &status, 4) != 4) {
+            exit(1);
+        }
+    }
+}
+
+void run_replay(enum FuzzTarget target, char **filenames, int count,
+                int repeat) {
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    long runs = 0;
+    for (int i = 0; i < count; i++) {
+        size_t size = read_input(filenames[i]);
+        int rejected = 0;
+        for (int r = 0; r < repeat; r++) {
+            rejected = harness_run(target, input, size);
+            runs++;
+        }
+        fprintf(stderr, "%s: %s\n", filenames[i],
+                rejected ? "rejected" : "accepted");
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%ld runs, %.0f execs/s, %u map entries hit\n", runs,
+            seconds > 0 ? runs / seconds : 0.0, coverage_count());
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2 || strcmp(argv[1], "--help") == 0) {
+        print_help();
+    }
+
+    enum FuzzTarget target;
+    if (strcmp(argv[1], "vm") == 0) {
+        target = FuzzTargetVm;
+    } else if (strcmp(argv[1], "asm") == 0) {
+        target = FuzzTargetAsm;
+    } else if (strcmp(argv[1], "cache") == 0) {
+        target = FuzzTargetCache;
+    } else {
+        fprintf(stderr, "`%s` is not a valid target, see `--help`\n", argv[1]);
+        exit(1);
+    }
+
+    int repeat = 1;
+    char **filenames = calloc(argc, sizeof(char *));
+    int count = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--help") == 0) {
+            print_help();
+        } else if (strcmp(argv[i], "--repeat") == 0 && i + 1 < argc) {
+            repeat = atoi(argv[++i]);
+        } else {
+            filenames[count++] = argv[i];
+        }
+    }
+
+    int shared = coverage_init();
+    harness_init();
+
+    if (shared) {
+        run_persistent(target, count > 0 ? filenames[0] : NULL);
+    } else if (count > 0) {
+        run_replay(target, filenames, count, repeat);
+    } else {
+        harness_run(target, input, read_input(NULL));
+    }
+
+    free(filenames);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../../assembler/src/arena.h"
+#include "../../assembler/src/code_generation.h"
+#include "../../assembler/src/layout.h"
+#include "../../assembler/src/object.h"
+#include "../../assembler/src/optimize.h"
+#include "../../assembler/src/parallel.h"
+#include "../../assembler/src/parser.h"
+
+void print_help() {
+    printf("Link am4 objects made with `am4asm -c` into a binary\n");
+    printf("\n");
+    printf("Usage: am4ld [OPTIONS] <OBJECT>...\n");
+    printf("\n");
+    printf("The binary is the same as am4asm makes of the sources of the\n");
+    printf("objects, in the same order. It starts at the first object.\n");
+    printf("\n");
+    printf("Arguments\n");
+    printf("    --help           -- Print this message\n");
+    printf("    --out <FILE>     -- Name of the binary, out.bin (default)\n");
+    printf("    --threads <N>    -- Threads for generating big binaries, 0 "
+           "(default)\n");
+    printf("                        uses every processor\n");
+    printf("    -O<N>            -- Optimize the program, N is 0 (default), 1 "
+           "or 2\n");
+    printf("    --profile <FILE> -- Lay the program out along a profile from "
+           "`am4vm\n");
+    printf("                        --profile`, made with the binary the same "
+           "options give\n");
+    exit(0);
+}
+
+int main(int argc, char **argv) {
+    char *output = "out.bin";
+    char *profile = NULL;
+    int optimization_level = 0;
+    int threads = 0;
+    char **objects = malloc(argc * sizeof(char *));
+    int objects_len = 0;
+    if (objects == NULL) {
+        fprintf(stderr, "Failed to do a heap allocation\n");
+        exit(1);
+    }
+
+    for (int i = 1; i < argc; i++) {
+        char *end;
+        if (strcmp(argv[i], "--help") == 0) {
+            print_help();
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+            profile = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            long value = strtol(argv[++i], &end, 10);
+            if (argv[i][0] == '\0' || *end != '\0' || value < 0 ||
+                value > INT_MAX) {
+                fprintf(stderr, "`--threads` needs a number of threads, see "
+                                "`--help` for more info\n");
+                exit(1);
+            }
+            threads = value;
+        } else if (strncmp(argv[i], "-O", 2) == 0) {
+            long level = strtol(argv[i] + 2, &end, 10);
+            if (argv[i][2] == '\0' || *end != '\0' || level < 0 ||
+                level > OPTIMIZATION_LEVEL_MAX) {
+                fprintf(stderr,
+                        "`%s` is not a valid optimization level, see `--help` "
+                        "for more info\n",
+                        argv[i]);
+                exit(1);
+            }
+            optimization_level = level;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr,
+                    "`%s` is not a valid argument, see `--help` for more "
+                    "info\n",
+                    argv[i]);
+            exit(1);
+        } else {
+            objects[objects_len++] = argv[i];
+        }
+    }
+    if (objects_len == 0) {
+        fprintf(stderr, "No objects, see `--help` for more info\n");
+        exit(1);
+    }
+
+    // Everything the link allocates goes at once at the end
+    struct Arena arena = arena_new();
+    struct ParseResult result = object_read(objects[0], &arena);
+    for (int i = 1; i < objects_len; i++) {
+        struct ParseResult part = object_read(objects[i], &arena);
+        parse_result_append(&result, &part);
+    }
+    // The objects are not optimized, so the whole program is
+    optimize(&result, optimization_level);
+    if (profile != NULL) {
+        layout_with_profile(&result, profile, &arena);
+    }
+    struct Binary binary = generate_binary_parallel(result, threads);
+    write_binary_to_file(&binary, &result, output);
+    arena_destroy(&arena);
+    free(objects);
+
+    return 0;
+}
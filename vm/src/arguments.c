@@ -1,5 +1,6 @@
 #include "arguments.h"
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -10,7 +11,21 @@ void print_help() {
     printf("Usage: am4vm [OPTIONS] <FILENAME>\n");
     printf("\n");
     printf("Arguments\n");
-    printf("    --help  -- Print this message\n");
+    printf("    --help              -- Print this message\n");
+    printf("    --cache-dir <DIR>   -- Directory of the decoded code cache\n");
+    printf("    --no-cache          -- Do not read or write the code cache\n");
+    printf("    --serve <SOCKET>    -- Serve jobs on a unix socket\n");
+    printf("    --workers <N>       -- Number of server workers\n");
+    printf("    --max-jobs <N>      -- Jobs a worker runs before it is "
+           "recycled\n");
+    printf("    --connect <SOCKET>  -- Run <FILENAME> on an am4vm server\n");
+    printf("    --simd <LEVEL>      -- auto, scalar, sse2 or avx2\n");
+    printf("    --pipeline <A,B,..> -- Run binaries as connected stages\n");
+    printf("    --threads <N>       -- Host threads running spawned threads\n");
+    printf("    --profile <FILE>    -- Write how often every instruction "
+           "ran\n");
+    printf("    --lines <FILE>      -- Write how often every source line "
+           "ran\n");
     exit(0);
 }
 
@@ -23,14 +38,75 @@ bool str_starts_with(char *str, char *pattern) {
     return !*pattern;
 }
 
+char *option_value(int argc, char **argv, int *i) {
+    char *option = argv[*i];
+    (*i)++;
+    if (*i >= argc) {
+        fprintf(stderr, "`%s` needs an argument, see `--help` for more info\n",
+                option);
+        exit(1);
+    }
+    return argv[*i];
+}
+
+int option_positive_int(int argc, char **argv, int *i) {
+    char *option = argv[*i];
+    char *value = option_value(argc, argv, i);
+    char *end;
+    long n = strtol(value, &end, 10);
+    if (*end || n <= 0 || n > INT32_MAX) {
+        fprintf(stderr, "`%s` expects a positive integer, found `%s`\n",
+                option, value);
+        exit(1);
+    }
+    return n;
+}
+
 struct Arguments arguments_parse(int argc, char **argv) {
     // Skip the run command
-    struct Arguments args = {.input = NULL};
+    struct Arguments args = {.input = NULL,
+                             .cache_dir = NULL,
+                             .no_cache = false,
+                             .serve = NULL,
+                             .connect = NULL,
+                             .workers = 0,
+                             .max_jobs = 1000,
+                             .simd = SimdAuto,
+                             .pipeline = NULL,
+                             .threads = 0,
+                             .profile = NULL,
+                             .lines = NULL};
 
     for (int i = 1; i < argc; i++) {
         if (str_starts_with(argv[i], "--")) {
             if (strcmp(argv[i], "--help") == 0) {
                 print_help();
+            } else if (strcmp(argv[i], "--cache-dir") == 0) {
+                args.cache_dir = option_value(argc, argv, &i);
+            } else if (strcmp(argv[i], "--no-cache") == 0) {
+                args.no_cache = true;
+            } else if (strcmp(argv[i], "--serve") == 0) {
+                args.serve = option_value(argc, argv, &i);
+            } else if (strcmp(argv[i], "--connect") == 0) {
+                args.connect = option_value(argc, argv, &i);
+            } else if (strcmp(argv[i], "--workers") == 0) {
+                args.workers = option_positive_int(argc, argv, &i);
+            } else if (strcmp(argv[i], "--max-jobs") == 0) {
+                args.max_jobs = option_positive_int(argc, argv, &i);
+            } else if (strcmp(argv[i], "--threads") == 0) {
+                args.threads = option_positive_int(argc, argv, &i);
+            } else if (strcmp(argv[i], "--profile") == 0) {
+                args.profile = option_value(argc, argv, &i);
+            } else if (strcmp(argv[i], "--lines") == 0) {
+                args.lines = option_value(argc, argv, &i);
+            } else if (strcmp(argv[i], "--pipeline") == 0) {
+                args.pipeline = option_value(argc, argv, &i);
+            } else if (strcmp(argv[i], "--simd") == 0) {
+                char *level = option_value(argc, argv, &i);
+                if (simd_level_parse(level, &args.simd) != 0) {
+                    fprintf(stderr, "`%s` is not a valid simd level\n", level);
+                    exit(1);
+                }
             } else {
                 fprintf(stderr,
                         "`%s` is not a valid argument, see `--help` for more "
@@ -47,15 +123,32 @@ struct Arguments arguments_parse(int argc, char **argv) {
             }
         }
     }
-    if (args.input == NULL) {
+    if (args.input == NULL && args.serve == NULL && args.pipeline == NULL) {
         fprintf(stderr, "No input files, see `--help` for more info\n");
         exit(1);
     }
+    if ((args.profile != NULL || args.lines != NULL) &&
+        (args.serve != NULL || args.connect != NULL || args.pipeline != NULL)) {
+        fprintf(stderr, "`--profile` and `--lines` profile a single local run, "
+                        "see `--help` for more info\n");
+        exit(1);
+    }
     return args;
 }
 
 void arguments_print(struct Arguments args) {
     printf("struct Arguments {\n");
     printf("  .input = \"%s\",\n", args.input);
+    printf("  .cache_dir = \"%s\",\n", args.cache_dir);
+    printf("  .no_cache = %s,\n", args.no_cache ? "true" : "false");
+    printf("  .serve = \"%s\",\n", args.serve);
+    printf("  .connect = \"%s\",\n", args.connect);
+    printf("  .workers = %d,\n", args.workers);
+    printf("  .max_jobs = %d,\n", args.max_jobs);
+    printf("  .simd = %d,\n", args.simd);
+    printf("  .pipeline = \"%s\",\n", args.pipeline);
+    printf("  .threads = %d,\n", args.threads);
+    printf("  .profile = \"%s\",\n", args.profile);
+    printf("  .lines = \"%s\",\n", args.lines);
     printf("}\n");
 }
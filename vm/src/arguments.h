@@ -1,8 +1,29 @@
 #pragma once
+#include "simd.h"
 #include <stdbool.h>
 
 struct Arguments {
     char *input;
+    // NULL means the default cache directory
+    char *cache_dir;
+    bool no_cache;
+    // Unix socket to serve on, see server.h
+    char *serve;
+    // Unix socket of a server to run input on
+    char *connect;
+    // 0 means one worker per online cpu
+    int workers;
+    int max_jobs;
+    // Highest instruction set extension of the bulk memory kernels
+    enum SimdLevel simd;
+    // Comma separated binaries to run as a pipeline, see pipeline.h
+    char *pipeline;
+    // Host threads running guest threads, 0 means one per online cpu
+    int threads;
+    // File the execution profile of the run is written to, see profile.h
+    char *profile;
+    // File the line profile of the run is written to, see profile.h
+    char *lines;
 };
 
 /**
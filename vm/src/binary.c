@@ -1,6 +1,219 @@
 #include "binary.h"
+#include "error.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#define HEADER_SIZE (2 * sizeof(uint32_t))
+
+#define FNV_OFFSET_BASIS 0xcbf29ce484222325ULL
+#define FNV_PRIME 0x100000001b3ULL
+
+uint64_t hash_bytes(const uint8_t *bytes, size_t len) {
+    uint64_t hash = FNV_OFFSET_BASIS;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// CRC-32 of every nibble, for the reversed polynomial 0xedb88320
+const uint32_t binary_crc_nibbles[16] = {
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4,
+    0x4db26158, 0x5005713c, 0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c,
+    0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+};
+
+uint32_t crc32(const uint8_t *bytes, size_t len) {
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 0; i < len; i++) {
+        crc = (crc >> 4) ^ binary_crc_nibbles[(crc ^ bytes[i]) & 0xf];
+        crc = (crc >> 4) ^ binary_crc_nibbles[(crc ^ (bytes[i] >> 4)) & 0xf];
+    }
+    return ~crc;
+}
+
+bool read_varint(const uint8_t *bytes, size_t size, size_t *position,
+                 uint64_t *value) {
+    *value = 0;
+    for (unsigned shift = 0; shift < 64; shift += 7) {
+        if (*position >= size) {
+            return false;
+        }
+        uint8_t byte = bytes[(*position)++];
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) {
+            return true;
+        }
+    }
+    return false;
+}
+
+struct BinaryFile *binary_malformed(struct BinaryFile *file, const char *name,
+                                    const char *problem) {
+    if (!vm_error_quiet) {
+        fprintf(stderr, "%s %s\n", name, problem);
+    }
+    free(file->memory);
+    free(file->text);
+    free(file->debug);
+    free(file);
+    return NULL;
+}
+
+/**
+ * Find the only section of a type
+ *
+ * @returns false if there is none, or more than one
+ */
+bool binary_section(const uint8_t *contents, struct BinaryHeader *header,
+                    uint32_t type, struct BinarySection *section) {
+    bool found = false;
+    for (uint32_t i = 0; i < header->sections_len; i++) {
+        struct BinarySection entry;
+        memcpy(&entry, contents + header->table + i * sizeof(entry),
+               sizeof(entry));
+        if (entry.type == type) {
+            if (found) {
+                return false;
+            }
+            *section = entry;
+            found = true;
+        }
+    }
+    return found;
+}
+
+/**
+ * The data section is copied into memory, the text section is kept as it is
+ * for decode_program
+ */
+struct BinaryFile *binary_from_v2(const uint8_t *contents, size_t size,
+                                  const char *name) {
+    struct BinaryFile *file = calloc(1, sizeof(struct BinaryFile));
+    struct BinaryHeader header;
+    if (size < sizeof(header)) {
+        return binary_malformed(file, name, "has a malformed header");
+    }
+    memcpy(&header, contents, sizeof(header));
+    if (header.version != BINARY_VERSION) {
+        return binary_malformed(file, name,
+                                "is of a version this vm can not run");
+    }
+    if (crc32(contents + sizeof(header), size - sizeof(header)) !=
+        header.crc) {
+        return binary_malformed(file, name, "is corrupted, its crc is wrong");
+    }
+    size_t table_size =
+        (size_t)header.sections_len * sizeof(struct BinarySection);
+    if (header.table < sizeof(header) || header.table > size ||
+        table_size > size - header.table) {
+        return binary_malformed(file, name, "has a malformed section table");
+    }
+    for (uint32_t i = 0; i < header.sections_len; i++) {
+        struct BinarySection entry;
+        memcpy(&entry, contents + header.table + i * sizeof(entry),
+               sizeof(entry));
+        if (entry.offset < sizeof(header) || entry.offset > header.table ||
+            entry.size > header.table - entry.offset) {
+            return binary_malformed(file, name,
+                                    "has a section out of the file");
+        }
+    }
+
+    struct BinarySection data = {0};
+    struct BinarySection text = {0};
+    if (!binary_section(contents, &header, SectionData, &data) ||
+        !binary_section(contents, &header, SectionText, &text)) {
+        return binary_malformed(file, name,
+                                "needs exactly one data and text section");
+    }
+
+    if (data.size < sizeof(uint32_t) || data.size % sizeof(uint32_t) != 0) {
+        return binary_malformed(file, name, "has a malformed data section");
+    }
+    size_t initialized = data.size / sizeof(uint32_t) - 1;
+    memcpy(&file->start_addr, contents + data.offset, sizeof(uint32_t));
+    if (initialized > file->start_addr) {
+        return binary_malformed(file, name, "has a malformed data section");
+    }
+
+    // Every instruction takes at least a byte, so a small file can not ask
+    // for a lot of memory
+    size_t position = 0;
+    uint64_t text_len;
+    if (!read_varint(contents + text.offset, text.size, &position,
+                     &text_len) ||
+        text_len > text.size - position ||
+        text_len > UINT32_MAX - file->start_addr) {
+        return binary_malformed(file, name, "has a malformed text section");
+    }
+    file->total_size = file->start_addr + text_len;
+
+    file->memory = calloc(file->total_size, sizeof(uint32_t));
+    file->text_size = text.size - position;
+    file->text = malloc(file->text_size + 1);
+    if ((file->memory == NULL && file->total_size > 0) || file->text == NULL) {
+        return binary_malformed(file, name, "does not fit in memory");
+    }
+    memcpy(file->memory, contents + data.offset + sizeof(uint32_t),
+           initialized * sizeof(uint32_t));
+    memcpy(file->text, contents + text.offset + position, file->text_size);
+
+    // Only the profiler reads the line table, it is checked then
+    struct BinarySection debug;
+    if (binary_section(contents, &header, SectionDebug, &debug)) {
+        file->debug_size = debug.size;
+        file->debug = malloc(debug.size + 1);
+        if (file->debug == NULL) {
+            return binary_malformed(file, name, "does not fit in memory");
+        }
+        memcpy(file->debug, contents + debug.offset, debug.size);
+    }
+    file->hash = hash_bytes(contents, size);
+
+    return file;
+}
+
+struct BinaryFile *binary_from_bytes(const uint8_t *contents, size_t size,
+                                     const char *name) {
+    uint32_t magic;
+    if (size >= sizeof(magic)) {
+        memcpy(&magic, contents, sizeof(magic));
+        if (magic == BINARY_MAGIC) {
+            return binary_from_v2(contents, size, name);
+        }
+    }
+
+    if (size < HEADER_SIZE) {
+        if (!vm_error_quiet) {
+            fprintf(stderr, "%s is too small to be an am4 binary\n", name);
+        }
+        return NULL;
+    }
+
+    struct BinaryFile *file = calloc(1, sizeof(struct BinaryFile));
+
+    memcpy(&file->start_addr, contents, sizeof(uint32_t));
+    memcpy(&file->total_size, contents + sizeof(uint32_t), sizeof(uint32_t));
+
+    size_t memory_size = (size_t)file->total_size * sizeof(uint32_t);
+    if (file->start_addr > file->total_size ||
+        memory_size != size - HEADER_SIZE) {
+        if (!vm_error_quiet) {
+            fprintf(stderr, "%s has a malformed header\n", name);
+        }
+        free(file);
+        return NULL;
+    }
+
+    file->memory = calloc(file->total_size, sizeof(uint32_t));
+    memcpy(file->memory, contents + HEADER_SIZE, memory_size);
+    file->hash = hash_bytes(contents, size);
+
+    return file;
+}
 
 struct BinaryFile *read_binary_file(char *filename) {
     FILE *fptr;
@@ -11,21 +224,40 @@ struct BinaryFile *read_binary_file(char *filename) {
         exit(1);
     }
 
-    struct BinaryFile *file = calloc(1, sizeof(struct BinaryFile));
-
-    fread(&file->start_addr, sizeof(uint32_t), 1, fptr);
-
-    fread(&file->total_size, sizeof(uint32_t), 1, fptr);
-
-    file->memory = calloc(file->total_size, sizeof(uint32_t));
-    fread(file->memory, sizeof(uint32_t), file->total_size, fptr);
+    if (fseek(fptr, 0, SEEK_END) != 0) {
+        perror("Error reading file");
+        exit(1);
+    }
+    long file_size = ftell(fptr);
+    rewind(fptr);
+    if (file_size < 0) {
+        perror("Error reading file");
+        exit(1);
+    }
 
+    uint8_t *contents = malloc(file_size + 1);
+    if (contents == NULL) {
+        fprintf(stderr, "Failed to do a heap allocation\n");
+        exit(1);
+    }
+    if (fread(contents, 1, file_size, fptr) != (size_t)file_size) {
+        fprintf(stderr, "Failed to read %s\n", filename);
+        exit(1);
+    }
     fclose(fptr);
 
+    struct BinaryFile *file = binary_from_bytes(contents, file_size, filename);
+    free(contents);
+    if (file == NULL) {
+        exit(1);
+    }
+
     return file;
 }
 
 void free_binary_file(struct BinaryFile *bin) {
     free(bin->memory);
+    free(bin->text);
+    free(bin->debug);
     free(bin);
 }
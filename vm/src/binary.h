@@ -1,12 +1,95 @@
 #pragma once
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
+// "AM4B" in a little endian word, the first word of a version 2 binary
+#define BINARY_MAGIC 0x42344d41
+
+#define BINARY_VERSION 2
+
+/**
+ * A version 1 binary is the start of the text section and the size of memory,
+ * followed by all of memory.
+ *
+ * A version 2 binary is a header, its sections and a table of the sections.
+ * The crc is the CRC-32 of every byte after the header. Sections of a type
+ * the vm does not know are skipped, see assembler/src/format.h for what is
+ * in them.
+ */
+struct BinaryHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t crc;
+    uint32_t sections_len;
+    // Offset of the section table
+    uint32_t table;
+};
+
+enum BinarySectionType {
+    SectionData = 1,
+    SectionText = 2,
+    SectionSymbols = 3,
+    SectionDebug = 4,
+};
+
+struct BinarySection {
+    uint32_t type;
+    uint32_t offset;
+    uint32_t size;
+};
+
 struct BinaryFile {
     uint32_t start_addr;
     uint32_t total_size;
     uint32_t *memory;
+    // FNV-1a hash of the file contents, used as the code cache key
+    uint64_t hash;
+    // Text section of a version 2 binary, NULL for version 1. The text of
+    // memory is zero until decode_program expands it.
+    uint8_t *text;
+    size_t text_size;
+    // Line table of a version 2 binary, NULL if it has none
+    uint8_t *debug;
+    size_t debug_size;
 };
 
+/**
+ * Read an am4 binary from disk
+ *
+ * @note Exits if the file can not be read or is truncated
+ *
+ * @param filename
+ *
+ * @returns struct BinaryFile*
+ */
 struct BinaryFile *read_binary_file(char *filename);
 
+/**
+ * Parse an am4 binary that is already in memory, of either version
+ *
+ * @note The memory image is copied, contents can be unmapped afterwards
+ *
+ * @param contents
+ * @param size Size of contents in bytes
+ * @param name Used in error messages
+ *
+ * @returns struct BinaryFile*, or NULL if the binary is malformed
+ */
+struct BinaryFile *binary_from_bytes(const uint8_t *contents, size_t size,
+                                     const char *name);
+
+/**
+ * Read a LEB128 varint
+ *
+ * @param bytes
+ * @param size
+ * @param position Where the varint starts, moved past it
+ * @param value
+ *
+ * @returns false if the varint runs past size or over 64 bits
+ */
+bool read_varint(const uint8_t *bytes, size_t size, size_t *position,
+                 uint64_t *value);
+
 void free_binary_file(struct BinaryFile *bin);
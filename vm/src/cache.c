@@ -0,0 +1,193 @@
+#include "cache.h"
+#include "vm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "AM4D"
+#define CACHE_FORMAT_VERSION 1
+#define MAX_PATH_SIZE 4096
+
+struct CacheHeader {
+    char magic[4];
+    uint32_t format_version;
+    char vm_version[16];
+    uint64_t hash;
+    uint32_t start_addr;
+    uint32_t total_size;
+    uint32_t len;
+    uint32_t reserved;
+};
+
+char *cache_default_dir() {
+    char path[MAX_PATH_SIZE];
+    char *xdg_cache = getenv("XDG_CACHE_HOME");
+    char *home = getenv("HOME");
+    if (xdg_cache != NULL && *xdg_cache) {
+        snprintf(path, MAX_PATH_SIZE, "%s/am4vm", xdg_cache);
+    } else if (home != NULL && *home) {
+        snprintf(path, MAX_PATH_SIZE, "%s/.cache/am4vm", home);
+    } else {
+        return NULL;
+    }
+    return strdup(path);
+}
+
+/**
+ * The key covers both the binary and the vm that decoded it, so an upgraded
+ * vm never picks up stale entries
+ */
+uint64_t cache_key(struct BinaryFile *bin) {
+    uint64_t key = bin->hash;
+    for (const char *c = AM4VM_VERSION; *c; c++) {
+        key ^= (uint8_t)*c;
+        key *= 0x100000001b3ULL;
+    }
+    return key;
+}
+
+void cache_entry_path(const char *dir, struct BinaryFile *bin, char *path) {
+    snprintf(path, MAX_PATH_SIZE, "%s/%016llx.am4d", dir,
+             (unsigned long long)cache_key(bin));
+}
+
+/**
+ * mkdir -p
+ */
+int make_dirs(const char *dir) {
+    char path[MAX_PATH_SIZE];
+    snprintf(path, MAX_PATH_SIZE, "%s", dir);
+    for (char *c = path + 1; *c; c++) {
+        if (*c == '/') {
+            *c = '\0';
+            if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+                return -1;
+            }
+            *c = '/';
+        }
+    }
+    if (mkdir(path, 0755) != 0 && errno != EEXIST) {
+        return -1;
+    }
+    return 0;
+}
+
+void cache_header_fill(struct CacheHeader *header, struct BinaryFile *bin,
+                       struct Program *program) {
+    memset(header, 0, sizeof(struct CacheHeader));
+    memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+    header->format_version = CACHE_FORMAT_VERSION;
+    strncpy(header->vm_version, AM4VM_VERSION, sizeof(header->vm_version));
+    header->hash = bin->hash;
+    header->start_addr = bin->start_addr;
+    header->total_size = bin->total_size;
+    header->len = program->len;
+}
+
+struct Program *cache_load(const char *dir, struct BinaryFile *bin) {
+    char path[MAX_PATH_SIZE];
+    cache_entry_path(dir, bin, path);
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+
+    struct stat st;
+    size_t len = bin->total_size - bin->start_addr;
+    size_t expected_size =
+        sizeof(struct CacheHeader) + len * sizeof(struct DecodedInstruction);
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size != expected_size) {
+        close(fd);
+        return NULL;
+    }
+
+    void *mapping = mmap(NULL, expected_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) {
+        return NULL;
+    }
+
+    struct Program expected = {.len = len};
+    struct CacheHeader header;
+    cache_header_fill(&header, bin, &expected);
+    if (memcmp(mapping, &header, sizeof(struct CacheHeader)) != 0) {
+        munmap(mapping, expected_size);
+        return NULL;
+    }
+
+    struct Program *program = calloc(1, sizeof(struct Program));
+    program->len = len;
+    program->code = (struct DecodedInstruction *)((char *)mapping +
+                                                  sizeof(struct CacheHeader));
+    program->mapping = mapping;
+    program->mapping_size = expected_size;
+
+    // The header only says which binary the entry claims to be for, the
+    // entry itself may be corrupted or crafted to collide with the hash
+    if (!check_program(bin, program)) {
+        free_program(program);
+        return NULL;
+    }
+    return program;
+}
+
+void cache_store(const char *dir, struct BinaryFile *bin,
+                 struct Program *program) {
+    if (make_dirs(dir) != 0) {
+        return;
+    }
+
+    char path[MAX_PATH_SIZE];
+    char tmp_path[MAX_PATH_SIZE + 32];
+    cache_entry_path(dir, bin, path);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+
+    FILE *fptr = fopen(tmp_path, "wb");
+    if (fptr == NULL) {
+        return;
+    }
+
+    struct CacheHeader header;
+    cache_header_fill(&header, bin, program);
+    bool ok = fwrite(&header, sizeof(struct CacheHeader), 1, fptr) == 1 &&
+              fwrite(program->code, sizeof(struct DecodedInstruction),
+                     program->len, fptr) == program->len;
+    ok = fclose(fptr) == 0 && ok;
+
+    // rename is atomic, readers see either no entry or a complete one
+    if (!ok || rename(tmp_path, path) != 0) {
+        unlink(tmp_path);
+    }
+}
+
+struct Program *load_program(struct Arguments *args, struct BinaryFile *bin) {
+    // Expanding a compact text section is no slower than reading a cache
+    // entry, and fills in the text of memory that an entry leaves out
+    if (args->no_cache || bin->text != NULL) {
+        return decode_program(bin);
+    }
+
+    char *cache_dir =
+        args->cache_dir != NULL ? args->cache_dir : cache_default_dir();
+    if (cache_dir == NULL) {
+        return decode_program(bin);
+    }
+
+    struct Program *program = cache_load(cache_dir, bin);
+    if (program == NULL) {
+        program = decode_program(bin);
+        cache_store(cache_dir, bin, program);
+    }
+
+    if (cache_dir != args->cache_dir) {
+        free(cache_dir);
+    }
+    return program;
+}
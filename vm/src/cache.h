@@ -0,0 +1,53 @@
+#pragma once
+
+#include "arguments.h"
+#include "binary.h"
+#include "decode.h"
+
+/**
+ * Get the default code cache directory
+ *
+ * @note $XDG_CACHE_HOME/am4vm, falling back to $HOME/.cache/am4vm
+ *
+ * @returns A heap allocated path, or NULL if neither variable is set
+ */
+char *cache_default_dir();
+
+/**
+ * Look up the decoded program of a binary in the code cache
+ *
+ * @note The returned program is mmap'd directly from the cache file. Every
+ * instruction is checked before it is returned, an entry that fails is a
+ * miss.
+ *
+ * @param dir Cache directory
+ * @param bin
+ *
+ * @returns struct Program*, or NULL on a cache miss
+ */
+struct Program *cache_load(const char *dir, struct BinaryFile *bin);
+
+/**
+ * Store a decoded program in the code cache
+ *
+ * @note Failures are silently ignored, the cache is only an optimization.
+ * The file is written under a temporary name and renamed into place, so
+ * concurrent writers never expose a partially written entry.
+ *
+ * @param dir Cache directory
+ * @param bin
+ * @param program
+ */
+void cache_store(const char *dir, struct BinaryFile *bin,
+                 struct Program *program);
+
+/**
+ * Get the decoded program of a binary, going through the code cache unless
+ * it is disabled by the arguments or the binary is of version 2
+ *
+ * @param args
+ * @param bin
+ *
+ * @returns struct Program*
+ */
+struct Program *load_program(struct Arguments *args, struct BinaryFile *bin);
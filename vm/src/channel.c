@@ -0,0 +1,139 @@
+#include "channel.h"
+#include "error.h"
+#include <sched.h>
+#include <stdlib.h>
+
+// Values sent or received before the position is published
+#define BATCH_SIZE 64
+
+// Busy waits before giving the cpu away
+#define SPIN_LIMIT 1024
+
+_Thread_local struct Channel *vm_channel_in = NULL;
+_Thread_local struct Channel *vm_channel_out = NULL;
+
+struct Channel *channel_new(size_t capacity) {
+    size_t size = (sizeof(struct Channel) + CACHE_LINE_SIZE - 1) /
+                  CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+    struct Channel *channel = aligned_alloc(CACHE_LINE_SIZE, size);
+    if (channel == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+
+    // A full batch has to fit, or the producer could wait on itself
+    size_t rounded = BATCH_SIZE;
+    while (rounded < capacity) {
+        rounded *= 2;
+    }
+    channel->capacity = rounded;
+    channel->slots = calloc(rounded, sizeof(int32_t));
+    if (channel->slots == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+
+    atomic_init(&channel->head, 0);
+    atomic_init(&channel->tail, 0);
+    atomic_init(&channel->closed, false);
+    atomic_init(&channel->abandoned, false);
+    channel->write = 0;
+    channel->tail_cache = 0;
+    channel->read = 0;
+    channel->head_cache = 0;
+    return channel;
+}
+
+void channel_free(struct Channel *channel) {
+    free(channel->slots);
+    free(channel);
+}
+
+void channel_wait(int *spins) {
+    if (++*spins < SPIN_LIMIT) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+void channel_flush(struct Channel *channel) {
+    atomic_store_explicit(&channel->head, channel->write,
+                          memory_order_release);
+}
+
+bool channel_send(struct Channel *channel, int32_t value) {
+    if (channel->write - channel->tail_cache == channel->capacity) {
+        // The consumer can only make room for values it can see
+        channel_flush(channel);
+        int spins = 0;
+        for (;;) {
+            channel->tail_cache =
+                atomic_load_explicit(&channel->tail, memory_order_acquire);
+            if (channel->write - channel->tail_cache < channel->capacity) {
+                break;
+            }
+            if (atomic_load_explicit(&channel->abandoned,
+                                     memory_order_relaxed)) {
+                return false;
+            }
+            channel_wait(&spins);
+        }
+    }
+
+    channel->slots[channel->write & (channel->capacity - 1)] = value;
+    channel->write++;
+    if (channel->write % BATCH_SIZE == 0) {
+        channel_flush(channel);
+    }
+    return true;
+}
+
+bool channel_recv(struct Channel *channel, int32_t *value,
+                  struct Channel *out) {
+    if (channel->read == channel->head_cache) {
+        // Hand the slots back and pass on what is ready before waiting
+        atomic_store_explicit(&channel->tail, channel->read,
+                              memory_order_release);
+        if (out != NULL) {
+            channel_flush(out);
+        }
+
+        int spins = 0;
+        for (;;) {
+            channel->head_cache =
+                atomic_load_explicit(&channel->head, memory_order_acquire);
+            if (channel->read != channel->head_cache) {
+                break;
+            }
+            if (atomic_load_explicit(&channel->closed, memory_order_acquire)) {
+                // Values published right before closing
+                channel->head_cache =
+                    atomic_load_explicit(&channel->head, memory_order_acquire);
+                if (channel->read == channel->head_cache) {
+                    *value = 0;
+                    return false;
+                }
+                break;
+            }
+            channel_wait(&spins);
+        }
+    }
+
+    *value = channel->slots[channel->read & (channel->capacity - 1)];
+    channel->read++;
+    if (channel->read % BATCH_SIZE == 0) {
+        atomic_store_explicit(&channel->tail, channel->read,
+                              memory_order_release);
+    }
+    return true;
+}
+
+void channel_close(struct Channel *channel) {
+    channel_flush(channel);
+    atomic_store_explicit(&channel->closed, true, memory_order_release);
+}
+
+void channel_abandon(struct Channel *channel) {
+    atomic_store_explicit(&channel->abandoned, true, memory_order_relaxed);
+}
@@ -0,0 +1,110 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+/**
+ * Bounded ring of integers between exactly one producer and one consumer
+ * thread, see pipeline.h
+ *
+ * @note The producer and the consumer only publish their position every few
+ * values, so the shared cache lines do not bounce on every value
+ */
+struct Channel {
+    // Written by the producer
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t head;
+    // Next slot to write, ahead of head until it is published
+    size_t write;
+    // The last tail the producer saw, it only needs a fresh one when full
+    size_t tail_cache;
+
+    // Written by the consumer
+    _Alignas(CACHE_LINE_SIZE) atomic_size_t tail;
+    // Next slot to read, ahead of tail until it is published
+    size_t read;
+    // The last head the consumer saw, it only needs a fresh one when empty
+    size_t head_cache;
+
+    // Written once at the end of a stage
+    _Alignas(CACHE_LINE_SIZE) atomic_bool closed;
+    atomic_bool abandoned;
+
+    // Power of two
+    size_t capacity;
+    int32_t *slots;
+};
+
+/**
+ * Channels of the stage running on this thread, NULL outside of a pipeline
+ */
+extern _Thread_local struct Channel *vm_channel_in;
+extern _Thread_local struct Channel *vm_channel_out;
+
+/**
+ * Create a Channel
+ *
+ * @param capacity Rounded up to a power of two
+ *
+ * @returns struct Channel*
+ */
+struct Channel *channel_new(size_t capacity);
+
+void channel_free(struct Channel *channel);
+
+/**
+ * Send a value, waiting while the channel is full
+ *
+ * @note Producer only
+ *
+ * @param channel
+ * @param value
+ *
+ * @returns false if the consumer has finished and will never read it
+ */
+bool channel_send(struct Channel *channel, int32_t value);
+
+/**
+ * Publish every value sent so far
+ *
+ * @note Producer only
+ *
+ * @param channel
+ */
+void channel_flush(struct Channel *channel);
+
+/**
+ * Receive a value, waiting while the channel is empty
+ *
+ * @note Consumer only
+ *
+ * @param channel
+ * @param value Set to the value, or 0 once the channel is closed and drained
+ * @param out Flushed before waiting, so the next stage does not wait on
+ * values that are ready. May be NULL.
+ *
+ * @returns false once the channel is closed and drained
+ */
+bool channel_recv(struct Channel *channel, int32_t *value,
+                  struct Channel *out);
+
+/**
+ * Publish everything and tell the consumer nothing more will be sent
+ *
+ * @note Producer only
+ *
+ * @param channel
+ */
+void channel_close(struct Channel *channel);
+
+/**
+ * Tell the producer nothing more will be received
+ *
+ * @note Consumer only
+ *
+ * @param channel
+ */
+void channel_abandon(struct Channel *channel);
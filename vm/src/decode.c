@@ -0,0 +1,290 @@
+#include "decode.h"
+#include "error.h"
+#include "vm.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define ARG_MASK 0xffffff
+#define SIGN_BIT 0x800000
+#define SIGN_EXTEND 0xff000000
+
+__attribute__((noreturn)) void verify_error(struct Program *program,
+                                            uint32_t pc, const char *message,
+                                            int32_t value) {
+    free_program(program);
+    vm_error("error(pc %u): %s %d\n", pc, message, value);
+}
+
+/**
+ * @returns The instruction a wide form stands for, or 0 if opcode is not a
+ * wide form
+ */
+uint32_t narrow_opcode(uint32_t opcode) {
+    switch (opcode) {
+    case InstructionJmpW:
+        return InstructionJmp;
+    case InstructionJEQZW:
+        return InstructionJEQZ;
+    case InstructionJNEZW:
+        return InstructionJNEZ;
+    case InstructionCallW:
+        return InstructionCall;
+    case InstructionSpawnW:
+        return InstructionSpawn;
+    case InstructionPushK:
+        return InstructionPush;
+    case InstructionFetchW:
+        return InstructionFetch;
+    case InstructionStoreW:
+        return InstructionStore;
+    case InstructionPrintVW:
+        return InstructionPrintV;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * @returns true if the text section of a version 2 binary has an argument
+ * for opcode
+ */
+bool opcode_has_argument(uint32_t opcode) {
+    switch (opcode) {
+    case InstructionJmp:
+    case InstructionJEQZ:
+    case InstructionJNEZ:
+    case InstructionCall:
+    case InstructionSpawn:
+    case InstructionJmpW:
+    case InstructionJEQZW:
+    case InstructionJNEZW:
+    case InstructionCallW:
+    case InstructionSpawnW:
+    case InstructionPush:
+    case InstructionPushK:
+    case InstructionFetch:
+    case InstructionStore:
+    case InstructionFetchW:
+    case InstructionStoreW:
+    case InstructionPrintC:
+    case InstructionPrintV:
+    case InstructionPrintVW:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * @returns true if the argument of opcode is a text address
+ */
+bool opcode_is_jump(uint32_t opcode) {
+    switch (opcode) {
+    case InstructionJmp:
+    case InstructionJEQZ:
+    case InstructionJNEZ:
+    case InstructionCall:
+    case InstructionSpawn:
+        return true;
+    default:
+        return false;
+    }
+}
+
+enum InstructionCheck check_instruction(struct BinaryFile *bin,
+                                        struct DecodedInstruction instruction) {
+    switch (instruction.opcode) {
+    case InstructionJmp:
+    case InstructionJEQZ:
+    case InstructionJNEZ:
+    case InstructionCall:
+    case InstructionSpawn:
+        // Jumping to the very end of the binary halts the vm
+        if ((uint32_t)instruction.arg > bin->total_size - bin->start_addr) {
+            return InstructionBadJump;
+        }
+        return InstructionValid;
+    case InstructionFetch:
+    case InstructionStore:
+    case InstructionPrintV:
+        if (instruction.arg < 0 ||
+            (uint32_t)instruction.arg >= bin->total_size) {
+            return InstructionBadAddress;
+        }
+        return InstructionValid;
+    case InstructionNoop:
+    case InstructionRet:
+    case InstructionPush:
+    case InstructionAdd:
+    case InstructionSub:
+    case InstructionMul:
+    case InstructionDiv:
+    case InstructionMod:
+    case InstructionAnd:
+    case InstructionOr:
+    case InstructionXor:
+    case InstructionShl:
+    case InstructionShr:
+    case InstructionDup:
+    case InstructionSwap:
+    case InstructionOver:
+    case InstructionDrop:
+    case InstructionEq:
+    case InstructionLt:
+    case InstructionLe:
+    case InstructionGt:
+    case InstructionGe:
+    case InstructionLAnd:
+    case InstructionLOr:
+    case InstructionLNeg:
+    case InstructionPrintC:
+    case InstructionJoin:
+    case InstructionFAdd:
+    case InstructionCas:
+    case InstructionFence:
+    case InstructionRead:
+    case InstructionSend:
+    case InstructionRecv:
+    // Stack addressed, checked when they run
+    case InstructionFetchI:
+    case InstructionStoreI:
+    case InstructionFill:
+    case InstructionCopy:
+    case InstructionVAdd:
+    case InstructionSum:
+        return InstructionValid;
+    default:
+        // Wide forms never make it into a decoded program
+        return InstructionUnknown;
+    }
+}
+
+bool check_program(struct BinaryFile *bin, struct Program *program) {
+    if (program->len != bin->total_size - bin->start_addr) {
+        return false;
+    }
+    for (uint32_t i = 0; i < program->len; i++) {
+        if (check_instruction(bin, program->code[i]) != InstructionValid) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Verify an instruction and store it at index i of the program
+ */
+void decode_instruction(struct Program *program, struct BinaryFile *bin,
+                        uint32_t i, uint32_t opcode, int32_t op_arg) {
+    uint32_t pc = bin->start_addr + i;
+
+    // Wide forms load their argument from the constant pool once here,
+    // so they run as the plain instruction
+    if (narrow_opcode(opcode) != 0) {
+        if (op_arg < 0 || op_arg >= (int32_t)bin->start_addr) {
+            verify_error(program, pc, "constant pool entry out of bounds at",
+                         op_arg);
+        }
+        opcode = narrow_opcode(opcode);
+        op_arg = bin->memory[op_arg];
+    }
+
+    struct DecodedInstruction instruction = {.opcode = opcode, .arg = op_arg};
+    if (opcode_is_jump(opcode)) {
+        // Wraps around for targets before the text section, which are then
+        // out of range as well
+        instruction.arg = (int32_t)((uint32_t)op_arg - bin->start_addr);
+    }
+
+    switch (check_instruction(bin, instruction)) {
+    case InstructionValid:
+        break;
+    case InstructionBadJump:
+        verify_error(program, pc, "jump out of the text section to", op_arg);
+    case InstructionBadAddress:
+        verify_error(program, pc, "memory access out of bounds at", op_arg);
+    case InstructionUnknown:
+        free_program(program);
+        vm_error("error(pc %u): unknown operation %02x\n", pc, opcode);
+    }
+
+    program->code[i] = instruction;
+}
+
+struct Program *program_new(struct BinaryFile *bin) {
+    struct Program *program = calloc(1, sizeof(struct Program));
+    program->len = bin->total_size - bin->start_addr;
+    program->code = calloc(program->len, sizeof(struct DecodedInstruction));
+    if (program->code == NULL && program->len > 0) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+    return program;
+}
+
+/**
+ * Expand the compact text section of a version 2 binary, writing every
+ * instruction to memory as its version 1 word too
+ */
+struct Program *decode_compact(struct BinaryFile *bin) {
+    struct Program *program = program_new(bin);
+
+    size_t position = 0;
+    for (uint32_t i = 0; i < program->len; i++) {
+        uint32_t pc = bin->start_addr + i;
+        if (position >= bin->text_size) {
+            free_program(program);
+            vm_error("error(pc %u): the text section is truncated\n", pc);
+        }
+        uint32_t opcode = bin->text[position++];
+
+        uint64_t zigzag = 0;
+        if (opcode_has_argument(opcode) &&
+            !read_varint(bin->text, bin->text_size, &position, &zigzag)) {
+            free_program(program);
+            vm_error("error(pc %u): the text section is truncated\n", pc);
+        }
+        // The argument has to fit in the word of the instruction
+        if (zigzag > ARG_MASK) {
+            free_program(program);
+            vm_error("error(pc %u): argument does not fit in an instruction\n",
+                     pc);
+        }
+        int32_t op_arg = (int32_t)(zigzag >> 1) ^ -(int32_t)(zigzag & 1);
+
+        bin->memory[pc] = (opcode << 24) | (op_arg & ARG_MASK);
+        decode_instruction(program, bin, i, opcode, op_arg);
+    }
+    if (position != bin->text_size) {
+        free_program(program);
+        vm_error("error: the text section goes on after its last "
+                 "instruction\n");
+    }
+
+    return program;
+}
+
+struct Program *decode_program(struct BinaryFile *bin) {
+    if (bin->text != NULL) {
+        return decode_compact(bin);
+    }
+    struct Program *program = program_new(bin);
+
+    for (uint32_t i = 0; i < program->len; i++) {
+        uint32_t instruction = bin->memory[bin->start_addr + i];
+        int32_t op_arg = instruction & ARG_MASK;
+        op_arg = op_arg | ((op_arg & SIGN_BIT) ? SIGN_EXTEND : 0);
+        decode_instruction(program, bin, i, instruction >> 24, op_arg);
+    }
+
+    return program;
+}
+
+void free_program(struct Program *program) {
+    if (program->mapping != NULL) {
+        munmap(program->mapping, program->mapping_size);
+    } else {
+        free(program->code);
+    }
+    free(program);
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "binary.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A single instruction with its argument already extracted and sign
+ * extended. Jump targets are relative to the start of the text section.
+ *
+ * @note This layout is written to the code cache, keep it fixed size
+ */
+struct DecodedInstruction {
+    uint32_t opcode;
+    int32_t arg;
+};
+
+/**
+ * The decoded and verified text section of a binary
+ */
+struct Program {
+    uint32_t len;
+    struct DecodedInstruction *code;
+    // Set when code points into a cache file mapping instead of the heap
+    void *mapping;
+    size_t mapping_size;
+};
+
+/**
+ * Decode and verify the text section of a binary
+ *
+ * The compact text of a version 2 binary is expanded straight into the
+ * decoded form, and into memory as the words of version 1.
+ *
+ * @note Exits if the text section contains an unknown opcode or an out of
+ * bounds address
+ *
+ * @param bin
+ *
+ * @returns struct Program*
+ */
+struct Program *decode_program(struct BinaryFile *bin);
+
+enum InstructionCheck {
+    InstructionValid,
+    InstructionBadJump,
+    InstructionBadAddress,
+    InstructionUnknown,
+};
+
+/**
+ * Check that a decoded instruction is safe to run, the execute loop does not
+ * check opcodes or the bounds of jumps and direct memory accesses itself
+ *
+ * @param bin
+ * @param instruction
+ *
+ * @returns enum InstructionCheck
+ */
+enum InstructionCheck check_instruction(struct BinaryFile *bin,
+                                        struct DecodedInstruction instruction);
+
+/**
+ * Check every instruction of a program that was not decoded by this process,
+ * like one loaded from the code cache
+ *
+ * @param bin
+ * @param program
+ *
+ * @returns false if the program does not fit bin or any instruction is not
+ * safe to run
+ */
+bool check_program(struct BinaryFile *bin, struct Program *program);
+
+/**
+ * Free a Program, unmapping it if it was loaded from the code cache
+ *
+ * @param program
+ */
+void free_program(struct Program *program);
@@ -0,0 +1,21 @@
+#include "error.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+jmp_buf *vm_error_trap = NULL;
+bool vm_error_quiet = false;
+
+void vm_error(const char *format, ...) {
+    if (!vm_error_quiet) {
+        va_list args;
+        va_start(args, format);
+        vfprintf(stderr, format, args);
+        va_end(args);
+    }
+
+    if (vm_error_trap != NULL) {
+        longjmp(*vm_error_trap, 1);
+    }
+    exit(1);
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <setjmp.h>
+#include <stdbool.h>
+
+/**
+ * When set, vm_error longjmps here instead of exiting, so a program can be
+ * run without taking the whole process down
+ */
+extern jmp_buf *vm_error_trap;
+
+/**
+ * Do not print errors, used when errors are expected (fuzzing)
+ */
+extern bool vm_error_quiet;
+
+/**
+ * Report a runtime or verification error and stop the vm
+ *
+ * @note Exits unless vm_error_trap is set
+ *
+ * @param format printf style format string
+ */
+__attribute__((noreturn, format(printf, 1, 2))) void
+vm_error(const char *format, ...);
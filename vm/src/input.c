@@ -0,0 +1,225 @@
+#include "input.h"
+#include "error.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Pipes and terminals are read this much at a time
+#define BLOCK_SIZE (1 << 20)
+
+// INT32_MIN has 10 digits
+#define MAX_DIGITS 10
+
+_Thread_local int vm_input_fd = STDIN_FILENO;
+
+/**
+ * Either a mapping of a whole regular file, or a buffer that is refilled from
+ * a pipe
+ */
+struct Input {
+    bool opened;
+    bool mapped;
+    bool eof;
+    const char *data;
+    size_t pos;
+    size_t len;
+    // Only used when not mapped
+    char *buffer;
+    // Only used when mapped
+    size_t mapping_size;
+};
+
+static _Thread_local struct Input input = {.opened = false};
+
+void input_open() {
+    input = (struct Input){.opened = true};
+    if (vm_input_fd < 0) {
+        input.eof = true;
+        return;
+    }
+
+    struct stat st;
+    off_t offset = lseek(vm_input_fd, 0, SEEK_CUR);
+    if (fstat(vm_input_fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 &&
+        st.st_size > offset) {
+        void *mapping = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE,
+                             vm_input_fd, 0);
+        if (mapping != MAP_FAILED) {
+            madvise(mapping, st.st_size, MADV_SEQUENTIAL);
+            input.mapped = true;
+            input.eof = true;
+            input.data = mapping;
+            input.mapping_size = st.st_size;
+            input.pos = offset;
+            input.len = st.st_size;
+            return;
+        }
+    }
+
+    input.buffer = malloc(BLOCK_SIZE);
+    if (input.buffer == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+    input.data = input.buffer;
+}
+
+void input_reset() {
+    if (input.mapped) {
+        munmap((void *)input.data, input.mapping_size);
+    }
+    free(input.buffer);
+    input = (struct Input){.opened = false};
+}
+
+/**
+ * Move the unread bytes to the front of the buffer and read until it is full
+ * or the input ends
+ */
+void input_fill() {
+    size_t unread = input.len - input.pos;
+    memmove(input.buffer, input.buffer + input.pos, unread);
+    input.pos = 0;
+    input.len = unread;
+    while (!input.eof && input.len < BLOCK_SIZE) {
+        ssize_t n =
+            read(vm_input_fd, input.buffer + input.len, BLOCK_SIZE - input.len);
+        if (n <= 0) {
+            input.eof = true;
+        } else {
+            input.len += n;
+        }
+    }
+}
+
+bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+/**
+ * Number of leading digits in 8 bytes, checked all at once
+ */
+int swar_digit_count(uint64_t chunk) {
+    // A byte is a digit when both '0' <= c and c + 0x46 has no carry out
+    // of 0x7f, that is c <= '9'
+    uint64_t below = chunk - 0x3030303030303030ull;
+    uint64_t above = chunk + 0x4646464646464646ull;
+    uint64_t not_digit = (below | above) & 0x8080808080808080ull;
+    if (not_digit == 0) {
+        return 8;
+    }
+    return __builtin_ctzll(not_digit) / 8;
+}
+
+/**
+ * Value of 8 ascii digits, the first digit in the lowest byte
+ */
+uint32_t swar_parse_8(uint64_t chunk) {
+    // Combine pairs of digits, then pairs of pairs, then the two halves
+    chunk = ((chunk & 0x0f0f0f0f0f0f0f0full) * 2561) >> 8;
+    chunk = ((chunk & 0x00ff00ff00ff00ffull) * 6553601) >> 16;
+    return ((chunk & 0x0000ffff0000ffffull) * 42949672960001ull) >> 32;
+}
+
+/**
+ * Parse the digits starting at input.pos, which has to be a digit
+ *
+ * @returns The number of digits
+ */
+size_t parse_digits(uint64_t *value) {
+    size_t start = input.pos;
+    uint64_t result = 0;
+    // Bytes are read as little endian words
+    while (input.pos + 8 <= input.len &&
+           __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__) {
+        uint64_t chunk;
+        memcpy(&chunk, input.data + input.pos, sizeof(chunk));
+        int count = swar_digit_count(chunk);
+        if (count == 8) {
+            result = result * 100000000 + swar_parse_8(chunk);
+            input.pos += 8;
+            if (input.pos - start > MAX_DIGITS) {
+                break;
+            }
+            continue;
+        }
+        // Shift the digits to the top so the missing ones read as zeros
+        if (count > 0) {
+            uint64_t digits = chunk << (8 * (8 - count));
+            digits |= 0x3030303030303030ull >> (8 * count);
+            uint64_t scale = 1;
+            for (int i = 0; i < count; i++) {
+                scale *= 10;
+            }
+            result = result * scale + swar_parse_8(digits);
+            input.pos += count;
+        }
+        *value = result;
+        return input.pos - start;
+    }
+    while (input.pos < input.len && is_digit(input.data[input.pos]) &&
+           input.pos - start <= MAX_DIGITS) {
+        result = result * 10 + (input.data[input.pos] - '0');
+        input.pos++;
+    }
+    *value = result;
+    return input.pos - start;
+}
+
+/**
+ * Make sure n bytes are buffered, unless the input ends first
+ *
+ * @returns false if there are less than n bytes left
+ */
+bool input_available(size_t n) {
+    if (input.len - input.pos < n && !input.eof) {
+        input_fill();
+    }
+    return input.len - input.pos >= n;
+}
+
+bool input_read_int(int32_t *value) {
+    if (!input.opened) {
+        input_open();
+    }
+    *value = 0;
+
+    for (;;) {
+        while (input_available(1) && !is_digit(input.data[input.pos]) &&
+               input.data[input.pos] != '-') {
+            input.pos++;
+        }
+        if (!input_available(1)) {
+            return false;
+        }
+
+        // Buffer the longest number there is, so it is never split between
+        // two blocks
+        input_available(MAX_DIGITS + 2);
+        bool negative = input.data[input.pos] == '-';
+        if (negative) {
+            input.pos++;
+            if (!input_available(1) || !is_digit(input.data[input.pos])) {
+                // A lone `-` is not a number
+                continue;
+            }
+        }
+        // Leading zeros do not count towards the digits
+        while (input.data[input.pos] == '0' && input_available(2) &&
+               is_digit(input.data[input.pos + 1])) {
+            input.pos++;
+            input_available(MAX_DIGITS + 1);
+        }
+
+        uint64_t magnitude;
+        size_t digits = parse_digits(&magnitude);
+        if (digits > MAX_DIGITS ||
+            magnitude > (negative ? 2147483648ull : 2147483647ull)) {
+            vm_error("Input integer does not fit in 32 bits!\n");
+        }
+        *value = negative ? (int32_t)(0u - (uint32_t)magnitude)
+                          : (int32_t)magnitude;
+        return true;
+    }
+}
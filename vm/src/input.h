@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * File descriptor the `read` instruction parses integers from, -1 means no
+ * input at all
+ *
+ * @note Every thread has its own input, see pipeline.h
+ */
+extern _Thread_local int vm_input_fd;
+
+/**
+ * Drop the input state of a previous run
+ *
+ * @note The input is opened on the first `read`, so programs that never read
+ * do not touch it
+ */
+void input_reset();
+
+/**
+ * Parse the next decimal integer from vm_input_fd, skipping anything that is
+ * not part of a number
+ *
+ * @note Stops the vm if the integer does not fit in 32 bits
+ *
+ * @param value Set to the integer, or 0 at the end of the input
+ *
+ * @returns false at the end of the input
+ */
+bool input_read_int(int32_t *value);
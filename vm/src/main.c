@@ -4,18 +4,57 @@
 
 #include "arguments.h"
 #include "binary.h"
+#include "cache.h"
+#include "decode.h"
+#include "pipeline.h"
+#include "pool.h"
+#include "profile.h"
+#include "server.h"
+#include "simd.h"
 #include "vm.h"
 
 int main(int argc, char **argv) {
     struct Arguments args = arguments_parse(argc, argv);
+    simd_init(args.simd);
+    pool_threads = args.threads;
+    if (args.serve != NULL) {
+        serve(&args);
+        return 0;
+    }
+    if (args.pipeline != NULL) {
+        run_pipeline(&args);
+        return 0;
+    }
+    if (args.connect != NULL) {
+        return serve_client(&args);
+    }
     if (args.input == NULL) {
         fprintf(stderr, "am4vm needs a filename. See `--help` for more info");
         exit(1);
     }
 
     struct BinaryFile *bin = read_binary_file(args.input);
+    struct Program *program = load_program(&args, bin);
+    if (args.lines != NULL && bin->debug == NULL) {
+        fprintf(stderr, "`--lines` needs a binary with a line table\n");
+        exit(1);
+    }
 
-    run_vm(bin);
+    bool profiling = args.profile != NULL || args.lines != NULL;
+    if (profiling) {
+        profile_start(program);
+    }
+    run_vm(bin, program);
+    if (args.profile != NULL) {
+        profile_write(bin, program, args.profile);
+    }
+    if (args.lines != NULL) {
+        profile_write_lines(bin, program, args.lines);
+    }
+    if (profiling) {
+        profile_stop();
+    }
 
+    free_program(program);
     free_binary_file(bin);
 }
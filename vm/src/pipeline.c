@@ -0,0 +1,93 @@
+#include "pipeline.h"
+#include "binary.h"
+#include "cache.h"
+#include "channel.h"
+#include "decode.h"
+#include "input.h"
+#include "vm.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// Integers buffered between two stages
+#define CHANNEL_CAPACITY 4096
+
+struct Stage {
+    struct BinaryFile *bin;
+    struct Program *program;
+    // NULL for the first stage
+    struct Channel *in;
+    // NULL for the last stage
+    struct Channel *out;
+    pthread_t thread;
+};
+
+void *run_stage(void *arg) {
+    struct Stage *stage = arg;
+    vm_channel_in = stage->in;
+    vm_channel_out = stage->out;
+    vm_input_fd = stage->in == NULL ? STDIN_FILENO : -1;
+
+    run_vm(stage->bin, stage->program);
+
+    if (stage->out != NULL) {
+        channel_close(stage->out);
+    }
+    if (stage->in != NULL) {
+        channel_abandon(stage->in);
+    }
+    return NULL;
+}
+
+void run_pipeline(struct Arguments *args) {
+    char *paths = strdup(args->pipeline);
+    size_t stage_count = 1;
+    for (char *c = paths; *c; c++) {
+        stage_count += *c == ',';
+    }
+    struct Stage *stages = calloc(stage_count, sizeof(struct Stage));
+    if (paths == NULL || stages == NULL) {
+        fprintf(stderr, "Failed to do a heap allocation\n");
+        exit(1);
+    }
+
+    char *save = NULL;
+    char *path = strtok_r(paths, ",", &save);
+    for (size_t i = 0; i < stage_count; i++) {
+        if (path == NULL) {
+            fprintf(stderr, "`--pipeline` expects a comma separated list of "
+                            "binaries\n");
+            exit(1);
+        }
+        stages[i].bin = read_binary_file(path);
+        stages[i].program = load_program(args, stages[i].bin);
+        if (i > 0) {
+            stages[i].in = channel_new(CHANNEL_CAPACITY);
+            stages[i - 1].out = stages[i].in;
+        }
+        path = strtok_r(NULL, ",", &save);
+    }
+
+    for (size_t i = 0; i < stage_count; i++) {
+        if (pthread_create(&stages[i].thread, NULL, run_stage, &stages[i]) !=
+            0) {
+            fprintf(stderr, "Failed to start pipeline stage %zu\n", i);
+            exit(1);
+        }
+    }
+    for (size_t i = 0; i < stage_count; i++) {
+        pthread_join(stages[i].thread, NULL);
+    }
+
+    for (size_t i = 0; i < stage_count; i++) {
+        if (stages[i].in != NULL) {
+            channel_free(stages[i].in);
+        }
+        free_program(stages[i].program);
+        free_binary_file(stages[i].bin);
+    }
+    free(stages);
+    free(paths);
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include "arguments.h"
+
+/**
+ * Run the binaries in args->pipeline as the stages of a pipeline, each on
+ * its own thread. A stage's `send` goes to the next stage's `recv` through a
+ * Channel. The first stage receives from stdin and the last stage's sends
+ * are printed.
+ *
+ * @note A stage finishing closes its output, the next stage's `recv` then
+ * reports the end of the input once it has read everything
+ *
+ * @param args
+ */
+void run_pipeline(struct Arguments *args);
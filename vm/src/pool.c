@@ -0,0 +1,277 @@
+#include "pool.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+// Tasks a pool thread can hold before they go to the injection queue
+#define DEQUE_SIZE 1024
+
+// Busy waits before giving the cpu away
+#define SPIN_LIMIT 256
+
+/**
+ * Chase-Lev work stealing deque. The owner pushes and pops at the bottom,
+ * thieves take from the top.
+ */
+struct Deque {
+    _Alignas(64) atomic_llong top;
+    _Alignas(64) atomic_llong bottom;
+    _Atomic(struct Task *) tasks[DEQUE_SIZE];
+};
+
+struct Pool {
+    pthread_once_t started;
+    struct Deque *deques;
+    int deque_count;
+
+    // Tasks from threads outside the pool, or from full deques
+    pthread_mutex_t injection_lock;
+    struct Task *injection_head;
+    struct Task *injection_tail;
+    // Lets threads skip the lock when the queue is empty
+    atomic_int injected;
+
+    // Idle pool threads sleep until a task is queued
+    pthread_mutex_t sleep_lock;
+    pthread_cond_t wake;
+    atomic_int sleepers;
+    atomic_int queued;
+};
+
+int pool_threads = 0;
+
+static struct Pool pool = {
+    .started = PTHREAD_ONCE_INIT,
+    .injection_lock = PTHREAD_MUTEX_INITIALIZER,
+    .sleep_lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+// NULL on threads outside of the pool
+static _Thread_local struct Deque *own_deque = NULL;
+
+// Spreads the thieves over the deques
+static _Thread_local unsigned steal_start = 0;
+
+bool deque_push(struct Deque *deque, struct Task *task) {
+    long long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed);
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    if (bottom - top >= DEQUE_SIZE) {
+        return false;
+    }
+    atomic_store_explicit(&deque->tasks[bottom % DEQUE_SIZE], task,
+                          memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&deque->bottom, bottom + 1, memory_order_relaxed);
+    return true;
+}
+
+struct Task *deque_pop(struct Deque *deque) {
+    long long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&deque->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long top = atomic_load_explicit(&deque->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+        return NULL;
+    }
+
+    struct Task *task = atomic_load_explicit(
+        &deque->tasks[bottom % DEQUE_SIZE], memory_order_relaxed);
+    if (top == bottom) {
+        // The last task, a thief may be taking it at the same time
+        if (!atomic_compare_exchange_strong_explicit(
+                &deque->top, &top, top + 1, memory_order_seq_cst,
+                memory_order_relaxed)) {
+            task = NULL;
+        }
+        atomic_store_explicit(&deque->bottom, bottom + 1,
+                              memory_order_relaxed);
+    }
+    return task;
+}
+
+struct Task *deque_steal(struct Deque *deque) {
+    long long top = atomic_load_explicit(&deque->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    long long bottom =
+        atomic_load_explicit(&deque->bottom, memory_order_acquire);
+    if (top >= bottom) {
+        return NULL;
+    }
+
+    struct Task *task = atomic_load_explicit(&deque->tasks[top % DEQUE_SIZE],
+                                             memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&deque->top, &top, top + 1,
+                                                 memory_order_seq_cst,
+                                                 memory_order_relaxed)) {
+        // Lost the race to the owner or another thief
+        return NULL;
+    }
+    return task;
+}
+
+struct Task *injection_pop() {
+    pthread_mutex_lock(&pool.injection_lock);
+    struct Task *task = pool.injection_head;
+    if (task != NULL) {
+        pool.injection_head = task->next;
+        if (pool.injection_head == NULL) {
+            pool.injection_tail = NULL;
+        }
+        atomic_fetch_sub(&pool.injected, 1);
+    }
+    pthread_mutex_unlock(&pool.injection_lock);
+    return task;
+}
+
+void injection_push(struct Task *task) {
+    task->next = NULL;
+    pthread_mutex_lock(&pool.injection_lock);
+    if (pool.injection_tail == NULL) {
+        pool.injection_head = task;
+    } else {
+        pool.injection_tail->next = task;
+    }
+    pool.injection_tail = task;
+    atomic_fetch_add(&pool.injected, 1);
+    pthread_mutex_unlock(&pool.injection_lock);
+}
+
+struct Task *find_task() {
+    struct Task *task = NULL;
+    if (own_deque != NULL) {
+        task = deque_pop(own_deque);
+    }
+    if (task == NULL && atomic_load(&pool.injected) > 0) {
+        task = injection_pop();
+    }
+    steal_start++;
+    for (int i = 0; task == NULL && i < pool.deque_count; i++) {
+        struct Deque *victim =
+            &pool.deques[(steal_start + i) % pool.deque_count];
+        if (victim != own_deque) {
+            task = deque_steal(victim);
+        }
+    }
+    if (task != NULL) {
+        atomic_fetch_sub(&pool.queued, 1);
+    }
+    return task;
+}
+
+void run_task(struct Task *task) {
+    task->run(task);
+    atomic_store_explicit(&task->done, true, memory_order_release);
+}
+
+void *pool_thread(void *arg) {
+    own_deque = arg;
+    for (;;) {
+        struct Task *task = find_task();
+        if (task != NULL) {
+            run_task(task);
+            continue;
+        }
+
+        // Announce the sleep before the last look, pool_submit checks the
+        // sleepers after it counted the task, so one of them sees the other
+        pthread_mutex_lock(&pool.sleep_lock);
+        atomic_fetch_add(&pool.sleepers, 1);
+        while (atomic_load(&pool.queued) <= 0) {
+            pthread_cond_wait(&pool.wake, &pool.sleep_lock);
+        }
+        atomic_fetch_sub(&pool.sleepers, 1);
+        pthread_mutex_unlock(&pool.sleep_lock);
+    }
+    return NULL;
+}
+
+void pool_start() {
+    int threads = pool_threads;
+    if (threads <= 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    // The waiting thread is the last one
+    pool.deque_count = threads > 1 ? threads - 1 : 0;
+    if (pool.deque_count == 0) {
+        return;
+    }
+
+    pool.deques = aligned_alloc(64, pool.deque_count * sizeof(struct Deque));
+    if (pool.deques == NULL) {
+        fprintf(stderr, "Failed to do a heap allocation\n");
+        exit(1);
+    }
+    for (int i = 0; i < pool.deque_count; i++) {
+        atomic_init(&pool.deques[i].top, 0);
+        atomic_init(&pool.deques[i].bottom, 0);
+    }
+    for (int i = 0; i < pool.deque_count; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, pool_thread, &pool.deques[i]) != 0) {
+            fprintf(stderr, "Failed to start a pool thread\n");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
+
+void pool_submit(struct Task *task) {
+    pthread_once(&pool.started, pool_start);
+    atomic_init(&task->done, false);
+    if (own_deque == NULL || !deque_push(own_deque, task)) {
+        injection_push(task);
+    }
+
+    atomic_fetch_add(&pool.queued, 1);
+    if (atomic_load(&pool.sleepers) > 0) {
+        pthread_mutex_lock(&pool.sleep_lock);
+        pthread_cond_signal(&pool.wake);
+        pthread_mutex_unlock(&pool.sleep_lock);
+    }
+}
+
+bool pool_run_one() {
+    struct Task *task = find_task();
+    if (task == NULL) {
+        return false;
+    }
+    run_task(task);
+    return true;
+}
+
+void pool_pause(int *spins) {
+    if (++*spins < SPIN_LIMIT) {
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    } else {
+        sched_yield();
+    }
+}
+
+void pool_wait(struct Task *task) {
+    int spins = 0;
+    while (!atomic_load_explicit(&task->done, memory_order_acquire)) {
+        if (pool_run_one()) {
+            spins = 0;
+        } else {
+            pool_pause(&spins);
+        }
+    }
+}
+
+void pool_reset() {
+    pthread_mutex_lock(&pool.injection_lock);
+    pool.injection_head = NULL;
+    pool.injection_tail = NULL;
+    atomic_store(&pool.injected, 0);
+    atomic_store(&pool.queued, 0);
+    pthread_mutex_unlock(&pool.injection_lock);
+}
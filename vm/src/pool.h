@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+/**
+ * A unit of work for the pool, embed it as the first member of the real task
+ */
+struct Task {
+    void (*run)(struct Task *task);
+    // Set once run has returned
+    atomic_bool done;
+    // Used by the injection queue
+    struct Task *next;
+};
+
+/**
+ * Number of threads running tasks, counting the thread that waits on them.
+ * 0 means one per online cpu, 1 means tasks only run while someone waits.
+ *
+ * @note Read when the first task is submitted
+ */
+extern int pool_threads;
+
+/**
+ * Queue a task, starting the pool on first use
+ *
+ * @note Tasks submitted from a pool thread go to that thread's own deque,
+ * other threads steal from the far end of it
+ *
+ * @param task
+ */
+void pool_submit(struct Task *task);
+
+/**
+ * Run a single queued task on the calling thread, if there is one
+ *
+ * @returns false if no task was found
+ */
+bool pool_run_one();
+
+/**
+ * Wait for a task to finish, running other tasks in the meantime so a pool
+ * thread waiting on a queued task can not starve the pool
+ *
+ * @param task
+ */
+void pool_wait(struct Task *task);
+
+/**
+ * Back off after pool_run_one found nothing
+ *
+ * @param spins Number of times in a row this has been called
+ */
+void pool_pause(int *spins);
+
+/**
+ * Drop every task in the injection queue
+ *
+ * @note Only safe with pool_threads == 1, after a run was abandoned
+ */
+void pool_reset();
@@ -0,0 +1,234 @@
+#include "profile.h"
+#include "error.h"
+#include "vm.h"
+#include <inttypes.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Times control jumped to every pc, the end of the program included
+_Atomic uint64_t *profile_entries = NULL;
+// Times the jump at every pc was taken
+_Atomic uint64_t *profile_taken = NULL;
+uint32_t profile_len = 0;
+
+bool profile_jump(uint32_t from, uint32_t to) {
+    // Guest threads run on several host threads
+    atomic_fetch_add_explicit(&profile_taken[from], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&profile_entries[to], 1, memory_order_relaxed);
+    return true;
+}
+
+void profile_start(struct Program *program) {
+    profile_len = program->len;
+    profile_entries = calloc(program->len + 1, sizeof(*profile_entries));
+    profile_taken = calloc(program->len + 1, sizeof(*profile_taken));
+    if (profile_entries == NULL || profile_taken == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+    // The main thread starts at the first instruction
+    profile_entries[0] = 1;
+    vm_jump_hook = profile_jump;
+}
+
+/**
+ * @returns How often control goes on to the next instruction after the
+ * instruction at pc ran count times
+ */
+uint64_t profile_fall_through(struct Program *program, uint32_t pc,
+                              uint64_t count) {
+    switch (program->code[pc].opcode) {
+    case InstructionJmp:
+    case InstructionRet:
+    // The return lands after the call, and is counted as a jump there
+    case InstructionCall:
+        return 0;
+    case InstructionJEQZ:
+    case InstructionJNEZ: {
+        uint64_t taken = profile_taken[pc];
+        return taken < count ? count - taken : 0;
+    }
+    default:
+        // A spawn jumps in the new thread, the spawning thread goes on
+        return count;
+    }
+}
+
+/**
+ * @returns How often every instruction ran, has to be freed
+ */
+uint64_t *profile_counts(struct Program *program) {
+    uint64_t *counts = calloc(profile_len + 1, sizeof(uint64_t));
+    if (counts == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+    // Every instruction runs as often as control falls into it and jumps to
+    // it. Threads that stop half way through a block make this an estimate.
+    uint64_t fall_through = 0;
+    for (uint32_t pc = 0; pc < profile_len; pc++) {
+        counts[pc] = fall_through + profile_entries[pc];
+        fall_through = profile_fall_through(program, pc, counts[pc]);
+    }
+    return counts;
+}
+
+FILE *profile_open(char *filename) {
+    FILE *output = fopen(filename, "w");
+    if (output == NULL) {
+        perror("Error opening the profile");
+        exit(1);
+    }
+    return output;
+}
+
+void profile_close(FILE *output, char *filename) {
+    if (fclose(output) != 0) {
+        fprintf(stderr, "Failed to write the profile %s\n", filename);
+        exit(1);
+    }
+}
+
+void profile_write(struct BinaryFile *bin, struct Program *program,
+                   char *filename) {
+    FILE *output = profile_open(filename);
+    fprintf(output, "am4 profile\n");
+    fprintf(output, "binary %016" PRIx64 " %" PRIu32 "\n", bin->hash,
+            profile_len);
+
+    uint64_t *counts = profile_counts(program);
+    for (uint32_t pc = 0; pc < profile_len; pc++) {
+        if (counts[pc] > 0) {
+            fprintf(output, "%" PRIu32 " %" PRIu64 " %" PRIu64 "\n", pc,
+                    counts[pc], (uint64_t)profile_taken[pc]);
+        }
+    }
+    free(counts);
+    profile_close(output, filename);
+}
+
+/**
+ * Instructions that ran on a line
+ */
+struct LineCount {
+    uint32_t line;
+    uint64_t count;
+};
+
+int line_count_compare_lines(const void *a, const void *b) {
+    const struct LineCount *x = a;
+    const struct LineCount *y = b;
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+int line_count_compare_counts(const void *a, const void *b) {
+    const struct LineCount *x = a;
+    const struct LineCount *y = b;
+    if (x->count != y->count) {
+        return x->count < y->count ? 1 : -1;
+    }
+    return line_count_compare_lines(a, b);
+}
+
+/**
+ * Add up the counts of every line and write them, the most expensive first
+ *
+ * @param lines The line and count of every instruction, sorted in place
+ */
+void profile_write_line_counts(FILE *output, const char *kind,
+                               struct LineCount *lines, size_t len,
+                               uint64_t total) {
+    qsort(lines, len, sizeof(struct LineCount), line_count_compare_lines);
+    size_t merged = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (merged > 0 && lines[merged - 1].line == lines[i].line) {
+            lines[merged - 1].count += lines[i].count;
+        } else {
+            lines[merged++] = lines[i];
+        }
+    }
+    qsort(lines, merged, sizeof(struct LineCount), line_count_compare_counts);
+    for (size_t i = 0; i < merged && lines[i].count > 0; i++) {
+        fprintf(output, "%s %" PRIu32 " %" PRIu64 " %.1f%%\n", kind,
+                lines[i].line, lines[i].count,
+                100.0 * lines[i].count / total);
+    }
+}
+
+/**
+ * Read the line table of a binary
+ *
+ * @returns false if it is malformed
+ */
+bool profile_read_lines(struct BinaryFile *bin, struct LineCount *lines,
+                        struct LineCount *source_lines) {
+    size_t position = 0;
+    uint64_t len;
+    if (!read_varint(bin->debug, bin->debug_size, &position, &len) ||
+        len != profile_len) {
+        return false;
+    }
+    int64_t line = 0;
+    int64_t source_line = 0;
+    for (uint32_t pc = 0; pc < profile_len; pc++) {
+        uint64_t line_diff;
+        uint64_t source_line_diff;
+        if (!read_varint(bin->debug, bin->debug_size, &position, &line_diff) ||
+            !read_varint(bin->debug, bin->debug_size, &position,
+                         &source_line_diff)) {
+            return false;
+        }
+        // Zigzag, the differences can be negative
+        line += (int64_t)(line_diff >> 1) ^ -(int64_t)(line_diff & 1);
+        source_line += (int64_t)(source_line_diff >> 1) ^
+                       -(int64_t)(source_line_diff & 1);
+        lines[pc].line = line;
+        source_lines[pc].line = source_line;
+    }
+    return position == bin->debug_size;
+}
+
+void profile_write_lines(struct BinaryFile *bin, struct Program *program,
+                         char *filename) {
+    struct LineCount *lines = calloc(profile_len + 1, sizeof(*lines));
+    struct LineCount *source_lines =
+        calloc(profile_len + 1, sizeof(*source_lines));
+    if (lines == NULL || source_lines == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+    if (!profile_read_lines(bin, lines, source_lines)) {
+        fprintf(stderr, "The line table of the binary is malformed\n");
+        exit(1);
+    }
+
+    uint64_t *counts = profile_counts(program);
+    uint64_t total = 0;
+    size_t source_len = 0;
+    for (uint32_t pc = 0; pc < profile_len; pc++) {
+        total += counts[pc];
+        lines[pc].count = counts[pc];
+        // Instructions without a source line are only counted for the asm
+        if (source_lines[pc].line != 0) {
+            source_lines[source_len].line = source_lines[pc].line;
+            source_lines[source_len++].count = counts[pc];
+        }
+    }
+    free(counts);
+
+    FILE *output = profile_open(filename);
+    fprintf(output, "am4 line profile\n");
+    profile_write_line_counts(output, "source", source_lines, source_len,
+                              total);
+    profile_write_line_counts(output, "asm", lines, profile_len, total);
+    profile_close(output, filename);
+
+    free(lines);
+    free(source_lines);
+}
+
+void profile_stop() {
+    vm_jump_hook = NULL;
+    free(profile_entries);
+    free(profile_taken);
+    profile_entries = NULL;
+    profile_taken = NULL;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "binary.h"
+#include "decode.h"
+
+/**
+ * A profile is a text file, `am4asm --profile` reads it back:
+ *
+ *   am4 profile
+ *   binary <hash> <len>
+ *   <pc> <count> <taken>
+ *   ...
+ *
+ * hash is the FNV-1a hash of the binary file, in hex, and len the length of
+ * its text section. There is a line for every pc that ran, with the times it
+ * ran and, for jumps, calls, returns and spawns, the times it was taken.
+ *
+ * A line profile adds the counts up by the lines of the line table of the
+ * binary, see INSTRUCTION_SET.md:
+ *
+ *   am4 line profile
+ *   source <line> <count> <percent>%
+ *   ...
+ *   asm <line> <count> <percent>%
+ *   ...
+ *
+ * count is how many instructions ran on the line of the source or of the
+ * assembly, the lines that ran the most come first. Instructions without a
+ * source line only count for the assembly.
+ */
+
+/**
+ * Start counting how often every instruction of a program runs
+ *
+ * @note Only taken jumps are counted, through vm_jump_hook, and the count of
+ * every instruction is worked out from them once the program is done. A run
+ * without a profile does not pay for it.
+ *
+ * @param program
+ */
+void profile_start(struct Program *program);
+
+/**
+ * Write the profile of the run
+ *
+ * @note Exits if the file can not be written
+ *
+ * @param bin The binary the program was decoded from
+ * @param program
+ * @param filename
+ */
+void profile_write(struct BinaryFile *bin, struct Program *program,
+                   char *filename);
+
+/**
+ * Write the line profile of the run
+ *
+ * @note Exits if the file can not be written or the line table of the binary
+ * does not match its text
+ *
+ * @param bin The binary the program was decoded from, with a line table
+ * @param program
+ * @param filename
+ */
+void profile_write_lines(struct BinaryFile *bin, struct Program *program,
+                         char *filename);
+
+/**
+ * Stop counting and free the counts
+ */
+void profile_stop();
@@ -0,0 +1,316 @@
+#include "server.h"
+#include "binary.h"
+#include "cache.h"
+#include "decode.h"
+#include "input.h"
+#include "vm.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LISTEN_BACKLOG 128
+
+// The binary, stdin, stdout and stderr
+#define SERVE_FDS_MAX 4
+
+volatile sig_atomic_t shutting_down = 0;
+
+void handle_shutdown(__attribute__((unused)) int signal) { shutting_down = 1; }
+
+struct sockaddr_un socket_address(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Socket path `%s` is too long\n", path);
+        exit(1);
+    }
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+/**
+ * Receive a request and its file descriptors
+ *
+ * @returns The number of file descriptors received, -1 on error
+ */
+int receive_request(int conn, struct ServeRequest *request,
+                    int fds[SERVE_FDS_MAX]) {
+    struct iovec iov = {.iov_base = request,
+                        .iov_len = sizeof(struct ServeRequest)};
+    union {
+        char buf[CMSG_SPACE(SERVE_FDS_MAX * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+
+    ssize_t received = recvmsg(conn, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC);
+    if (received != sizeof(struct ServeRequest)) {
+        return -1;
+    }
+
+    int fd_count = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+         cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+            fd_count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            if (fd_count > SERVE_FDS_MAX) {
+                fd_count = SERVE_FDS_MAX;
+            }
+            memcpy(fds, CMSG_DATA(cmsg), fd_count * sizeof(int));
+        }
+    }
+    request->path[SERVE_PATH_SIZE - 1] = '\0';
+    return fd_count;
+}
+
+/**
+ * Map the binary straight from the client's file descriptor
+ */
+struct BinaryFile *map_binary(int fd, const char *name) {
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Can not read binary `%s`\n", name);
+        return NULL;
+    }
+    void *contents = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (contents == MAP_FAILED) {
+        perror("Error mapping binary");
+        return NULL;
+    }
+    struct BinaryFile *bin = binary_from_bytes(contents, st.st_size, name);
+    munmap(contents, st.st_size);
+    return bin;
+}
+
+/**
+ * Run the program in a child with the client's stdin, stdout and stderr
+ *
+ * @note vm_error exits and guest threads run on pool threads, so the child
+ * takes the error down instead of the worker. The pool is started on the
+ * first spawn, in the child.
+ *
+ * @param stdio_fds stdin, stdout and stderr of the client
+ *
+ * @returns The exit status of the program
+ */
+int run_job(struct BinaryFile *bin, struct Program *program, int stdio_fds[3]) {
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error forking job");
+        return 1;
+    }
+    if (pid == 0) {
+        dup2(stdio_fds[0], STDIN_FILENO);
+        dup2(stdio_fds[1], STDOUT_FILENO);
+        dup2(stdio_fds[2], STDERR_FILENO);
+        vm_input_fd = STDIN_FILENO;
+        run_vm(bin, program);
+        exit(0);
+    }
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            perror("Error waiting for job");
+            return 1;
+        }
+    }
+    if (WIFSIGNALED(status)) {
+        // Like a shell reports it
+        return 128 + WTERMSIG(status);
+    }
+    return WEXITSTATUS(status);
+}
+
+void handle_job(struct Arguments *args, int conn) {
+    struct ServeRequest request;
+    int fds[SERVE_FDS_MAX] = {-1, -1, -1, -1};
+    int fd_count = receive_request(conn, &request, fds);
+
+    int binary_fd = -1;
+    int *stdio_fds = NULL;
+    if (fd_count == SERVE_FDS_MAX && request.has_binary_fd) {
+        binary_fd = fds[0];
+        stdio_fds = fds + 1;
+    } else if (fd_count == SERVE_FDS_MAX - 1 && !request.has_binary_fd) {
+        binary_fd = open(request.path, O_RDONLY | O_CLOEXEC);
+        stdio_fds = fds;
+    }
+
+    struct ServeResponse response = {.status = 1};
+    struct BinaryFile *bin = NULL;
+    if (binary_fd >= 0 && stdio_fds != NULL) {
+        bin = map_binary(binary_fd, request.path);
+    }
+
+    if (bin != NULL) {
+        struct Program *program = load_program(args, bin);
+        response.status = run_job(bin, program, stdio_fds);
+        free_program(program);
+        free_binary_file(bin);
+    }
+
+    if (binary_fd >= 0 && binary_fd != fds[0]) {
+        close(binary_fd);
+    }
+    for (int i = 0; i < fd_count; i++) {
+        close(fds[i]);
+    }
+    send(conn, &response, sizeof(struct ServeResponse), MSG_NOSIGNAL);
+}
+
+void worker_loop(struct Arguments *args, int listen_fd) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    for (int jobs = 0; jobs < args->max_jobs; jobs++) {
+        int conn = accept(listen_fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                jobs--;
+                continue;
+            }
+            perror("Error accepting connection");
+            exit(1);
+        }
+        handle_job(args, conn);
+        close(conn);
+    }
+    exit(0);
+}
+
+pid_t spawn_worker(struct Arguments *args, int listen_fd) {
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("Error forking worker");
+        exit(1);
+    }
+    if (pid == 0) {
+        worker_loop(args, listen_fd);
+    }
+    return pid;
+}
+
+void serve(struct Arguments *args) {
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("Error creating socket");
+        exit(1);
+    }
+
+    struct sockaddr_un addr = socket_address(args->serve);
+    unlink(args->serve);
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(listen_fd, LISTEN_BACKLOG) != 0) {
+        perror("Error binding socket");
+        exit(1);
+    }
+
+    int workers = args->workers;
+    if (workers == 0) {
+        workers = sysconf(_SC_NPROCESSORS_ONLN);
+        if (workers < 1) {
+            workers = 1;
+        }
+    }
+
+    struct sigaction action = {.sa_handler = handle_shutdown};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    pid_t *pids = calloc(workers, sizeof(pid_t));
+    for (int i = 0; i < workers; i++) {
+        pids[i] = spawn_worker(args, listen_fd);
+    }
+
+    while (!shutting_down) {
+        pid_t pid = wait(NULL);
+        if (pid < 0) {
+            continue;
+        }
+        // Recycle the worker that finished its jobs or crashed
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] == pid && !shutting_down) {
+                pids[i] = spawn_worker(args, listen_fd);
+            }
+        }
+    }
+
+    for (int i = 0; i < workers; i++) {
+        kill(pids[i], SIGTERM);
+    }
+    while (wait(NULL) > 0) {
+    }
+
+    close(listen_fd);
+    unlink(args->serve);
+    free(pids);
+}
+
+int serve_client(struct Arguments *args) {
+    int binary_fd = open(args->input, O_RDONLY);
+    if (binary_fd < 0) {
+        perror("Error opening file");
+        exit(1);
+    }
+
+    int conn = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = socket_address(args->connect);
+    if (conn < 0 ||
+        connect(conn, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        perror("Error connecting to server");
+        exit(1);
+    }
+
+    struct ServeRequest request = {.has_binary_fd = 1};
+    snprintf(request.path, SERVE_PATH_SIZE, "%s", args->input);
+    int fds[SERVE_FDS_MAX] = {binary_fd, STDIN_FILENO, STDOUT_FILENO,
+                              STDERR_FILENO};
+
+    struct iovec iov = {.iov_base = &request,
+                        .iov_len = sizeof(struct ServeRequest)};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct msghdr msg = {.msg_iov = &iov,
+                         .msg_iovlen = 1,
+                         .msg_control = control.buf,
+                         .msg_controllen = sizeof(control.buf)};
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    fflush(stdout);
+    fflush(stderr);
+    if (sendmsg(conn, &msg, 0) != sizeof(struct ServeRequest)) {
+        perror("Error sending request");
+        exit(1);
+    }
+    close(binary_fd);
+
+    struct ServeResponse response;
+    if (recv(conn, &response, sizeof(response), MSG_WAITALL) !=
+        sizeof(response)) {
+        fprintf(stderr, "The program crashed on the server\n");
+        close(conn);
+        return 1;
+    }
+    close(conn);
+    return response.status;
+}
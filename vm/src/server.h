@@ -0,0 +1,51 @@
+#pragma once
+
+#include "arguments.h"
+#include <stdint.h>
+
+/*
+ * Protocol
+ *
+ * A client connects to the unix socket and sends a single struct
+ * ServeRequest with sendmsg. Two file descriptors can be attached with
+ * SCM_RIGHTS:
+ *   - the binary to run, only if .has_binary_fd is set, otherwise the
+ *     worker opens .path
+ *   - stdin, stdout and stderr of the program, always
+ * The worker runs the program in a child and answers with a struct
+ * ServeResponse holding its exit status once it is done. If the connection
+ * is closed without a response the worker crashed.
+ */
+
+#define SERVE_PATH_SIZE 4096
+
+struct ServeRequest {
+    uint32_t has_binary_fd;
+    char path[SERVE_PATH_SIZE];
+};
+
+struct ServeResponse {
+    // Exit status of the program, 128 + the signal if one killed it
+    int32_t status;
+};
+
+/**
+ * Run a prefork server on args->serve
+ *
+ * @note Workers are forked up front and replaced after args->max_jobs jobs,
+ * or when a program makes them exit. Returns on SIGINT or SIGTERM.
+ *
+ * @param args
+ */
+void serve(struct Arguments *args);
+
+/**
+ * Run args->input on the server listening on args->connect
+ *
+ * @note The program reads our stdin and writes to our stdout and stderr
+ *
+ * @param args
+ *
+ * @returns The exit status of the program
+ */
+int serve_client(struct Arguments *args);
@@ -0,0 +1,207 @@
+#include "simd.h"
+#include <stdbool.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+struct SimdKernels {
+    enum SimdLevel level;
+    void (*fill)(uint32_t *dst, size_t n, uint32_t value);
+    void (*vadd)(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                 size_t n);
+    uint32_t (*sum)(const uint32_t *src, size_t n);
+};
+
+void fill_scalar(uint32_t *dst, size_t n, uint32_t value) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = value;
+    }
+}
+
+void vadd_scalar(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+                 size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        dst[i] = a[i] + b[i];
+    }
+}
+
+uint32_t sum_scalar(const uint32_t *src, size_t n) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i < n; i++) {
+        sum += src[i];
+    }
+    return sum;
+}
+
+#ifdef SIMD_X86
+__attribute__((target("sse2"))) void fill_sse2(uint32_t *dst, size_t n,
+                                               uint32_t value) {
+    __m128i v = _mm_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        _mm_storeu_si128((__m128i *)(dst + i), v);
+    }
+    fill_scalar(dst + i, n - i, value);
+}
+
+__attribute__((target("sse2"))) void
+vadd_sse2(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_add_epi32(va, vb));
+    }
+    vadd_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("sse2"))) uint32_t sum_sse2(const uint32_t *src,
+                                                  size_t n) {
+    // Two accumulators to hide the latency of the adds
+    __m128i acc0 = _mm_setzero_si128();
+    __m128i acc1 = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        acc0 = _mm_add_epi32(acc0,
+                             _mm_loadu_si128((const __m128i *)(src + i)));
+        acc1 = _mm_add_epi32(acc1,
+                             _mm_loadu_si128((const __m128i *)(src + i + 4)));
+    }
+    uint32_t lanes[4];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi32(acc0, acc1));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] +
+           sum_scalar(src + i, n - i);
+}
+
+__attribute__((target("avx2"))) void fill_avx2(uint32_t *dst, size_t n,
+                                               uint32_t value) {
+    __m256i v = _mm256_set1_epi32(value);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        _mm256_storeu_si256((__m256i *)(dst + i), v);
+    }
+    fill_scalar(dst + i, n - i, value);
+}
+
+__attribute__((target("avx2"))) void
+vadd_avx2(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n) {
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i vb = _mm256_loadu_si256((const __m256i *)(b + i));
+        _mm256_storeu_si256((__m256i *)(dst + i), _mm256_add_epi32(va, vb));
+    }
+    vadd_scalar(dst + i, a + i, b + i, n - i);
+}
+
+__attribute__((target("avx2"))) uint32_t sum_avx2(const uint32_t *src,
+                                                  size_t n) {
+    __m256i acc0 = _mm256_setzero_si256();
+    __m256i acc1 = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        acc0 = _mm256_add_epi32(
+            acc0, _mm256_loadu_si256((const __m256i *)(src + i)));
+        acc1 = _mm256_add_epi32(
+            acc1, _mm256_loadu_si256((const __m256i *)(src + i + 8)));
+    }
+    uint32_t lanes[8];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi32(acc0, acc1));
+    uint32_t sum = 0;
+    for (int lane = 0; lane < 8; lane++) {
+        sum += lanes[lane];
+    }
+    return sum + sum_scalar(src + i, n - i);
+}
+#endif
+
+static struct SimdKernels kernels;
+static bool kernels_selected = false;
+
+void simd_init(enum SimdLevel level) {
+    kernels = (struct SimdKernels){.level = SimdScalar,
+                                   .fill = fill_scalar,
+                                   .vadd = vadd_scalar,
+                                   .sum = sum_scalar};
+    kernels_selected = true;
+#ifdef SIMD_X86
+    __builtin_cpu_init();
+    if (level >= SimdAVX2 && __builtin_cpu_supports("avx2")) {
+        kernels = (struct SimdKernels){.level = SimdAVX2,
+                                       .fill = fill_avx2,
+                                       .vadd = vadd_avx2,
+                                       .sum = sum_avx2};
+    } else if (level >= SimdSSE2 && __builtin_cpu_supports("sse2")) {
+        kernels = (struct SimdKernels){.level = SimdSSE2,
+                                       .fill = fill_sse2,
+                                       .vadd = vadd_sse2,
+                                       .sum = sum_sse2};
+    }
+#else
+    (void)level;
+#endif
+}
+
+enum SimdLevel simd_level() {
+    if (!kernels_selected) {
+        simd_init(SimdAuto);
+    }
+    return kernels.level;
+}
+
+int simd_level_parse(const char *name, enum SimdLevel *level) {
+    if (strcmp(name, "auto") == 0) {
+        *level = SimdAuto;
+    } else if (strcmp(name, "scalar") == 0) {
+        *level = SimdScalar;
+    } else if (strcmp(name, "sse2") == 0) {
+        *level = SimdSSE2;
+    } else if (strcmp(name, "avx2") == 0) {
+        *level = SimdAVX2;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+void simd_fill(uint32_t *dst, size_t n, uint32_t value) {
+    if (!kernels_selected) {
+        simd_init(SimdAuto);
+    }
+    kernels.fill(dst, n, value);
+}
+
+void simd_copy(uint32_t *dst, const uint32_t *src, size_t n) {
+    // libc already picks a vectorized memmove for the cpu
+    memmove(dst, src, n * sizeof(uint32_t));
+}
+
+/**
+ * A forward vector loop only gives the scalar result when dst does not
+ * overlap the part of src that is read after dst is written
+ */
+bool vector_safe(uint32_t *dst, const uint32_t *src, size_t n) {
+    return dst <= src || dst >= src + n;
+}
+
+void simd_vadd(uint32_t *dst, const uint32_t *a, const uint32_t *b,
+               size_t n) {
+    if (!kernels_selected) {
+        simd_init(SimdAuto);
+    }
+    if (vector_safe(dst, a, n) && vector_safe(dst, b, n)) {
+        kernels.vadd(dst, a, b, n);
+    } else {
+        vadd_scalar(dst, a, b, n);
+    }
+}
+
+uint32_t simd_sum(const uint32_t *src, size_t n) {
+    if (!kernels_selected) {
+        simd_init(SimdAuto);
+    }
+    return kernels.sum(src, n);
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Instruction set extensions the bulk memory kernels can use
+ */
+enum SimdLevel {
+    SimdScalar,
+    SimdSSE2,
+    SimdAVX2,
+    // Pick the best level the cpu supports
+    SimdAuto,
+};
+
+/**
+ * Select the bulk memory kernels
+ *
+ * @note The kernels select SimdAuto on first use if this is never called
+ *
+ * @param level Highest level to use, lowered to what the cpu supports
+ */
+void simd_init(enum SimdLevel level);
+
+/**
+ * @returns The level of the selected kernels
+ */
+enum SimdLevel simd_level();
+
+/**
+ * Parse a level as given on the command line
+ *
+ * @param name One of auto, scalar, sse2 or avx2
+ * @param level Set on success
+ *
+ * @returns 0 on success, -1 if name is not a level
+ */
+int simd_level_parse(const char *name, enum SimdLevel *level);
+
+/**
+ * dst[i] = value for every i < n
+ */
+void simd_fill(uint32_t *dst, size_t n, uint32_t value);
+
+/**
+ * Copy n words from src to dst, the ranges may overlap
+ */
+void simd_copy(uint32_t *dst, const uint32_t *src, size_t n);
+
+/**
+ * dst[i] = a[i] + b[i] for every i < n in ascending order, wrapping on
+ * overflow
+ *
+ * @note dst may overlap a and b, the result is the same as for a scalar loop
+ */
+void simd_vadd(uint32_t *dst, const uint32_t *a, const uint32_t *b, size_t n);
+
+/**
+ * @returns The sum of n words, wrapping on overflow
+ */
+uint32_t simd_sum(const uint32_t *src, size_t n);
@@ -1,21 +1,68 @@
 #include "vm.h"
+#include "channel.h"
+#include "error.h"
+#include "input.h"
+#include "pool.h"
+#include "simd.h"
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 
 #define STACK_SIZE 1024
-#define ARG_MASK 0xffffff
-#define SIGN_BIT 0x800000
-#define SIGN_EXTEND 0xff000000
+#define RETURN_STACK_SIZE 1024
+
+bool (*vm_jump_hook)(uint32_t from, uint32_t to) = NULL;
 
 struct Stack {
     int32_t stack[STACK_SIZE];
     int sp;
 };
 
+/**
+ * Return addresses live apart from the operand stack, so a procedure can not
+ * clobber them
+ */
+struct ReturnStack {
+    uint32_t stack[RETURN_STACK_SIZE];
+    int sp;
+};
+
+struct GuestThread;
+
+/**
+ * State shared by every guest thread of a run
+ */
+struct Machine {
+    struct BinaryFile *bin;
+    struct Program *program;
+
+    pthread_mutex_t lock;
+    // Indexed by thread handle, NULL once a thread is joined
+    struct GuestThread **threads;
+    size_t thread_count;
+    size_t thread_capacity;
+    // Handles of joined threads, reused before new ones
+    int32_t *free_handles;
+    size_t free_count;
+};
+
+struct GuestThread {
+    // Has to come first, the pool hands it back to run_guest_thread
+    struct Task task;
+    struct Machine *machine;
+    uint32_t pc;
+    struct Stack stack;
+    struct ReturnStack return_stack;
+    // Top of the stack when the thread ended, 0 if it was empty
+    int32_t result;
+    // The main thread can not end with a bare `ret`
+    bool spawned;
+};
+
 void push(struct Stack *stack, int32_t value) {
     if (stack->sp >= STACK_SIZE) {
-        fprintf(stderr, "Stack overflow!\n");
-        exit(1);
+        vm_error("Stack overflow!\n");
     }
     stack->stack[stack->sp] = value;
     stack->sp++;
@@ -23,92 +70,506 @@ void push(struct Stack *stack, int32_t value) {
 
 int32_t pop(struct Stack *stack) {
     if (stack->sp <= 0) {
-        fprintf(stderr, "Stack underflow!\n");
-        exit(1);
+        vm_error("Stack underflow!\n");
+    }
+    stack->sp--;
+    return stack->stack[stack->sp];
+}
+
+void push_return(struct ReturnStack *stack, uint32_t addr) {
+    if (stack->sp >= RETURN_STACK_SIZE) {
+        vm_error("Return stack overflow!\n");
+    }
+    stack->stack[stack->sp] = addr;
+    stack->sp++;
+}
+
+uint32_t pop_return(struct ReturnStack *stack) {
+    if (stack->sp <= 0) {
+        vm_error("Return stack underflow!\n");
     }
     stack->sp--;
     return stack->stack[stack->sp];
 }
 
-void run_vm(struct BinaryFile *bin) {
-    struct Stack stack = {.sp = 0};
+/**
+ * Stack addressed memory accesses may only touch the data section
+ *
+ * @returns addr
+ */
+uint32_t check_range(struct BinaryFile *bin, int32_t addr, int32_t n) {
+    if (addr < 0 || n < 0 || (int64_t)addr + n > bin->start_addr) {
+        vm_error("Memory access out of bounds at %d (%d words)!\n", addr, n);
+    }
+    return addr;
+}
 
-    uint32_t pc = bin->start_addr;
-    while (pc < bin->total_size) {
-        uint32_t instruction = bin->memory[pc];
-        uint32_t opcode = instruction >> 24;
+void run_guest_thread(struct Task *task);
 
-        int32_t op_arg = instruction & ARG_MASK;
-        op_arg = op_arg | ((op_arg & SIGN_BIT) ? SIGN_EXTEND : 0);
+/**
+ * Start a guest thread at pc with arg on its stack
+ *
+ * @returns The handle of the thread
+ */
+int32_t spawn_thread(struct Machine *machine, uint32_t pc, int32_t arg) {
+    struct GuestThread *thread = malloc(sizeof(struct GuestThread));
+    if (thread == NULL) {
+        vm_error("Failed to do a heap allocation\n");
+    }
+    thread->task.run = run_guest_thread;
+    thread->machine = machine;
+    thread->pc = pc;
+    thread->stack.sp = 0;
+    thread->return_stack.sp = 0;
+    thread->result = 0;
+    thread->spawned = true;
+    push(&thread->stack, arg);
+
+    pthread_mutex_lock(&machine->lock);
+    int32_t handle;
+    if (machine->free_count > 0) {
+        handle = machine->free_handles[--machine->free_count];
+    } else {
+        if (machine->thread_count == machine->thread_capacity) {
+            size_t capacity = machine->thread_capacity == 0
+                                  ? 16
+                                  : machine->thread_capacity * 2;
+            machine->threads = realloc(machine->threads,
+                                       capacity * sizeof(struct GuestThread *));
+            machine->free_handles =
+                realloc(machine->free_handles, capacity * sizeof(int32_t));
+            if (machine->threads == NULL || machine->free_handles == NULL) {
+                vm_error("Failed to do a heap allocation\n");
+            }
+            machine->thread_capacity = capacity;
+        }
+        handle = machine->thread_count++;
+    }
+    machine->threads[handle] = thread;
+    pthread_mutex_unlock(&machine->lock);
+
+    pool_submit(&thread->task);
+    return handle;
+}
+
+/**
+ * Take a thread out of the handle table, so it can only be joined once
+ *
+ * @returns NULL if there is no such thread
+ */
+struct GuestThread *claim_thread(struct Machine *machine, int32_t handle) {
+    pthread_mutex_lock(&machine->lock);
+    struct GuestThread *thread = NULL;
+    if (handle >= 0 && (size_t)handle < machine->thread_count) {
+        thread = machine->threads[handle];
+        machine->threads[handle] = NULL;
+    }
+    pthread_mutex_unlock(&machine->lock);
+    return thread;
+}
+
+/**
+ * @returns One past the highest handle handed out so far
+ */
+size_t thread_handle_limit(struct Machine *machine) {
+    pthread_mutex_lock(&machine->lock);
+    size_t limit = machine->thread_count;
+    pthread_mutex_unlock(&machine->lock);
+    return limit;
+}
+
+/**
+ * Wait for a claimed thread and free it
+ *
+ * @returns The result of the thread
+ */
+int32_t join_thread(struct Machine *machine, int32_t handle,
+                    struct GuestThread *thread) {
+    pool_wait(&thread->task);
+    int32_t result = thread->result;
+    free(thread);
+
+    pthread_mutex_lock(&machine->lock);
+    machine->free_handles[machine->free_count++] = handle;
+    pthread_mutex_unlock(&machine->lock);
+    return result;
+}
+
+void execute(struct Machine *machine, struct GuestThread *thread) {
+    struct BinaryFile *bin = machine->bin;
+    struct Program *program = machine->program;
+    struct Stack *stack = &thread->stack;
+    struct ReturnStack *return_stack = &thread->return_stack;
+
+    // Relative to the start of the text section
+    uint32_t pc = thread->pc;
+    while (pc < program->len) {
+        struct DecodedInstruction instruction = program->code[pc];
+        int32_t op_arg = instruction.arg;
 
         pc++;
 
-        if (opcode == InstructionNoop) {
-        } else if (opcode == InstructionJmp) {
+        switch (instruction.opcode) {
+        case InstructionNoop:
+            break;
+        case InstructionJmp:
+            if (vm_jump_hook != NULL && !vm_jump_hook(pc - 1, op_arg)) {
+                return;
+            }
             pc = op_arg;
-        } else if (opcode == InstructionJEQZ) {
-            int32_t v1 = pop(&stack);
+            break;
+        case InstructionJEQZ: {
+            int32_t v1 = pop(stack);
             if (v1 == 0) {
+                if (vm_jump_hook != NULL && !vm_jump_hook(pc - 1, op_arg)) {
+                    return;
+                }
+                pc = op_arg;
+            }
+            break;
+        }
+        case InstructionJNEZ: {
+            int32_t v1 = pop(stack);
+            if (v1 != 0) {
+                if (vm_jump_hook != NULL && !vm_jump_hook(pc - 1, op_arg)) {
+                    return;
+                }
                 pc = op_arg;
             }
-        } else if (opcode == InstructionPush) {
-            push(&stack, op_arg);
-        } else if (opcode == InstructionAdd) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 + v2);
-        } else if (opcode == InstructionSub) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 - v2);
-        } else if (opcode == InstructionMul) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 * v2);
-        } else if (opcode == InstructionEq) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 == v2);
-        } else if (opcode == InstructionLt) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 < v2);
-        } else if (opcode == InstructionLe) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 <= v2);
-        } else if (opcode == InstructionGt) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 > v2);
-        } else if (opcode == InstructionGe) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 >= v2);
-        } else if (opcode == InstructionLAnd) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 && v2);
-        } else if (opcode == InstructionLOr) {
-            int32_t v2 = pop(&stack);
-            int32_t v1 = pop(&stack);
-            push(&stack, v1 || v2);
-        } else if (opcode == InstructionLNeg) {
-            int32_t v1 = pop(&stack);
-            push(&stack, !v1);
-        } else if (opcode == InstructionFetch) {
+            break;
+        }
+        case InstructionCall:
+            if (vm_jump_hook != NULL && !vm_jump_hook(pc - 1, op_arg)) {
+                return;
+            }
+            push_return(return_stack, pc);
+            pc = op_arg;
+            break;
+        case InstructionRet: {
+            if (thread->spawned && return_stack->sp == 0) {
+                // Returning from the start of a spawned thread ends it
+                return;
+            }
+            uint32_t addr = pop_return(return_stack);
+            if (vm_jump_hook != NULL && !vm_jump_hook(pc - 1, addr)) {
+                return;
+            }
+            pc = addr;
+            break;
+        }
+        case InstructionSpawn: {
+            if (vm_jump_hook != NULL && !vm_jump_hook(pc - 1, op_arg)) {
+                return;
+            }
+            int32_t arg = pop(stack);
+            push(stack, spawn_thread(machine, op_arg, arg));
+            break;
+        }
+        case InstructionJoin: {
+            int32_t handle = pop(stack);
+            struct GuestThread *joined = claim_thread(machine, handle);
+            if (joined == NULL) {
+                vm_error("Invalid thread handle %d!\n", handle);
+            }
+            push(stack, join_thread(machine, handle, joined));
+            break;
+        }
+        case InstructionPush:
+            push(stack, op_arg);
+            break;
+        case InstructionAdd: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 + v2);
+            break;
+        }
+        case InstructionSub: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 - v2);
+            break;
+        }
+        case InstructionMul: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 * v2);
+            break;
+        }
+        case InstructionDiv: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            if (v2 == 0) {
+                vm_error("Division by zero!\n");
+            }
+            // INT32_MIN / -1 overflows, it wraps around like mul does
+            push(stack, v2 == -1 ? (int32_t)(0u - (uint32_t)v1) : v1 / v2);
+            break;
+        }
+        case InstructionMod: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            if (v2 == 0) {
+                vm_error("Division by zero!\n");
+            }
+            push(stack, v2 == -1 ? 0 : v1 % v2);
+            break;
+        }
+        case InstructionAnd: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 & v2);
+            break;
+        }
+        case InstructionOr: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 | v2);
+            break;
+        }
+        case InstructionXor: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 ^ v2);
+            break;
+        }
+        case InstructionShl: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            // Only the 5 lowest bits of the shift amount are used
+            push(stack, (int32_t)((uint32_t)v1 << (v2 & 31)));
+            break;
+        }
+        case InstructionShr: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            // Arithmetic shift, the sign bit is kept
+            push(stack, v1 >> (v2 & 31));
+            break;
+        }
+        case InstructionDup: {
+            int32_t v1 = pop(stack);
+            push(stack, v1);
+            push(stack, v1);
+            break;
+        }
+        case InstructionSwap: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v2);
+            push(stack, v1);
+            break;
+        }
+        case InstructionOver: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1);
+            push(stack, v2);
+            push(stack, v1);
+            break;
+        }
+        case InstructionDrop:
+            pop(stack);
+            break;
+        case InstructionEq: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 == v2);
+            break;
+        }
+        case InstructionLt: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 < v2);
+            break;
+        }
+        case InstructionLe: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 <= v2);
+            break;
+        }
+        case InstructionGt: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 > v2);
+            break;
+        }
+        case InstructionGe: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 >= v2);
+            break;
+        }
+        case InstructionLAnd: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 && v2);
+            break;
+        }
+        case InstructionLOr: {
+            int32_t v2 = pop(stack);
+            int32_t v1 = pop(stack);
+            push(stack, v1 || v2);
+            break;
+        }
+        case InstructionLNeg: {
+            int32_t v1 = pop(stack);
+            push(stack, !v1);
+            break;
+        }
+        case InstructionFetch: {
             int32_t mem_val = bin->memory[op_arg];
-            push(&stack, mem_val);
-        } else if (opcode == InstructionStore) {
-            int32_t value = pop(&stack);
+            push(stack, mem_val);
+            break;
+        }
+        case InstructionStore: {
+            int32_t value = pop(stack);
             bin->memory[op_arg] = value;
-        } else if (opcode == InstructionPrintC) {
+            break;
+        }
+        case InstructionFAdd: {
+            int32_t value = pop(stack);
+            uint32_t addr = check_range(bin, pop(stack), 1);
+            _Atomic uint32_t *word = (_Atomic uint32_t *)&bin->memory[addr];
+            push(stack, atomic_fetch_add(word, value));
+            break;
+        }
+        case InstructionCas: {
+            uint32_t desired = pop(stack);
+            uint32_t expected = pop(stack);
+            uint32_t addr = check_range(bin, pop(stack), 1);
+            _Atomic uint32_t *word = (_Atomic uint32_t *)&bin->memory[addr];
+            push(stack,
+                 atomic_compare_exchange_strong(word, &expected, desired));
+            break;
+        }
+        case InstructionFence:
+            atomic_thread_fence(memory_order_seq_cst);
+            break;
+        case InstructionFetchI: {
+            uint32_t addr = check_range(bin, pop(stack), 1);
+            push(stack, bin->memory[addr]);
+            break;
+        }
+        case InstructionStoreI: {
+            uint32_t addr = check_range(bin, pop(stack), 1);
+            bin->memory[addr] = pop(stack);
+            break;
+        }
+        case InstructionPrintC:
             printf("%d\n", op_arg);
-        } else if (opcode == InstructionPrintV) {
+            break;
+        case InstructionPrintV:
             printf("%d\n", bin->memory[op_arg]);
-        } else {
-            fprintf(stderr, "Unknown operation %02x\n", opcode);
-            exit(1);
+            break;
+        case InstructionRead: {
+            // Input and channels belong to the main thread, spawned threads
+            // would race on them
+            int32_t value = 0;
+            bool ok = !thread->spawned && input_read_int(&value);
+            push(stack, value);
+            push(stack, ok);
+            break;
+        }
+        case InstructionSend: {
+            int32_t value = pop(stack);
+            if (vm_channel_out == NULL || thread->spawned) {
+                printf("%d\n", value);
+            } else if (!channel_send(vm_channel_out, value)) {
+                // The next stage is done, like writing to a closed pipe
+                return;
+            }
+            break;
+        }
+        case InstructionRecv: {
+            int32_t value;
+            bool ok = false;
+            if (thread->spawned) {
+                value = 0;
+            } else if (vm_channel_in == NULL) {
+                ok = input_read_int(&value);
+            } else {
+                ok = channel_recv(vm_channel_in, &value, vm_channel_out);
+            }
+            push(stack, value);
+            push(stack, ok);
+            break;
+        }
+        case InstructionFill: {
+            int32_t value = pop(stack);
+            int32_t n = pop(stack);
+            uint32_t addr = check_range(bin, pop(stack), n);
+            simd_fill(bin->memory + addr, n, value);
+            break;
+        }
+        case InstructionCopy: {
+            int32_t n = pop(stack);
+            uint32_t src = check_range(bin, pop(stack), n);
+            uint32_t dst = check_range(bin, pop(stack), n);
+            simd_copy(bin->memory + dst, bin->memory + src, n);
+            break;
+        }
+        case InstructionVAdd: {
+            int32_t n = pop(stack);
+            uint32_t b = check_range(bin, pop(stack), n);
+            uint32_t a = check_range(bin, pop(stack), n);
+            uint32_t dst = check_range(bin, pop(stack), n);
+            simd_vadd(bin->memory + dst, bin->memory + a, bin->memory + b, n);
+            break;
+        }
+        case InstructionSum: {
+            int32_t n = pop(stack);
+            uint32_t addr = check_range(bin, pop(stack), n);
+            push(stack, simd_sum(bin->memory + addr, n));
+            break;
+        }
+        default:
+            // decode_program rejects unknown operations
+            __builtin_unreachable();
+        }
+    }
+}
+
+void run_guest_thread(struct Task *task) {
+    struct GuestThread *thread = (struct GuestThread *)task;
+    execute(thread->machine, thread);
+    if (thread->stack.sp > 0) {
+        thread->result = thread->stack.stack[thread->stack.sp - 1];
+    }
+}
+
+void run_vm(struct BinaryFile *bin, struct Program *program) {
+    struct Machine machine = {.bin = bin,
+                              .program = program,
+                              .threads = NULL,
+                              .thread_count = 0,
+                              .thread_capacity = 0,
+                              .free_handles = NULL,
+                              .free_count = 0};
+    pthread_mutex_init(&machine.lock, NULL);
+    input_reset();
+
+    struct GuestThread main_thread = {
+        .machine = &machine, .pc = 0, .spawned = false};
+    execute(&machine, &main_thread);
+
+    // The run ends once every thread has, joined or not. The threads a joined
+    // thread spawned may have reused any handle, so look again until a pass
+    // finds nothing.
+    bool joined = true;
+    while (joined) {
+        joined = false;
+        for (size_t handle = 0; handle < thread_handle_limit(&machine);
+             handle++) {
+            struct GuestThread *thread = claim_thread(&machine, handle);
+            if (thread != NULL) {
+                join_thread(&machine, handle, thread);
+                joined = true;
+            }
         }
     }
+
+    free(machine.threads);
+    free(machine.free_handles);
+    pthread_mutex_destroy(&machine.lock);
 }
@@ -1,19 +1,55 @@
 #pragma once
 
 #include "binary.h"
+#include "decode.h"
+#include <stdbool.h>
 #include <stdint.h>
 
+// Part of the code cache key, bump whenever the decoded form changes
+#define AM4VM_VERSION "0.10.0"
+
 enum InstructionKind {
     InstructionNoop = 0x00,
 
     InstructionJmp = 0x01,
     InstructionJEQZ = 0x02,
 
+    InstructionCall = 0x03,
+    InstructionRet = 0x04,
+
+    // Wide forms, the argument is the address of a constant pool entry
+    // holding the full 32 bit argument
+    InstructionJmpW = 0x05,
+    InstructionJEQZW = 0x06,
+    InstructionCallW = 0x07,
+
+    InstructionSpawn = 0x08,
+    InstructionSpawnW = 0x09,
+    InstructionJoin = 0x0a,
+
+    InstructionJNEZ = 0x0b,
+    InstructionJNEZW = 0x0c,
+
     InstructionPush = 0x10,
+    InstructionPushK = 0x11,
 
     InstructionAdd = 0x20,
     InstructionSub = 0x30,
     InstructionMul = 0x40,
+    InstructionDiv = 0x50,
+    InstructionMod = 0x60,
+
+    InstructionAnd = 0x70,
+    InstructionOr = 0x71,
+    InstructionXor = 0x72,
+
+    InstructionShl = 0x80,
+    InstructionShr = 0x81,
+
+    InstructionDup = 0x90,
+    InstructionSwap = 0x91,
+    InstructionOver = 0x92,
+    InstructionDrop = 0x93,
 
     InstructionEq = 0xa0,
     InstructionLt = 0xa1,
@@ -27,9 +63,42 @@ enum InstructionKind {
 
     InstructionFetch = 0xc0,
     InstructionStore = 0xc1,
+    InstructionFetchI = 0xc2,
+    InstructionStoreI = 0xc3,
+    InstructionFetchW = 0xc4,
+    InstructionStoreW = 0xc5,
+
+    InstructionFAdd = 0xc6,
+    InstructionCas = 0xc7,
+    InstructionFence = 0xc8,
 
     InstructionPrintC = 0xd0,
     InstructionPrintV = 0xd1,
+    InstructionPrintVW = 0xd2,
+
+    InstructionRead = 0xd4,
+    InstructionSend = 0xd5,
+    InstructionRecv = 0xd6,
+
+    InstructionFill = 0xe0,
+    InstructionCopy = 0xe1,
+    InstructionVAdd = 0xe2,
+    InstructionSum = 0xe3,
 };
 
-void run_vm(struct BinaryFile *bin);
\ No newline at end of file
+/**
+ * Called on every taken jump and every spawn when set, with pcs relative to
+ * the start of the text section. Used for coverage and to bound execution
+ * when fuzzing, and for profiles.
+ *
+ * @returns false to stop the vm
+ */
+extern bool (*vm_jump_hook)(uint32_t from, uint32_t to);
+
+/**
+ * Run a decoded program
+ *
+ * @param bin The binary the program was decoded from, owns the memory
+ * @param program
+ */
+void run_vm(struct BinaryFile *bin, struct Program *program);
\ No newline at end of file
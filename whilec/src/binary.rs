@@ -0,0 +1,368 @@
+use std::collections::HashMap;
+use std::io::{self, Write};
+
+use crate::code_gen::Instruction;
+use crate::parser::{ArithmeticOp, BooleanOp};
+
+// The binary format of am4asm, see assembler/src/format.h
+
+// "AM4B" in a little endian word
+const BINARY_MAGIC: u32 = 0x42344d41;
+const BINARY_VERSION: u32 = 2;
+// Magic, version, crc, number of sections and offset of the section table
+const HEADER_SIZE: u32 = 20;
+
+const SECTION_DATA: u32 = 1;
+const SECTION_TEXT: u32 = 2;
+const SECTION_SYMBOLS: u32 = 3;
+const SECTION_DEBUG: u32 = 4;
+
+const SYMBOL_LABEL: u8 = 0;
+const SYMBOL_IDENT: u8 = 1;
+
+// CRC-32 of every nibble, for the reversed polynomial 0xedb88320
+const CRC32_NIBBLES: [u32; 16] = [
+    0x00000000, 0x1db71064, 0x3b6e20c8, 0x26d930ac, 0x76dc4190, 0x6b6b51f4, 0x4db26158, 0x5005713c,
+    0xedb88320, 0xf00f9344, 0xd6d6a3e8, 0xcb61b38c, 0x9b64c2b0, 0x86d3d2d4, 0xa00ae278, 0xbdbdf21c,
+];
+
+fn crc32_update(crc: u32, bytes: &[u8]) -> u32 {
+    let mut crc = !crc;
+    for byte in bytes {
+        crc = (crc >> 4) ^ CRC32_NIBBLES[((crc ^ *byte as u32) & 0xf) as usize];
+        crc = (crc >> 4) ^ CRC32_NIBBLES[((crc ^ (*byte >> 4) as u32) & 0xf) as usize];
+    }
+    !crc
+}
+
+/// The opcode of an instruction that runs, and of its wide form if it has one
+fn opcode(instruction: &Instruction) -> (u8, Option<u8>) {
+    match instruction {
+        Instruction::Label(_) | Instruction::Loc(_) => unreachable!(),
+        Instruction::Noop => (0x00, None),
+        Instruction::Jmp(_) => (0x01, Some(0x05)),
+        Instruction::Jeqz(_) => (0x02, Some(0x06)),
+        Instruction::Call(_) => (0x03, Some(0x07)),
+        Instruction::Ret => (0x04, None),
+        Instruction::Spawn(_) => (0x08, Some(0x09)),
+        Instruction::Join => (0x0a, None),
+        Instruction::Jnez(_) => (0x0b, Some(0x0c)),
+        Instruction::Push(_) | Instruction::PushBool(_) => (0x10, Some(0x11)),
+        Instruction::Arithmetic(op) => match op {
+            ArithmeticOp::Add => (0x20, None),
+            ArithmeticOp::Sub => (0x30, None),
+            ArithmeticOp::Mul => (0x40, None),
+            ArithmeticOp::Div => (0x50, None),
+            ArithmeticOp::Mod => (0x60, None),
+            ArithmeticOp::BitAnd => (0x70, None),
+            ArithmeticOp::BitOr => (0x71, None),
+            ArithmeticOp::BitXor => (0x72, None),
+            ArithmeticOp::Shl => (0x80, None),
+            ArithmeticOp::Shr => (0x81, None),
+        },
+        Instruction::Dup => (0x90, None),
+        Instruction::Drop => (0x93, None),
+        Instruction::Boolean(op) => match op {
+            BooleanOp::Eq => (0xa0, None),
+            BooleanOp::Lt => (0xa1, None),
+            BooleanOp::LEq => (0xa2, None),
+            BooleanOp::Gt => (0xa3, None),
+            BooleanOp::GEq => (0xa4, None),
+            BooleanOp::And => (0xaa, None),
+            BooleanOp::Or => (0xab, None),
+            BooleanOp::Not => (0xb0, None),
+        },
+        Instruction::Fetch(_) => (0xc0, Some(0xc4)),
+        Instruction::Store(_) => (0xc1, Some(0xc5)),
+        // Too large a character is cut to 24 bits
+        Instruction::PrintC(_) => (0xd0, None),
+        Instruction::PrintV(_) => (0xd1, Some(0xd2)),
+    }
+}
+
+fn has_argument(instruction: &Instruction) -> bool {
+    !matches!(
+        instruction,
+        Instruction::Noop
+            | Instruction::Ret
+            | Instruction::Join
+            | Instruction::Arithmetic(_)
+            | Instruction::Dup
+            | Instruction::Drop
+            | Instruction::Boolean(_)
+    )
+}
+
+/// Where am4asm puts every label and identifier of the assembly
+struct Layout<'a> {
+    // Every instruction that runs, with its line of the assembly and the
+    // source line of the `.loc` before it
+    code: Vec<(&'a Instruction, u32, u32)>,
+    // Labels in definition order, with the instruction they are in front of
+    labels: Vec<(&'a str, u32)>,
+    label_addrs: HashMap<&'a str, u32>,
+    // Identifiers in the order they are first stored
+    idents: Vec<&'a str>,
+    ident_addrs: HashMap<&'a str, u32>,
+}
+
+impl<'a> Layout<'a> {
+    fn new(instructions: &'a [Instruction]) -> Self {
+        let mut layout = Layout {
+            code: Vec::new(),
+            labels: Vec::new(),
+            label_addrs: HashMap::new(),
+            idents: Vec::new(),
+            ident_addrs: HashMap::new(),
+        };
+        let mut line = 1;
+        let mut source_line = 0;
+        for instruction in instructions {
+            match instruction {
+                Instruction::Label(label) => {
+                    // A label that is defined again keeps its first address
+                    let addr = layout.code.len() as u32;
+                    if !layout.label_addrs.contains_key(label.as_str()) {
+                        layout.label_addrs.insert(label, addr);
+                        layout.labels.push((label, addr));
+                    }
+                }
+                Instruction::Loc(loc) => source_line = *loc as u32,
+                instruction => {
+                    // A fetch can only read identifiers that are stored
+                    if let Instruction::Store(ident) = instruction
+                        && !layout.ident_addrs.contains_key(ident.as_str())
+                    {
+                        layout.ident_addrs.insert(ident, layout.idents.len() as u32);
+                        layout.idents.push(ident);
+                    }
+                    layout.code.push((instruction, line, source_line));
+                }
+            }
+            line += 1;
+        }
+        layout
+    }
+
+    /// The argument of an instruction with the constant pool in front of the
+    /// data section
+    fn argument(&self, instruction: &Instruction, pool_len: u32) -> i32 {
+        let ident = |ident: &String| match self.ident_addrs.get(ident.as_str()) {
+            Some(addr) => (addr + pool_len) as i32,
+            None => panic!("error: `{ident}` is never assigned"),
+        };
+        let label = |label: &String| {
+            (self.label_addrs[label.as_str()] + pool_len + self.idents.len() as u32) as i32
+        };
+        match instruction {
+            Instruction::Push(int) | Instruction::PrintC(int) => *int,
+            Instruction::PushBool(bool) => *bool as i32,
+            Instruction::Fetch(name) | Instruction::Store(name) | Instruction::PrintV(name) => {
+                ident(name)
+            }
+            Instruction::Jmp(name)
+            | Instruction::Jeqz(name)
+            | Instruction::Jnez(name)
+            | Instruction::Call(name)
+            | Instruction::Spawn(name) => label(name),
+            _ => 0,
+        }
+    }
+
+    /// Every argument that needs a wide instruction form
+    ///
+    /// Growing the pool moves every address after it, which can push more
+    /// addresses past 24 bits, so this runs until the size settles.
+    fn constant_pool(&self) -> Vec<u32> {
+        let mut pool: Vec<u32> = Vec::new();
+        loop {
+            let pool_len = pool.len() as u32;
+            pool.clear();
+            for (instruction, _, _) in &self.code {
+                let value = self.argument(instruction, pool_len) as u32;
+                if opcode(instruction).1.is_some()
+                    && !fits_in_argument(value as i32)
+                    && !pool.contains(&value)
+                {
+                    pool.push(value);
+                }
+            }
+            if pool.len() as u32 == pool_len {
+                return pool;
+            }
+        }
+    }
+}
+
+fn fits_in_argument(value: i32) -> bool {
+    (-(1 << 23)..(1 << 23)).contains(&value)
+}
+
+/// Writes a binary file one section at a time, after the header
+struct BinaryWriter<W: Write> {
+    writer: W,
+    // Of everything written after the header so far
+    crc: u32,
+    offset: u32,
+    // Type, offset and size of every section
+    sections: Vec<[u32; 3]>,
+}
+
+impl<W: Write> BinaryWriter<W> {
+    fn new(writer: W) -> Self {
+        BinaryWriter {
+            writer,
+            crc: 0,
+            offset: HEADER_SIZE,
+            sections: Vec::new(),
+        }
+    }
+
+    fn section(&mut self, kind: u32) {
+        self.sections.push([kind, self.offset, 0]);
+    }
+
+    fn write(&mut self, bytes: &[u8]) -> io::Result<()> {
+        let len = u32::try_from(bytes.len())
+            .ok()
+            .filter(|len| *len <= u32::MAX - self.offset)
+            .unwrap_or_else(|| panic!("error: the program does not fit in a binary file"));
+        self.writer.write_all(bytes)?;
+        self.crc = crc32_update(self.crc, bytes);
+        self.offset += len;
+        if let Some(section) = self.sections.last_mut() {
+            section[2] += len;
+        }
+        Ok(())
+    }
+
+    /// LEB128, 7 bits at a time with the high bit set on every byte but the
+    /// last
+    fn write_varint(&mut self, mut value: u64) -> io::Result<()> {
+        let mut bytes = Vec::with_capacity(10);
+        while value >= 0x80 {
+            bytes.push((value & 0x7f) as u8 | 0x80);
+            value >>= 7;
+        }
+        bytes.push(value as u8);
+        self.write(&bytes)
+    }
+
+    /// Zigzag, so small negative numbers stay short
+    fn write_signed(&mut self, value: i64) -> io::Result<()> {
+        self.write_varint(((value << 1) ^ (value >> 63)) as u64)
+    }
+
+    /// The section table, it is not a section of its own
+    fn table(&self) -> Vec<u8> {
+        self.sections
+            .iter()
+            .flatten()
+            .flat_map(|word| word.to_le_bytes())
+            .collect()
+    }
+}
+
+/// Write the binary am4asm would assemble from the instructions, labels and
+/// identifiers are resolved the way it does
+///
+/// The lines of the assembly in the line table are those `--emit=asm` writes.
+///
+/// The header comes first and holds the crc of everything after it, so the
+/// sections are encoded twice, once to measure them and once to write them.
+/// The writer does not have to seek, it can be a pipe.
+pub fn write_binary(instructions: &[Instruction], writer: impl Write) -> io::Result<()> {
+    let layout = Layout::new(instructions);
+    let pool = layout.constant_pool();
+    for (instruction, _, _) in &layout.code {
+        let value = layout.argument(instruction, pool.len() as u32);
+        if opcode(instruction).1.is_none() && has_argument(instruction) && !fits_in_argument(value)
+        {
+            eprintln!("warning: `{value}` cannot fit within 24 bits and will be truncated");
+        }
+    }
+
+    let mut measure = BinaryWriter::new(io::sink());
+    write_sections(&mut measure, &layout, &pool)?;
+    let table = measure.table();
+    let table_offset = measure.offset;
+    measure.write(&table)?;
+    let header = [
+        BINARY_MAGIC,
+        BINARY_VERSION,
+        measure.crc,
+        measure.sections.len() as u32,
+        table_offset,
+    ];
+
+    let mut writer = BinaryWriter::new(writer);
+    for word in header {
+        writer.writer.write_all(&word.to_le_bytes())?;
+    }
+    write_sections(&mut writer, &layout, &pool)?;
+    writer.write(&table)?;
+    writer.writer.flush()
+}
+
+/// Write every section, but not the section table
+fn write_sections<W: Write>(
+    writer: &mut BinaryWriter<W>,
+    layout: &Layout,
+    pool: &[u32],
+) -> io::Result<()> {
+    let pool_len = pool.len() as u32;
+
+    // The data section is zero until the program stores to it, only the
+    // constant pool in front of it is written
+    writer.section(SECTION_DATA);
+    writer.write(&(pool_len + layout.idents.len() as u32).to_le_bytes())?;
+    for value in pool {
+        writer.write(&value.to_le_bytes())?;
+    }
+
+    writer.section(SECTION_TEXT);
+    writer.write_varint(layout.code.len() as u64)?;
+    for (instruction, _, _) in &layout.code {
+        let (kind, wide) = opcode(instruction);
+        let mut value = layout.argument(instruction, pool_len);
+        let kind = match wide {
+            Some(wide) if !fits_in_argument(value) => {
+                value = pool
+                    .iter()
+                    .position(|entry| *entry == value as u32)
+                    .unwrap() as i32;
+                wide
+            }
+            _ => kind,
+        };
+        writer.write(&[kind])?;
+        if has_argument(instruction) {
+            // Only the 24 bits an instruction word has room for, sign extended
+            writer.write_signed(((value << 8) >> 8) as i64)?;
+        }
+    }
+
+    writer.section(SECTION_SYMBOLS);
+    for (label, addr) in &layout.labels {
+        writer.write(&[SYMBOL_LABEL])?;
+        writer.write_varint(*addr as u64)?;
+        writer.write(label.as_bytes())?;
+        writer.write(&[0])?;
+    }
+    for (addr, ident) in layout.idents.iter().enumerate() {
+        writer.write(&[SYMBOL_IDENT])?;
+        writer.write_varint(pool_len as u64 + addr as u64)?;
+        writer.write(ident.as_bytes())?;
+        writer.write(&[0])?;
+    }
+
+    writer.section(SECTION_DEBUG);
+    writer.write_varint(layout.code.len() as u64)?;
+    let (mut line, mut source_line) = (0, 0);
+    for (_, next_line, next_source_line) in &layout.code {
+        writer.write_signed(*next_line as i64 - line)?;
+        writer.write_signed(*next_source_line as i64 - source_line)?;
+        (line, source_line) = (*next_line as i64, *next_source_line as i64);
+    }
+    Ok(())
+}
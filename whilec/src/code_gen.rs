@@ -1,9 +1,80 @@
-use crate::parser::{Arithmetic, Boolean, Statement};
+use std::collections::HashSet;
+use std::io::{self, Write};
+
+use crate::parser::{Arithmetic, ArithmeticOp, Boolean, BooleanOp, Statement};
+
+/// A line of the assembly, labels end in `:` like they do there
+#[derive(Debug, Clone)]
+pub enum Instruction {
+    Label(String),
+    // The source line of the instructions after it
+    Loc(usize),
+    Noop,
+    Push(i32),
+    PushBool(bool),
+    Fetch(String),
+    Store(String),
+    Dup,
+    Drop,
+    Arithmetic(ArithmeticOp),
+    Boolean(BooleanOp),
+    Jmp(String),
+    Jeqz(String),
+    Jnez(String),
+    Call(String),
+    Spawn(String),
+    Join,
+    Ret,
+    PrintC(i32),
+    PrintV(String),
+}
+
+impl std::fmt::Display for Instruction {
+    fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
+        match self {
+            Instruction::Label(label) => write!(f, "{label}"),
+            Instruction::Loc(line) => write!(f, ".loc {line}"),
+            Instruction::Noop => write!(f, "    noop"),
+            Instruction::Push(int) => write!(f, "    push {int}"),
+            Instruction::PushBool(bool) => write!(f, "    push {bool}"),
+            Instruction::Fetch(ident) => write!(f, "    fetch {ident}"),
+            Instruction::Store(ident) => write!(f, "    store {ident}"),
+            Instruction::Dup => write!(f, "    dup"),
+            Instruction::Drop => write!(f, "    drop"),
+            Instruction::Arithmetic(op) => write!(f, "    {op}"),
+            Instruction::Boolean(op) => write!(f, "    {op}"),
+            Instruction::Jmp(label) => write!(f, "    jmp {label}"),
+            Instruction::Jeqz(label) => write!(f, "    jeqz {label}"),
+            Instruction::Jnez(label) => write!(f, "    jnez {label}"),
+            Instruction::Call(label) => write!(f, "    call {label}"),
+            Instruction::Spawn(label) => write!(f, "    spawn {label}"),
+            Instruction::Join => write!(f, "    join"),
+            Instruction::Ret => write!(f, "    ret"),
+            Instruction::PrintC(int) => write!(f, "    printc {int}"),
+            Instruction::PrintV(ident) => write!(f, "    printv {ident}"),
+        }
+    }
+}
+
+/// Write the assembly am4asm reads, one instruction at a time
+pub fn write_asm(instructions: &[Instruction], writer: &mut impl Write) -> io::Result<()> {
+    for instruction in instructions {
+        writeln!(writer, "{instruction}")?;
+    }
+    writer.flush()
+}
 
 #[derive(Clone)]
 pub struct CodeGenerator {
-    pub output_string: String,
+    pub instructions: Vec<Instruction>,
     pub label: usize,
+    // Procedure and par branch bodies are emitted after the main program, in
+    // definition order, under their label
+    pub procs: Vec<(String, Statement)>,
+    pub calls: HashSet<String>,
+    // Source line of the last `.loc`, which the assembler gives every
+    // instruction after it
+    pub line: usize,
 }
 
 impl CodeGenerator {
@@ -13,13 +84,46 @@ impl CodeGenerator {
         label
     }
 
+    pub fn code_gen_program(&mut self, ast: Statement) {
+        self.code_gen(ast);
+        if !self.procs.is_empty() {
+            self.code_gen_procs();
+        }
+
+        let defined: HashSet<String> = self.procs.iter().map(|(label, _)| label.clone()).collect();
+        if let Some(name) = self
+            .calls
+            .iter()
+            .find(|name| !defined.contains(&format!("proc_{name}")))
+        {
+            panic!("error: procedure `{name}` is not defined");
+        }
+    }
+
+    fn code_gen_procs(&mut self) {
+        // Jumping past the last instruction halts the vm
+        let end_label = self.next_label();
+        self.instructions.push(Instruction::Jmp(end_label.clone()));
+
+        let mut index = 0;
+        while index < self.procs.len() {
+            let (label, body) = self.procs[index].clone();
+            self.instructions
+                .push(Instruction::Label(format!("{label}:")));
+            self.code_gen(body);
+            self.instructions.push(Instruction::Ret);
+            index += 1;
+        }
+        self.instructions.push(Instruction::Label(end_label));
+    }
+
     pub fn code_gen(&mut self, ast: Statement) {
         match ast {
             Statement::Assignment { ident, value } => {
                 self.code_gen_arithmetic(value.clone());
-                self.output_string += &format!("    store {ident}\n");
+                self.instructions.push(Instruction::Store(ident));
             }
-            Statement::Skip => self.output_string += "    noop\n",
+            Statement::Skip => self.instructions.push(Instruction::Noop),
             Statement::Composision(statement, statement1) => {
                 self.code_gen(*statement);
                 self.code_gen(*statement1);
@@ -32,22 +136,94 @@ impl CodeGenerator {
             Statement::While { condition, body } => self.code_gen_while(condition, *body),
             Statement::Paren(statement) => self.code_gen(*statement),
             Statement::Print(arithmetic) => match arithmetic {
-                Arithmetic::Int(int) => self.output_string += &format!("    printc {int}\n"),
-                Arithmetic::Ident(ident) => self.output_string += &format!("    printv {ident}\n"),
+                Arithmetic::Int(int) => self.instructions.push(Instruction::PrintC(int)),
+                Arithmetic::Ident(ident) => self.instructions.push(Instruction::PrintV(ident)),
                 Arithmetic::Binary { .. } => unreachable!(),
                 Arithmetic::Paren(_) => unreachable!(),
             },
+            Statement::Proc { name, body } => {
+                let label = format!("proc_{name}");
+                if self.procs.iter().any(|(defined, _)| *defined == label) {
+                    panic!("error: procedure `{name}` is defined more than once");
+                }
+                self.procs.push((label, *body));
+            }
+            Statement::Call(name) => {
+                self.instructions
+                    .push(Instruction::Call(format!("proc_{name}:")));
+                self.calls.insert(name);
+            }
+            Statement::Par(branches) => self.code_gen_par(branches),
+            Statement::Line(line, statement) => {
+                // A procedure is generated after the program, with the lines
+                // of its body
+                if !matches!(*statement, Statement::Proc { .. }) {
+                    self.code_gen_line(line);
+                }
+                self.code_gen(*statement);
+            }
+        }
+    }
+
+    fn code_gen_line(&mut self, line: usize) {
+        if line != self.line {
+            self.instructions.push(Instruction::Loc(line));
+            self.line = line;
+        }
+    }
+
+    /// Every branch is spawned before the first join, which leaves the handles
+    /// on the stack
+    fn code_gen_par(&mut self, branches: Vec<Statement>) {
+        let count = branches.len();
+        for branch in branches {
+            let label = format!("par_{}", self.label);
+            self.label += 1;
+            self.instructions.push(Instruction::Push(0));
+            self.instructions
+                .push(Instruction::Spawn(format!("{label}:")));
+            self.procs.push((label, branch));
+        }
+        for _ in 0..count {
+            self.instructions.push(Instruction::Join);
+            self.instructions.push(Instruction::Drop);
+        }
+    }
+
+    /// A value that was just stored is still on the stack if it is duplicated
+    /// before the store, which saves the trip through memory
+    fn code_gen_fetch(&mut self, ident: String) {
+        // A `.loc` does not run, the store still comes right before
+        let mut end = self.instructions.len();
+        if let Some(Instruction::Loc(_)) = self.instructions.last() {
+            end -= 1;
+        }
+        match end.checked_sub(1).map(|store| &self.instructions[store]) {
+            Some(Instruction::Store(stored)) if *stored == ident => {
+                self.instructions.insert(end - 1, Instruction::Dup)
+            }
+            _ => self.instructions.push(Instruction::Fetch(ident)),
+        }
+    }
+
+    /// Both operands of `x * x` are the same value, compute it once
+    fn code_gen_operands(&mut self, lhs: Arithmetic, rhs: Arithmetic) {
+        if lhs.unparen() == rhs.unparen() {
+            self.code_gen_arithmetic(lhs);
+            self.instructions.push(Instruction::Dup);
+        } else {
+            self.code_gen_arithmetic(lhs);
+            self.code_gen_arithmetic(rhs);
         }
     }
 
     fn code_gen_arithmetic(&mut self, ast: Arithmetic) {
         match ast {
-            Arithmetic::Int(int) => self.output_string += &format!("    push {int}\n"),
-            Arithmetic::Ident(string) => self.output_string += &format!("    fetch {string}\n"),
+            Arithmetic::Int(int) => self.instructions.push(Instruction::Push(int)),
+            Arithmetic::Ident(string) => self.code_gen_fetch(string),
             Arithmetic::Binary { lhs, op, rhs } => {
-                self.code_gen_arithmetic(*lhs);
-                self.code_gen_arithmetic(*rhs);
-                self.output_string += &format!("    {}\n", op);
+                self.code_gen_operands(*lhs, *rhs);
+                self.instructions.push(Instruction::Arithmetic(op));
             }
             Arithmetic::Paren(arithmetic) => self.code_gen_arithmetic(*arithmetic),
         }
@@ -55,42 +231,90 @@ impl CodeGenerator {
 
     fn code_gen_boolean(&mut self, ast: Boolean) {
         match ast {
-            Boolean::False => self.output_string += "    push false\n",
-            Boolean::True => self.output_string += "    push true\n",
+            Boolean::False => self.instructions.push(Instruction::PushBool(false)),
+            Boolean::True => self.instructions.push(Instruction::PushBool(true)),
             Boolean::Cmp { lhs, op, rhs } => {
-                self.code_gen_arithmetic(*lhs);
-                self.code_gen_arithmetic(*rhs);
-                self.output_string += &format!("    {}\n", op);
+                self.code_gen_operands(*lhs, *rhs);
+                self.instructions.push(Instruction::Boolean(op));
             }
             Boolean::Binary { lhs, op, rhs } => {
                 self.code_gen_boolean(*lhs);
                 self.code_gen_boolean(*rhs);
-                self.output_string += &format!("    {}\n", op);
+                self.instructions.push(Instruction::Boolean(op));
             }
             Boolean::Paren(boolean) => self.code_gen_boolean(*boolean),
         }
     }
 
+    /// Jump to target if the condition is `jump_if`, fall through if it is
+    /// not
+    ///
+    /// `&` and `|` skip their right side once the left side decides the
+    /// result, and every comparison jumps straight to where its result leads.
+    fn code_gen_condition(&mut self, ast: Boolean, target: &str, jump_if: bool) {
+        let jump = |target: &str| {
+            if jump_if {
+                Instruction::Jnez(target.to_string())
+            } else {
+                Instruction::Jeqz(target.to_string())
+            }
+        };
+        match ast {
+            Boolean::False | Boolean::True => {
+                if matches!(ast, Boolean::True) == jump_if {
+                    self.instructions.push(Instruction::Jmp(target.to_string()));
+                }
+            }
+            Boolean::Cmp { lhs, op, rhs } => {
+                self.code_gen_operands(*lhs, *rhs);
+                self.instructions.push(Instruction::Boolean(op));
+                self.instructions.push(jump(target));
+            }
+            Boolean::Binary {
+                lhs,
+                op: op @ (BooleanOp::And | BooleanOp::Or),
+                rhs,
+            } => {
+                // The left side of `a & b` decides if it is false, of `a | b`
+                // if it is true
+                let decides = matches!(op, BooleanOp::Or);
+                if decides == jump_if {
+                    self.code_gen_condition(*lhs, target, jump_if);
+                    self.code_gen_condition(*rhs, target, jump_if);
+                } else {
+                    let skip_label = self.next_label();
+                    self.code_gen_condition(*lhs, &skip_label, decides);
+                    self.code_gen_condition(*rhs, target, jump_if);
+                    self.instructions.push(Instruction::Label(skip_label));
+                }
+            }
+            Boolean::Paren(boolean) => self.code_gen_condition(*boolean, target, jump_if),
+            ast => {
+                self.code_gen_boolean(ast);
+                self.instructions.push(jump(target));
+            }
+        }
+    }
+
     fn code_gen_if(&mut self, condition: Boolean, if_branch: Statement, else_branch: Statement) {
         let else_label = self.next_label();
         let end_label = self.next_label();
-        self.code_gen_boolean(condition);
-        self.output_string += &format!("    jeqz {else_label}\n");
+        self.code_gen_condition(condition, &else_label, false);
         self.code_gen(if_branch);
-        self.output_string += &format!("    jmp {end_label}\n");
-        self.output_string += &format!("{else_label}\n");
+        self.instructions.push(Instruction::Jmp(end_label.clone()));
+        self.instructions.push(Instruction::Label(else_label));
         self.code_gen(else_branch);
-        self.output_string += &format!("{end_label}\n");
+        self.instructions.push(Instruction::Label(end_label));
     }
 
     fn code_gen_while(&mut self, condition: Boolean, body: Statement) {
         let condition_label = self.next_label();
         let end_label = self.next_label();
-        self.output_string += &format!("{condition_label}\n");
-        self.code_gen_boolean(condition);
-        self.output_string += &format!("    jeqz {end_label}\n");
+        self.instructions
+            .push(Instruction::Label(condition_label.clone()));
+        self.code_gen_condition(condition, &end_label, false);
         self.code_gen(body);
-        self.output_string += &format!("    jmp {condition_label}\n");
-        self.output_string += &format!("{end_label}\n");
+        self.instructions.push(Instruction::Jmp(condition_label));
+        self.instructions.push(Instruction::Label(end_label));
     }
 }
@@ -12,6 +12,22 @@ pub enum Token {
     Sub,
     #[token("*")]
     Mul,
+    #[token("/")]
+    Div,
+    #[token("%")]
+    Mod,
+
+    // `&` and `|` are the boolean connectives
+    #[token("band")]
+    BitAnd,
+    #[token("bor")]
+    BitOr,
+    #[token("^")]
+    BitXor,
+    #[token("<<")]
+    Shl,
+    #[token(">>")]
+    Shr,
 
     #[token("(")]
     OpenParen,
@@ -62,22 +78,41 @@ pub enum Token {
     Do,
     #[token("print")]
     Print,
+    #[token("proc")]
+    Proc,
+    #[token("call")]
+    Call,
+    #[token("par")]
+    Par,
+    #[token("{")]
+    OpenBrace,
+    #[token("}")]
+    CloseBrace,
 
     #[regex(r"[A-Za-z][0-9A-Za-z]*", |ident| ident.slice().to_string())]
     Ident(String),
 }
 
-pub fn lex(input: String) -> Vec<Token> {
+/// Every token, with the line it starts on, one-indexed
+pub fn lex(input: String) -> (Vec<Token>, Vec<usize>) {
     let code = std::fs::read_to_string(input).expect("Failed to read file");
     let lexer = Token::lexer(&code);
     let mut tokens = vec![];
+    let mut lines = vec![];
+    let mut line = 1;
+    let mut counted = 0;
     for (token, span) in lexer.spanned() {
+        line += code[counted..span.start].matches('\n').count();
+        counted = span.start;
         match token {
-            Ok(token) => tokens.push(token),
+            Ok(token) => {
+                tokens.push(token);
+                lines.push(line);
+            }
             Err(_) => {
-                panic!("lexer error at {:?}", span);
+                panic!("lexer error at line {line}, {:?}", span);
             }
         }
     }
-    tokens
+    (tokens, lines)
 }
@@ -1,30 +1,67 @@
-use std::io::Write;
+use std::io::BufWriter;
 
 use clap::Parser;
 
+mod binary;
 mod code_gen;
 mod lexer;
+mod optimize;
 mod parser;
 
+#[derive(clap::ValueEnum, Clone, Copy, Debug)]
+enum Emit {
+    /// The assembly am4asm reads, for debugging
+    Asm,
+    /// A binary am4vm runs
+    Bin,
+}
+
 #[derive(Parser, Debug)]
 struct Args {
     input: String,
 
-    #[arg(short, long, default_value_t = String::from("out.bin"))]
-    output: String,
+    /// Defaults to out.bin, or out.asm for the assembly
+    #[arg(short, long)]
+    output: Option<String>,
+
+    /// What to write
+    #[arg(long, value_enum, default_value_t = Emit::Bin)]
+    emit: Emit,
+
+    /// Optimize the program, 0 (default), 1 or 2
+    #[arg(short = 'O', default_value_t = 0, value_parser = clap::value_parser!(u8).range(0..=2))]
+    optimize: u8,
 }
 
 fn main() {
     let args = Args::parse();
-    let tokens = lexer::lex(args.input);
-    let mut parser = parser::Parser { tokens, index: 0 };
-    let ast = parser.parse_statement();
+    let (tokens, lines) = lexer::lex(args.input);
+    let mut parser = parser::Parser {
+        tokens,
+        lines,
+        index: 0,
+    };
+    let ast = optimize::optimize(parser.parse_statement(), args.optimize);
     let mut code_generator = code_gen::CodeGenerator {
-        output_string: String::from("0:\n"),
+        instructions: vec![code_gen::Instruction::Label(String::from("0:"))],
         label: 1,
+        procs: Vec::new(),
+        calls: std::collections::HashSet::new(),
+        line: 0,
     };
-    code_generator.code_gen(ast);
-    let mut file = std::fs::File::create("out.asm").unwrap();
-    file.write_all(code_generator.output_string.as_bytes())
-        .unwrap();
+    code_generator.code_gen_program(ast);
+
+    let output = args.output.unwrap_or_else(|| match args.emit {
+        Emit::Asm => String::from("out.asm"),
+        Emit::Bin => String::from("out.bin"),
+    });
+    let file = std::fs::File::create(&output)
+        .unwrap_or_else(|error| panic!("error: failed to create `{output}`: {error}"));
+    let mut writer = BufWriter::new(file);
+    let instructions = &code_generator.instructions;
+    match args.emit {
+        Emit::Asm => code_gen::write_asm(instructions, &mut writer),
+        Emit::Bin => binary::write_binary(instructions, &mut writer),
+    }
+    .unwrap_or_else(|error| panic!("error: failed to write `{output}`: {error}"));
 }
@@ -0,0 +1,1041 @@
+use std::collections::{HashMap, HashSet};
+
+use crate::parser::{Arithmetic, ArithmeticOp, Boolean, BooleanOp, Statement};
+
+/// Rewrite a program into one that runs fewer instructions
+///
+/// `-O1` propagates and folds constants, drops the branches and loops that
+/// can not run and reduces the strength of arithmetic. `-O2` also computes
+/// common subexpressions and the expressions a loop does not change once,
+/// into a temporary variable.
+///
+/// The passes work on the tree the parser builds, which the code generator
+/// walks, so every level generates code the same way.
+pub fn optimize(ast: Statement, level: u8) -> Statement {
+    if level == 0 {
+        return ast;
+    }
+    let mut before = HashSet::new();
+    stores(&ast, &mut before);
+    let mut ast = ast;
+    let mut unassigned = HashSet::new();
+    loop {
+        let mut folder = Folder {
+            known: HashMap::new(),
+            unassigned: unassigned.clone(),
+        };
+        ast = folder.fold(ast);
+        // A variable whose every assignment was in a dropped branch has no
+        // place in memory any more, it reads as the 0 it always holds. That
+        // can drop more branches.
+        let mut after = HashSet::new();
+        stores(&ast, &mut after);
+        let dropped: Vec<String> = before
+            .difference(&after)
+            .filter(|ident| !unassigned.contains(*ident))
+            .cloned()
+            .collect();
+        if dropped.is_empty() {
+            break;
+        }
+        unassigned.extend(dropped);
+    }
+    if level == 1 {
+        return ast;
+    }
+    let mut temporaries = Temporaries {
+        concurrent: concurrent_procs(&ast),
+        next: 0,
+    };
+    temporaries.block(ast, false)
+}
+
+/// Append the statements of a sequence, without the grouping of `;` and
+/// parentheses
+fn flatten(statement: Statement, statements: &mut Vec<Statement>) {
+    match statement {
+        Statement::Composision(first, second) => {
+            flatten(*first, statements);
+            flatten(*second, statements);
+        }
+        Statement::Paren(statement) => flatten(*statement, statements),
+        statement => statements.push(statement),
+    }
+}
+
+/// The statements one after the other, `skip` if there are none
+fn sequence(statements: Vec<Statement>) -> Statement {
+    let mut statements = statements.into_iter().rev();
+    let Some(mut sequence) = statements.next() else {
+        return Statement::Skip;
+    };
+    for statement in statements {
+        sequence = Statement::Composision(Box::new(statement), Box::new(sequence));
+    }
+    sequence
+}
+
+fn is_skip(statement: &Statement) -> bool {
+    match statement {
+        Statement::Skip => true,
+        Statement::Line(_, statement) => is_skip(statement),
+        _ => false,
+    }
+}
+
+/// Append the procedures defined in a statement that is dropped, they can
+/// still be called
+fn definitions(statement: Statement, kept: &mut Vec<Statement>) {
+    match statement {
+        Statement::Line(_, ref inner) if matches!(**inner, Statement::Proc { .. }) => {
+            kept.push(statement)
+        }
+        Statement::Proc { .. } => kept.push(statement),
+        Statement::Line(_, statement) | Statement::Paren(statement) => {
+            definitions(*statement, kept)
+        }
+        Statement::Composision(first, second) => {
+            definitions(*first, kept);
+            definitions(*second, kept);
+        }
+        Statement::If {
+            if_branch,
+            else_branch,
+            ..
+        } => {
+            definitions(*if_branch, kept);
+            definitions(*else_branch, kept);
+        }
+        Statement::While { body, .. } => definitions(*body, kept),
+        _ => (),
+    }
+}
+
+/// Add the variables a statement assigns to
+///
+/// Returns false if it calls a procedure or runs branches in parallel, which
+/// can assign to any variable
+fn assigned(statement: &Statement, variables: &mut HashSet<String>) -> bool {
+    match statement {
+        Statement::Assignment { ident, .. } => {
+            variables.insert(ident.clone());
+            true
+        }
+        // A definition does not run the body
+        Statement::Skip | Statement::Print(_) | Statement::Proc { .. } => true,
+        Statement::Composision(first, second) => {
+            assigned(first, variables) && assigned(second, variables)
+        }
+        Statement::If {
+            if_branch,
+            else_branch,
+            ..
+        } => assigned(if_branch, variables) && assigned(else_branch, variables),
+        Statement::While { body, .. } | Statement::Paren(body) | Statement::Line(_, body) => {
+            assigned(body, variables)
+        }
+        Statement::Call(_) | Statement::Par(_) => false,
+    }
+}
+
+/// Add every variable a statement assigns to anywhere, in the bodies of
+/// procedures and parallel branches too
+fn stores(statement: &Statement, variables: &mut HashSet<String>) {
+    match statement {
+        Statement::Assignment { ident, .. } => {
+            variables.insert(ident.clone());
+        }
+        Statement::Skip | Statement::Print(_) | Statement::Call(_) => (),
+        Statement::Composision(first, second) => {
+            stores(first, variables);
+            stores(second, variables);
+        }
+        Statement::If {
+            if_branch,
+            else_branch,
+            ..
+        } => {
+            stores(if_branch, variables);
+            stores(else_branch, variables);
+        }
+        Statement::While { body, .. }
+        | Statement::Paren(body)
+        | Statement::Line(_, body)
+        | Statement::Proc { body, .. } => stores(body, variables),
+        Statement::Par(branches) => {
+            for branch in branches {
+                stores(branch, variables);
+            }
+        }
+    }
+}
+
+/// True if evaluating the expression can stop the vm, dividing by zero
+fn can_trap(arithmetic: &Arithmetic) -> bool {
+    match arithmetic {
+        Arithmetic::Int(_) | Arithmetic::Ident(_) => false,
+        Arithmetic::Binary {
+            lhs,
+            op: ArithmeticOp::Div | ArithmeticOp::Mod,
+            rhs,
+        } => !matches!(**rhs, Arithmetic::Int(int) if int != 0) || can_trap(lhs) || can_trap(rhs),
+        Arithmetic::Binary { lhs, rhs, .. } => can_trap(lhs) || can_trap(rhs),
+        Arithmetic::Paren(arithmetic) => can_trap(arithmetic),
+    }
+}
+
+fn boolean_can_trap(boolean: &Boolean) -> bool {
+    match boolean {
+        Boolean::False | Boolean::True => false,
+        Boolean::Binary { lhs, rhs, .. } => boolean_can_trap(lhs) || boolean_can_trap(rhs),
+        Boolean::Cmp { lhs, rhs, .. } => can_trap(lhs) || can_trap(rhs),
+        Boolean::Paren(boolean) => boolean_can_trap(boolean),
+    }
+}
+
+/// The value the vm computes, None if it stops instead
+fn evaluate(op: &ArithmeticOp, lhs: i32, rhs: i32) -> Option<i32> {
+    Some(match op {
+        ArithmeticOp::Add => lhs.wrapping_add(rhs),
+        ArithmeticOp::Sub => lhs.wrapping_sub(rhs),
+        ArithmeticOp::Mul => lhs.wrapping_mul(rhs),
+        ArithmeticOp::Div if rhs == 0 => return None,
+        ArithmeticOp::Div => lhs.wrapping_div(rhs),
+        ArithmeticOp::Mod if rhs == 0 => return None,
+        ArithmeticOp::Mod => lhs.wrapping_rem(rhs),
+        ArithmeticOp::BitAnd => lhs & rhs,
+        ArithmeticOp::BitOr => lhs | rhs,
+        ArithmeticOp::BitXor => lhs ^ rhs,
+        ArithmeticOp::Shl => ((lhs as u32) << (rhs & 31)) as i32,
+        ArithmeticOp::Shr => lhs >> (rhs & 31),
+    })
+}
+
+fn compare(op: &BooleanOp, lhs: i32, rhs: i32) -> bool {
+    match op {
+        BooleanOp::Eq => lhs == rhs,
+        BooleanOp::Lt => lhs < rhs,
+        BooleanOp::LEq => lhs <= rhs,
+        BooleanOp::Gt => lhs > rhs,
+        BooleanOp::GEq => lhs >= rhs,
+        op => unreachable!("{op} is not a comparison"),
+    }
+}
+
+fn constant(value: bool) -> Boolean {
+    if value { Boolean::True } else { Boolean::False }
+}
+
+fn binary(lhs: Arithmetic, op: ArithmeticOp, rhs: Arithmetic) -> Arithmetic {
+    Arithmetic::Binary {
+        lhs: Box::new(lhs),
+        op,
+        rhs: Box::new(rhs),
+    }
+}
+
+/// The cheapest expression that computes `lhs op rhs`, with folded operands
+fn simplify(lhs: Arithmetic, op: ArithmeticOp, rhs: Arithmetic) -> Arithmetic {
+    if let (Arithmetic::Int(lhs), Arithmetic::Int(rhs)) = (&lhs, &rhs)
+        && let Some(int) = evaluate(&op, *lhs, *rhs)
+    {
+        return Arithmetic::Int(int);
+    }
+    let commutative = matches!(
+        op,
+        ArithmeticOp::Add
+            | ArithmeticOp::Mul
+            | ArithmeticOp::BitAnd
+            | ArithmeticOp::BitOr
+            | ArithmeticOp::BitXor
+    );
+    match (lhs, rhs) {
+        (lhs, Arithmetic::Int(int)) => simplify_constant(lhs, op, int),
+        // A constant has nothing to evaluate first
+        (Arithmetic::Int(int), rhs) if commutative => simplify_constant(rhs, op, int),
+        (lhs, rhs)
+            if lhs == rhs
+                && !can_trap(&lhs)
+                && matches!(op, ArithmeticOp::Sub | ArithmeticOp::BitXor) =>
+        {
+            Arithmetic::Int(0)
+        }
+        (lhs, rhs) => binary(lhs, op, rhs),
+    }
+}
+
+/// lhs as a term plus a constant, if it is one
+fn split_term(lhs: &Arithmetic) -> Option<(Arithmetic, i32)> {
+    match lhs {
+        Arithmetic::Binary { lhs, op, rhs } => match (op, &**rhs) {
+            (ArithmeticOp::Add, Arithmetic::Int(int)) => Some(((**lhs).clone(), *int)),
+            (ArithmeticOp::Sub, Arithmetic::Int(int)) => {
+                Some(((**lhs).clone(), int.wrapping_neg()))
+            }
+            _ => None,
+        },
+        _ => None,
+    }
+}
+
+/// lhs as a factor times a constant, if it is one
+fn split_factor(lhs: &Arithmetic) -> Option<(Arithmetic, i32)> {
+    match lhs {
+        Arithmetic::Binary { lhs, op, rhs } => match (op, &**rhs) {
+            (ArithmeticOp::Mul, Arithmetic::Int(int)) => Some(((**lhs).clone(), *int)),
+            (ArithmeticOp::Shl, Arithmetic::Int(int)) => {
+                Some(((**lhs).clone(), 1i32.wrapping_shl(*int as u32 & 31)))
+            }
+            // What `x * 2` becomes
+            (ArithmeticOp::Add, rhs) if **lhs == *rhs => Some(((**lhs).clone(), 2)),
+            _ => None,
+        },
+        _ => None,
+    }
+}
+
+/// The cheapest expression that computes `lhs op int`
+fn simplify_constant(lhs: Arithmetic, op: ArithmeticOp, int: i32) -> Arithmetic {
+    use ArithmeticOp::*;
+    match (&op, int) {
+        (Add | Sub | BitOr | BitXor, 0) | (Mul | Div, 1) | (BitAnd, -1) => return lhs,
+        (Shl | Shr, int) if int & 31 == 0 => return lhs,
+        (Mul | BitAnd, 0) | (Mod, 1 | -1) if !can_trap(&lhs) => return Arithmetic::Int(0),
+        (BitOr, -1) if !can_trap(&lhs) => return Arithmetic::Int(-1),
+        _ => (),
+    }
+    // Two's complement wraps around the same way in any order, so constants
+    // can be combined
+    match op {
+        Add | Sub => {
+            if let Some((term, constant)) = split_term(&lhs) {
+                let int = if op == Add { int } else { int.wrapping_neg() };
+                return simplify_constant(term, Add, constant.wrapping_add(int));
+            }
+        }
+        Mul => {
+            if let Some((factor, constant)) = split_factor(&lhs) {
+                return simplify_constant(factor, Mul, constant.wrapping_mul(int));
+            }
+            // The code generator computes the operand once and duplicates it
+            if int == 2 {
+                return binary(lhs.clone(), Add, lhs);
+            }
+            if int.count_ones() == 1 {
+                return binary(lhs, Shl, Arithmetic::Int(int.trailing_zeros() as i32));
+            }
+        }
+        _ => (),
+    }
+    binary(lhs, op, Arithmetic::Int(int))
+}
+
+/// Propagates and folds constants
+struct Folder {
+    // Variables that hold a known value where the program is
+    known: HashMap<String, i32>,
+    // Variables that are read but never assigned, which hold 0
+    unassigned: HashSet<String>,
+}
+
+impl Folder {
+    /// A folder for a part of the program that starts out knowing `known`
+    fn nested(&self, known: HashMap<String, i32>) -> Folder {
+        Folder {
+            known,
+            unassigned: self.unassigned.clone(),
+        }
+    }
+
+    fn fold(&mut self, statement: Statement) -> Statement {
+        match statement {
+            Statement::Assignment { ident, value } => {
+                let value = self.arithmetic(value);
+                match value {
+                    Arithmetic::Int(int) => self.known.insert(ident.clone(), int),
+                    _ => self.known.remove(&ident),
+                };
+                Statement::Assignment { ident, value }
+            }
+            Statement::Skip => Statement::Skip,
+            statement @ (Statement::Composision(..) | Statement::Paren(_)) => {
+                let mut statements = vec![];
+                flatten(statement, &mut statements);
+                let mut folded = vec![];
+                for statement in statements {
+                    flatten(self.fold(statement), &mut folded);
+                }
+                folded.retain(|statement| !is_skip(statement));
+                sequence(folded)
+            }
+            Statement::If {
+                condition,
+                if_branch,
+                else_branch,
+            } => self.fold_if(condition, *if_branch, *else_branch),
+            Statement::While { condition, body } => self.fold_while(condition, *body),
+            Statement::Print(Arithmetic::Ident(ident)) => {
+                match self.arithmetic(Arithmetic::Ident(ident.clone())) {
+                    // printc has no wide form
+                    Arithmetic::Int(int) if (-(1 << 23)..1 << 23).contains(&int) => {
+                        Statement::Print(Arithmetic::Int(int))
+                    }
+                    _ => Statement::Print(Arithmetic::Ident(ident)),
+                }
+            }
+            Statement::Print(arithmetic) => Statement::Print(arithmetic),
+            Statement::Proc { name, body } => {
+                let mut folder = self.nested(HashMap::new());
+                Statement::Proc {
+                    name,
+                    body: Box::new(folder.fold(*body)),
+                }
+            }
+            Statement::Call(name) => {
+                self.known.clear();
+                Statement::Call(name)
+            }
+            Statement::Par(branches) => {
+                let branches = branches
+                    .into_iter()
+                    .map(|branch| {
+                        let mut folder = self.nested(HashMap::new());
+                        folder.fold(branch)
+                    })
+                    .collect();
+                self.known.clear();
+                Statement::Par(branches)
+            }
+            Statement::Line(line, statement) => match self.fold(*statement) {
+                // What is left of a branch has lines of its own
+                statement @ (Statement::Skip
+                | Statement::Composision(..)
+                | Statement::Paren(_)
+                | Statement::Line(..)) => statement,
+                statement => Statement::Line(line, Box::new(statement)),
+            },
+        }
+    }
+
+    fn fold_if(
+        &mut self,
+        condition: Boolean,
+        if_branch: Statement,
+        else_branch: Statement,
+    ) -> Statement {
+        match self.boolean(condition) {
+            Boolean::True => {
+                let mut kept = vec![if_branch];
+                definitions(else_branch, &mut kept);
+                self.fold(sequence(kept))
+            }
+            Boolean::False => {
+                let mut kept = vec![];
+                definitions(if_branch, &mut kept);
+                kept.push(else_branch);
+                self.fold(sequence(kept))
+            }
+            condition => {
+                let mut other = self.nested(self.known.clone());
+                let if_branch = self.fold(if_branch);
+                let else_branch = other.fold(else_branch);
+                // Only what both branches agree on is known after them
+                self.known
+                    .retain(|ident, int| other.known.get(ident) == Some(int));
+                Statement::If {
+                    condition,
+                    if_branch: Box::new(if_branch),
+                    else_branch: Box::new(else_branch),
+                }
+            }
+        }
+    }
+
+    fn fold_while(&mut self, condition: Boolean, body: Statement) -> Statement {
+        // The condition also runs after the body, which may change anything it
+        // assigns to
+        let mut variables = HashSet::new();
+        if assigned(&body, &mut variables) {
+            self.known.retain(|ident, _| !variables.contains(ident));
+        } else {
+            self.known.clear();
+        }
+        match self.boolean(condition) {
+            Boolean::False => {
+                let mut kept = vec![];
+                definitions(body, &mut kept);
+                self.fold(sequence(kept))
+            }
+            condition => {
+                let known = self.known.clone();
+                let body = self.fold(body);
+                self.known = known;
+                Statement::While {
+                    condition,
+                    body: Box::new(body),
+                }
+            }
+        }
+    }
+
+    fn arithmetic(&self, arithmetic: Arithmetic) -> Arithmetic {
+        match arithmetic {
+            Arithmetic::Int(int) => Arithmetic::Int(int),
+            Arithmetic::Ident(ident) if self.unassigned.contains(&ident) => Arithmetic::Int(0),
+            Arithmetic::Ident(ident) => match self.known.get(&ident) {
+                Some(&int) => Arithmetic::Int(int),
+                None => Arithmetic::Ident(ident),
+            },
+            Arithmetic::Binary { lhs, op, rhs } => {
+                simplify(self.arithmetic(*lhs), op, self.arithmetic(*rhs))
+            }
+            Arithmetic::Paren(arithmetic) => self.arithmetic(*arithmetic),
+        }
+    }
+
+    fn boolean(&self, boolean: Boolean) -> Boolean {
+        match boolean {
+            Boolean::False => Boolean::False,
+            Boolean::True => Boolean::True,
+            Boolean::Cmp { lhs, op, rhs } => {
+                let lhs = self.arithmetic(*lhs);
+                let rhs = self.arithmetic(*rhs);
+                match (&lhs, &rhs) {
+                    (Arithmetic::Int(lhs), Arithmetic::Int(rhs)) => {
+                        constant(compare(&op, *lhs, *rhs))
+                    }
+                    _ if lhs == rhs && !can_trap(&lhs) => constant(matches!(
+                        op,
+                        BooleanOp::Eq | BooleanOp::LEq | BooleanOp::GEq
+                    )),
+                    _ => Boolean::Cmp {
+                        lhs: Box::new(lhs),
+                        op,
+                        rhs: Box::new(rhs),
+                    },
+                }
+            }
+            Boolean::Binary { lhs, op, rhs } => {
+                let lhs = self.boolean(*lhs);
+                let rhs = self.boolean(*rhs);
+                // The right side only runs if the left side does not decide,
+                // a left side that can stop the vm stays
+                match (op, lhs, rhs) {
+                    (BooleanOp::And, Boolean::True, boolean)
+                    | (BooleanOp::And, boolean, Boolean::True)
+                    | (BooleanOp::Or, Boolean::False, boolean)
+                    | (BooleanOp::Or, boolean, Boolean::False) => boolean,
+                    (BooleanOp::And, Boolean::False, _) => Boolean::False,
+                    (BooleanOp::Or, Boolean::True, _) => Boolean::True,
+                    (BooleanOp::And, boolean, Boolean::False) if !boolean_can_trap(&boolean) => {
+                        Boolean::False
+                    }
+                    (BooleanOp::Or, boolean, Boolean::True) if !boolean_can_trap(&boolean) => {
+                        Boolean::True
+                    }
+                    (op, lhs, rhs) => Boolean::Binary {
+                        lhs: Box::new(lhs),
+                        op,
+                        rhs: Box::new(rhs),
+                    },
+                }
+            }
+            Boolean::Paren(boolean) => self.boolean(*boolean),
+        }
+    }
+}
+
+/// Procedures that a parallel branch calls, directly or through other
+/// procedures, and can run on several threads at once
+fn concurrent_procs(ast: &Statement) -> HashSet<String> {
+    fn walk(
+        statement: &Statement,
+        parallel: bool,
+        calls: &mut HashSet<String>,
+        procs: &mut HashMap<String, HashSet<String>>,
+        concurrent: &mut HashSet<String>,
+    ) {
+        match statement {
+            Statement::Call(name) => {
+                calls.insert(name.clone());
+                if parallel {
+                    concurrent.insert(name.clone());
+                }
+            }
+            Statement::Proc { name, body } => {
+                let mut own = HashSet::new();
+                walk(body, false, &mut own, procs, concurrent);
+                procs.insert(name.clone(), own);
+            }
+            Statement::Par(branches) => {
+                for branch in branches {
+                    walk(branch, true, calls, procs, concurrent);
+                }
+            }
+            Statement::Composision(first, second) => {
+                walk(first, parallel, calls, procs, concurrent);
+                walk(second, parallel, calls, procs, concurrent);
+            }
+            Statement::If {
+                if_branch,
+                else_branch,
+                ..
+            } => {
+                walk(if_branch, parallel, calls, procs, concurrent);
+                walk(else_branch, parallel, calls, procs, concurrent);
+            }
+            Statement::While { body, .. } | Statement::Paren(body) | Statement::Line(_, body) => {
+                walk(body, parallel, calls, procs, concurrent)
+            }
+            Statement::Assignment { .. } | Statement::Skip | Statement::Print(_) => (),
+        }
+    }
+
+    let mut procs = HashMap::new();
+    let mut concurrent = HashSet::new();
+    walk(ast, false, &mut HashSet::new(), &mut procs, &mut concurrent);
+    let mut pending: Vec<String> = concurrent.iter().cloned().collect();
+    while let Some(name) = pending.pop() {
+        for called in procs.get(&name).into_iter().flatten() {
+            if concurrent.insert(called.clone()) {
+                pending.push(called.clone());
+            }
+        }
+    }
+    concurrent
+}
+
+/// Number of instructions the code generator emits for an expression
+fn cost(arithmetic: &Arithmetic) -> usize {
+    match arithmetic {
+        Arithmetic::Int(_) | Arithmetic::Ident(_) => 1,
+        // The second operand is a dup if it is the same as the first
+        Arithmetic::Binary { lhs, rhs, .. } if lhs.unparen() == rhs.unparen() => cost(lhs) + 2,
+        Arithmetic::Binary { lhs, rhs, .. } => cost(lhs) + cost(rhs) + 1,
+        Arithmetic::Paren(arithmetic) => cost(arithmetic),
+    }
+}
+
+/// An expression with the last time a variable of it was assigned to, which
+/// has the same value wherever it is computed in a run of statements
+type Value = (Arithmetic, usize);
+
+/// Counts how often every value is computed in a run of assignments
+#[derive(Default)]
+struct Uses {
+    // The last time every variable was assigned to
+    versions: HashMap<String, usize>,
+    time: usize,
+    counts: HashMap<Value, usize>,
+}
+
+impl Uses {
+    fn assign(&mut self, ident: &str) {
+        self.time += 1;
+        self.versions.insert(ident.to_string(), self.time);
+    }
+
+    fn value(&self, arithmetic: &Arithmetic) -> Value {
+        (arithmetic.clone(), self.version(arithmetic))
+    }
+
+    fn version(&self, arithmetic: &Arithmetic) -> usize {
+        match arithmetic {
+            Arithmetic::Int(_) => 0,
+            Arithmetic::Ident(ident) => self.versions.get(ident).copied().unwrap_or(0),
+            Arithmetic::Binary { lhs, rhs, .. } => self.version(lhs).max(self.version(rhs)),
+            Arithmetic::Paren(arithmetic) => self.version(arithmetic),
+        }
+    }
+
+    fn count(&mut self, arithmetic: &Arithmetic) {
+        match arithmetic {
+            Arithmetic::Binary { lhs, rhs, .. } => {
+                *self.counts.entry(self.value(arithmetic)).or_insert(0) += 1;
+                self.count(lhs);
+                if lhs.unparen() != rhs.unparen() {
+                    self.count(rhs);
+                }
+            }
+            Arithmetic::Paren(arithmetic) => self.count(arithmetic),
+            Arithmetic::Int(_) | Arithmetic::Ident(_) => (),
+        }
+    }
+}
+
+/// Replace the uses of temporaries that are used once with their value
+fn inline(mut statements: Vec<Statement>, temporaries: &HashSet<String>) -> Vec<Statement> {
+    fn count(arithmetic: &Arithmetic, uses: &mut HashMap<String, usize>) {
+        match arithmetic {
+            Arithmetic::Ident(ident) => *uses.entry(ident.clone()).or_insert(0) += 1,
+            Arithmetic::Binary { lhs, rhs, .. } => {
+                count(lhs, uses);
+                count(rhs, uses);
+            }
+            Arithmetic::Paren(arithmetic) => count(arithmetic, uses),
+            Arithmetic::Int(_) => (),
+        }
+    }
+    fn substitute(arithmetic: Arithmetic, values: &mut HashMap<String, Arithmetic>) -> Arithmetic {
+        match arithmetic {
+            Arithmetic::Ident(ident) => match values.remove(&ident) {
+                Some(value) => substitute(value, values),
+                None => Arithmetic::Ident(ident),
+            },
+            Arithmetic::Binary { lhs, op, rhs } => {
+                binary(substitute(*lhs, values), op, substitute(*rhs, values))
+            }
+            Arithmetic::Paren(arithmetic) => {
+                Arithmetic::Paren(Box::new(substitute(*arithmetic, values)))
+            }
+            arithmetic => arithmetic,
+        }
+    }
+
+    let mut uses = HashMap::new();
+    for statement in statements.iter_mut() {
+        if let Some((_, value)) = assignment(statement) {
+            count(value, &mut uses);
+        }
+    }
+    let mut values = HashMap::new();
+    statements.retain_mut(|statement| match assignment(statement) {
+        Some((ident, value)) if temporaries.contains(ident) && uses.get(ident) == Some(&1) => {
+            values.insert(ident.clone(), std::mem::replace(value, Arithmetic::Int(0)));
+            false
+        }
+        _ => true,
+    });
+    for statement in statements.iter_mut() {
+        if let Some((_, value)) = assignment(statement) {
+            *value = substitute(std::mem::replace(value, Arithmetic::Int(0)), &mut values);
+        }
+    }
+    statements
+}
+
+/// The assignment a statement of a run is, None for one that computes nothing
+fn assignment(statement: &mut Statement) -> Option<(&String, &mut Arithmetic)> {
+    match statement {
+        Statement::Assignment { ident, value } => Some((&*ident, value)),
+        Statement::Line(_, statement) => assignment(statement),
+        _ => None,
+    }
+}
+
+/// Statements that run one after the other, without a jump in between
+fn is_straight(statement: &Statement) -> bool {
+    match statement {
+        Statement::Assignment { .. }
+        | Statement::Skip
+        | Statement::Print(_)
+        | Statement::Proc { .. } => true,
+        Statement::Line(_, statement) => is_straight(statement),
+        _ => false,
+    }
+}
+
+/// Gives the expressions that are computed more than once a temporary
+/// variable
+struct Temporaries {
+    concurrent: HashSet<String>,
+    next: usize,
+}
+
+impl Temporaries {
+    /// A variable no While program can name
+    fn temporary(&mut self) -> String {
+        let temporary = format!("tmp_{}", self.next);
+        self.next += 1;
+        temporary
+    }
+
+    /// Optimize a sequence of statements
+    ///
+    /// The temporaries are shared by every thread, so code that can run on
+    /// several threads at once is left alone.
+    fn block(&mut self, statement: Statement, concurrent: bool) -> Statement {
+        let mut statements = vec![];
+        flatten(statement, &mut statements);
+        let mut optimized = vec![];
+        for statement in statements {
+            flatten(self.statement(statement, concurrent), &mut optimized);
+        }
+        if !concurrent {
+            let mut start = 0;
+            while start < optimized.len() {
+                let end = start
+                    + optimized[start..]
+                        .iter()
+                        .position(|statement| !is_straight(statement))
+                        .unwrap_or(optimized.len() - start);
+                if end > start {
+                    let run: Vec<Statement> = optimized.drain(start..end).collect();
+                    let run = self.eliminate(run);
+                    let len = run.len();
+                    optimized.splice(start..start, run);
+                    start += len;
+                }
+                start += 1;
+            }
+        }
+        sequence(optimized)
+    }
+
+    fn statement(&mut self, statement: Statement, concurrent: bool) -> Statement {
+        match statement {
+            Statement::Line(line, statement) => match *statement {
+                Statement::While { condition, body } if !concurrent => {
+                    self.hoist(line, condition, *body)
+                }
+                statement => Statement::Line(line, Box::new(self.statement(statement, concurrent))),
+            },
+            Statement::If {
+                condition,
+                if_branch,
+                else_branch,
+            } => Statement::If {
+                condition,
+                if_branch: Box::new(self.block(*if_branch, concurrent)),
+                else_branch: Box::new(self.block(*else_branch, concurrent)),
+            },
+            Statement::While { condition, body } => Statement::While {
+                condition,
+                body: Box::new(self.block(*body, concurrent)),
+            },
+            Statement::Proc { name, body } => {
+                let concurrent = self.concurrent.contains(&name);
+                Statement::Proc {
+                    name,
+                    body: Box::new(self.block(*body, concurrent)),
+                }
+            }
+            Statement::Par(branches) => Statement::Par(
+                branches
+                    .into_iter()
+                    .map(|branch| self.block(branch, concurrent))
+                    .collect(),
+            ),
+            statement => statement,
+        }
+    }
+
+    /// Compute the common subexpressions of a run of statements once, in
+    /// front of the statement of their first use
+    fn eliminate(&mut self, mut run: Vec<Statement>) -> Vec<Statement> {
+        let mut uses = Uses::default();
+        for statement in run.iter_mut() {
+            if let Some((ident, value)) = assignment(statement) {
+                uses.count(value);
+                uses.assign(ident);
+            }
+        }
+        // The temporary costs a store and a fetch for every use, every use
+        // but the first no longer computes the expression
+        let mut selected: HashMap<Value, Option<String>> = uses
+            .counts
+            .into_iter()
+            .filter(|((arithmetic, _), uses)| (uses - 1) * cost(arithmetic) > uses + 1)
+            .map(|(value, _)| (value, None))
+            .collect();
+        if selected.is_empty() {
+            return run;
+        }
+
+        let mut uses = Uses::default();
+        let mut created = vec![];
+        let mut eliminated = vec![];
+        for mut statement in run {
+            if let Some((ident, value)) = assignment(&mut statement) {
+                let ident = ident.clone();
+                let arithmetic = std::mem::replace(value, Arithmetic::Int(0));
+                *value = self.replace(arithmetic, &uses, &mut selected, &mut created);
+                uses.assign(&ident);
+            }
+            for (ident, value) in created.drain(..) {
+                let assignment = Statement::Assignment { ident, value };
+                eliminated.push(match &statement {
+                    Statement::Line(line, _) => Statement::Line(*line, Box::new(assignment)),
+                    _ => assignment,
+                });
+            }
+            eliminated.push(statement);
+        }
+        // An expression that was only computed in others that are now
+        // computed once may be left with a single use
+        let temporaries = selected.into_values().flatten().collect();
+        inline(eliminated, &temporaries)
+    }
+
+    /// Replace the selected values with their temporary, the first use
+    /// creates it
+    fn replace(
+        &mut self,
+        arithmetic: Arithmetic,
+        uses: &Uses,
+        selected: &mut HashMap<Value, Option<String>>,
+        created: &mut Vec<(String, Arithmetic)>,
+    ) -> Arithmetic {
+        let value = match arithmetic {
+            Arithmetic::Binary { .. } => uses.value(&arithmetic),
+            Arithmetic::Paren(arithmetic) => {
+                return self.replace(*arithmetic, uses, selected, created);
+            }
+            arithmetic => return arithmetic,
+        };
+        let temporary = match selected.get(&value) {
+            Some(Some(temporary)) => return Arithmetic::Ident(temporary.clone()),
+            Some(None) => Some(self.temporary()),
+            None => None,
+        };
+        let Arithmetic::Binary { lhs, op, rhs } = arithmetic else {
+            unreachable!()
+        };
+        // The temporaries of the operands are created first
+        let arithmetic = binary(
+            self.replace(*lhs, uses, selected, created),
+            op,
+            self.replace(*rhs, uses, selected, created),
+        );
+        match temporary {
+            Some(temporary) => {
+                selected.insert(value, Some(temporary.clone()));
+                created.push((temporary.clone(), arithmetic));
+                Arithmetic::Ident(temporary)
+            }
+            None => arithmetic,
+        }
+    }
+
+    /// Compute the expressions a loop does not change once in front of it
+    fn hoist(&mut self, line: usize, condition: Boolean, body: Statement) -> Statement {
+        let mut variables = HashSet::new();
+        let mut hoisted = vec![];
+        let (condition, body) = if assigned(&body, &mut variables) {
+            let mut invariants = Invariants {
+                temporaries: self,
+                variables: &variables,
+                hoisted: &mut hoisted,
+            };
+            (invariants.boolean(condition), invariants.statement(body))
+        } else {
+            (condition, body)
+        };
+        let body = self.block(body, false);
+
+        let mut statements: Vec<Statement> = hoisted
+            .into_iter()
+            .map(|(value, ident)| {
+                Statement::Line(line, Box::new(Statement::Assignment { ident, value }))
+            })
+            .collect();
+        statements.push(Statement::Line(
+            line,
+            Box::new(Statement::While {
+                condition,
+                body: Box::new(body),
+            }),
+        ));
+        sequence(statements)
+    }
+}
+
+/// Replaces the expressions that do not change in a loop with temporaries
+struct Invariants<'a> {
+    temporaries: &'a mut Temporaries,
+    // Assigned to in the loop
+    variables: &'a HashSet<String>,
+    // Every expression with its temporary
+    hoisted: &'a mut Vec<(Arithmetic, String)>,
+}
+
+impl Invariants<'_> {
+    fn is_invariant(&self, arithmetic: &Arithmetic) -> bool {
+        match arithmetic {
+            Arithmetic::Int(_) => true,
+            Arithmetic::Ident(ident) => !self.variables.contains(ident),
+            Arithmetic::Binary { lhs, rhs, .. } => self.is_invariant(lhs) && self.is_invariant(rhs),
+            Arithmetic::Paren(arithmetic) => self.is_invariant(arithmetic),
+        }
+    }
+
+    fn arithmetic(&mut self, arithmetic: Arithmetic) -> Arithmetic {
+        // The loop may not run at all, so it must not be able to stop the vm
+        if matches!(arithmetic, Arithmetic::Binary { .. })
+            && self.is_invariant(&arithmetic)
+            && !can_trap(&arithmetic)
+        {
+            let temporary = match self
+                .hoisted
+                .iter()
+                .find(|(hoisted, _)| *hoisted == arithmetic)
+            {
+                Some((_, temporary)) => temporary.clone(),
+                None => {
+                    let temporary = self.temporaries.temporary();
+                    self.hoisted.push((arithmetic, temporary.clone()));
+                    temporary
+                }
+            };
+            return Arithmetic::Ident(temporary);
+        }
+        match arithmetic {
+            Arithmetic::Binary { lhs, op, rhs } => {
+                binary(self.arithmetic(*lhs), op, self.arithmetic(*rhs))
+            }
+            Arithmetic::Paren(arithmetic) => {
+                Arithmetic::Paren(Box::new(self.arithmetic(*arithmetic)))
+            }
+            arithmetic => arithmetic,
+        }
+    }
+
+    fn boolean(&mut self, boolean: Boolean) -> Boolean {
+        match boolean {
+            Boolean::Binary { lhs, op, rhs } => Boolean::Binary {
+                lhs: Box::new(self.boolean(*lhs)),
+                op,
+                rhs: Box::new(self.boolean(*rhs)),
+            },
+            Boolean::Cmp { lhs, op, rhs } => Boolean::Cmp {
+                lhs: Box::new(self.arithmetic(*lhs)),
+                op,
+                rhs: Box::new(self.arithmetic(*rhs)),
+            },
+            Boolean::Paren(boolean) => Boolean::Paren(Box::new(self.boolean(*boolean))),
+            boolean => boolean,
+        }
+    }
+
+    fn statement(&mut self, statement: Statement) -> Statement {
+        match statement {
+            Statement::Assignment { ident, value } => Statement::Assignment {
+                ident,
+                value: self.arithmetic(value),
+            },
+            Statement::Composision(first, second) => Statement::Composision(
+                Box::new(self.statement(*first)),
+                Box::new(self.statement(*second)),
+            ),
+            Statement::If {
+                condition,
+                if_branch,
+                else_branch,
+            } => Statement::If {
+                condition: self.boolean(condition),
+                if_branch: Box::new(self.statement(*if_branch)),
+                else_branch: Box::new(self.statement(*else_branch)),
+            },
+            Statement::While { condition, body } => Statement::While {
+                condition: self.boolean(condition),
+                body: Box::new(self.statement(*body)),
+            },
+            Statement::Paren(statement) => Statement::Paren(Box::new(self.statement(*statement))),
+            Statement::Line(line, statement) => {
+                Statement::Line(line, Box::new(self.statement(*statement)))
+            }
+            // A definition is not part of the loop
+            statement => statement,
+        }
+    }
+}
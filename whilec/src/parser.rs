@@ -1,23 +1,39 @@
 use crate::lexer::Token;
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
 pub enum ArithmeticOp {
     Add,
     Sub,
     Mul,
+    Div,
+    Mod,
+
+    BitAnd,
+    BitOr,
+    BitXor,
+    Shl,
+    Shr,
 }
 
 impl std::fmt::Display for ArithmeticOp {
     fn fmt(&self, f: &mut std::fmt::Formatter<'_>) -> std::fmt::Result {
         match self {
-            ArithmeticOp::Add => writeln!(f, "add"),
-            ArithmeticOp::Sub => writeln!(f, "sub"),
-            ArithmeticOp::Mul => writeln!(f, "mul"),
+            ArithmeticOp::Add => write!(f, "add"),
+            ArithmeticOp::Sub => write!(f, "sub"),
+            ArithmeticOp::Mul => write!(f, "mul"),
+            ArithmeticOp::Div => write!(f, "div"),
+            ArithmeticOp::Mod => write!(f, "mod"),
+
+            ArithmeticOp::BitAnd => write!(f, "and"),
+            ArithmeticOp::BitOr => write!(f, "or"),
+            ArithmeticOp::BitXor => write!(f, "xor"),
+            ArithmeticOp::Shl => write!(f, "shl"),
+            ArithmeticOp::Shr => write!(f, "shr"),
         }
     }
 }
 
-#[derive(Debug, Clone)]
+#[derive(Debug, Clone, PartialEq, Eq, Hash)]
 pub enum Arithmetic {
     Int(i32),
     Ident(String),
@@ -29,6 +45,16 @@ pub enum Arithmetic {
     Paren(Box<Arithmetic>),
 }
 
+impl Arithmetic {
+    /// The expression without any surrounding parentheses
+    pub fn unparen(&self) -> &Arithmetic {
+        match self {
+            Arithmetic::Paren(arithmetic) => arithmetic.unparen(),
+            arithmetic => arithmetic,
+        }
+    }
+}
+
 #[derive(Debug, Clone)]
 pub enum BooleanOp {
     Eq,
@@ -96,14 +122,29 @@ pub enum Statement {
     },
     Paren(Box<Statement>),
     Print(Arithmetic),
+    Proc {
+        name: String,
+        body: Box<Statement>,
+    },
+    Call(String),
+    // Every statement runs on its own thread
+    Par(Vec<Statement>),
+    // The statement starts on a line of the source, one-indexed
+    Line(usize, Box<Statement>),
 }
 
 pub struct Parser {
     pub tokens: Vec<Token>,
+    // Line of every token
+    pub lines: Vec<usize>,
     pub index: usize,
 }
 
 impl Parser {
+    fn line(&self) -> usize {
+        self.lines.get(self.index).copied().unwrap_or(0)
+    }
+
     fn peek(&mut self) -> Option<Token> {
         self.tokens.get(self.index).cloned()
     }
@@ -124,20 +165,26 @@ impl Parser {
     }
 
     fn parse_statement_component(&mut self) -> Statement {
+        let line = self.line();
         let token = self.next().expect("unexpected end of file");
-        match token {
+        let statement = match token {
+            // The statements in parentheses have lines of their own
             Token::OpenParen => {
                 let statement = self.parse_statement();
                 self.expect(Token::CloseParen);
-                Statement::Paren(Box::new(statement))
+                return Statement::Paren(Box::new(statement));
             }
             Token::Skip => Statement::Skip,
             Token::If => self.parse_if(),
             Token::While => self.parse_while(),
             Token::Ident(ident) => self.parse_assignment(ident),
             Token::Print => self.parse_print(),
+            Token::Proc => self.parse_proc(),
+            Token::Call => self.parse_call(),
+            Token::Par => self.parse_par(),
             t => panic!("unexpected token {t:?}"),
-        }
+        };
+        Statement::Line(line, Box::new(statement))
     }
 
     pub fn parse_statement(&mut self) -> Statement {
@@ -171,7 +218,11 @@ impl Parser {
         match token {
             Token::Int(int) => Arithmetic::Int(int),
             Token::Ident(ident) => Arithmetic::Ident(ident),
-            Token::OpenParen => Arithmetic::Paren(Box::new(self.parse_arithmetic())),
+            Token::OpenParen => {
+                let arithmetic = self.parse_arithmetic();
+                self.expect(Token::CloseParen);
+                Arithmetic::Paren(Box::new(arithmetic))
+            }
             t => panic!("unexpected token {t:?}"),
         }
     }
@@ -180,7 +231,16 @@ impl Parser {
         let mut lhs = self.parse_arithmetic_component();
         while let Some(token) = self.peek() {
             match token {
-                Token::Add | Token::Sub | Token::Mul => {
+                Token::Add
+                | Token::Sub
+                | Token::Mul
+                | Token::Div
+                | Token::Mod
+                | Token::BitAnd
+                | Token::BitOr
+                | Token::BitXor
+                | Token::Shl
+                | Token::Shr => {
                     let operator_token = self.next().expect("unexpected end of file");
                     let op = self.get_arithmetic_operator(operator_token);
                     let rhs = self.parse_arithmetic_component();
@@ -304,11 +364,49 @@ impl Parser {
         Statement::While { condition, body }
     }
 
+    fn parse_proc(&mut self) -> Statement {
+        let name = match self.next().expect("unexpected end of file") {
+            Token::Ident(name) => name,
+            t => panic!("error: expected a procedure name, found {t:?}"),
+        };
+        self.expect(Token::Do);
+        let body = Box::new(self.parse_statement_component());
+
+        Statement::Proc { name, body }
+    }
+
+    fn parse_call(&mut self) -> Statement {
+        match self.next().expect("unexpected end of file") {
+            Token::Ident(name) => Statement::Call(name),
+            t => panic!("error: expected a procedure name, found {t:?}"),
+        }
+    }
+
+    fn parse_par(&mut self) -> Statement {
+        self.expect(Token::OpenBrace);
+        let mut branches = vec![self.parse_statement_component()];
+        while self.peek() == Some(Token::SemiColon) {
+            self.next();
+            branches.push(self.parse_statement_component());
+        }
+        self.expect(Token::CloseBrace);
+
+        Statement::Par(branches)
+    }
+
     fn get_arithmetic_operator(&self, token: Token) -> ArithmeticOp {
         match token {
             Token::Add => ArithmeticOp::Add,
             Token::Sub => ArithmeticOp::Sub,
             Token::Mul => ArithmeticOp::Mul,
+            Token::Div => ArithmeticOp::Div,
+            Token::Mod => ArithmeticOp::Mod,
+
+            Token::BitAnd => ArithmeticOp::BitAnd,
+            Token::BitOr => ArithmeticOp::BitOr,
+            Token::BitXor => ArithmeticOp::BitXor,
+            Token::Shl => ArithmeticOp::Shl,
+            Token::Shr => ArithmeticOp::Shr,
             t => panic!("unexpected token {t:?}"),
         }
     }